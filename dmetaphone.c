@@ -96,11 +96,24 @@ The remaining code is authored by Andrew Dunstan <amdunstan@ncshp.org> and
 
 
 
+/*
+ * When FUZZYSTRMATCH_STANDALONE is defined, this file is being #included by
+ * one of the standalone programs (see fuzzystrmatchd.c): it behaves as with
+ * DMETAPHONE_MAIN, except that no main() is provided.
+ */
+#if defined(FUZZYSTRMATCH_STANDALONE) && !defined(DMETAPHONE_STANDALONE)
+#define DMETAPHONE_STANDALONE
+#endif
+#if defined(DMETAPHONE_MAIN) && !defined(DMETAPHONE_STANDALONE)
+#define DMETAPHONE_STANDALONE
+#endif
+
 /* include these first, according to the docs */
-#ifndef DMETAPHONE_MAIN
+#ifndef DMETAPHONE_STANDALONE
 
 #include "postgres.h"
 
+#include "miscadmin.h"
 #include "utils/builtins.h"
 
 /* turn off assertions for embedded function */
@@ -114,13 +127,15 @@ The remaining code is authored by Andrew Dunstan <amdunstan@ncshp.org> and
 #include <stdarg.h>
 #include <assert.h>
 
-extern Datum dmetaphone(PG_FUNCTION_ARGS);
-extern Datum dmetaphone_alt(PG_FUNCTION_ARGS);
-
 /* prototype for the main function we got from the perl module */
 static void DoubleMetaphone(char *, char **);
 
-#ifndef DMETAPHONE_MAIN
+#include "fuzzystrmatch.h"
+
+#ifndef DMETAPHONE_STANDALONE
+
+extern Datum dmetaphone(PG_FUNCTION_ARGS);
+extern Datum dmetaphone_alt(PG_FUNCTION_ARGS);
 
 /*
  * The PostgreSQL visible dmetaphone function.
@@ -141,6 +156,8 @@ dmetaphone(PG_FUNCTION_ARGS)
 		PG_RETURN_NULL();
 #endif
 	arg = PG_GETARG_TEXT_P(0);
+	/* the string is copied twice before it is encoded */
+	fuzzy_check_result_memory(NULL, 2 * (Size) VARSIZE(arg));
 	aptr = text_to_cstring(arg);
 
 	DoubleMetaphone(aptr, codes);
@@ -170,6 +187,8 @@ dmetaphone_alt(PG_FUNCTION_ARGS)
 		PG_RETURN_NULL();
 #endif
 	arg = PG_GETARG_TEXT_P(0);
+	/* the string is copied twice before it is encoded */
+	fuzzy_check_result_memory(NULL, 2 * (Size) VARSIZE(arg));
 	aptr = text_to_cstring(arg);
 
 	DoubleMetaphone(aptr, codes);
@@ -199,7 +218,7 @@ dmetaphone_alt(PG_FUNCTION_ARGS)
  */
 
 #define META_FREE(x)			/* pfree((x)) */
-#else							/* not defined DMETAPHONE_MAIN */
+#else							/* not defined DMETAPHONE_STANDALONE */
 
 /* use the standard malloc library when not running in PostgreSQL */
 
@@ -210,7 +229,11 @@ dmetaphone_alt(PG_FUNCTION_ARGS)
 					  (v = (t*)realloc((v),((n)*sizeof(t))))
 
 #define META_FREE(x) free((x))
-#endif   /* defined DMETAPHONE_MAIN */
+
+#ifndef CHECK_FOR_INTERRUPTS
+#define CHECK_FOR_INTERRUPTS()	((void) 0)
+#endif
+#endif   /* defined DMETAPHONE_STANDALONE */
 
 
 
@@ -398,6 +421,7 @@ DoubleMetaphone(char *str, char **codes)
 	metastring *secondary;
 	int			current;
 	int			last;
+	int			steps = 0;
 
 	current = 0;
 	/* we need the real length and last prior to padding */
@@ -426,11 +450,17 @@ DoubleMetaphone(char *str, char **codes)
 		current += 1;
 	}
 
-	/* main loop */
+	/*
+	 * main loop; it ends once both codes are complete, but a long run of
+	 * letters that produce nothing can keep it going, so check for
+	 * interrupts now and then
+	 */
 	while ((primary->length < 4) || (secondary->length < 4))
 	{
 		if (current >= length)
 			break;
+		if ((++steps & 4095) == 0)
+			CHECK_FOR_INTERRUPTS();
 
 		switch (GetAt(original, current))
 		{
@@ -1424,6 +1454,25 @@ DoubleMetaphone(char *str, char **codes)
 	DestroyMetaString(secondary);
 }
 
+/*
+ * Compute both codes of str into primary and alternate, each of which must
+ * have room for DMETAPHONE_CODE_LEN + 1 bytes.  This is the entry point for
+ * the other parts of the module, which need both codes at once.
+ */
+void
+dmetaphone_codes(char *str, char *primary, char *alternate)
+{
+	char	   *codes[2];
+
+	DoubleMetaphone(str, codes);
+	strncpy(primary, codes[0] ? codes[0] : "", DMETAPHONE_CODE_LEN);
+	primary[DMETAPHONE_CODE_LEN] = '\0';
+	strncpy(alternate, codes[1] ? codes[1] : "", DMETAPHONE_CODE_LEN);
+	alternate[DMETAPHONE_CODE_LEN] = '\0';
+	META_FREE(codes[0]);
+	META_FREE(codes[1]);
+}
+
 #ifdef DMETAPHONE_MAIN
 
 /* just for testing - not part of the perl code */
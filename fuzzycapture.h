@@ -0,0 +1,72 @@
+/*
+ * fuzzycapture.h
+ *
+ * Format of the call logs written by fuzzystrmatch.capture_file.
+ *
+ * contrib/fuzzystrmatch/fuzzycapture.h
+ *
+ * A log is a plain sequence of records with no file header, so that any
+ * number of backends can append to the same file: each record is written
+ * with a single write() to a descriptor opened with O_APPEND.  A record is
+ * a FuzzyCaptureRecord, followed by the SQL name of the function called
+ * (name_len bytes, no terminator), then what was kept of the first and the
+ * second input (a_size and b_size bytes).  Integers are in the byte order
+ * of the server that wrote the log.
+ *
+ * What is kept of the inputs depends on fuzzystrmatch.capture_inputs:
+ *
+ *	none		nothing; a_chars and b_chars still give their lengths
+ *	hashed		a uint32 hash of each input's bytes, so that repeated inputs
+ *				can be recognized without being readable
+ *	scrambled	each input converted to UTF-8 and every character replaced
+ *				through a keyed permutation that maps letters to letters,
+ *				digits to digits and other characters to ones of the same
+ *				UTF-8 length; equal characters stay equal, so the distances
+ *				and the work done by the kernels are unchanged
+ *	raw			each input converted to UTF-8
+ *
+ * Scrambling is not encryption.  The permutation is a simple affine one,
+ * keyed per backend, and a log of natural-language strings can be
+ * unscrambled by frequency analysis; use "hashed" or "none" where the
+ * inputs must not leave the server.
+ *
+ * This header is shared by the backend and the standalone programs, so it
+ * must only use types that fuzzystrmatch_standalone.h also provides.
+ */
+#ifndef FUZZYCAPTURE_H
+#define FUZZYCAPTURE_H
+
+#define FUZZY_CAPTURE_MAGIC		0x315A5A46	/* "FZZ1" on little-endian */
+
+/* what follows the name, see above */
+typedef enum
+{
+	FUZZY_CAPTURE_INPUTS_NONE,
+	FUZZY_CAPTURE_INPUTS_HASHED,
+	FUZZY_CAPTURE_INPUTS_SCRAMBLED,
+	FUZZY_CAPTURE_INPUTS_RAW
+} FuzzyCaptureInputs;
+
+/* flags */
+#define FUZZY_CAPTURE_BOUNDED	0x01	/* a _less_equal variant; max_d applies */
+
+typedef struct
+{
+	uint32		magic;
+	uint16		name_len;
+	uint8		inputs;			/* FuzzyCaptureInputs */
+	uint8		flags;
+	int32		ins_c;
+	int32		del_c;
+	int32		sub_c;
+	int32		trans_c;
+	int32		max_d;
+	int32		result;			/* as returned by the function */
+	int32		a_chars;		/* length of the inputs, in characters */
+	int32		b_chars;
+	uint32		a_size;			/* bytes of each input that follow */
+	uint32		b_size;
+	uint32		elapsed_ns;		/* time spent in the backend, at most ~4s */
+} FuzzyCaptureRecord;
+
+#endif   /* FUZZYCAPTURE_H */
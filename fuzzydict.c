@@ -0,0 +1,2252 @@
+/*
+ * fuzzydict.c
+ *
+ * Compiled fuzzy dictionaries: building, validating and searching the
+ * position-independent images described in fuzzydict.h, and the SQL
+ * functions that map them into a backend.
+ *
+ * contrib/fuzzystrmatch/fuzzydict.c
+ *
+ * The first part of this file is shared with the standalone programs
+ * (fuzzystrmatch_builddict and fuzzystrmatchd), which #include it after
+ * fuzzystrmatch_standalone.h and dmetaphone.c; the SQL-callable part at the
+ * end is only compiled into the backend module.
+ */
+#ifndef FUZZYSTRMATCH_STANDALONE
+#include "postgres.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/tuplestore.h"
+
+#define FZD_ALLOC(sz)	MemoryContextAllocHuge(CurrentMemoryContext, (sz))
+#define FZD_FREE(p)		pfree(p)
+#else
+#include <errno.h>
+
+#define FZD_ALLOC(sz)	fzd_malloc(sz)
+#define FZD_FREE(p)		free(p)
+
+static void *
+fzd_malloc(size_t size)
+{
+	void	   *p = malloc(size);
+
+	if (p == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+#endif
+
+#include "fuzzydict.h"
+#include "fuzzystrmatch.h"
+#include "soundex.c"
+
+#define FZD_ALIGN(x)	(((x) + 7) & ~((uint64) 7))
+
+/* longest word in bytes; pg_mblen never exceeds 4 for server encodings */
+#define FZD_MAX_BYTES	(FZD_MAX_CHARS * 4)
+
+typedef struct
+{
+	const char *str;
+	int			len;
+} FzdWord;
+
+static int
+fzd_word_cmp(const void *a, const void *b)
+{
+	const FzdWord *wa = (const FzdWord *) a;
+	const FzdWord *wb = (const FzdWord *) b;
+	int			c = memcmp(wa->str, wb->str, Min(wa->len, wb->len));
+
+	if (c != 0)
+		return c;
+	return wa->len - wb->len;
+}
+
+static int
+fzd_code_entry_cmp(const void *a, const void *b)
+{
+	const FuzzyDictCodeEntry *ea = (const FuzzyDictCodeEntry *) a;
+	const FuzzyDictCodeEntry *eb = (const FuzzyDictCodeEntry *) b;
+	int			c = memcmp(ea->code, eb->code, FZD_CODE_LEN);
+
+	if (c != 0)
+		return c;
+	return ea->word < eb->word ? -1 : ea->word > eb->word ? 1 : 0;
+}
+
+/* Copy a NUL-terminated phonetic code into its NUL-padded stored form */
+void
+fzd_pad_code(char *padded, const char *code)
+{
+	int			i;
+
+	for (i = 0; i < FZD_CODE_LEN && code[i] != '\0'; i++)
+		padded[i] = code[i];
+	for (; i < FZD_CODE_LEN; i++)
+		padded[i] = '\0';
+}
+
+/*
+ * Build a dictionary image from an array of NUL-terminated words, which need
+ * not be sorted or distinct.  Empty words and words longer than
+ * FZD_MAX_CHARS characters are left out; *nskipped reports how many.  The
+ * result is allocated with FZD_ALLOC and its size returned in *size.
+ */
+char *
+fzd_build_image(char **words, int nwords, const char *encoding,
+				uint64 generation, uint64 *size, int *nskipped)
+{
+	FzdWord    *sorted;
+	int			nsorted = 0;
+	uint64		total_bytes = 0;
+	uint32		count[FZD_MAX_CHARS + 2];
+	uint32	   *length_start;
+	uint32	   *by_length;
+	FuzzyDictTrieNode *trie;
+	uint32	   *trie_lo,
+			   *trie_hi,
+			   *trie_depth;
+	uint32		ntrie;
+	FuzzyDictCodeEntry *soundex;
+	FuzzyDictCodeEntry *dmetaphone;
+	uint32		nsoundex = 0,
+				ndmetaphone = 0;
+	FuzzyDictHeader *hdr;
+	char	   *image;
+	uint64		offset;
+	uint32	   *word_offsets;
+	char	   *strings;
+	uint32		k;
+	int			i;
+
+	*nskipped = 0;
+
+	/* sort and deduplicate */
+	sorted = FZD_ALLOC(Max(nwords, 1) * sizeof(FzdWord));
+	for (i = 0; i < nwords; i++)
+	{
+		int			len = strlen(words[i]);
+
+		if (len == 0 || len > FZD_MAX_BYTES ||
+			pg_mbstrlen_with_len(words[i], len) > FZD_MAX_CHARS)
+		{
+			(*nskipped)++;
+			continue;
+		}
+		sorted[nsorted].str = words[i];
+		sorted[nsorted].len = len;
+		nsorted++;
+	}
+	qsort(sorted, nsorted, sizeof(FzdWord), fzd_word_cmp);
+	if (nsorted > 1)
+	{
+		int			j = 0;
+
+		for (i = 1; i < nsorted; i++)
+			if (fzd_word_cmp(&sorted[j], &sorted[i]) != 0)
+				sorted[++j] = sorted[i];
+		nsorted = j + 1;
+	}
+	for (i = 0; i < nsorted; i++)
+		total_bytes += sorted[i].len;
+
+	/* length index, by counting sort */
+	length_start = FZD_ALLOC((FZD_MAX_CHARS + 2) * sizeof(uint32));
+	by_length = FZD_ALLOC(Max(nsorted, 1) * sizeof(uint32));
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < nsorted; i++)
+		count[pg_mbstrlen_with_len(sorted[i].str, sorted[i].len)]++;
+	length_start[0] = 0;
+	for (k = 0; k <= FZD_MAX_CHARS; k++)
+		length_start[k + 1] = length_start[k] + count[k];
+	memcpy(count, length_start, sizeof(count));
+	for (i = 0; i < nsorted; i++)
+		by_length[count[pg_mbstrlen_with_len(sorted[i].str, sorted[i].len)]++] = i;
+
+	/*
+	 * Trie, laid out breadth-first so that each node's children are
+	 * contiguous.  Node k covers the sorted words [trie_lo[k], trie_hi[k]),
+	 * all of which share their first trie_depth[k] bytes; since the words
+	 * are sorted and distinct, the only one that can end at this node is the
+	 * first.  There can be no more nodes than bytes, plus the root.
+	 */
+	trie = FZD_ALLOC((total_bytes + 1) * sizeof(FuzzyDictTrieNode));
+	trie_lo = FZD_ALLOC((total_bytes + 1) * sizeof(uint32));
+	trie_hi = FZD_ALLOC((total_bytes + 1) * sizeof(uint32));
+	trie_depth = FZD_ALLOC((total_bytes + 1) * sizeof(uint32));
+	memset(&trie[0], 0, sizeof(FuzzyDictTrieNode));
+	trie_lo[0] = 0;
+	trie_hi[0] = nsorted;
+	trie_depth[0] = 0;
+	ntrie = 1;
+	for (k = 0; k < ntrie; k++)
+	{
+		uint32		lo = trie_lo[k];
+		uint32		hi = trie_hi[k];
+		uint32		d = trie_depth[k];
+
+		trie[k].word = FZD_NO_WORD;
+		if (lo < hi && (uint32) sorted[lo].len == d)
+			trie[k].word = lo++;
+		trie[k].first_child = ntrie;
+		trie[k].nchildren = 0;
+		while (lo < hi)
+		{
+			unsigned char b = (unsigned char) sorted[lo].str[d];
+			uint32		j = lo;
+
+			while (j < hi && (unsigned char) sorted[j].str[d] == b)
+				j++;
+			memset(&trie[ntrie], 0, sizeof(FuzzyDictTrieNode));
+			trie[ntrie].label = b;
+			trie_lo[ntrie] = lo;
+			trie_hi[ntrie] = j;
+			trie_depth[ntrie] = d + 1;
+			ntrie++;
+			trie[k].nchildren++;
+			lo = j;
+		}
+	}
+	FZD_FREE(trie_lo);
+	FZD_FREE(trie_hi);
+	FZD_FREE(trie_depth);
+
+	/* phonetic code indexes */
+	soundex = FZD_ALLOC(Max(nsorted, 1) * sizeof(FuzzyDictCodeEntry));
+	dmetaphone = FZD_ALLOC(Max(2 * nsorted, 1) * sizeof(FuzzyDictCodeEntry));
+	for (i = 0; i < nsorted; i++)
+	{
+		char		buf[FZD_MAX_BYTES + 1];
+		char		sndx[SOUNDEX_LEN + 1];
+		char		primary[DMETAPHONE_CODE_LEN + 1];
+		char		alternate[DMETAPHONE_CODE_LEN + 1];
+
+		memcpy(buf, sorted[i].str, sorted[i].len);
+		buf[sorted[i].len] = '\0';
+
+		_soundex(buf, sndx);
+		if (sndx[0] != '\0')
+		{
+			fzd_pad_code(soundex[nsoundex].code, sndx);
+			soundex[nsoundex++].word = i;
+		}
+
+		dmetaphone_codes(buf, primary, alternate);
+		if (primary[0] != '\0')
+		{
+			fzd_pad_code(dmetaphone[ndmetaphone].code, primary);
+			dmetaphone[ndmetaphone++].word = i;
+		}
+		if (alternate[0] != '\0' && strcmp(primary, alternate) != 0)
+		{
+			fzd_pad_code(dmetaphone[ndmetaphone].code, alternate);
+			dmetaphone[ndmetaphone++].word = i;
+		}
+	}
+	qsort(soundex, nsoundex, sizeof(FuzzyDictCodeEntry), fzd_code_entry_cmp);
+	qsort(dmetaphone, ndmetaphone, sizeof(FuzzyDictCodeEntry),
+		  fzd_code_entry_cmp);
+
+	/* lay out and fill in the image */
+	{
+		FuzzyDictHeader h;
+
+		memset(&h, 0, sizeof(h));
+		offset = FZD_ALIGN(sizeof(FuzzyDictHeader));
+#define FZD_PLACE(id, bytes) \
+		(h.sections[id].offset = offset, h.sections[id].size = (bytes), \
+		 offset = FZD_ALIGN(offset + (bytes)))
+		FZD_PLACE(FZD_SECTION_WORD_OFFSETS, (uint64) (nsorted + 1) * sizeof(uint32));
+		FZD_PLACE(FZD_SECTION_STRINGS, total_bytes + nsorted);
+		FZD_PLACE(FZD_SECTION_LENGTH_START, (FZD_MAX_CHARS + 2) * sizeof(uint32));
+		FZD_PLACE(FZD_SECTION_BY_LENGTH, (uint64) nsorted * sizeof(uint32));
+		FZD_PLACE(FZD_SECTION_TRIE, (uint64) ntrie * sizeof(FuzzyDictTrieNode));
+		FZD_PLACE(FZD_SECTION_SOUNDEX, (uint64) nsoundex * sizeof(FuzzyDictCodeEntry));
+		FZD_PLACE(FZD_SECTION_DMETAPHONE, (uint64) ndmetaphone * sizeof(FuzzyDictCodeEntry));
+#undef FZD_PLACE
+
+		image = FZD_ALLOC(offset);
+		memset(image, 0, offset);
+		hdr = (FuzzyDictHeader *) image;
+		*hdr = h;
+	}
+	memcpy(hdr->magic, FZD_MAGIC, sizeof(hdr->magic));
+	hdr->version = FZD_VERSION;
+	hdr->byte_order = FZD_BYTE_ORDER;
+	hdr->image_size = offset;
+	hdr->generation = generation;
+	strncpy(hdr->encoding, encoding, sizeof(hdr->encoding) - 1);
+	hdr->nwords = nsorted;
+	hdr->ntrie_nodes = ntrie;
+	hdr->nsoundex = nsoundex;
+	hdr->ndmetaphone = ndmetaphone;
+
+#define FZD_SECTION_PTR(id) (image + hdr->sections[id].offset)
+	word_offsets = (uint32 *) FZD_SECTION_PTR(FZD_SECTION_WORD_OFFSETS);
+	strings = FZD_SECTION_PTR(FZD_SECTION_STRINGS);
+	offset = 0;
+	for (i = 0; i < nsorted; i++)
+	{
+		word_offsets[i] = (uint32) offset;
+		memcpy(strings + offset, sorted[i].str, sorted[i].len);
+		strings[offset + sorted[i].len] = '\0';
+		offset += sorted[i].len + 1;
+	}
+	word_offsets[nsorted] = (uint32) offset;
+	memcpy(FZD_SECTION_PTR(FZD_SECTION_LENGTH_START), length_start,
+		   (FZD_MAX_CHARS + 2) * sizeof(uint32));
+	memcpy(FZD_SECTION_PTR(FZD_SECTION_BY_LENGTH), by_length,
+		   nsorted * sizeof(uint32));
+	memcpy(FZD_SECTION_PTR(FZD_SECTION_TRIE), trie,
+		   ntrie * sizeof(FuzzyDictTrieNode));
+	memcpy(FZD_SECTION_PTR(FZD_SECTION_SOUNDEX), soundex,
+		   nsoundex * sizeof(FuzzyDictCodeEntry));
+	memcpy(FZD_SECTION_PTR(FZD_SECTION_DMETAPHONE), dmetaphone,
+		   ndmetaphone * sizeof(FuzzyDictCodeEntry));
+#undef FZD_SECTION_PTR
+
+	FZD_FREE(sorted);
+	FZD_FREE(length_start);
+	FZD_FREE(by_length);
+	FZD_FREE(trie);
+	FZD_FREE(soundex);
+	FZD_FREE(dmetaphone);
+
+	*size = hdr->image_size;
+	return image;
+}
+
+void
+fzd_free_image(char *image)
+{
+	FZD_FREE(image);
+}
+
+/*
+ * Check that an image is well-formed and resolve its sections.  Returns
+ * NULL on success, or a description of the problem.
+ *
+ * Images may come from files that anyone could have written, so everything
+ * a search relies on is checked here, once, rather than on every access: in
+ * particular that all offsets and indexes are in range and that trie
+ * children always follow their parent, so traversals terminate.
+ */
+const char *
+fzd_attach(FuzzyDict *dict, const char *image, uint64 size)
+{
+	const FuzzyDictHeader *hdr = (const FuzzyDictHeader *) image;
+	uint64		expected[FZD_NUM_SECTIONS];
+	uint32		strings_size;
+	uint32		k;
+	int			id;
+
+	if (size < sizeof(FuzzyDictHeader) ||
+		memcmp(hdr->magic, FZD_MAGIC, sizeof(hdr->magic)) != 0)
+		return "not a compiled fuzzy dictionary";
+	if (hdr->byte_order != FZD_BYTE_ORDER)
+		return "dictionary was built on a machine with a different byte order";
+	if (hdr->version != FZD_VERSION)
+		return "unsupported dictionary format version";
+	if (hdr->image_size != size)
+		return "dictionary size does not match its header";
+	if (hdr->ntrie_nodes == 0 || memchr(hdr->encoding, '\0',
+										sizeof(hdr->encoding)) == NULL)
+		return "invalid dictionary header";
+
+	expected[FZD_SECTION_WORD_OFFSETS] = ((uint64) hdr->nwords + 1) * sizeof(uint32);
+	expected[FZD_SECTION_STRINGS] = hdr->sections[FZD_SECTION_STRINGS].size;
+	expected[FZD_SECTION_LENGTH_START] = (FZD_MAX_CHARS + 2) * sizeof(uint32);
+	expected[FZD_SECTION_BY_LENGTH] = (uint64) hdr->nwords * sizeof(uint32);
+	expected[FZD_SECTION_TRIE] = (uint64) hdr->ntrie_nodes * sizeof(FuzzyDictTrieNode);
+	expected[FZD_SECTION_SOUNDEX] = (uint64) hdr->nsoundex * sizeof(FuzzyDictCodeEntry);
+	expected[FZD_SECTION_DMETAPHONE] = (uint64) hdr->ndmetaphone * sizeof(FuzzyDictCodeEntry);
+	for (id = 0; id < FZD_NUM_SECTIONS; id++)
+	{
+		const FuzzyDictSection *sec = &hdr->sections[id];
+
+		if (sec->size != expected[id] || sec->offset % 8 != 0 ||
+			sec->offset < sizeof(FuzzyDictHeader) ||
+			sec->offset > size || sec->size > size - sec->offset)
+			return "dictionary section out of bounds";
+	}
+	if (hdr->sections[FZD_SECTION_STRINGS].size > 0xFFFFFFFF)
+		return "dictionary section out of bounds";
+	strings_size = (uint32) hdr->sections[FZD_SECTION_STRINGS].size;
+
+	dict->image = image;
+	dict->size = size;
+	dict->hdr = hdr;
+#define FZD_SECTION_PTR(id) (image + hdr->sections[id].offset)
+	dict->word_offsets = (const uint32 *) FZD_SECTION_PTR(FZD_SECTION_WORD_OFFSETS);
+	dict->strings = FZD_SECTION_PTR(FZD_SECTION_STRINGS);
+	dict->length_start = (const uint32 *) FZD_SECTION_PTR(FZD_SECTION_LENGTH_START);
+	dict->by_length = (const uint32 *) FZD_SECTION_PTR(FZD_SECTION_BY_LENGTH);
+	dict->trie = (const FuzzyDictTrieNode *) FZD_SECTION_PTR(FZD_SECTION_TRIE);
+	dict->soundex = (const FuzzyDictCodeEntry *) FZD_SECTION_PTR(FZD_SECTION_SOUNDEX);
+	dict->dmetaphone = (const FuzzyDictCodeEntry *) FZD_SECTION_PTR(FZD_SECTION_DMETAPHONE);
+#undef FZD_SECTION_PTR
+
+	/* words: non-empty, NUL-terminated, inside the string area */
+	if (dict->word_offsets[0] != 0 ||
+		dict->word_offsets[hdr->nwords] > strings_size)
+		return "corrupt word table";
+	for (k = 0; k < hdr->nwords; k++)
+	{
+		uint32		end = dict->word_offsets[k + 1];
+
+		if (end < dict->word_offsets[k] + 2 ||
+			end - dict->word_offsets[k] - 1 > FZD_MAX_BYTES ||
+			dict->strings[end - 1] != '\0')
+			return "corrupt word table";
+	}
+
+	/* length index */
+	if (dict->length_start[0] != 0 ||
+		dict->length_start[FZD_MAX_CHARS + 1] != hdr->nwords)
+		return "corrupt length index";
+	for (k = 0; k <= FZD_MAX_CHARS; k++)
+		if (dict->length_start[k] > dict->length_start[k + 1])
+			return "corrupt length index";
+	for (k = 0; k < hdr->nwords; k++)
+		if (dict->by_length[k] >= hdr->nwords)
+			return "corrupt length index";
+
+	/* trie */
+	for (k = 0; k < hdr->ntrie_nodes; k++)
+	{
+		const FuzzyDictTrieNode *node = &dict->trie[k];
+
+		if (node->word != FZD_NO_WORD && node->word >= hdr->nwords)
+			return "corrupt trie";
+		if (node->nchildren > 0 &&
+			(node->first_child <= k ||
+			 node->first_child > hdr->ntrie_nodes ||
+			 node->nchildren > hdr->ntrie_nodes - node->first_child))
+			return "corrupt trie";
+	}
+
+	/* code indexes */
+	for (k = 0; k < hdr->nsoundex; k++)
+		if (dict->soundex[k].word >= hdr->nwords)
+			return "corrupt soundex index";
+	for (k = 0; k < hdr->ndmetaphone; k++)
+		if (dict->dmetaphone[k].word >= hdr->nwords)
+			return "corrupt double metaphone index";
+
+	return NULL;
+}
+
+/*
+ * Find the run [*start, *end) of entries of a code index carrying the given
+ * (NUL-terminated) code.
+ */
+void
+fzd_code_range(const FuzzyDictCodeEntry *idx, uint32 n, const char *code,
+			   uint32 *start, uint32 *end)
+{
+	char		padded[FZD_CODE_LEN];
+	uint32		lo = 0,
+				hi = n;
+
+	if (code[0] == '\0')
+	{
+		*start = *end = 0;
+		return;
+	}
+	fzd_pad_code(padded, code);
+	while (lo < hi)
+	{
+		uint32		mid = lo + (hi - lo) / 2;
+
+		if (memcmp(idx[mid].code, padded, FZD_CODE_LEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*start = lo;
+	while (lo < n && memcmp(idx[lo].code, padded, FZD_CODE_LEN) == 0)
+		lo++;
+	*end = lo;
+}
+
+/*
+ * Look a word up by its bytes, returning its number or FZD_NO_WORD.  Words
+ * are numbered in memcmp() order, so this is a binary search.
+ */
+uint32
+fzd_find_word(const FuzzyDict *dict, const char *str, int len)
+{
+	FzdWord		key;
+	uint32		lo = 0,
+				hi = dict->hdr->nwords;
+
+	key.str = str;
+	key.len = len;
+	while (lo < hi)
+	{
+		uint32		mid = lo + (hi - lo) / 2;
+		FzdWord		w;
+		int			c;
+
+		w.str = fzd_word(dict, mid, &w.len);
+		c = fzd_word_cmp(&w, &key);
+		if (c == 0)
+			return mid;
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return FZD_NO_WORD;
+}
+
+/*
+ * Report every word within Levenshtein distance max_d (unit costs) of the
+ * query, in word order.
+ *
+ * This is a depth-first walk of the trie which keeps one row of the usual
+ * dynamic programming matrix per character of the current prefix: the row
+ * for a prefix is computed from its parent's row when the prefix's last
+ * character is complete, so rows are shared by all words with that prefix.
+ * The trie is over bytes while distances are over characters, so nodes in
+ * the middle of a multibyte character just pass their parent's row along.
+ * A subtree is abandoned as soon as every entry of its row exceeds max_d,
+ * since extending the prefix can never make any entry smaller.
+ */
+void
+fzd_search_levenshtein(const FuzzyDict *dict,
+					   const char *query, int query_bytes, int max_d,
+					   fzd_match_callback callback, void *arg)
+{
+	typedef struct
+	{
+		uint32		node;
+		uint32		next_child;
+		int			char_depth;
+		int			char_start;	/* byte depth at which the current, maybe
+								 * incomplete, character started */
+	} FzdFrame;
+
+	int			m;
+	int		   *q_off;
+	int		   *rows;
+	FzdFrame   *stack;
+	int			sp;
+	unsigned char path[FZD_MAX_BYTES + 1];
+	const char *p;
+	int			i;
+
+	if (max_d < 0)
+		return;
+	m = pg_mbstrlen_with_len(query, query_bytes);
+	if (m > FZD_MAX_CHARS + max_d)
+		return;
+
+	/* character boundaries in the query */
+	q_off = FZD_ALLOC((m + 1) * sizeof(int));
+	for (p = query, i = 0; i < m; i++)
+	{
+		q_off[i] = p - query;
+		p += pg_mblen(p);
+	}
+	q_off[m] = p - query;
+
+	rows = FZD_ALLOC((uint64) (FZD_MAX_CHARS + 1) * (m + 1) * sizeof(int));
+	stack = FZD_ALLOC((FZD_MAX_BYTES + 1) * sizeof(FzdFrame));
+
+	for (i = 0; i <= m; i++)
+		rows[i] = i;
+	stack[0].node = 0;
+	stack[0].next_child = 0;
+	stack[0].char_depth = 0;
+	stack[0].char_start = 0;
+	sp = 1;
+
+	while (sp > 0)
+	{
+		FzdFrame   *top = &stack[sp - 1];
+		const FuzzyDictTrieNode *parent = &dict->trie[top->node];
+		const FuzzyDictTrieNode *child;
+		uint32		child_no;
+		int			byte_depth = sp - 1;
+		int			char_start = top->char_start;
+		int			char_depth = top->char_depth;
+
+		if (top->next_child >= parent->nchildren || byte_depth >= FZD_MAX_BYTES)
+		{
+			sp--;
+			continue;
+		}
+		child_no = parent->first_child + top->next_child++;
+		child = &dict->trie[child_no];
+		path[byte_depth] = child->label;
+
+		if (byte_depth + 1 - char_start ==
+			pg_mblen((const char *) path + char_start))
+		{
+			/* the child completes a character: compute its row */
+			const int  *prev = rows + (uint64) char_depth * (m + 1);
+			int		   *curr = rows + (uint64) (char_depth + 1) * (m + 1);
+			const char *c = (const char *) path + char_start;
+			int			c_len = byte_depth + 1 - char_start;
+			int			row_min;
+
+			if (char_depth + 1 > FZD_MAX_CHARS)
+				continue;
+			curr[0] = char_depth + 1;
+			row_min = curr[0];
+			for (i = 1; i <= m; i++)
+			{
+				int			q_len = q_off[i] - q_off[i - 1];
+				int			sub = prev[i - 1];
+				int			v;
+
+				if (q_len != c_len || memcmp(query + q_off[i - 1], c, c_len) != 0)
+					sub++;
+				v = Min(prev[i] + 1, curr[i - 1] + 1);
+				v = Min(v, sub);
+				curr[i] = v;
+				row_min = Min(row_min, v);
+			}
+
+			if (child->word != FZD_NO_WORD && curr[m] <= max_d)
+			{
+				if (!callback(child->word, curr[m], arg))
+					break;
+			}
+			if (row_min > max_d || child->nchildren == 0)
+				continue;
+
+			stack[sp].char_depth = char_depth + 1;
+			stack[sp].char_start = byte_depth + 1;
+		}
+		else
+		{
+			/* in the middle of a multibyte character */
+			if (child->nchildren == 0)
+				continue;
+			stack[sp].char_depth = char_depth;
+			stack[sp].char_start = char_start;
+		}
+		stack[sp].node = child_no;
+		stack[sp].next_child = 0;
+		sp++;
+	}
+
+	FZD_FREE(q_off);
+	FZD_FREE(rows);
+	FZD_FREE(stack);
+}
+
+
+#ifdef FUZZYSTRMATCH_STANDALONE
+
+/*
+ * Read a word list, one word per line.  Blank lines, and lines containing
+ * tabs (which the daemon's protocol could not carry), are ignored; the
+ * latter are counted in *nskipped.  Exits on I/O errors.
+ */
+static char **
+fzd_read_words(const char *path, int *nwords, int *nskipped)
+{
+	FILE	   *fp = fopen(path, "r");
+	char	   *line = NULL;
+	size_t		linecap = 0;
+	ssize_t		len;
+	int			cap = 1024;
+	char	  **words;
+
+	if (fp == NULL)
+	{
+		fprintf(stderr, "could not open \"%s\": %s\n", path, strerror(errno));
+		exit(1);
+	}
+	*nwords = 0;
+	*nskipped = 0;
+	words = fzd_malloc(cap * sizeof(char *));
+	while ((len = getline(&line, &linecap, fp)) != -1)
+	{
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if (strchr(line, '\t') != NULL)
+		{
+			(*nskipped)++;
+			continue;
+		}
+		if (*nwords == cap)
+		{
+			cap *= 2;
+			words = realloc(words, cap * sizeof(char *));
+			if (words == NULL)
+			{
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		words[*nwords] = fzd_malloc(len + 1);
+		memcpy(words[*nwords], line, len + 1);
+		(*nwords)++;
+	}
+	if (ferror(fp))
+	{
+		fprintf(stderr, "could not read \"%s\": %s\n", path, strerror(errno));
+		exit(1);
+	}
+	free(line);
+	fclose(fp);
+	return words;
+}
+
+static void
+fzd_free_words(char **words, int nwords)
+{
+	int			i;
+
+	for (i = 0; i < nwords; i++)
+		free(words[i]);
+	free(words);
+}
+
+#else							/* !FUZZYSTRMATCH_STANDALONE */
+
+/*
+ * SQL interface.
+ *
+ * fuzzy_dict_load(name, path) maps a compiled dictionary file into the
+ * current backend under the given name; the fuzzy_dict_* search functions
+ * then refer to it by name.  Files are mapped read-only and shared, so the
+ * pages are shared with every other process that maps the same file, and
+ * loading costs little more than one validation pass over the image.
+ *
+ * Keeping a dictionary current.  An image is never modified; instead, the
+ * fuzzy_dict_track() trigger on the table a dictionary was built from
+ * records every word added or removed in the extension's fuzzy_dict_delta
+ * table, and each search combines the image with the net effect of those
+ * changes: words removed since the image was built are filtered out of its
+ * results, and the words added are compiled into a small image of their own
+ * which is searched the same way.  That costs time in proportion to the
+ * number of changes, so fuzzy_dict_compact() should be run periodically (from
+ * cron, say) to fold them into a new image file.  It renames the new file
+ * over the old one, and every backend maps the new file on its next search.
+ *
+ * The file is replaced before the compacting transaction commits, so if the
+ * transaction aborts, the change rows it deleted come back although the file
+ * already includes them.  That is harmless, since applying a change twice
+ * has no further effect.  Searches read the change rows before checking the
+ * file, so one whose snapshot no longer sees some rows always finds the file
+ * that includes them.
+ *
+ * A word is tracked by value, not by row, so the word column should be
+ * unique: deleting one of two rows with the same word removes the word.
+ *
+ * With fuzzystrmatch in shared_preload_libraries, the changes need not be
+ * read for every search.  Each dictionary a backend loads has a slot in
+ * shared memory holding a count that every committed transaction which
+ * recorded or compacted changes for it advances, and a backend keeps the
+ * changes it last read, with the image of the added words, until that count
+ * or the file moves.  The count is advanced after the commit is visible,
+ * and a backend reads it before taking the snapshot it reads the changes
+ * with, so the changes kept for a given count include every commit that
+ * advanced it that far.  A transaction sees its own uncommitted changes by
+ * reading them afresh, and may not be prepared, since the count would not
+ * move when it was finally committed.  The slot also counts the change rows
+ * awaiting compaction, and if fuzzystrmatch.dict_compact_database is set, a
+ * background worker connected to that database compacts any dictionary
+ * loaded there once the count reaches fuzzystrmatch.dict_compact_threshold.
+ */
+
+typedef struct LoadedDict
+{
+	struct LoadedDict *next;
+	char		name[NAMEDATALEN];
+	char		path[MAXPGPATH];
+	char	   *mapping;
+	size_t		mapping_size;
+	dev_t		dev;			/* identity of the mapped file, to notice */
+	ino_t		ino;			/* when it has been replaced */
+	time_t		mtime;
+	FuzzyDict	dict;
+	int			shared_slot;	/* slot in FzdShared, or -1 if none */
+	struct FzdDelta *delta;		/* changes kept for this file, or NULL */
+	uint64		delta_changes;	/* shared change count they were read at */
+} LoadedDict;
+
+/* The changes recorded since a dictionary's image was built */
+typedef struct FzdDelta
+{
+	MemoryContext context;		/* where they and added_dict live */
+	FzdWord    *deleted;		/* words removed, sorted */
+	int			ndeleted;
+	char	  **added;			/* words added that the image lacks, sorted */
+	int			nadded;
+	bool		added_built;	/* added_dict is valid */
+	FuzzyDict	added_dict;		/* image of added[], built on demand */
+} FzdDelta;
+
+/* advisory lock class serializing fuzzy_dict_compact() on the same file */
+#define FZD_COMPACT_LOCK_CLASS	0x465A4443
+
+static LoadedDict *loaded_dicts = NULL;
+
+extern Datum fuzzy_dict_load(PG_FUNCTION_ARGS);
+extern Datum fuzzy_dict_search(PG_FUNCTION_ARGS);
+extern Datum fuzzy_dict_soundex(PG_FUNCTION_ARGS);
+extern Datum fuzzy_dict_dmetaphone(PG_FUNCTION_ARGS);
+extern Datum fuzzy_dict_track(PG_FUNCTION_ARGS);
+extern Datum fuzzy_dict_compact(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT void fuzzy_dict_compactor_main(Datum main_arg);
+
+/*
+ * Shared state of the dictionaries loaded in any backend, when the module
+ * is preloaded.  fuzzy_dict_load() claims a slot for each database and name
+ * and slots are never given up, so a backend remembers its slot's number.
+ * If they run out, dictionaries without one read their changes every time.
+ */
+#define FZD_SHARED_SLOTS		64
+
+typedef struct
+{
+	Oid			dbid;			/* InvalidOid while the slot is free */
+	char		name[NAMEDATALEN];
+	char		path[MAXPGPATH];	/* file it was last loaded from */
+	uint64		changes;		/* commits that changed its changes */
+	int64		pending;		/* change rows not compacted, roughly */
+} FzdSharedDict;
+
+typedef struct
+{
+	LWLock	   *lock;			/* protects the slots */
+	FzdSharedDict dicts[FZD_SHARED_SLOTS];
+} FzdShared;
+
+/* what the current transaction has done to a dictionary's changes */
+typedef struct FzdXactChange
+{
+	struct FzdXactChange *next;
+	char		name[NAMEDATALEN];
+	int64		recorded;
+	int64		consumed;
+} FzdXactChange;
+
+/* API differences between the server versions we build against */
+#if PG_VERSION_NUM >= 110000
+#define fzd_connect_worker(dbname) \
+	BackgroundWorkerInitializeConnection((dbname), NULL, 0)
+#else
+#define fzd_connect_worker(dbname) \
+	BackgroundWorkerInitializeConnection((dbname), NULL)
+#endif
+#if PG_VERSION_NUM >= 100000
+#define fzd_wait_latch(timeout) \
+	WaitLatch(&MyProc->procLatch, \
+			  WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, \
+			  (timeout), PG_WAIT_EXTENSION)
+#else
+#define fzd_wait_latch(timeout) \
+	WaitLatch(&MyProc->procLatch, \
+			  WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, (timeout))
+#endif
+
+#define FZD_LWLOCK_TRANCHE		"fuzzystrmatch dictionaries"
+
+int			fuzzystrmatch_dict_compact_threshold = 10000;
+int			fuzzystrmatch_dict_compact_naptime = 60;
+char	   *fuzzystrmatch_dict_compact_database = NULL;
+
+static FzdShared *fzd_shared = NULL;
+static FzdXactChange *fzd_xact_changes = NULL;	/* in TopTransactionContext */
+static volatile sig_atomic_t fzd_got_sighup = false;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+static void
+fzd_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	fzd_shared = ShmemInitStruct("fuzzystrmatch dictionaries",
+								 sizeof(FzdShared), &found);
+	if (!found)
+	{
+		memset(fzd_shared, 0, sizeof(FzdShared));
+#if PG_VERSION_NUM >= 90600
+		fzd_shared->lock = &(GetNamedLWLockTranche(FZD_LWLOCK_TRANCHE))->lock;
+#else
+		fzd_shared->lock = LWLockAssign();
+#endif
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+static void
+fzd_request_shmem(void)
+{
+	RequestAddinShmemSpace(MAXALIGN(sizeof(FzdShared)));
+#if PG_VERSION_NUM >= 90600
+	RequestNamedLWLockTranche(FZD_LWLOCK_TRANCHE, 1);
+#else
+	RequestAddinLWLocks(1);
+#endif
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+fzd_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+	fzd_request_shmem();
+}
+#endif
+
+/*
+ * Advance the shared change counts of the dictionaries this transaction
+ * changed, once its changes are visible to everyone; see above.
+ */
+static void
+fzd_xact_callback(XactEvent event, void *arg)
+{
+	FzdXactChange *c;
+	int			i;
+
+	switch (event)
+	{
+#if PG_VERSION_NUM >= 90500
+		case XACT_EVENT_PRE_PREPARE:
+			if (fzd_xact_changes != NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has changed a fuzzy dictionary")));
+			break;
+#endif
+		case XACT_EVENT_COMMIT:
+			if (fzd_xact_changes == NULL)
+				break;
+			LWLockAcquire(fzd_shared->lock, LW_EXCLUSIVE);
+			for (c = fzd_xact_changes; c != NULL; c = c->next)
+			{
+				for (i = 0; i < FZD_SHARED_SLOTS; i++)
+				{
+					FzdSharedDict *sd = &fzd_shared->dicts[i];
+
+					if (sd->dbid == MyDatabaseId &&
+						strcmp(sd->name, c->name) == 0)
+					{
+						sd->changes++;
+						sd->pending = Max(sd->pending + c->recorded -
+										  c->consumed, 0);
+						break;
+					}
+				}
+			}
+			LWLockRelease(fzd_shared->lock);
+			fzd_xact_changes = NULL;
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			fzd_xact_changes = NULL;
+			break;
+		default:
+			break;
+	}
+}
+
+/* Count the change rows this transaction has recorded or consumed */
+static void
+fzd_note_changes(const char *name, int64 recorded, int64 consumed)
+{
+	FzdXactChange *c;
+
+	if (fzd_shared == NULL)
+		return;
+
+	for (c = fzd_xact_changes; c != NULL; c = c->next)
+		if (strncmp(c->name, name, NAMEDATALEN - 1) == 0)
+			break;
+	if (c == NULL)
+	{
+		c = MemoryContextAllocZero(TopTransactionContext,
+								   sizeof(FzdXactChange));
+		strlcpy(c->name, name, NAMEDATALEN);
+		c->next = fzd_xact_changes;
+		fzd_xact_changes = c;
+	}
+	c->recorded += recorded;
+	c->consumed += consumed;
+}
+
+/*
+ * Give a dictionary just loaded the shared slot of its database and name,
+ * claiming one if it has none.
+ */
+static void
+fzd_register(LoadedDict *ld)
+{
+	int			free_slot = -1;
+	int			i;
+
+	ld->shared_slot = -1;
+	if (fzd_shared == NULL)
+		return;
+
+	LWLockAcquire(fzd_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < FZD_SHARED_SLOTS; i++)
+	{
+		FzdSharedDict *sd = &fzd_shared->dicts[i];
+
+		if (sd->dbid == MyDatabaseId && strcmp(sd->name, ld->name) == 0)
+		{
+			ld->shared_slot = i;
+			break;
+		}
+		if (sd->dbid == InvalidOid && free_slot < 0)
+			free_slot = i;
+	}
+	if (ld->shared_slot < 0 && free_slot >= 0)
+	{
+		FzdSharedDict *sd = &fzd_shared->dicts[free_slot];
+
+		sd->dbid = MyDatabaseId;
+		strlcpy(sd->name, ld->name, NAMEDATALEN);
+		sd->changes = 0;
+		sd->pending = 0;
+		ld->shared_slot = free_slot;
+	}
+	if (ld->shared_slot >= 0)
+		strlcpy(fzd_shared->dicts[ld->shared_slot].path, ld->path, MAXPGPATH);
+	LWLockRelease(fzd_shared->lock);
+}
+
+/*
+ * Read the shared change count of a dictionary.  Returns false if it has no
+ * slot, or if the current transaction has changed it, since the count does
+ * not reflect that.
+ */
+static bool
+fzd_shared_changes(LoadedDict *ld, uint64 *changes)
+{
+	FzdXactChange *c;
+
+	if (ld->shared_slot < 0)
+		return false;
+	for (c = fzd_xact_changes; c != NULL; c = c->next)
+		if (strcmp(c->name, ld->name) == 0)
+			return false;
+
+	LWLockAcquire(fzd_shared->lock, LW_SHARED);
+	*changes = fzd_shared->dicts[ld->shared_slot].changes;
+	LWLockRelease(fzd_shared->lock);
+	return true;
+}
+
+/*
+ * Having read all nrows change rows of a dictionary at the given count,
+ * correct its pending count, unless some commit has moved on since.
+ */
+static void
+fzd_set_pending(LoadedDict *ld, uint64 changes, uint64 nrows)
+{
+	FzdSharedDict *sd = &fzd_shared->dicts[ld->shared_slot];
+
+	LWLockAcquire(fzd_shared->lock, LW_EXCLUSIVE);
+	if (sd->changes == changes)
+		sd->pending = (int64) nrows;
+	LWLockRelease(fzd_shared->lock);
+}
+
+/* Drop the changes kept for a dictionary */
+static void
+fzd_forget_delta(LoadedDict *ld)
+{
+	if (ld->delta != NULL)
+	{
+		MemoryContextDelete(ld->delta->context);
+		ld->delta = NULL;
+	}
+}
+
+static LoadedDict *
+lookup_dict(text *name)
+{
+	char	   *cname = text_to_cstring(name);
+	LoadedDict *ld;
+
+	for (ld = loaded_dicts; ld != NULL; ld = ld->next)
+		if (strcmp(ld->name, cname) == 0)
+			return ld;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_OBJECT),
+			 errmsg("fuzzy dictionary \"%s\" is not loaded", cname),
+			 errhint("Load it with fuzzy_dict_load().")));
+	return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * Map a compiled dictionary file and validate it, returning the mapping,
+ * the file's status and the attached dictionary.
+ */
+static void
+fzd_map_file(const char *path, char **mapping, struct stat * st,
+			 FuzzyDict *dict)
+{
+	int			fd;
+	void	   *addr;
+	const char *problem;
+
+	fd = OpenTransientFile((char *) path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+	if (fstat(fd, st) < 0)
+	{
+		int			save_errno = errno;
+
+		CloseTransientFile(fd);
+		errno = save_errno;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+	}
+	if (st->st_size < (off_t) sizeof(FuzzyDictHeader))
+	{
+		CloseTransientFile(fd);
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("file \"%s\" is not a compiled fuzzy dictionary", path)));
+	}
+	addr = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	CloseTransientFile(fd);
+	if (addr == MAP_FAILED)
+		ereport(ERROR,
+				(errmsg("could not map file \"%s\": %m", path)));
+
+	problem = fzd_attach(dict, addr, st->st_size);
+	if (problem == NULL &&
+		strcmp(dict->hdr->encoding, GetDatabaseEncodingName()) != 0)
+		problem = "dictionary encoding does not match the database encoding";
+	if (problem != NULL)
+	{
+		munmap(addr, st->st_size);
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("could not load fuzzy dictionary \"%s\": %s",
+						path, problem)));
+	}
+	*mapping = addr;
+}
+
+static void
+fzd_set_mapping(LoadedDict *ld, char *mapping, const struct stat * st,
+				const FuzzyDict *dict)
+{
+	ld->mapping = mapping;
+	ld->mapping_size = st->st_size;
+	ld->dev = st->st_dev;
+	ld->ino = st->st_ino;
+	ld->mtime = st->st_mtime;
+	ld->dict = *dict;
+	/* the added words were checked against the old file */
+	fzd_forget_delta(ld);
+}
+
+/*
+ * Switch to the current file if the one we mapped has been replaced, as
+ * fuzzy_dict_compact() does.  If the file has gone, keep what we have.
+ */
+static void
+fzd_refresh(LoadedDict *ld)
+{
+	struct stat st;
+	char	   *mapping;
+	FuzzyDict	dict;
+
+	if (stat(ld->path, &st) < 0 ||
+		(st.st_dev == ld->dev && st.st_ino == ld->ino &&
+		 st.st_mtime == ld->mtime && (size_t) st.st_size == ld->mapping_size))
+		return;
+
+	fzd_map_file(ld->path, &mapping, &st, &dict);
+	munmap(ld->mapping, ld->mapping_size);
+	fzd_set_mapping(ld, mapping, &st, &dict);
+}
+
+PG_FUNCTION_INFO_V1(fuzzy_dict_load);
+Datum
+fuzzy_dict_load(PG_FUNCTION_ARGS)
+{
+	char	   *name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char	   *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	LoadedDict *ld;
+	LoadedDict **prevp;
+	struct stat st;
+	char	   *mapping;
+	FuzzyDict	dict;
+
+	if (strlen(name) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("fuzzy dictionary name too long")));
+	if (strlen(path) >= MAXPGPATH)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("path too long")));
+
+	fzd_map_file(path, &mapping, &st, &dict);
+
+	/* replace any dictionary previously loaded under this name */
+	for (prevp = &loaded_dicts; *prevp != NULL; prevp = &(*prevp)->next)
+	{
+		if (strcmp((*prevp)->name, name) == 0)
+		{
+			ld = *prevp;
+			*prevp = ld->next;
+			fzd_forget_delta(ld);
+			munmap(ld->mapping, ld->mapping_size);
+			pfree(ld);
+			break;
+		}
+	}
+
+	ld = MemoryContextAllocZero(TopMemoryContext, sizeof(LoadedDict));
+	strlcpy(ld->name, name, NAMEDATALEN);
+	strlcpy(ld->path, path, MAXPGPATH);
+	fzd_set_mapping(ld, mapping, &st, &dict);
+	fzd_register(ld);
+	ld->next = loaded_dicts;
+	loaded_dicts = ld;
+
+	PG_RETURN_INT64((int64) dict.hdr->nwords);
+}
+
+/* The delta table, which lives in the schema of the extension's functions */
+static char *
+fzd_delta_table(FunctionCallInfo fcinfo)
+{
+	Oid			nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+
+	return psprintf("%s.fuzzy_dict_delta",
+					quote_identifier(get_namespace_name(nspid)));
+}
+
+typedef struct
+{
+	char	   *word;
+	int			len;
+	bool		deleted;
+	int64		seq;
+} FzdDeltaRow;
+
+/* by word, then latest change first */
+static int
+fzd_delta_row_cmp(const void *a, const void *b)
+{
+	const FzdDeltaRow *ra = (const FzdDeltaRow *) a;
+	const FzdDeltaRow *rb = (const FzdDeltaRow *) b;
+	int			c = memcmp(ra->word, rb->word, Min(ra->len, rb->len));
+
+	if (c != 0)
+		return c;
+	if (ra->len != rb->len)
+		return ra->len - rb->len;
+	return ra->seq > rb->seq ? -1 : ra->seq < rb->seq ? 1 : 0;
+}
+
+/*
+ * Read the changes recorded for a dictionary and reduce them to their net
+ * effect: the words whose latest change added them, and (sorted) the words
+ * whose latest change removed them, allocated in context.  With consume, the
+ * rows are deleted as they are read; with latest, they are read with a new
+ * snapshot rather than the statement's.  Returns the number of rows.
+ */
+static uint64
+fzd_fetch_delta(FunctionCallInfo fcinfo, const char *name, bool consume,
+				bool latest, MemoryContext context,
+				char ***added, int *nadded, FzdWord **deleted, int *ndeleted)
+{
+	MemoryContext oldcontext;
+	char	   *table = fzd_delta_table(fcinfo);
+	Oid			argtypes[1] = {TEXTOID};
+	Datum		values[1];
+	FzdDeltaRow *rows;
+	uint64		nrows;
+	uint64		i;
+	int			ret;
+
+	values[0] = CStringGetTextDatum(name);
+
+	if (latest)
+		PushActiveSnapshot(GetLatestSnapshot());
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+	if (consume)
+		ret = SPI_execute_with_args(psprintf("DELETE FROM %s WHERE dict = $1 RETURNING word, deleted, seq", table),
+									1, argtypes, values, NULL, false, 0);
+	else
+		ret = SPI_execute_with_args(psprintf("SELECT word, deleted, seq FROM %s WHERE dict = $1", table),
+									1, argtypes, values, NULL, true, 0);
+	if (ret != (consume ? SPI_OK_DELETE_RETURNING : SPI_OK_SELECT))
+		elog(ERROR, "could not read changes to fuzzy dictionary \"%s\": %s",
+			 name, SPI_result_code_string(ret));
+
+	/* copy the rows out before SPI_finish releases them */
+	nrows = SPI_processed;
+	oldcontext = MemoryContextSwitchTo(context);
+	rows = MemoryContextAllocHuge(context,
+								  Max(nrows, 1) * sizeof(FzdDeltaRow));
+	for (i = 0; i < nrows; i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+		bool		isnull;
+
+		rows[i].word = SPI_getvalue(tuple, tupdesc, 1);
+		rows[i].len = strlen(rows[i].word);
+		rows[i].deleted = DatumGetBool(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+		rows[i].seq = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+	}
+	MemoryContextSwitchTo(oldcontext);
+	SPI_finish();
+	if (latest)
+		PopActiveSnapshot();
+
+	qsort(rows, nrows, sizeof(FzdDeltaRow), fzd_delta_row_cmp);
+
+	*added = MemoryContextAllocHuge(context, Max(nrows, 1) * sizeof(char *));
+	*deleted = MemoryContextAllocHuge(context, Max(nrows, 1) * sizeof(FzdWord));
+	*nadded = *ndeleted = 0;
+	for (i = 0; i < nrows; i++)
+	{
+		if (i > 0 && rows[i].len == rows[i - 1].len &&
+			memcmp(rows[i].word, rows[i - 1].word, rows[i].len) == 0)
+			continue;
+		if (rows[i].deleted)
+		{
+			(*deleted)[*ndeleted].str = rows[i].word;
+			(*deleted)[*ndeleted].len = rows[i].len;
+			(*ndeleted)++;
+		}
+		else
+			(*added)[(*nadded)++] = rows[i].word;
+	}
+	pfree(rows);
+
+	return nrows;
+}
+
+/*
+ * Look up a loaded dictionary for a search and map its current file.  If
+ * the dictionary has a shared change count this transaction can rely on,
+ * *counted is set and the count, read before the file is checked, is
+ * returned in *changes; together with the file they determine the result.
+ */
+static LoadedDict *
+fzd_lookup_current(text *name, bool *counted, uint64 *changes)
+{
+	LoadedDict *ld = lookup_dict(name);
+
+	*changes = 0;
+	*counted = fzd_shared_changes(ld, changes);
+	fzd_refresh(ld);
+	return ld;
+}
+
+/*
+ * Collect the changes recorded since a dictionary's file was built, or
+ * reuse those collected before if the shared change count has not moved
+ * (those kept are forgotten when the file is replaced).
+ */
+static FzdDelta *
+fzd_open(FunctionCallInfo fcinfo, LoadedDict *ld, bool counted,
+		 uint64 changes)
+{
+	FzdDelta   *delta;
+	MemoryContext context;
+	bool		keep = counted;
+	uint64		nrows;
+	char	  **added;
+	int			nadded;
+	int			i;
+
+	if (keep && ld->delta != NULL && ld->delta_changes == changes)
+		return ld->delta;
+
+	/*
+	 * Changes to keep get a context of their own, which is only moved under
+	 * TopMemoryContext once they are complete.
+	 */
+	if (keep)
+		context = AllocSetContextCreate(CurrentMemoryContext,
+										"fuzzy dictionary changes",
+										ALLOCSET_SMALL_MINSIZE,
+										ALLOCSET_SMALL_INITSIZE,
+										ALLOCSET_DEFAULT_MAXSIZE);
+	else
+		context = CurrentMemoryContext;
+	delta = MemoryContextAllocZero(context, sizeof(FzdDelta));
+	delta->context = context;
+
+	/* the changes must be read before the file is checked; see above */
+	nrows = fzd_fetch_delta(fcinfo, ld->name, false, keep, context,
+							&added, &nadded,
+							&delta->deleted, &delta->ndeleted);
+	fzd_refresh(ld);
+
+	/* words that are in the image already need no second copy */
+	delta->added = added;
+	delta->nadded = 0;
+	for (i = 0; i < nadded; i++)
+		if (fzd_find_word(&ld->dict, added[i], strlen(added[i])) == FZD_NO_WORD)
+			delta->added[delta->nadded++] = added[i];
+	delta->added_built = false;
+
+	if (keep)
+	{
+		fzd_forget_delta(ld);
+		MemoryContextSetParent(context, TopMemoryContext);
+		ld->delta = delta;
+		ld->delta_changes = changes;
+		fzd_set_pending(ld, changes, nrows);
+	}
+
+	return delta;
+}
+
+/* The image of the words added since the file was built, or NULL if none */
+static const FuzzyDict *
+fzd_added_dict(LoadedDict *ld, FzdDelta *delta)
+{
+	if (delta->nadded == 0)
+		return NULL;
+	if (!delta->added_built)
+	{
+		uint64		size;
+		int			nskipped;
+		char	   *image;
+		const char *problem;
+		MemoryContext oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(delta->context);
+		image = fzd_build_image(delta->added, delta->nadded,
+								ld->dict.hdr->encoding,
+								ld->dict.hdr->generation, &size, &nskipped);
+		MemoryContextSwitchTo(oldcontext);
+		problem = fzd_attach(&delta->added_dict, image, size);
+		if (problem != NULL)
+			elog(ERROR, "could not build image of changes to fuzzy dictionary \"%s\": %s",
+				 ld->name, problem);
+		delta->added_built = true;
+	}
+	return &delta->added_dict;
+}
+
+static bool
+fzd_is_deleted(const FzdDelta *delta, const char *str, int len)
+{
+	FzdWord		key;
+
+	if (delta == NULL || delta->ndeleted == 0)
+		return false;
+	key.str = str;
+	key.len = len;
+	return bsearch(&key, delta->deleted, delta->ndeleted, sizeof(FzdWord),
+				   fzd_word_cmp) != NULL;
+}
+
+/*
+ * Where the rows of a search go: the SRF's tuplestore and, if the result
+ * cache is in use, a copy in the form the cache keeps, which is an int32
+ * distance and an int32 length followed by the word's bytes for each row.
+ * The copy is abandoned if it outgrows a cache slot.
+ */
+typedef struct
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;		/* (word) or (word, distance) */
+	StringInfo	capture;
+} FzdOutput;
+
+static void
+fzd_emit(FzdOutput *out, const char *str, int len, int distance)
+{
+	Datum		values[2];
+	bool		nulls[2] = {false, false};
+
+	values[0] = PointerGetDatum(cstring_to_text_with_len(str, len));
+	values[1] = Int32GetDatum(distance);
+	tuplestore_putvalues(out->tupstore, out->tupdesc, values, nulls);
+
+	if (out->capture != NULL)
+	{
+		int32		header[2];
+
+		if (out->capture->len + sizeof(header) + len > FUZZY_CACHE_VALUE_MAX)
+		{
+			out->capture = NULL;
+			return;
+		}
+		header[0] = distance;
+		header[1] = len;
+		appendBinaryStringInfo(out->capture, (char *) header, sizeof(header));
+		appendBinaryStringInfo(out->capture, str, len);
+	}
+}
+
+/* the kinds of search, as distinguished in result cache keys */
+#define FZD_CACHE_LEVENSHTEIN	1
+#define FZD_CACHE_SOUNDEX		2
+#define FZD_CACHE_DMETAPHONE	3
+
+/*
+ * Everything a search result depends on besides the query: the file, and
+ * the changes recorded for the dictionary, which its shared slot (one per
+ * database and name) and the slot's change count identify.
+ */
+typedef struct
+{
+	int32		kind;
+	int32		max_d;
+	uint64		generation;
+	uint64		dev;
+	uint64		ino;
+	int64		mtime;
+	uint64		size;
+	int32		shared_slot;
+	uint64		changes;
+} FzdCacheKey;
+
+/*
+ * Try to answer a search from the shared result cache, emitting the rows
+ * if so.  Otherwise, if the cache is enabled, set out up to capture the
+ * result, for fzd_cache_store() to store under *key.  Dictionaries without
+ * a change count (see fzd_lookup_current) are not cached, since nothing
+ * short of reading their changes tells whether they have moved.
+ */
+static bool
+fzd_cache_fetch(LoadedDict *ld, bool counted, uint64 changes, int kind,
+				int max_d, const char *query, int query_len, FzdOutput *out,
+				StringInfo key)
+{
+	FzdCacheKey k;
+	StringInfoData value;
+	int			pos;
+
+	out->capture = NULL;
+	if (!counted || !fuzzy_cache_enabled())
+		return false;
+
+	memset(&k, 0, sizeof(k));
+	k.kind = kind;
+	k.max_d = max_d;
+	k.generation = ld->dict.hdr->generation;
+	k.dev = (uint64) ld->dev;
+	k.ino = (uint64) ld->ino;
+	k.mtime = (int64) ld->mtime;
+	k.size = (uint64) ld->mapping_size;
+	k.shared_slot = ld->shared_slot;
+	k.changes = changes;
+	initStringInfo(key);
+	appendBinaryStringInfo(key, (char *) &k, sizeof(k));
+	appendBinaryStringInfo(key, query, query_len);
+	if (key->len > FUZZY_CACHE_KEY_MAX)
+		return false;
+
+	initStringInfo(&value);
+	if (!fuzzy_cache_get(key->data, key->len, &value))
+	{
+		out->capture = makeStringInfo();
+		return false;
+	}
+
+	for (pos = 0; pos + 2 * (int) sizeof(int32) <= value.len;)
+	{
+		int32		header[2];
+
+		memcpy(header, value.data + pos, sizeof(header));
+		pos += sizeof(header);
+		fzd_emit(out, value.data + pos, header[1], header[0]);
+		pos += header[1];
+	}
+	return true;
+}
+
+static void
+fzd_cache_store(StringInfo key, FzdOutput *out)
+{
+	if (out->capture != NULL)
+		fuzzy_cache_put(key->data, key->len,
+						out->capture->data, out->capture->len);
+}
+
+typedef struct
+{
+	const FuzzyDict *dict;
+	const FzdDelta *filter;		/* drop the words it deletes, unless NULL */
+	FzdOutput	out;
+} FzdSearchState;
+
+static bool
+fzd_collect_match(uint32 word, int distance, void *arg)
+{
+	FzdSearchState *state = (FzdSearchState *) arg;
+	const char *str;
+	int			len;
+
+	CHECK_FOR_INTERRUPTS();
+
+	str = fzd_word(state->dict, word, &len);
+	if (!fzd_is_deleted(state->filter, str, len))
+		fzd_emit(&state->out, str, len, distance);
+	return true;
+}
+
+PG_FUNCTION_INFO_V1(fuzzy_dict_search);
+Datum
+fuzzy_dict_search(PG_FUNCTION_ARGS)
+{
+	bool		counted;
+	uint64		changes;
+	LoadedDict *ld = fzd_lookup_current(PG_GETARG_TEXT_PP(0),
+										&counted, &changes);
+	FzdDelta   *delta;
+	text	   *query = PG_GETARG_TEXT_PP(1);
+	int			max_d = PG_GETARG_INT32(2);
+	const FuzzyDict *added;
+	FzdSearchState state;
+	StringInfoData key;
+
+	state.out.tupstore = init_materialize_srf(fcinfo, &state.out.tupdesc);
+	if (fzd_cache_fetch(ld, counted, changes, FZD_CACHE_LEVENSHTEIN, max_d,
+						VARDATA_ANY(query), VARSIZE_ANY_EXHDR(query),
+						&state.out, &key))
+		return (Datum) 0;
+
+	delta = fzd_open(fcinfo, ld, counted, changes);
+	state.dict = &ld->dict;
+	state.filter = delta;
+	fzd_search_levenshtein(&ld->dict, VARDATA_ANY(query),
+						   VARSIZE_ANY_EXHDR(query), max_d,
+						   fzd_collect_match, &state);
+
+	added = fzd_added_dict(ld, delta);
+	if (added != NULL)
+	{
+		state.dict = added;
+		state.filter = NULL;
+		fzd_search_levenshtein(added, VARDATA_ANY(query),
+							   VARSIZE_ANY_EXHDR(query), max_d,
+							   fzd_collect_match, &state);
+	}
+
+	fzd_cache_store(&key, &state.out);
+	return (Datum) 0;
+}
+
+static void
+fzd_put_code_matches(FzdOutput *out, const FuzzyDict *dict,
+					 const FzdDelta *filter,
+					 const FuzzyDictCodeEntry *idx, uint32 n,
+					 const char *code1, const char *code2)
+{
+	uint32		a,
+				a_end,
+				b,
+				b_end;
+
+	fzd_code_range(idx, n, code1, &a, &a_end);
+	if (code2 != NULL && strcmp(code1, code2) != 0)
+		fzd_code_range(idx, n, code2, &b, &b_end);
+	else
+		b = b_end = 0;
+
+	/*
+	 * Each run is sorted by word number, so merging them reports each word
+	 * that carries either code exactly once.
+	 */
+	while (a < a_end || b < b_end)
+	{
+		uint32		wa = a < a_end ? idx[a].word : FZD_NO_WORD;
+		uint32		wb = b < b_end ? idx[b].word : FZD_NO_WORD;
+		uint32		word = Min(wa, wb);
+		const char *str;
+		int			len;
+
+		str = fzd_word(dict, word, &len);
+		if (!fzd_is_deleted(filter, str, len))
+			fzd_emit(out, str, len, 0);
+		if (wa == word)
+			a++;
+		if (wb == word)
+			b++;
+	}
+}
+
+/*
+ * The code searches cache their results under the codes rather than the
+ * query, since that is all the result depends on.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_dict_soundex);
+Datum
+fuzzy_dict_soundex(PG_FUNCTION_ARGS)
+{
+	bool		counted;
+	uint64		changes;
+	LoadedDict *ld = fzd_lookup_current(PG_GETARG_TEXT_PP(0),
+										&counted, &changes);
+	FzdDelta   *delta;
+	char	   *query = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char		code[SOUNDEX_LEN + 1];
+	const FuzzyDict *added;
+	FzdOutput	out;
+	StringInfoData key;
+
+	out.tupstore = init_materialize_srf(fcinfo, &out.tupdesc);
+	_soundex(query, code);
+	if (fzd_cache_fetch(ld, counted, changes, FZD_CACHE_SOUNDEX, 0,
+						code, strlen(code), &out, &key))
+		return (Datum) 0;
+
+	delta = fzd_open(fcinfo, ld, counted, changes);
+	fzd_put_code_matches(&out, &ld->dict, delta,
+						 ld->dict.soundex, ld->dict.hdr->nsoundex,
+						 code, NULL);
+	added = fzd_added_dict(ld, delta);
+	if (added != NULL)
+		fzd_put_code_matches(&out, added, NULL,
+							 added->soundex, added->hdr->nsoundex,
+							 code, NULL);
+
+	fzd_cache_store(&key, &out);
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(fuzzy_dict_dmetaphone);
+Datum
+fuzzy_dict_dmetaphone(PG_FUNCTION_ARGS)
+{
+	bool		counted;
+	uint64		changes;
+	LoadedDict *ld = fzd_lookup_current(PG_GETARG_TEXT_PP(0),
+										&counted, &changes);
+	FzdDelta   *delta;
+	char	   *query = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char		primary[DMETAPHONE_CODE_LEN + 1];
+	char		alternate[DMETAPHONE_CODE_LEN + 1];
+	char		codes[2 * (DMETAPHONE_CODE_LEN + 1)];
+	const FuzzyDict *added;
+	FzdOutput	out;
+	StringInfoData key;
+
+	out.tupstore = init_materialize_srf(fcinfo, &out.tupdesc);
+	dmetaphone_codes(query, primary, alternate);
+	memset(codes, 0, sizeof(codes));
+	strcpy(codes, primary);
+	strcpy(codes + DMETAPHONE_CODE_LEN + 1, alternate);
+	if (fzd_cache_fetch(ld, counted, changes, FZD_CACHE_DMETAPHONE, 0,
+						codes, sizeof(codes), &out, &key))
+		return (Datum) 0;
+
+	delta = fzd_open(fcinfo, ld, counted, changes);
+	fzd_put_code_matches(&out, &ld->dict, delta,
+						 ld->dict.dmetaphone, ld->dict.hdr->ndmetaphone,
+						 primary, alternate);
+	added = fzd_added_dict(ld, delta);
+	if (added != NULL)
+		fzd_put_code_matches(&out, added, NULL,
+							 added->dmetaphone, added->hdr->ndmetaphone,
+							 primary, alternate);
+
+	fzd_cache_store(&key, &out);
+	return (Datum) 0;
+}
+
+/*
+ * fuzzy_dict_track(dict_name, word_column)
+ *
+ * AFTER ROW trigger recording, in fuzzy_dict_delta, the words a change to
+ * the table adds to and removes from the named dictionary.  Null words are
+ * not in a dictionary, so changes to or from null are half-recorded or not
+ * at all.  TRUNCATE is not tracked; rebuild the dictionary after one.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_dict_track);
+Datum
+fuzzy_dict_track(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	Trigger    *trigger;
+	TupleDesc	tupdesc;
+	HeapTuple	rettuple;
+	int			attnum;
+	char	   *old_word = NULL;
+	char	   *new_word = NULL;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "fuzzy_dict_track: not called by trigger manager");
+	if (!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event) ||
+		!TRIGGER_FIRED_AFTER(trigdata->tg_event))
+		elog(ERROR, "fuzzy_dict_track: must be fired AFTER ROW");
+
+	trigger = trigdata->tg_trigger;
+	if (trigger->tgnargs != 2)
+		elog(ERROR, "fuzzy_dict_track: expected 2 arguments (dictionary name, word column)");
+
+	tupdesc = trigdata->tg_relation->rd_att;
+	attnum = SPI_fnumber(tupdesc, trigger->tgargs[1]);
+	if (attnum <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" of relation \"%s\" does not exist",
+						trigger->tgargs[1],
+						RelationGetRelationName(trigdata->tg_relation))));
+
+	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+	{
+		new_word = SPI_getvalue(trigdata->tg_trigtuple, tupdesc, attnum);
+		rettuple = trigdata->tg_trigtuple;
+	}
+	else if (TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+	{
+		old_word = SPI_getvalue(trigdata->tg_trigtuple, tupdesc, attnum);
+		rettuple = trigdata->tg_trigtuple;
+	}
+	else
+	{
+		old_word = SPI_getvalue(trigdata->tg_trigtuple, tupdesc, attnum);
+		new_word = SPI_getvalue(trigdata->tg_newtuple, tupdesc, attnum);
+		rettuple = trigdata->tg_newtuple;
+		if (old_word != NULL && new_word != NULL &&
+			strcmp(old_word, new_word) == 0)
+			old_word = new_word = NULL;
+	}
+
+	if (old_word != NULL || new_word != NULL)
+	{
+		char	   *sql;
+		Oid			argtypes[3] = {TEXTOID, TEXTOID, BOOLOID};
+		Datum		values[3];
+
+		sql = psprintf("INSERT INTO %s (dict, word, deleted) VALUES ($1, $2, $3)",
+					   fzd_delta_table(fcinfo));
+		values[0] = CStringGetTextDatum(trigger->tgargs[0]);
+
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+		if (old_word != NULL)
+		{
+			values[1] = CStringGetTextDatum(old_word);
+			values[2] = BoolGetDatum(true);
+			if (SPI_execute_with_args(sql, 3, argtypes, values, NULL,
+									  false, 0) != SPI_OK_INSERT)
+				elog(ERROR, "could not record change to fuzzy dictionary \"%s\"",
+					 trigger->tgargs[0]);
+		}
+		if (new_word != NULL)
+		{
+			values[1] = CStringGetTextDatum(new_word);
+			values[2] = BoolGetDatum(false);
+			if (SPI_execute_with_args(sql, 3, argtypes, values, NULL,
+									  false, 0) != SPI_OK_INSERT)
+				elog(ERROR, "could not record change to fuzzy dictionary \"%s\"",
+					 trigger->tgargs[0]);
+		}
+		SPI_finish();
+		fzd_note_changes(trigger->tgargs[0],
+						 (old_word != NULL) + (new_word != NULL), 0);
+	}
+
+	return PointerGetDatum(rettuple);
+}
+
+/*
+ * Replace the file at path with an image: the image is written and flushed
+ * under a temporary name, renamed over path, and the rename flushed too,
+ * since the caller is about to delete the rows it was built from.
+ */
+static void
+fzd_write_file(const char *path, const char *image, uint64 size)
+{
+	char	   *tmppath = psprintf("%s.tmp.%d", path, MyProcPid);
+	char	   *dir;
+	uint64		done = 0;
+	int			fd;
+
+	fd = OpenTransientFile(tmppath, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+						   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+
+	while (done < size)
+	{
+		ssize_t		n = write(fd, image + done,
+							  Min(size - done, (uint64) 1 << 30));
+
+		if (n <= 0)
+		{
+			int			save_errno = n < 0 ? errno : ENOSPC;
+
+			CloseTransientFile(fd);
+			unlink(tmppath);
+			errno = save_errno;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write file \"%s\": %m", tmppath)));
+		}
+		done += n;
+	}
+	if (pg_fsync(fd) != 0)
+	{
+		int			save_errno = errno;
+
+		CloseTransientFile(fd);
+		unlink(tmppath);
+		errno = save_errno;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", tmppath)));
+	}
+	CloseTransientFile(fd);
+
+	if (rename(tmppath, path) < 0)
+	{
+		int			save_errno = errno;
+
+		unlink(tmppath);
+		errno = save_errno;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not rename file \"%s\" to \"%s\": %m",
+						tmppath, path)));
+	}
+
+	dir = pstrdup(path);
+	get_parent_directory(dir);
+	fd = OpenTransientFile(dir[0] != '\0' ? dir : ".", O_RDONLY | PG_BINARY, 0);
+	if (fd < 0 || pg_fsync(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync directory of \"%s\": %m", path)));
+	CloseTransientFile(fd);
+}
+
+/*
+ * fuzzy_dict_compact(name) returns bigint
+ *
+ * Fold the changes recorded for a dictionary into a new image, which
+ * replaces the file it was loaded from, and return the number of words in
+ * it.  The server must be able to write to the file's directory.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_dict_compact);
+Datum
+fuzzy_dict_compact(PG_FUNCTION_ARGS)
+{
+	LoadedDict *ld = lookup_dict(PG_GETARG_TEXT_PP(0));
+	uint32		path_hash;
+	uint64		nrows;
+	char	  **added;
+	int			nadded;
+	FzdWord    *deleted;
+	int			ndeleted;
+	char	  **words;
+	int			nwords = 0;
+	uint32		nbase;
+	uint32		w;
+	int			i;
+	char	   *image;
+	uint64		size;
+	int			nskipped;
+
+	/*
+	 * Compactions of the same file must not overlap, or the second could
+	 * rename an image built without the first one's changes over the first
+	 * one's image.  Having waited our turn, we pick up the file the previous
+	 * compaction left.
+	 */
+	path_hash = DatumGetUInt32(hash_any((unsigned char *) ld->path,
+										strlen(ld->path)));
+	DirectFunctionCall2(pg_advisory_xact_lock_int4,
+						Int32GetDatum(FZD_COMPACT_LOCK_CLASS),
+						Int32GetDatum((int32) path_hash));
+	nrows = fzd_fetch_delta(fcinfo, ld->name, true, false,
+							CurrentMemoryContext,
+							&added, &nadded, &deleted, &ndeleted);
+	if (nrows > 0)
+		fzd_note_changes(ld->name, 0, (int64) nrows);
+	fzd_refresh(ld);
+
+	nbase = ld->dict.hdr->nwords;
+	if (nadded == 0 && ndeleted == 0)
+		PG_RETURN_INT64((int64) nbase);
+
+	/* base words are numbered in order, so deletions can be merged out */
+	words = MemoryContextAllocHuge(CurrentMemoryContext,
+								   ((Size) nbase + nadded) * sizeof(char *));
+	i = 0;
+	for (w = 0; w < nbase; w++)
+	{
+		FzdWord		word;
+		int			c = 1;
+
+		word.str = fzd_word(&ld->dict, w, &word.len);
+		while (i < ndeleted && (c = fzd_word_cmp(&deleted[i], &word)) < 0)
+			i++;
+		if (i < ndeleted && c == 0)
+			continue;
+		words[nwords++] = (char *) word.str;
+	}
+	for (i = 0; i < nadded; i++)
+		words[nwords++] = added[i];
+
+	image = fzd_build_image(words, nwords, ld->dict.hdr->encoding,
+							ld->dict.hdr->generation + 1, &size, &nskipped);
+	fzd_write_file(ld->path, image, size);
+	fzd_free_image(image);
+	fzd_refresh(ld);
+
+	PG_RETURN_INT64((int64) ld->dict.hdr->nwords);
+}
+
+/*
+ * Compact the dictionaries loaded in this database whose pending changes
+ * have reached the threshold, each in a transaction of its own, by calling
+ * fuzzy_dict_load() and fuzzy_dict_compact() just as a user would.
+ */
+static void
+fzd_compact_pending(void)
+{
+	FzdSharedDict *todo;
+	int			ntodo = 0;
+	int			i;
+
+	if (fuzzystrmatch_dict_compact_threshold <= 0)
+		return;
+
+	todo = palloc(FZD_SHARED_SLOTS * sizeof(FzdSharedDict));
+	LWLockAcquire(fzd_shared->lock, LW_SHARED);
+	for (i = 0; i < FZD_SHARED_SLOTS; i++)
+	{
+		FzdSharedDict *sd = &fzd_shared->dicts[i];
+
+		if (sd->dbid == MyDatabaseId && sd->path[0] != '\0' &&
+			sd->pending >= fuzzystrmatch_dict_compact_threshold)
+			todo[ntodo++] = *sd;
+	}
+	LWLockRelease(fzd_shared->lock);
+
+	for (i = 0; i < ntodo; i++)
+	{
+		Oid			argtypes[2] = {TEXTOID, TEXTOID};
+		Datum		values[2];
+		const char *nspname;
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+		PushActiveSnapshot(GetTransactionSnapshot());
+		pgstat_report_activity(STATE_RUNNING, "compacting fuzzy dictionaries");
+
+		if (SPI_execute("SELECT n.nspname FROM pg_catalog.pg_extension e"
+						" JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace"
+						" WHERE e.extname = 'fuzzystrmatch'",
+						true, 1) != SPI_OK_SELECT)
+			elog(ERROR, "could not look up the fuzzystrmatch extension");
+
+		/* nothing to do where the extension is not installed */
+		if (SPI_processed > 0)
+		{
+			nspname = quote_identifier(SPI_getvalue(SPI_tuptable->vals[0],
+													SPI_tuptable->tupdesc, 1));
+			values[0] = CStringGetTextDatum(todo[i].name);
+			values[1] = CStringGetTextDatum(todo[i].path);
+			if (SPI_execute_with_args(psprintf("SELECT %s.fuzzy_dict_load($1, $2)",
+											   nspname),
+									  2, argtypes, values, NULL,
+									  false, 0) != SPI_OK_SELECT ||
+				SPI_execute_with_args(psprintf("SELECT %s.fuzzy_dict_compact($1)",
+											   nspname),
+									  1, argtypes, values, NULL,
+									  false, 0) != SPI_OK_SELECT)
+				elog(ERROR, "could not compact fuzzy dictionary \"%s\"",
+					 todo[i].name);
+			elog(DEBUG1, "compacted fuzzy dictionary \"%s\"", todo[i].name);
+		}
+
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		pgstat_report_activity(STATE_IDLE, NULL);
+	}
+	pfree(todo);
+}
+
+static void
+fzd_compactor_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	fzd_got_sighup = true;
+	SetLatch(&MyProc->procLatch);
+	errno = save_errno;
+}
+
+/*
+ * Entry point of the compaction worker.  An error, such as a file it cannot
+ * write, ends it, and the postmaster starts it again after a nap.
+ */
+void
+fuzzy_dict_compactor_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, fzd_compactor_sighup);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	fzd_connect_worker(fuzzystrmatch_dict_compact_database);
+
+	for (;;)
+	{
+		int			rc;
+
+		rc = fzd_wait_latch(fuzzystrmatch_dict_compact_naptime * 1000L);
+		ResetLatch(&MyProc->procLatch);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		CHECK_FOR_INTERRUPTS();
+
+		if (fzd_got_sighup)
+		{
+			fzd_got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+		fzd_compact_pending();
+	}
+}
+
+void
+fuzzystrmatch_dict_init(void)
+{
+	DefineCustomIntVariable("fuzzystrmatch.dict_compact_threshold",
+							"Number of recorded changes at which a fuzzy dictionary is compacted in the background.",
+							"Zero disables compaction in the background.",
+							&fuzzystrmatch_dict_compact_threshold,
+							10000,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("fuzzystrmatch.dict_compact_naptime",
+			"Time between checks for fuzzy dictionaries to compact.",
+							NULL,
+							&fuzzystrmatch_dict_compact_naptime,
+							60,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("fuzzystrmatch.dict_compact_database",
+		  "Database in which fuzzy dictionaries are compacted in the background.",
+							   "Only takes effect with fuzzystrmatch in shared_preload_libraries; if empty, no compaction worker is started.",
+							   &fuzzystrmatch_dict_compact_database,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	/*
+	 * Without XACT_EVENT_PRE_PREPARE, a transaction that changed a dictionary
+	 * could be prepared and leave the count behind, so keep no shared state.
+	 */
+#if PG_VERSION_NUM >= 90500
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = fzd_shmem_request;
+#else
+	fzd_request_shmem();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = fzd_shmem_startup;
+	RegisterXactCallback(fzd_xact_callback, NULL);
+
+	if (fuzzystrmatch_dict_compact_database[0] != '\0')
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		snprintf(worker.bgw_name, BGW_MAXLEN,
+				 "fuzzystrmatch dictionary compactor");
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = fuzzystrmatch_dict_compact_naptime;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "fuzzystrmatch");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN,
+				 "fuzzy_dict_compactor_main");
+		RegisterBackgroundWorker(&worker);
+	}
+#endif
+}
+
+#endif   /* !FUZZYSTRMATCH_STANDALONE */
@@ -0,0 +1,135 @@
+/*
+ * fuzzydict.h
+ *
+ * On-disk (and in-memory) format of compiled fuzzy dictionaries.
+ *
+ * contrib/fuzzystrmatch/fuzzydict.h
+ *
+ * A compiled dictionary is a single image holding a set of distinct words
+ * together with the structures needed to search it: a byte trie, a length
+ * index, and soundex and double metaphone code indexes.  Every reference
+ * inside the image is an offset or an array index, never a pointer, so a
+ * file can be mmap'd at any address and shared read-only between processes;
+ * the daemon and the backend use exactly the same representation whether
+ * the image was just built in memory or mapped from a file.
+ *
+ * Layout: a FuzzyDictHeader, followed by the sections it describes, each
+ * starting at an 8-byte aligned offset.  Multi-byte integers are stored in
+ * the byte order of the machine that built the file; the header records it,
+ * and readers refuse files of the other byte order.
+ *
+ * Words are numbered in memcmp() order of their bytes.  Word i's bytes are
+ * strings[word_offsets[i]] up to (excluding) strings[word_offsets[i + 1] - 1],
+ * where a NUL terminator is stored.
+ *
+ * This header is shared by the backend and the standalone programs, so it
+ * must only use types that fuzzystrmatch_standalone.h also provides.
+ */
+#ifndef FUZZYDICT_H
+#define FUZZYDICT_H
+
+#define FZD_MAGIC			"FZDICT\0\0"
+#define FZD_VERSION			1
+#define FZD_BYTE_ORDER		0x01020304
+
+/* longest word, in characters, that a dictionary may contain */
+#define FZD_MAX_CHARS		255
+
+/* phonetic codes are stored NUL-padded, without terminator */
+#define FZD_CODE_LEN		4
+
+#define FZD_NO_WORD			0xFFFFFFFF
+
+typedef enum
+{
+	FZD_SECTION_WORD_OFFSETS,	/* uint32[nwords + 1] */
+	FZD_SECTION_STRINGS,		/* char[] */
+	FZD_SECTION_LENGTH_START,	/* uint32[FZD_MAX_CHARS + 2] */
+	FZD_SECTION_BY_LENGTH,		/* uint32[nwords] */
+	FZD_SECTION_TRIE,			/* FuzzyDictTrieNode[ntrie_nodes] */
+	FZD_SECTION_SOUNDEX,		/* FuzzyDictCodeEntry[nsoundex] */
+	FZD_SECTION_DMETAPHONE,		/* FuzzyDictCodeEntry[ndmetaphone] */
+	FZD_NUM_SECTIONS
+} FuzzyDictSectionId;
+
+typedef struct
+{
+	uint64		offset;			/* from start of image */
+	uint64		size;			/* in bytes */
+} FuzzyDictSection;
+
+typedef struct
+{
+	char		magic[8];
+	uint32		version;
+	uint32		byte_order;
+	uint64		image_size;
+	uint64		generation;		/* changes whenever the content changes */
+	char		encoding[16];	/* server encoding name of the words */
+	uint32		nwords;
+	uint32		ntrie_nodes;
+	uint32		nsoundex;
+	uint32		ndmetaphone;
+	FuzzyDictSection sections[FZD_NUM_SECTIONS];
+} FuzzyDictHeader;
+
+/*
+ * Trie node.  Node 0 is the root; the children of a node are stored
+ * contiguously, ordered by label, starting at first_child.
+ */
+typedef struct
+{
+	uint32		first_child;
+	uint32		word;			/* word number if a word ends here, else
+								 * FZD_NO_WORD */
+	uint16		nchildren;
+	uint8		label;			/* byte on the edge from the parent */
+	uint8		padding;
+} FuzzyDictTrieNode;
+
+/* (code, word) pair; code indexes are sorted by code, then word */
+typedef struct
+{
+	char		code[FZD_CODE_LEN];
+	uint32		word;
+} FuzzyDictCodeEntry;
+
+/* A validated image, with pointers to its sections resolved */
+typedef struct
+{
+	const char *image;
+	uint64		size;
+	const FuzzyDictHeader *hdr;
+	const uint32 *word_offsets;
+	const char *strings;
+	const uint32 *length_start;
+	const uint32 *by_length;
+	const FuzzyDictTrieNode *trie;
+	const FuzzyDictCodeEntry *soundex;
+	const FuzzyDictCodeEntry *dmetaphone;
+} FuzzyDict;
+
+/* Called for each word found by a search; return false to stop searching */
+typedef bool (*fzd_match_callback) (uint32 word, int distance, void *arg);
+
+static inline const char *
+fzd_word(const FuzzyDict *dict, uint32 word, int *len)
+{
+	*len = (int) (dict->word_offsets[word + 1] - dict->word_offsets[word] - 1);
+	return dict->strings + dict->word_offsets[word];
+}
+
+/* fuzzydict.c */
+extern char *fzd_build_image(char **words, int nwords, const char *encoding,
+				uint64 generation, uint64 *size, int *nskipped);
+extern void fzd_free_image(char *image);
+extern const char *fzd_attach(FuzzyDict *dict, const char *image, uint64 size);
+extern void fzd_code_range(const FuzzyDictCodeEntry *idx, uint32 n,
+			   const char *code, uint32 *start, uint32 *end);
+extern void fzd_pad_code(char *padded, const char *code);
+extern uint32 fzd_find_word(const FuzzyDict *dict, const char *str, int len);
+extern void fzd_search_levenshtein(const FuzzyDict *dict,
+					   const char *query, int query_bytes, int max_d,
+					   fzd_match_callback callback, void *arg);
+
+#endif   /* FUZZYDICT_H */
@@ -0,0 +1,350 @@
+/* contrib/fuzzystrmatch/fuzzystrmatch--1.1--1.2.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION fuzzystrmatch UPDATE TO '1.2'" to load this file. \quit
+
+-- The dameraulevenshtein functions used to ignore their transposition cost
+-- and return Levenshtein distances; they now return optimal string alignment
+-- distances, in which a swap of adjacent characters costs trans_c.  Their
+-- results change for such inputs, so any expression index or stored value
+-- computed with them must be rebuilt, e.g. with REINDEX.
+
+CREATE FUNCTION fuzzy_dict_load (name text, path text) RETURNS bigint
+AS 'MODULE_PATHNAME', 'fuzzy_dict_load'
+LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION fuzzy_dict_load (text, text) FROM PUBLIC;
+
+CREATE FUNCTION fuzzy_dict_search (name text, query text, max_d int,
+	OUT word text, OUT distance int) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'fuzzy_dict_search'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION fuzzy_dict_soundex (name text, query text) RETURNS SETOF text
+AS 'MODULE_PATHNAME', 'fuzzy_dict_soundex'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION fuzzy_dict_dmetaphone (name text, query text) RETURNS SETOF text
+AS 'MODULE_PATHNAME', 'fuzzy_dict_dmetaphone'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION fuzzy_search_parallel (query text, candidates text[], max_d int,
+	OUT candidate text, OUT distance int) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'fuzzy_search_parallel'
+LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION levenshtein_within_radius (text, text) RETURNS bool
+AS 'MODULE_PATHNAME', 'levenshtein_within_radius'
+LANGUAGE C STABLE STRICT;
+
+-- a %~ b: Levenshtein distance at most fuzzystrmatch.radius
+CREATE OPERATOR %~ (
+	LEFTARG = text,
+	RIGHTARG = text,
+	PROCEDURE = levenshtein_within_radius,
+	COMMUTATOR = '%~',
+	RESTRICT = contsel,
+	JOIN = contjoinsel
+);
+
+-- a <~> b: Levenshtein distance, for ORDER BY
+CREATE OPERATOR <~> (
+	LEFTARG = text,
+	RIGHTARG = text,
+	PROCEDURE = levenshtein,
+	COMMUTATOR = '<~>'
+);
+
+-- GiST support
+CREATE FUNCTION gfuzzy_in (cstring) RETURNS gfuzzy
+AS 'MODULE_PATHNAME', 'gfuzzy_in'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION gfuzzy_out (gfuzzy) RETURNS cstring
+AS 'MODULE_PATHNAME', 'gfuzzy_out'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE gfuzzy (
+	INTERNALLENGTH = -1,
+	INPUT = gfuzzy_in,
+	OUTPUT = gfuzzy_out
+);
+
+CREATE FUNCTION gfuzzy_consistent (internal, text, smallint, oid, internal)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'gfuzzy_consistent'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION gfuzzy_distance (internal, text, smallint, oid, internal)
+RETURNS float8
+AS 'MODULE_PATHNAME', 'gfuzzy_distance'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION gfuzzy_compress (internal) RETURNS internal
+AS 'MODULE_PATHNAME', 'gfuzzy_compress'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION gfuzzy_decompress (internal) RETURNS internal
+AS 'MODULE_PATHNAME', 'gfuzzy_decompress'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION gfuzzy_union (internal, internal) RETURNS gfuzzy
+AS 'MODULE_PATHNAME', 'gfuzzy_union'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION gfuzzy_penalty (internal, internal, internal) RETURNS internal
+AS 'MODULE_PATHNAME', 'gfuzzy_penalty'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION gfuzzy_picksplit (internal, internal) RETURNS internal
+AS 'MODULE_PATHNAME', 'gfuzzy_picksplit'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION gfuzzy_same (gfuzzy, gfuzzy, internal) RETURNS internal
+AS 'MODULE_PATHNAME', 'gfuzzy_same'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OPERATOR CLASS gist_fuzzy_ops
+FOR TYPE text USING gist
+AS
+	OPERATOR	1	%~ (text, text),
+	OPERATOR	2	<~> (text, text) FOR ORDER BY pg_catalog.integer_ops,
+	FUNCTION	1	gfuzzy_consistent (internal, text, smallint, oid, internal),
+	FUNCTION	2	gfuzzy_union (internal, internal),
+	FUNCTION	3	gfuzzy_compress (internal),
+	FUNCTION	4	gfuzzy_decompress (internal),
+	FUNCTION	5	gfuzzy_penalty (internal, internal, internal),
+	FUNCTION	6	gfuzzy_picksplit (internal, internal),
+	FUNCTION	7	gfuzzy_same (gfuzzy, gfuzzy, internal),
+	FUNCTION	8	gfuzzy_distance (internal, text, smallint, oid, internal),
+	STORAGE		gfuzzy;
+
+CREATE FUNCTION fuzzy_choose_pivots (sample text[], npivots int) RETURNS text[]
+AS 'MODULE_PATHNAME', 'fuzzy_choose_pivots'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION fuzzy_pivot_distances (str text, pivots text[]) RETURNS smallint[]
+AS 'MODULE_PATHNAME', 'fuzzy_pivot_distances'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION fuzzy_pivot_filter (str text, str_dists smallint[],
+	query text, query_dists smallint[], max_d int) RETURNS bool
+AS 'MODULE_PATHNAME', 'fuzzy_pivot_filter'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qgram_array (str text, q int) RETURNS int[]
+AS 'MODULE_PATHNAME', 'qgram_array'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qgram_jaccard (text, text, q int) RETURNS float8
+AS 'MODULE_PATHNAME', 'qgram_jaccard'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qgram_jaccard (int[], int[]) RETURNS float8
+AS 'MODULE_PATHNAME', 'qgram_jaccard_arrays'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qgram_dice (text, text, q int) RETURNS float8
+AS 'MODULE_PATHNAME', 'qgram_dice'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qgram_dice (int[], int[]) RETURNS float8
+AS 'MODULE_PATHNAME', 'qgram_dice_arrays'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qgram_overlap (text, text, q int) RETURNS int
+AS 'MODULE_PATHNAME', 'qgram_overlap'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qgram_overlap (int[], int[]) RETURNS int
+AS 'MODULE_PATHNAME', 'qgram_overlap_arrays'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qgram_jaccard_at_least (text, text, q int, threshold float8) RETURNS bool
+AS 'MODULE_PATHNAME', 'qgram_jaccard_at_least'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION qgram_jaccard_at_least (int[], int[], threshold float8) RETURNS bool
+AS 'MODULE_PATHNAME', 'qgram_jaccard_at_least_arrays'
+LANGUAGE C IMMUTABLE STRICT;
+
+-- words added to and removed from the tables compiled dictionaries were
+-- built from, recorded by fuzzy_dict_track() and folded into the image
+-- files by fuzzy_dict_compact(); roles changing a tracked table need
+-- INSERT on it and USAGE on its sequence
+CREATE TABLE fuzzy_dict_delta (
+	seq bigserial PRIMARY KEY,
+	dict text NOT NULL,
+	word text NOT NULL,
+	deleted boolean NOT NULL
+);
+
+CREATE INDEX fuzzy_dict_delta_dict_idx ON fuzzy_dict_delta (dict);
+
+SELECT pg_catalog.pg_extension_config_dump('fuzzy_dict_delta', '');
+
+GRANT SELECT ON fuzzy_dict_delta TO PUBLIC;
+
+CREATE FUNCTION fuzzy_dict_track () RETURNS trigger
+AS 'MODULE_PATHNAME', 'fuzzy_dict_track'
+LANGUAGE C;
+
+CREATE FUNCTION fuzzy_dict_compact (name text) RETURNS bigint
+AS 'MODULE_PATHNAME', 'fuzzy_dict_compact'
+LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION fuzzy_dict_compact (text) FROM PUBLIC;
+
+CREATE FUNCTION fuzzy_dedupe (query text, max_d int,
+	OUT id1 bigint, OUT id2 bigint, OUT distance int) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'fuzzy_dedupe'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION fuzzy_block_distances (query text,
+	OUT id1 bigint, OUT id2 bigint, OUT distance int) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'fuzzy_block_distances'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION fuzzy_cache_stats (OUT entries bigint, OUT used bigint,
+	OUT hits bigint, OUT misses bigint, OUT inserts bigint,
+	OUT evictions bigint, OUT hit_ratio float8) RETURNS record
+AS 'MODULE_PATHNAME', 'fuzzy_cache_stats'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION fuzzy_cache_reset () RETURNS void
+AS 'MODULE_PATHNAME', 'fuzzy_cache_reset'
+LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION fuzzy_cache_reset () FROM PUBLIC;
+
+CREATE FUNCTION fuzzy_sketch (str text, q int) RETURNS bytea
+AS 'MODULE_PATHNAME', 'fuzzy_sketch'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION fuzzy_sketch_distance (bytea, bytea) RETURNS float8
+AS 'MODULE_PATHNAME', 'fuzzy_sketch_distance'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION metaphone_many (text[], int) RETURNS text[]
+AS 'MODULE_PATHNAME', 'metaphone_many'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION dmetaphone_many (text[]) RETURNS text[]
+AS 'MODULE_PATHNAME', 'dmetaphone_many'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION fuzzy_topk (rel regclass, col text, query text, k int,
+	OUT word text, OUT distance int) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'fuzzy_topk'
+LANGUAGE C STABLE STRICT;
+
+-- SP-GiST support, over the radix tree of the built-in text_ops
+CREATE FUNCTION spgfuzzy_inner_consistent (internal, internal) RETURNS void
+AS 'MODULE_PATHNAME', 'spgfuzzy_inner_consistent'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION spgfuzzy_leaf_consistent (internal, internal) RETURNS bool
+AS 'MODULE_PATHNAME', 'spgfuzzy_leaf_consistent'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OPERATOR CLASS spgist_fuzzy_ops
+FOR TYPE text USING spgist
+AS
+	OPERATOR	1	%~ (text, text),
+	FUNCTION	1	pg_catalog.spg_text_config (internal, internal),
+	FUNCTION	2	pg_catalog.spg_text_choose (internal, internal),
+	FUNCTION	3	pg_catalog.spg_text_picksplit (internal, internal),
+	FUNCTION	4	spgfuzzy_inner_consistent (internal, internal),
+	FUNCTION	5	spgfuzzy_leaf_consistent (internal, internal);
+
+CREATE FUNCTION soundex_match (text, text) RETURNS bool
+AS 'MODULE_PATHNAME', 'soundex_match'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION dmetaphone_match (text, text) RETURNS bool
+AS 'MODULE_PATHNAME', 'dmetaphone_match'
+LANGUAGE C IMMUTABLE STRICT;
+
+-- a #= b: equal soundex codes
+CREATE OPERATOR #= (
+	LEFTARG = text,
+	RIGHTARG = text,
+	PROCEDURE = soundex_match,
+	COMMUTATOR = '#=',
+	RESTRICT = contsel,
+	JOIN = contjoinsel
+);
+
+-- a ##= b: a shared primary or alternate Double Metaphone code
+CREATE OPERATOR ##= (
+	LEFTARG = text,
+	RIGHTARG = text,
+	PROCEDURE = dmetaphone_match,
+	COMMUTATOR = '##=',
+	RESTRICT = contsel,
+	JOIN = contjoinsel
+);
+
+-- BRIN support, from 9.5 on
+DO $$
+BEGIN
+	IF current_setting('server_version_num')::int >= 90500 THEN
+		CREATE FUNCTION bfuzzy_opcinfo (internal) RETURNS internal
+		AS 'MODULE_PATHNAME', 'bfuzzy_opcinfo'
+		LANGUAGE C IMMUTABLE STRICT;
+
+		CREATE FUNCTION bfuzzy_add_value (internal, internal, internal, internal)
+		RETURNS bool
+		AS 'MODULE_PATHNAME', 'bfuzzy_add_value'
+		LANGUAGE C IMMUTABLE STRICT;
+
+		CREATE FUNCTION bfuzzy_consistent (internal, internal, internal)
+		RETURNS bool
+		AS 'MODULE_PATHNAME', 'bfuzzy_consistent'
+		LANGUAGE C IMMUTABLE STRICT;
+
+		CREATE FUNCTION bfuzzy_union (internal, internal, internal) RETURNS bool
+		AS 'MODULE_PATHNAME', 'bfuzzy_union'
+		LANGUAGE C IMMUTABLE STRICT;
+
+		CREATE OPERATOR CLASS brin_phonetic_bloom_ops
+		FOR TYPE text USING brin
+		AS
+			OPERATOR	1	#= (text, text),
+			OPERATOR	2	##= (text, text),
+			FUNCTION	1	bfuzzy_opcinfo (internal),
+			FUNCTION	2	bfuzzy_add_value (internal, internal, internal, internal),
+			FUNCTION	3	bfuzzy_consistent (internal, internal, internal),
+			FUNCTION	4	bfuzzy_union (internal, internal, internal),
+			STORAGE		bytea;
+	END IF;
+END
+$$;
+
+CREATE FUNCTION fuzzy_neighbour_match (value text, w int, k int) RETURNS int[]
+AS 'MODULE_PATHNAME', 'fuzzy_neighbour_match'
+LANGUAGE C IMMUTABLE WINDOW;
+
+CREATE FUNCTION levenshtein_token_sort (text,text) RETURNS int
+AS 'MODULE_PATHNAME','levenshtein_token_sort'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION levenshtein_token_sort_less_equal (text,text,int) RETURNS int
+AS 'MODULE_PATHNAME','levenshtein_token_sort_less_equal'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION levenshtein_token_set (text,text) RETURNS int
+AS 'MODULE_PATHNAME','levenshtein_token_set'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION levenshtein_token_set_less_equal (text,text,int) RETURNS int
+AS 'MODULE_PATHNAME','levenshtein_token_set_less_equal'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION fuzzy_neighbourhood (query text, k int, alphabet text) RETURNS SETOF text
+AS 'MODULE_PATHNAME', 'fuzzy_neighbourhood'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION fuzzy_within_alphabet (value text, alphabet text) RETURNS bool
+AS 'MODULE_PATHNAME', 'fuzzy_within_alphabet'
+LANGUAGE C IMMUTABLE STRICT;
@@ -40,11 +40,31 @@
 
 #include <ctype.h>
 
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "access/tuptoaster.h"
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#include "access/tuptoaster.h"
+#endif
+#include "access/tupmacs.h"
+#include "catalog/pg_type.h"
+#include "fuzzystrmatch.h"
+#include "fuzzystrmatch_api.h"
 #include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
 
 PG_MODULE_MAGIC;
 
+void		_PG_init(void);
+
 
 /*
  * External declarations for exported functions
@@ -58,28 +78,15 @@ extern Datum dameraulevenshtein(PG_FUNCTION_ARGS);
 extern Datum dameraulevenshtein_less_equal_with_costs(PG_FUNCTION_ARGS);
 extern Datum dameraulevenshtein_less_equal(PG_FUNCTION_ARGS);
 extern Datum metaphone(PG_FUNCTION_ARGS);
+extern Datum metaphone_many(PG_FUNCTION_ARGS);
+extern Datum dmetaphone_many(PG_FUNCTION_ARGS);
 extern Datum soundex(PG_FUNCTION_ARGS);
 extern Datum difference(PG_FUNCTION_ARGS);
 
 /*
  * Soundex
  */
-static void _soundex(const char *instr, char *outstr);
-
-#define SOUNDEX_LEN 4
-
-/*									ABCDEFGHIJKLMNOPQRSTUVWXYZ */
-static const char *soundex_table = "01230120022455012623010202";
-
-static char
-soundex_code(char letter)
-{
-	letter = toupper((unsigned char) letter);
-	/* Defend against non-ASCII letters */
-	if (letter >= 'A' && letter <= 'Z')
-		return soundex_table[letter - 'A'];
-	return letter;
-}
+#include "soundex.c"
 
 /*
  * Metaphone
@@ -170,22 +177,603 @@ getcode(char c)
 /* These prevent GH from becoming F */
 #define NOGHTOF(c)	(getcode(c) & 16)	/* BDH */
 
-/* Faster than memcmp(), for this use case. */
-static inline bool
-rest_of_char_same(const char *s1, const char *s2, int len)
+#include "levenshtein.c"
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+
+/*
+ * Optional memoization of distances.
+ *
+ * In nested-loop fuzzy joins and correlated subqueries the same pair of
+ * strings is often compared over and over.  When fuzzystrmatch.memoize is
+ * on, each call site keeps the distances it has computed in a hash table
+ * hung off fn_extra, keyed on both strings and every parameter that affects
+ * the result, so a repeated pair costs a hash probe and a memcmp.  The
+ * table may use up to work_mem; when it fills up it is emptied and starts
+ * over, which favours the pairs that are recurring now.
+ */
+static bool fuzzystrmatch_memoize = false;
+
+#define LEV_MEMO_INITIAL_BUCKETS	256
+#define LEV_MEMO_NPARAMS			6
+
+typedef struct LevMemoEntry
 {
-	while (len > 0)
+	struct LevMemoEntry *next;
+	uint32		hash;
+	int			params[LEV_MEMO_NPARAMS];
+	int			a_len;
+	int			b_len;
+	int			result;
+	char		data[1];		/* a's bytes, then b's; VARIABLE LENGTH */
+} LevMemoEntry;
+
+typedef struct LevMemo
+{
+	MemoryContext cxt;			/* holds the buckets and entries */
+	LevMemoEntry **buckets;
+	int			nbuckets;
+	int			nentries;
+	Size		space_used;
+} LevMemo;
+
+static void
+lev_memo_reset(LevMemo *memo)
+{
+	MemoryContextReset(memo->cxt);
+	memo->nbuckets = LEV_MEMO_INITIAL_BUCKETS;
+	memo->buckets = MemoryContextAllocZero(memo->cxt,
+									memo->nbuckets * sizeof(LevMemoEntry *));
+	memo->nentries = 0;
+	memo->space_used = memo->nbuckets * sizeof(LevMemoEntry *);
+}
+
+static void
+lev_memo_grow(LevMemo *memo)
+{
+	int			nbuckets = memo->nbuckets * 2;
+	Size		space = nbuckets * sizeof(LevMemoEntry *);
+	LevMemoEntry **buckets;
+	int			i;
+
+	if (memo->space_used + space > (Size) work_mem * 1024L)
+		return;
+	buckets = MemoryContextAllocZero(memo->cxt, space);
+	for (i = 0; i < memo->nbuckets; i++)
 	{
-		len--;
-		if (s1[len] != s2[len])
-			return false;
+		LevMemoEntry *e = memo->buckets[i];
+
+		while (e != NULL)
+		{
+			LevMemoEntry *next = e->next;
+			int			b = e->hash & (nbuckets - 1);
+
+			e->next = buckets[b];
+			buckets[b] = e;
+			e = next;
+		}
 	}
-	return true;
+	memo->space_used += space - memo->nbuckets * sizeof(LevMemoEntry *);
+	pfree(memo->buckets);
+	memo->buckets = buckets;
+	memo->nbuckets = nbuckets;
 }
 
-#include "levenshtein.c"
-#define LEVENSHTEIN_LESS_EQUAL
-#include "levenshtein.c"
+/*
+ * Compiled matchers for unit-cost Damerau distances.
+ *
+ * Spell correction compares one query with a stream of candidates, as in
+ * "WHERE dameraulevenshtein_less_equal(word, 'recieve', 2) <= 2".  When one
+ * argument of a call site is a constant or an external parameter and every
+ * cost is 1, that argument is compiled once, and kept in fn_extra for as long
+ * as its value does not change, into a matcher for optimal string alignment
+ * distance: the states of the Levenshtein automaton of the query, extended
+ * with transposition states, simulated as bit vectors after Hyyrö.  Each
+ * candidate is then read once, one machine word operation sequence per
+ * character, with no DP matrix; in the bounded variant the scan stops as soon
+ * as the distance can no longer come within max_d.
+ *
+ * A column of the automaton is one bit per query character, so only queries
+ * of up to 64 characters are compiled; other calls use the levenshtein.c
+ * kernel, as do candidates over MAX_LEVENSHTEIN_STRLEN, so that those still
+ * raise its error.  Unit-cost optimal string alignment distance is symmetric,
+ * so the query may be either argument.
+ *
+ * Each query character gets a match mask, the bitmap of the positions at
+ * which it occurs; ASCII characters are looked up directly, and any others
+ * through a sorted array keyed on their bytes, which is enough for equality
+ * and avoids decoding the candidates.
+ */
+#define LEV_OSA_MASK_CHARS		64
+
+/* osa_arg before the call site's arguments have been looked at */
+#define LEV_OSA_ARG_UNKNOWN		(-2)
+
+typedef struct LevOsaMatcher
+{
+	int			m;				/* query length in characters */
+	int			nwide;			/* distinct non-ASCII characters */
+	uint64		ascii[128];
+	uint32		wide_keys[LEV_OSA_MASK_CHARS];	/* sorted */
+	uint64		wide_masks[LEV_OSA_MASK_CHARS];
+	int			bytes;
+	char		data[1];		/* the query; VARIABLE LENGTH */
+} LevOsaMatcher;
+
+/* what a call site keeps in fn_extra */
+typedef struct LevCallCache
+{
+	LevMemo    *memo;			/* when memoizing */
+	int			osa_arg;		/* argument to compile, or -1 for neither */
+	LevOsaMatcher *osa;			/* for its current value, if compiled */
+} LevCallCache;
+
+typedef struct
+{
+	uint32		key;
+	int			pos;
+} LevOsaChar;
+
+static LevCallCache *
+lev_call_cache(FunctionCallInfo fcinfo)
+{
+	LevCallCache *cache = (LevCallCache *) fcinfo->flinfo->fn_extra;
+
+	if (cache == NULL)
+	{
+		cache = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+									   sizeof(LevCallCache));
+		cache->osa_arg = LEV_OSA_ARG_UNKNOWN;
+		fcinfo->flinfo->fn_extra = cache;
+	}
+	return cache;
+}
+
+/* The bytes of a non-ASCII character, as a key unique to it */
+static inline uint32
+lev_osa_key(const char *p, int len)
+{
+	uint32		key = 0;
+	int			i;
+
+	for (i = 0; i < len && i < 4; i++)
+		key = (key << 8) | (unsigned char) p[i];
+	return key;
+}
+
+static int
+lev_osa_char_cmp(const void *a, const void *b)
+{
+	const LevOsaChar *ca = (const LevOsaChar *) a;
+	const LevOsaChar *cb = (const LevOsaChar *) b;
+
+	if (ca->key != cb->key)
+		return ca->key < cb->key ? -1 : 1;
+	return ca->pos - cb->pos;
+}
+
+/*
+ * Compile a query into a matcher in cxt, or return NULL if it is too long
+ * to be compiled.
+ */
+static LevOsaMatcher *
+lev_osa_compile(MemoryContext cxt, const char *s, int s_bytes)
+{
+	LevOsaMatcher *p;
+	LevOsaChar	wide[LEV_OSA_MASK_CHARS];
+	int			nwide = 0;
+	int			m = 0;
+	int			i;
+
+	if (pg_mbstrlen_with_len(s, s_bytes) > LEV_OSA_MASK_CHARS)
+		return NULL;
+
+	p = MemoryContextAllocZero(cxt, offsetof(LevOsaMatcher, data) + s_bytes);
+	p->bytes = s_bytes;
+	memcpy(p->data, s, s_bytes);
+
+	for (i = 0; i < s_bytes; m++)
+	{
+		unsigned char c = s[i];
+
+		if (c < 0x80)
+		{
+			p->ascii[c] |= UINT64CONST(1) << m;
+			i++;
+		}
+		else
+		{
+			int			len = pg_mblen(s + i);
+
+			wide[nwide].key = lev_osa_key(s + i, len);
+			wide[nwide].pos = m;
+			nwide++;
+			i += len;
+		}
+	}
+	p->m = m;
+
+	qsort(wide, nwide, sizeof(LevOsaChar), lev_osa_char_cmp);
+	for (i = 0; i < nwide; i++)
+	{
+		if (p->nwide == 0 || p->wide_keys[p->nwide - 1] != wide[i].key)
+		{
+			p->wide_keys[p->nwide] = wide[i].key;
+			p->nwide++;
+		}
+		p->wide_masks[p->nwide - 1] |= UINT64CONST(1) << wide[i].pos;
+	}
+	return p;
+}
+
+static inline uint64
+lev_osa_wide_mask(const LevOsaMatcher *p, uint32 key)
+{
+	int			lo = 0;
+	int			hi = p->nwide - 1;
+
+	while (lo <= hi)
+	{
+		int			mid = (lo + hi) / 2;
+
+		if (p->wide_keys[mid] == key)
+			return p->wide_masks[mid];
+		if (p->wide_keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return 0;
+}
+
+/*
+ * Optimal string alignment distance between the query and a candidate of
+ * n characters, or max_d + 1 as soon as it must exceed max_d >= 0.
+ *
+ * The column of the matrix for the query is kept as bit vectors of its
+ * vertical deltas, vp and vn, and score tracks its last entry, as in Myers'
+ * algorithm; d0, the diagonal zero-deltas, also takes the transpositions:
+ * a position that matches this character after matching the previous one
+ * at the position before, and is not already a diagonal match.  The
+ * horizontal deltas stay within -1..1, so once score exceeds max_d by more
+ * than the characters left, it cannot come back.
+ */
+static int
+lev_osa_distance(const LevOsaMatcher *p, const char *t, int t_bytes, int n,
+				 int max_d)
+{
+	uint64		vp = ~UINT64CONST(0);
+	uint64		vn = 0;
+	uint64		d0 = 0;
+	uint64		pm_prev = 0;
+	uint64		top;
+	int			score = p->m;
+	int			i = 0;
+	int			j = 0;
+
+	if (p->m == 0)
+		score = n;
+	else
+	{
+		top = UINT64CONST(1) << (p->m - 1);
+		while (i < t_bytes)
+		{
+			unsigned char c = t[i];
+			uint64		pm;
+			uint64		hp;
+			uint64		hn;
+
+			if (c < 0x80)
+			{
+				pm = p->ascii[c];
+				i++;
+			}
+			else
+			{
+				int			len = pg_mblen(t + i);
+
+				pm = lev_osa_wide_mask(p, lev_osa_key(t + i, len));
+				i += len;
+			}
+
+			d0 = ((((~d0) & pm) << 1) & pm_prev) |
+				(((pm & vp) + vp) ^ vp) | pm | vn;
+			hp = vn | ~(d0 | vp);
+			hn = d0 & vp;
+			if (hp & top)
+				score++;
+			else if (hn & top)
+				score--;
+			hp = (hp << 1) | 1;
+			hn <<= 1;
+			vp = hn | ~(d0 | hp);
+			vn = d0 & hp;
+			pm_prev = pm;
+
+			j++;
+			if (max_d >= 0 && score - (n - j) > max_d)
+				return max_d + 1;
+		}
+	}
+
+	if (max_d >= 0 && score > max_d)
+		return max_d + 1;
+	return score;
+}
+
+/*
+ * Compute a unit-cost optimal string alignment distance with the call
+ * site's compiled matcher, or return -1 if this call can't use one.
+ */
+static int
+lev_osa_lookup(FunctionCallInfo fcinfo, const char *a, int a_len,
+			   const char *b, int b_len, int max_d)
+{
+	LevCallCache *cache;
+	const char *q;
+	int			q_len;
+	const char *t;
+	int			t_len;
+	int			n;
+
+	/* nowhere to keep it when called through DirectFunctionCall */
+	if (fcinfo->flinfo == NULL)
+		return -1;
+	cache = lev_call_cache(fcinfo);
+	if (cache->osa_arg == LEV_OSA_ARG_UNKNOWN)
+	{
+		/* the query is more often the second argument */
+		if (get_fn_expr_arg_stable(fcinfo->flinfo, 1))
+			cache->osa_arg = 1;
+		else if (get_fn_expr_arg_stable(fcinfo->flinfo, 0))
+			cache->osa_arg = 0;
+		else
+			cache->osa_arg = -1;
+	}
+	if (cache->osa_arg < 0)
+		return -1;
+
+	if (cache->osa_arg == 0)
+	{
+		q = a;
+		q_len = a_len;
+		t = b;
+		t_len = b_len;
+	}
+	else
+	{
+		q = b;
+		q_len = b_len;
+		t = a;
+		t_len = a_len;
+	}
+
+	if (cache->osa == NULL || cache->osa->bytes != q_len ||
+		memcmp(cache->osa->data, q, q_len) != 0)
+	{
+		if (cache->osa != NULL)
+			pfree(cache->osa);
+		cache->osa = lev_osa_compile(fcinfo->flinfo->fn_mcxt, q, q_len);
+		if (cache->osa == NULL)
+		{
+			/* too long to compile; don't try again for this call site */
+			cache->osa_arg = -1;
+			return -1;
+		}
+	}
+
+	n = pg_mbstrlen_with_len(t, t_len);
+	if (n > MAX_LEVENSHTEIN_STRLEN)
+		return -1;
+	if (max_d >= 0 && Abs(n - cache->osa->m) > max_d)
+		return max_d + 1;
+	return lev_osa_distance(cache->osa, t, t_len, n, max_d);
+}
+
+/*
+ * Compute a distance, with the call site's compiled matcher if it has one
+ * for these costs, and otherwise going through its memo if memoization is
+ * enabled.  With bounded false, max_d is ignored and the exact distance is
+ * computed.
+ */
+static int
+levenshtein_memoized(FunctionCallInfo fcinfo, text *src, text *dst,
+					 int ins_c, int del_c, int sub_c, int trans_c,
+					 bool bounded, int max_d)
+{
+	const char *a = VARDATA_ANY(src);
+	const char *b = VARDATA_ANY(dst);
+	int			a_len = VARSIZE_ANY_EXHDR(src);
+	int			b_len = VARSIZE_ANY_EXHDR(dst);
+	int			params[LEV_MEMO_NPARAMS];
+	LevMemo    *memo;
+	LevMemoEntry *e;
+	uint32		hash;
+	Size		entry_size;
+	int			result;
+
+	if (ins_c == 1 && del_c == 1 && sub_c == 1 && trans_c == 1)
+	{
+		result = lev_osa_lookup(fcinfo, a, a_len, b, b_len,
+								bounded ? max_d : -1);
+		if (result >= 0)
+			return result;
+	}
+
+	/* a DirectFunctionCall has no FmgrInfo to keep a memo in */
+	if (!fuzzystrmatch_memoize || fcinfo->flinfo == NULL)
+	{
+		if (bounded)
+			return levenshtein_less_equal_internal(a, a_len, b, b_len,
+												   ins_c, del_c, sub_c,
+												   trans_c, max_d);
+		return levenshtein_internal(a, a_len, b, b_len,
+									ins_c, del_c, sub_c, trans_c);
+	}
+
+	memo = lev_call_cache(fcinfo)->memo;
+	if (memo == NULL)
+	{
+		memo = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt, sizeof(LevMemo));
+		memo->cxt = AllocSetContextCreate(fcinfo->flinfo->fn_mcxt,
+										  "fuzzystrmatch memo",
+										  ALLOCSET_DEFAULT_MINSIZE,
+										  ALLOCSET_DEFAULT_INITSIZE,
+										  ALLOCSET_DEFAULT_MAXSIZE);
+		lev_memo_reset(memo);
+		lev_call_cache(fcinfo)->memo = memo;
+	}
+
+	params[0] = ins_c;
+	params[1] = del_c;
+	params[2] = sub_c;
+	params[3] = trans_c;
+	params[4] = bounded;
+	params[5] = bounded ? max_d : 0;
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) a, a_len));
+	hash = (hash << 7 | hash >> 25) ^
+		DatumGetUInt32(hash_any((const unsigned char *) b, b_len));
+	hash = (hash << 7 | hash >> 25) ^
+		DatumGetUInt32(hash_any((const unsigned char *) params, sizeof(params)));
+
+	for (e = memo->buckets[hash & (memo->nbuckets - 1)]; e != NULL; e = e->next)
+	{
+		if (e->hash == hash && e->a_len == a_len && e->b_len == b_len &&
+			memcmp(e->params, params, sizeof(params)) == 0 &&
+			memcmp(e->data, a, a_len) == 0 &&
+			memcmp(e->data + a_len, b, b_len) == 0)
+			return e->result;
+	}
+
+	if (bounded)
+		result = levenshtein_less_equal_internal(a, a_len, b, b_len,
+												 ins_c, del_c, sub_c,
+												 trans_c, max_d);
+	else
+		result = levenshtein_internal(a, a_len, b, b_len,
+									  ins_c, del_c, sub_c, trans_c);
+
+	entry_size = MAXALIGN(offsetof(LevMemoEntry, data) + a_len + b_len);
+	if (memo->space_used + entry_size > (Size) work_mem * 1024L)
+	{
+		/* full: start over, unless this entry alone would not fit */
+		if (entry_size + memo->nbuckets * sizeof(LevMemoEntry *) >
+			(Size) work_mem * 1024L)
+			return result;
+		lev_memo_reset(memo);
+	}
+	if (memo->nentries >= 2 * memo->nbuckets)
+		lev_memo_grow(memo);
+
+	e = MemoryContextAlloc(memo->cxt, entry_size);
+	e->hash = hash;
+	memcpy(e->params, params, sizeof(params));
+	e->a_len = a_len;
+	e->b_len = b_len;
+	e->result = result;
+	memcpy(e->data, a, a_len);
+	memcpy(e->data + a_len, b, b_len);
+	e->next = memo->buckets[hash & (memo->nbuckets - 1)];
+	memo->buckets[hash & (memo->nbuckets - 1)] = e;
+	memo->nentries++;
+	memo->space_used += entry_size;
+
+	return result;
+}
+
+/*
+ * levenshtein_memoized(), writing the call to the capture file if it is
+ * sampled (see fuzzystrmatch_capture.c)
+ */
+static int
+levenshtein_sampled(FunctionCallInfo fcinfo, text *src, text *dst,
+					int ins_c, int del_c, int sub_c, int trans_c,
+					bool bounded, int max_d)
+{
+	FuzzyCaptureRecord rec;
+	instr_time	start;
+	int			result;
+
+	if (!fuzzy_capture_sampled())
+		return levenshtein_memoized(fcinfo, src, dst, ins_c, del_c, sub_c,
+									trans_c, bounded, max_d);
+
+	INSTR_TIME_SET_CURRENT(start);
+	result = levenshtein_memoized(fcinfo, src, dst, ins_c, del_c, sub_c,
+								  trans_c, bounded, max_d);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.flags = bounded ? FUZZY_CAPTURE_BOUNDED : 0;
+	rec.ins_c = ins_c;
+	rec.del_c = del_c;
+	rec.sub_c = sub_c;
+	rec.trans_c = trans_c;
+	rec.max_d = bounded ? max_d : -1;
+	rec.result = result;
+	fuzzy_capture_write(fcinfo, &rec,
+						VARDATA_ANY(src), VARSIZE_ANY_EXHDR(src),
+						VARDATA_ANY(dst), VARSIZE_ANY_EXHDR(dst), start);
+	return result;
+}
+
+/*
+ * Decide, if possible without detoasting, that a bounded distance must
+ * exceed max_d.
+ *
+ * The raw size of a compressed or out-of-line value is known from its header
+ * or TOAST pointer, and a string of b bytes has between b / max_char_len
+ * and b characters, which bounds the length difference and hence the
+ * distance from below.  When this returns true, the kernel would have
+ * returned max_d + 1 as well; any case in which the kernel might have
+ * raised an error or returned an exact result instead (empty strings, or
+ * strings that may exceed MAX_LEVENSHTEIN_STRLEN characters) is left to it.
+ */
+static bool
+levenshtein_bound_rejects(Datum src, Datum dst, int ins_c, int del_c,
+						  int max_d)
+{
+	struct varlena *s = (struct varlena *) DatumGetPointer(src);
+	struct varlena *t = (struct varlena *) DatumGetPointer(dst);
+	int			max_char_len;
+	int64		s_bytes,
+				t_bytes;
+	int64		m_lo,
+				n_lo;
+	int64		min_theo_d;
+
+	/* only worth it when detoasting would actually cost something */
+	if (!VARATT_IS_EXTERNAL(s) && !VARATT_IS_COMPRESSED(s) &&
+		!VARATT_IS_EXTERNAL(t) && !VARATT_IS_COMPRESSED(t))
+		return false;
+	if (max_d < 0 || ins_c < 0 || del_c < 0)
+		return false;
+
+	s_bytes = toast_raw_datum_size(src) - VARHDRSZ;
+	t_bytes = toast_raw_datum_size(dst) - VARHDRSZ;
+	if (s_bytes <= 0 || t_bytes <= 0)
+		return false;
+
+	max_char_len = pg_database_encoding_max_length();
+	m_lo = (s_bytes + max_char_len - 1) / max_char_len;
+	n_lo = (t_bytes + max_char_len - 1) / max_char_len;
+	if (m_lo > MAX_LEVENSHTEIN_STRLEN || n_lo > MAX_LEVENSHTEIN_STRLEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("argument exceeds the maximum length of %d bytes",
+						MAX_LEVENSHTEIN_STRLEN)));
+	if (s_bytes > MAX_LEVENSHTEIN_STRLEN || t_bytes > MAX_LEVENSHTEIN_STRLEN)
+		return false;
+
+	if (n_lo > s_bytes)
+		min_theo_d = (n_lo - s_bytes) * ins_c;
+	else if (m_lo > t_bytes)
+		min_theo_d = (m_lo - t_bytes) * del_c;
+	else
+		min_theo_d = 0;
+
+	return min_theo_d > max_d;
+}
 
 PG_FUNCTION_INFO_V1(levenshtein_with_costs);
 Datum
@@ -197,7 +785,8 @@ levenshtein_with_costs(PG_FUNCTION_ARGS)
 	int			del_c = PG_GETARG_INT32(3);
 	int			sub_c = PG_GETARG_INT32(4);
 
-	PG_RETURN_INT32(levenshtein_internal(src, dst, ins_c, del_c, sub_c, 0));
+	PG_RETURN_INT32(levenshtein_sampled(fcinfo, src, dst,
+										ins_c, del_c, sub_c, 0, false, 0));
 }
 
 
@@ -208,7 +797,8 @@ levenshtein(PG_FUNCTION_ARGS)
 	text	   *src = PG_GETARG_TEXT_PP(0);
 	text	   *dst = PG_GETARG_TEXT_PP(1);
 
-	PG_RETURN_INT32(levenshtein_internal(src, dst, 1, 1, 1, 0));
+	PG_RETURN_INT32(levenshtein_sampled(fcinfo, src, dst,
+										1, 1, 1, 0, false, 0));
 }
 
 
@@ -216,14 +806,21 @@ PG_FUNCTION_INFO_V1(levenshtein_less_equal_with_costs);
 Datum
 levenshtein_less_equal_with_costs(PG_FUNCTION_ARGS)
 {
-	text	   *src = PG_GETARG_TEXT_PP(0);
-	text	   *dst = PG_GETARG_TEXT_PP(1);
+	text	   *src;
+	text	   *dst;
 	int			ins_c = PG_GETARG_INT32(2);
 	int			del_c = PG_GETARG_INT32(3);
 	int			sub_c = PG_GETARG_INT32(4);
 	int			max_d = PG_GETARG_INT32(5);
 
-	PG_RETURN_INT32(levenshtein_less_equal_internal(src, dst, ins_c, del_c, sub_c, 0, max_d));
+	if (levenshtein_bound_rejects(PG_GETARG_DATUM(0), PG_GETARG_DATUM(1),
+								  ins_c, del_c, max_d))
+		PG_RETURN_INT32(max_d + 1);
+	src = PG_GETARG_TEXT_PP(0);
+	dst = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_INT32(levenshtein_sampled(fcinfo, src, dst,
+										ins_c, del_c, sub_c, 0, true, max_d));
 }
 
 
@@ -231,11 +828,18 @@ PG_FUNCTION_INFO_V1(levenshtein_less_equal);
 Datum
 levenshtein_less_equal(PG_FUNCTION_ARGS)
 {
-	text	   *src = PG_GETARG_TEXT_PP(0);
-	text	   *dst = PG_GETARG_TEXT_PP(1);
+	text	   *src;
+	text	   *dst;
 	int			max_d = PG_GETARG_INT32(2);
 
-	PG_RETURN_INT32(levenshtein_less_equal_internal(src, dst, 1, 1, 1, 0, max_d));
+	if (levenshtein_bound_rejects(PG_GETARG_DATUM(0), PG_GETARG_DATUM(1),
+								  1, 1, max_d))
+		PG_RETURN_INT32(max_d + 1);
+	src = PG_GETARG_TEXT_PP(0);
+	dst = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_INT32(levenshtein_sampled(fcinfo, src, dst,
+										1, 1, 1, 0, true, max_d));
 }
 
 PG_FUNCTION_INFO_V1(dameraulevenshtein_with_costs);
@@ -249,7 +853,9 @@ dameraulevenshtein_with_costs(PG_FUNCTION_ARGS)
 	int			sub_c = PG_GETARG_INT32(4);
 	int			trans_c = PG_GETARG_INT32(5);
 
-	PG_RETURN_INT32(levenshtein_internal(src, dst, ins_c, del_c, sub_c, trans_c));
+	PG_RETURN_INT32(levenshtein_sampled(fcinfo, src, dst,
+										ins_c, del_c, sub_c, trans_c,
+										false, 0));
 }
 
 
@@ -260,7 +866,8 @@ dameraulevenshtein(PG_FUNCTION_ARGS)
 	text	   *src = PG_GETARG_TEXT_PP(0);
 	text	   *dst = PG_GETARG_TEXT_PP(1);
 
-	PG_RETURN_INT32(levenshtein_internal(src, dst, 1, 1, 1, 1));
+	PG_RETURN_INT32(levenshtein_sampled(fcinfo, src, dst,
+										1, 1, 1, 1, false, 0));
 }
 
 
@@ -268,15 +875,23 @@ PG_FUNCTION_INFO_V1(dameraulevenshtein_less_equal_with_costs);
 Datum
 dameraulevenshtein_less_equal_with_costs(PG_FUNCTION_ARGS)
 {
-	text	   *src = PG_GETARG_TEXT_PP(0);
-	text	   *dst = PG_GETARG_TEXT_PP(1);
+	text	   *src;
+	text	   *dst;
 	int			ins_c = PG_GETARG_INT32(2);
 	int			del_c = PG_GETARG_INT32(3);
 	int			sub_c = PG_GETARG_INT32(4);
 	int			trans_c = PG_GETARG_INT32(5);
 	int			max_d = PG_GETARG_INT32(6);
 
-	PG_RETURN_INT32(levenshtein_less_equal_internal(src, dst, ins_c, del_c, sub_c, trans_c, max_d));
+	if (levenshtein_bound_rejects(PG_GETARG_DATUM(0), PG_GETARG_DATUM(1),
+								  ins_c, del_c, max_d))
+		PG_RETURN_INT32(max_d + 1);
+	src = PG_GETARG_TEXT_PP(0);
+	dst = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_INT32(levenshtein_sampled(fcinfo, src, dst,
+										ins_c, del_c, sub_c, trans_c,
+										true, max_d));
 }
 
 
@@ -284,44 +899,46 @@ PG_FUNCTION_INFO_V1(dameraulevenshtein_less_equal);
 Datum
 dameraulevenshtein_less_equal(PG_FUNCTION_ARGS)
 {
-	text	   *src = PG_GETARG_TEXT_PP(0);
-	text	   *dst = PG_GETARG_TEXT_PP(1);
+	text	   *src;
+	text	   *dst;
 	int			max_d = PG_GETARG_INT32(2);
 
-	PG_RETURN_INT32(levenshtein_less_equal_internal(src, dst, 1, 1, 1, 1, max_d));
+	if (levenshtein_bound_rejects(PG_GETARG_DATUM(0), PG_GETARG_DATUM(1),
+								  1, 1, max_d))
+		PG_RETURN_INT32(max_d + 1);
+	src = PG_GETARG_TEXT_PP(0);
+	dst = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_INT32(levenshtein_sampled(fcinfo, src, dst,
+										1, 1, 1, 1, true, max_d));
 }
 
 /*
  * Calculates the metaphone of an input string.
  * Returns number of characters requested
  * (suggested value is 4)
+ *
+ * metaphone_internal() works on a (pointer, length) string and returns a
+ * palloc'd result; it is shared by the SQL function, the C interface and
+ * fuzzystrmatch_dedupe.c.
  */
-PG_FUNCTION_INFO_V1(metaphone);
-Datum
-metaphone(PG_FUNCTION_ARGS)
+char *
+metaphone_internal(const char *str, int len, int reqlen)
 {
-	char	   *str_i = TextDatumGetCString(PG_GETARG_DATUM(0));
-	size_t		str_i_len = strlen(str_i);
-	int			reqlen;
+	char	   *str_i;
 	char	   *metaph;
 	int			retval;
 
 	/* return an empty string if we receive one */
-	if (!(str_i_len > 0))
-		PG_RETURN_TEXT_P(cstring_to_text(""));
+	if (!(len > 0))
+		return pstrdup("");
 
-	if (str_i_len > MAX_METAPHONE_STRLEN)
+	if (len > MAX_METAPHONE_STRLEN)
 		ereport(ERROR,
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 				 errmsg("argument exceeds the maximum length of %d bytes",
 						MAX_METAPHONE_STRLEN)));
 
-	if (!(str_i_len > 0))
-		ereport(ERROR,
-				(errcode(ERRCODE_ZERO_LENGTH_CHARACTER_STRING),
-				 errmsg("argument is empty string")));
-
-	reqlen = PG_GETARG_INT32(1);
 	if (reqlen > MAX_METAPHONE_STRLEN)
 		ereport(ERROR,
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
@@ -333,17 +950,296 @@ metaphone(PG_FUNCTION_ARGS)
 				(errcode(ERRCODE_ZERO_LENGTH_CHARACTER_STRING),
 				 errmsg("output cannot be empty string")));
 
-
+	str_i = pnstrdup(str, len);
 	retval = _metaphone(str_i, reqlen, &metaph);
-	if (retval == META_SUCCESS)
-		PG_RETURN_TEXT_P(cstring_to_text(metaph));
-	else
+	pfree(str_i);
+	if (retval != META_SUCCESS)
 	{
 		/* internal error */
 		elog(ERROR, "metaphone: failure");
-		/* keep the compiler quiet */
-		PG_RETURN_NULL();
 	}
+	return metaph;
+}
+
+PG_FUNCTION_INFO_V1(metaphone);
+Datum
+metaphone(PG_FUNCTION_ARGS)
+{
+	text	   *str = PG_GETARG_TEXT_PP(0);
+	int			reqlen = PG_GETARG_INT32(1);
+
+	PG_RETURN_TEXT_P(cstring_to_text(metaphone_internal(VARDATA_ANY(str),
+													VARSIZE_ANY_EXHDR(str),
+														 reqlen)));
+}
+
+
+/*
+ * Ceiling on the results a single call builds up.
+ *
+ * The functions whose results grow without bound as their input does call
+ * this as they go: metaphone_many() and dmetaphone_many() after each
+ * element, with the scratch context the element was encoded in and the
+ * size of the result array so far, fuzzy_neighbourhood() after each string
+ * it expands, and dmetaphone() and dmetaphone_alt() once, for the copies
+ * of their argument.  They get an error once the total passes
+ * fuzzystrmatch.result_memory_limit, rather than running the backend out
+ * of memory.  Nothing is checked within one element or string, and no
+ * other function is limited: the Levenshtein kernels only ever hold a few
+ * rows of MAX_LEVENSHTEIN_STRLEN cells.  What a context has allocated can
+ * only be asked from 13 on; before that, only the accumulated bytes are
+ * counted.
+ */
+int			fuzzystrmatch_result_memory_limit = 0;
+
+void
+fuzzy_check_result_memory(MemoryContext scratch, Size accumulated)
+{
+	Size		used = accumulated;
+
+	if (fuzzystrmatch_result_memory_limit <= 0)
+		return;
+#if PG_VERSION_NUM >= 130000
+	if (scratch != NULL)
+		used += MemoryContextMemAllocated(scratch, true);
+#endif
+	if (used > (Size) fuzzystrmatch_result_memory_limit * 1024)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("function call exceeds fuzzystrmatch.result_memory_limit (%d kB)",
+						fuzzystrmatch_result_memory_limit)));
+}
+
+/*
+ * Array forms of the phonetic encoders, for computing keys in bulk.
+ *
+ * The input array is walked in place rather than deconstructed, each
+ * element is encoded in a scratch context that is reset before the next
+ * one, and the codes are written straight into the data area of the result
+ * array as they are produced, so a call makes a handful of allocations
+ * however many elements there are.  NULL elements give NULL codes.
+ */
+typedef struct
+{
+	ArrayType  *result;
+	Size		size;			/* allocated size of result */
+	Size		used;			/* bytes filled, including the header */
+	int			item;			/* next element number */
+	bool		hasnulls;
+} PhoneticArray;
+
+static void
+phonetic_array_start(PhoneticArray *out, ArrayType *in, int per_item,
+					 Size est_item_size)
+{
+	int			ndim = ARR_NDIM(in);
+	int			nitems = ArrayGetNItems(ndim, ARR_DIMS(in)) * per_item;
+	int			out_ndim = per_item > 1 ? ndim + 1 : ndim;
+	Size		header;
+
+	if (out_ndim > MAXDIM)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("number of array dimensions (%d) exceeds the maximum allowed (%d)",
+						out_ndim, MAXDIM)));
+
+	out->hasnulls = ARR_HASNULL(in);
+	if (out->hasnulls)
+		header = ARR_OVERHEAD_WITHNULLS(out_ndim, nitems);
+	else
+		header = ARR_OVERHEAD_NONULLS(out_ndim);
+
+	out->size = header + nitems * est_item_size;
+	out->result = (ArrayType *) palloc0(out->size);
+	out->used = header;
+	out->item = 0;
+
+	out->result->ndim = out_ndim;
+	out->result->dataoffset = out->hasnulls ? header : 0;
+	out->result->elemtype = TEXTOID;
+	memcpy(ARR_DIMS(out->result), ARR_DIMS(in), ndim * sizeof(int));
+	memcpy(ARR_LBOUND(out->result), ARR_LBOUND(in), ndim * sizeof(int));
+	if (per_item > 1)
+	{
+		ARR_DIMS(out->result)[ndim] = per_item;
+		ARR_LBOUND(out->result)[ndim] = 1;
+	}
+}
+
+static void
+phonetic_array_put(PhoneticArray *out, const char *code, int len)
+{
+	Size		need = INTALIGN(VARHDRSZ + len);
+	char	   *dest;
+
+	if (out->used + need > out->size)
+	{
+		Size		newsize = Max(out->size * 2, out->used + need);
+
+		out->result = (ArrayType *) repalloc(out->result, newsize);
+		memset((char *) out->result + out->size, 0, newsize - out->size);
+		out->size = newsize;
+	}
+
+	dest = (char *) out->result + out->used;
+	SET_VARSIZE(dest, VARHDRSZ + len);
+	memcpy(VARDATA(dest), code, len);
+	out->used += need;
+
+	if (out->hasnulls)
+		ARR_NULLBITMAP(out->result)[out->item / 8] |= 1 << (out->item % 8);
+	out->item++;
+}
+
+static void
+phonetic_array_put_null(PhoneticArray *out)
+{
+	out->item++;
+}
+
+static ArrayType *
+phonetic_array_finish(PhoneticArray *out)
+{
+	SET_VARSIZE(out->result, out->used);
+	return out->result;
+}
+
+/*
+ * Step through the elements of a text array: returns the next element in
+ * *str and *len, or sets *isnull.  *pos and *bitmask are the walk's state,
+ * initially the data pointer and 1.
+ */
+static void
+phonetic_array_next(ArrayType *in, int i, char **pos, int *bitmask,
+					const char **str, int *len, bool *isnull)
+{
+	bits8	   *bitmap = ARR_NULLBITMAP(in);
+
+	*isnull = bitmap != NULL && (bitmap[i / 8] & *bitmask) == 0;
+	*bitmask = *bitmask == 0x80 ? 1 : *bitmask << 1;
+	if (*isnull)
+		return;
+
+	*str = VARDATA_ANY(*pos);
+	*len = VARSIZE_ANY_EXHDR(*pos);
+	*pos = att_addlength_pointer(*pos, -1, *pos);
+	*pos = (char *) att_align_nominal(*pos, 'i');
+}
+
+static MemoryContext
+phonetic_scratch_context(void)
+{
+	return AllocSetContextCreate(CurrentMemoryContext,
+								 "fuzzystrmatch phonetic scratch",
+								 ALLOCSET_SMALL_MINSIZE,
+								 ALLOCSET_SMALL_INITSIZE,
+								 ALLOCSET_DEFAULT_MAXSIZE);
+}
+
+PG_FUNCTION_INFO_V1(metaphone_many);
+Datum
+metaphone_many(PG_FUNCTION_ARGS)
+{
+	ArrayType  *in = PG_GETARG_ARRAYTYPE_P(0);
+	int			reqlen = PG_GETARG_INT32(1);
+	int			n = ArrayGetNItems(ARR_NDIM(in), ARR_DIMS(in));
+	PhoneticArray out;
+	MemoryContext scratch;
+	char	   *pos = ARR_DATA_PTR(in);
+	int			bitmask = 1;
+	int			i;
+
+	if (n == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(TEXTOID));
+
+	/* most codes come out as long as requested */
+	phonetic_array_start(&out, in, 1,
+						 INTALIGN(VARHDRSZ + Min(Max(reqlen, 0), 16)));
+	scratch = phonetic_scratch_context();
+	for (i = 0; i < n; i++)
+	{
+		const char *str;
+		int			len;
+		bool		isnull;
+		MemoryContext oldcontext;
+		char	   *code;
+
+		if ((i & 1023) == 0)
+			CHECK_FOR_INTERRUPTS();
+
+		phonetic_array_next(in, i, &pos, &bitmask, &str, &len, &isnull);
+		if (isnull)
+		{
+			phonetic_array_put_null(&out);
+			continue;
+		}
+
+		oldcontext = MemoryContextSwitchTo(scratch);
+		code = metaphone_internal(str, len, reqlen);
+		MemoryContextSwitchTo(oldcontext);
+		phonetic_array_put(&out, code, strlen(code));
+		fuzzy_check_result_memory(scratch, out.size);
+		MemoryContextReset(scratch);
+	}
+	MemoryContextDelete(scratch);
+
+	PG_RETURN_ARRAYTYPE_P(phonetic_array_finish(&out));
+}
+
+/*
+ * dmetaphone_many(text[]) returns an array with one more dimension, of
+ * length 2: the primary and the alternate code of each element.
+ */
+PG_FUNCTION_INFO_V1(dmetaphone_many);
+Datum
+dmetaphone_many(PG_FUNCTION_ARGS)
+{
+	ArrayType  *in = PG_GETARG_ARRAYTYPE_P(0);
+	int			n = ArrayGetNItems(ARR_NDIM(in), ARR_DIMS(in));
+	PhoneticArray out;
+	MemoryContext scratch;
+	char	   *pos = ARR_DATA_PTR(in);
+	int			bitmask = 1;
+	int			i;
+
+	if (n == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(TEXTOID));
+
+	/* codes are at most DMETAPHONE_CODE_LEN, so this never grows */
+	phonetic_array_start(&out, in, 2,
+						 INTALIGN(VARHDRSZ + DMETAPHONE_CODE_LEN));
+	scratch = phonetic_scratch_context();
+	for (i = 0; i < n; i++)
+	{
+		const char *str;
+		int			len;
+		bool		isnull;
+		MemoryContext oldcontext;
+		char		primary[DMETAPHONE_CODE_LEN + 1];
+		char		alternate[DMETAPHONE_CODE_LEN + 1];
+
+		if ((i & 1023) == 0)
+			CHECK_FOR_INTERRUPTS();
+
+		phonetic_array_next(in, i, &pos, &bitmask, &str, &len, &isnull);
+		if (isnull)
+		{
+			phonetic_array_put_null(&out);
+			phonetic_array_put_null(&out);
+			continue;
+		}
+
+		oldcontext = MemoryContextSwitchTo(scratch);
+		dmetaphone_codes(pnstrdup(str, len), primary, alternate);
+		MemoryContextSwitchTo(oldcontext);
+		phonetic_array_put(&out, primary, strlen(primary));
+		phonetic_array_put(&out, alternate, strlen(alternate));
+		fuzzy_check_result_memory(scratch, out.size);
+		MemoryContextReset(scratch);
+	}
+	MemoryContextDelete(scratch);
+
+	PG_RETURN_ARRAYTYPE_P(phonetic_array_finish(&out));
 }
 
 
@@ -772,82 +1668,254 @@ soundex(PG_FUNCTION_ARGS)
 {
 	char		outstr[SOUNDEX_LEN + 1];
 	char	   *arg;
+	bool		sampled = fuzzy_capture_sampled();
+	instr_time	start;
+
+	if (sampled)
+		INSTR_TIME_SET_CURRENT(start);
+	else
+		INSTR_TIME_SET_ZERO(start);
 
 	arg = text_to_cstring(PG_GETARG_TEXT_P(0));
 
 	_soundex(arg, outstr);
 
+	if (sampled)
+	{
+		FuzzyCaptureRecord rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.max_d = -1;
+		fuzzy_capture_write(fcinfo, &rec, arg, strlen(arg), NULL, 0, start);
+	}
+
 	PG_RETURN_TEXT_P(cstring_to_text(outstr));
 }
 
-static void
-_soundex(const char *instr, char *outstr)
+PG_FUNCTION_INFO_V1(difference);
+
+Datum
+difference(PG_FUNCTION_ARGS)
 {
-	int			count;
+	char		sndx1[SOUNDEX_LEN + 1],
+				sndx2[SOUNDEX_LEN + 1];
+	char	   *arg1;
+	char	   *arg2;
+	int			i,
+				result;
+	bool		sampled = fuzzy_capture_sampled();
+	instr_time	start;
 
-	AssertArg(instr);
-	AssertArg(outstr);
+	if (sampled)
+		INSTR_TIME_SET_CURRENT(start);
+	else
+		INSTR_TIME_SET_ZERO(start);
 
-	outstr[SOUNDEX_LEN] = '\0';
+	arg1 = text_to_cstring(PG_GETARG_TEXT_P(0));
+	arg2 = text_to_cstring(PG_GETARG_TEXT_P(1));
+	_soundex(arg1, sndx1);
+	_soundex(arg2, sndx2);
 
-	/* Skip leading non-alphabetic characters */
-	while (!isalpha((unsigned char) instr[0]) && instr[0])
-		++instr;
+	result = 0;
+	for (i = 0; i < SOUNDEX_LEN; i++)
+	{
+		if (sndx1[i] == sndx2[i])
+			result++;
+	}
 
-	/* No string left */
-	if (!instr[0])
+	if (sampled)
 	{
-		outstr[0] = (char) 0;
-		return;
+		FuzzyCaptureRecord rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.max_d = -1;
+		rec.result = result;
+		fuzzy_capture_write(fcinfo, &rec, arg1, strlen(arg1),
+							arg2, strlen(arg2), start);
 	}
 
-	/* Take the first letter as is */
-	*outstr++ = (char) toupper((unsigned char) *instr++);
+	PG_RETURN_INT32(result);
+}
+
+
+/*
+ * C-level interface for other extensions (see fuzzystrmatch_api.h)
+ */
+static int
+api_levenshtein(const char *a, int alen, const char *b, int blen,
+				int ins_c, int del_c, int sub_c)
+{
+	return levenshtein_internal(a, alen, b, blen, ins_c, del_c, sub_c, 0);
+}
+
+static int
+api_levenshtein_less_equal(const char *a, int alen, const char *b, int blen,
+						   int ins_c, int del_c, int sub_c, int max_d)
+{
+	return levenshtein_less_equal_internal(a, alen, b, blen,
+										   ins_c, del_c, sub_c, 0, max_d);
+}
 
-	count = 1;
-	while (*instr && count < SOUNDEX_LEN)
+/*
+ * Distances from one query to many candidates, for the C interface and for
+ * the batching scan node in fuzzystrmatch_batch.c.
+ */
+int
+levenshtein_batch_internal(const char *query, int query_len,
+						   const char *const *candidates,
+						   const int *candidate_lens,
+						   int n, int ins_c, int del_c, int sub_c, int max_d,
+						   int *distances)
+{
+	MemoryContext batch_context;
+	MemoryContext oldcontext;
+	int			nmatches = 0;
+	int			i;
+
+	/* the kernels palloc their work rows; don't let n calls' worth pile up */
+	batch_context = AllocSetContextCreate(CurrentMemoryContext,
+										  "fuzzystrmatch batch",
+										  ALLOCSET_SMALL_MINSIZE,
+										  ALLOCSET_SMALL_INITSIZE,
+										  ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(batch_context);
+	for (i = 0; i < n; i++)
 	{
-		if (isalpha((unsigned char) *instr) &&
-			soundex_code(*instr) != soundex_code(*(instr - 1)))
+		if ((i & 1023) == 0)
+			CHECK_FOR_INTERRUPTS();
+		if (max_d < 0)
+			distances[i] = levenshtein_internal(query, query_len,
+												candidates[i], candidate_lens[i],
+												ins_c, del_c, sub_c, 0);
+		else
 		{
-			*outstr = soundex_code(instr[0]);
-			if (*outstr != '0')
-			{
-				++outstr;
-				++count;
-			}
+			distances[i] = levenshtein_less_equal_internal(query, query_len,
+														   candidates[i],
+														   candidate_lens[i],
+														   ins_c, del_c, sub_c,
+														   0, max_d);
+			if (distances[i] <= max_d)
+				nmatches++;
 		}
-		++instr;
+		MemoryContextReset(batch_context);
 	}
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(batch_context);
 
-	/* Fill with 0's */
-	while (count < SOUNDEX_LEN)
-	{
-		*outstr = '0';
-		++outstr;
-		++count;
-	}
+	return max_d < 0 ? n : nmatches;
 }
 
-PG_FUNCTION_INFO_V1(difference);
+static void
+api_soundex(const char *str, int len, char *code)
+{
+	char	   *cstr = pnstrdup(str, len);
 
-Datum
-difference(PG_FUNCTION_ARGS)
+	_soundex(cstr, code);
+	pfree(cstr);
+}
+
+static void
+api_dmetaphone(const char *str, int len, char *primary, char *alternate)
 {
-	char		sndx1[SOUNDEX_LEN + 1],
-				sndx2[SOUNDEX_LEN + 1];
-	int			i,
-				result;
+	char	   *cstr = pnstrdup(str, len);
 
-	_soundex(text_to_cstring(PG_GETARG_TEXT_P(0)), sndx1);
-	_soundex(text_to_cstring(PG_GETARG_TEXT_P(1)), sndx2);
+	dmetaphone_codes(cstr, primary, alternate);
+	pfree(cstr);
+}
 
-	result = 0;
-	for (i = 0; i < SOUNDEX_LEN; i++)
+static const FuzzyStrMatchAPI fuzzystrmatch_api = {
+	FUZZYSTRMATCH_API_VERSION,
+	api_levenshtein,
+	api_levenshtein_less_equal,
+	levenshtein_batch_internal,
+	api_soundex,
+	api_dmetaphone,
+	metaphone_internal
+};
+
+/*
+ * Module load callback
+ */
+void
+_PG_init(void)
+{
+	void	  **api_slot;
+
+	DefineCustomBoolVariable("fuzzystrmatch.memoize",
+	 "Remember computed distances for repeated pairs within a query.",
+							 NULL,
+							 &fuzzystrmatch_memoize,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("fuzzystrmatch.result_memory_limit",
+	"Memory the result of a single phonetic array, dmetaphone or neighbourhood call may take.",
+							"Checked between the elements or strings such a call produces; other functions are not limited.  Zero means no limit.",
+							&fuzzystrmatch_result_memory_limit,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	fuzzystrmatch_dict_init();
+	fuzzystrmatch_parallel_init();
+	fuzzystrmatch_gist_init();
+	fuzzystrmatch_cache_init();
+	fuzzystrmatch_batch_init();
+	fuzzystrmatch_capture_init();
+	fuzzystrmatch_neighbourhood_init();
+
+	api_slot = find_rendezvous_variable(FUZZYSTRMATCH_API_RENDEZVOUS);
+	*api_slot = (void *) &fuzzystrmatch_api;
+}
+
+/*
+ * Set up a materialize-mode SRF result; returns the tuplestore to fill in,
+ * and the descriptor of its rows in *tupdesc.
+ */
+Tuplestorestate *
+init_materialize_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	switch (get_call_result_type(fcinfo, NULL, tupdesc))
 	{
-		if (sndx1[i] == sndx2[i])
-			result++;
+		case TYPEFUNC_COMPOSITE:
+			*tupdesc = CreateTupleDescCopy(*tupdesc);
+			break;
+		case TYPEFUNC_SCALAR:
+			if (rsinfo->expectedDesc == NULL)
+				elog(ERROR, "no expected tuple descriptor for set-returning function");
+			*tupdesc = CreateTupleDescCopy(rsinfo->expectedDesc);
+			break;
+		default:
+			elog(ERROR, "return type must be a row type");
 	}
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+	MemoryContextSwitchTo(oldcontext);
 
-	PG_RETURN_INT32(result);
+	return tupstore;
 }
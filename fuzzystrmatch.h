@@ -0,0 +1,88 @@
+/*
+ * fuzzystrmatch.h
+ *
+ * Declarations shared between the source files of the fuzzystrmatch module.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch.h
+ */
+#ifndef FUZZYSTRMATCH_H
+#define FUZZYSTRMATCH_H
+
+/* longest code DoubleMetaphone produces */
+#define DMETAPHONE_CODE_LEN		4
+
+/* dmetaphone.c */
+extern void dmetaphone_codes(char *str, char *primary, char *alternate);
+
+/* the rest is only for the backend module */
+#if !defined(FUZZYSTRMATCH_STANDALONE) && !defined(DMETAPHONE_STANDALONE)
+
+#include "funcapi.h"
+#include "fuzzycapture.h"
+#include "lib/stringinfo.h"
+#include "portability/instr_time.h"
+#include "utils/tuplestore.h"
+
+/* fuzzystrmatch.c */
+extern Tuplestorestate *init_materialize_srf(FunctionCallInfo fcinfo,
+					 TupleDesc *tupdesc);
+extern char *metaphone_internal(const char *str, int len, int reqlen);
+extern int	fuzzystrmatch_result_memory_limit;
+extern void fuzzy_check_result_memory(MemoryContext scratch, Size accumulated);
+extern int levenshtein_batch_internal(const char *query, int query_len,
+						   const char *const * candidates,
+						   const int *candidate_lens, int n,
+						   int ins_c, int del_c, int sub_c, int max_d,
+						   int *distances);
+
+/* fuzzydict.c */
+extern int	fuzzystrmatch_dict_compact_threshold;
+extern int	fuzzystrmatch_dict_compact_naptime;
+extern char *fuzzystrmatch_dict_compact_database;
+extern void fuzzystrmatch_dict_init(void);
+
+/* fuzzystrmatch_parallel.c */
+extern int	fuzzystrmatch_max_workers;
+extern void fuzzystrmatch_parallel_init(void);
+
+/* fuzzystrmatch_gist.c */
+extern int	fuzzystrmatch_radius;
+extern void fuzzystrmatch_gist_init(void);
+
+/* fuzzystrmatch_cache.c */
+#define FUZZY_CACHE_KEY_MAX		256
+#define FUZZY_CACHE_VALUE_MAX	7936
+
+extern int	fuzzystrmatch_cache_entries;
+extern void fuzzystrmatch_cache_init(void);
+extern bool fuzzy_cache_enabled(void);
+extern bool fuzzy_cache_get(const char *key, int key_len, StringInfo value);
+extern void fuzzy_cache_put(const char *key, int key_len,
+				const char *value, int value_len);
+
+/* fuzzystrmatch_batch.c */
+extern int	fuzzystrmatch_batch_size;
+extern void fuzzystrmatch_batch_init(void);
+
+/* fuzzystrmatch_capture.c */
+extern char *fuzzystrmatch_capture_file;
+extern double fuzzystrmatch_capture_rate;
+extern int	fuzzystrmatch_capture_inputs;
+extern void fuzzystrmatch_capture_init(void);
+extern bool fuzzy_capture_sampled(void);
+extern void fuzzy_capture_write(FunctionCallInfo fcinfo,
+					FuzzyCaptureRecord *rec,
+					const char *a, int a_len, const char *b, int b_len,
+					instr_time start);
+extern void fuzzy_capture_write_function(Oid funcid,
+							 FuzzyCaptureRecord *rec,
+							 const char *a, int a_len,
+							 const char *b, int b_len, instr_time start);
+
+/* fuzzystrmatch_neighbourhood.c */
+extern int	fuzzystrmatch_neighbourhood_max_variants;
+extern void fuzzystrmatch_neighbourhood_init(void);
+
+#endif   /* backend */
+
+#endif   /* FUZZYSTRMATCH_H */
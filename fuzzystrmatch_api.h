@@ -0,0 +1,105 @@
+/*
+ * fuzzystrmatch_api.h
+ *
+ * C-level interface to the fuzzystrmatch kernels, for other extensions.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_api.h
+ *
+ * When the fuzzystrmatch library is loaded it publishes a FuzzyStrMatchAPI
+ * through find_rendezvous_variable(FUZZYSTRMATCH_API_RENDEZVOUS).  The
+ * functions in it take raw (pointer, length) strings in the database
+ * encoding, so callers avoid the fmgr call, the Datum conversions and the
+ * detoasting that going through DirectFunctionCall would cost them per pair.
+ * They behave exactly like the corresponding SQL functions, including the
+ * errors they raise, and allocate any results in CurrentMemoryContext.
+ *
+ * Typical use:
+ *
+ *		const FuzzyStrMatchAPI *fsm = fuzzystrmatch_get_api(1);
+ *
+ *		d = fsm->levenshtein_less_equal(a, alen, b, blen, 1, 1, 1, 2);
+ *
+ * Compatibility: "version" is bumped whenever members are added; members are
+ * only ever appended, and existing ones never change meaning, so a caller
+ * that needs version N works with any provider of version N or later.
+ */
+#ifndef FUZZYSTRMATCH_API_H
+#define FUZZYSTRMATCH_API_H
+
+#include "fmgr.h"
+
+#define FUZZYSTRMATCH_API_RENDEZVOUS	"fuzzystrmatch_api"
+#define FUZZYSTRMATCH_API_VERSION		1
+
+/* buffer sizes needed for the phonetic codes, including the terminator */
+#define FUZZYSTRMATCH_SOUNDEX_SIZE		5
+#define FUZZYSTRMATCH_DMETAPHONE_SIZE	5
+
+typedef struct FuzzyStrMatchAPI
+{
+	int			version;		/* FUZZYSTRMATCH_API_VERSION of the provider */
+
+	/* levenshtein(a, b, ins_c, del_c, sub_c) */
+	int			(*levenshtein) (const char *a, int alen,
+											const char *b, int blen,
+											int ins_c, int del_c, int sub_c);
+
+	/*
+	 * levenshtein_less_equal(a, b, ins_c, del_c, sub_c, max_d): any result
+	 * greater than max_d only means "more than max_d".
+	 */
+	int			(*levenshtein_less_equal) (const char *a, int alen,
+													   const char *b, int blen,
+												 int ins_c, int del_c, int sub_c,
+													   int max_d);
+
+	/*
+	 * Compare one query against n candidates, storing each distance in
+	 * distances[i] (with the same meaning as levenshtein_less_equal when
+	 * max_d >= 0, or exact when max_d < 0).  Returns the number of
+	 * candidates within max_d, or n if max_d < 0.  Cheaper than n separate
+	 * calls: the per-call memory is recycled, and interrupts are checked
+	 * as the batch proceeds.
+	 */
+	int			(*levenshtein_batch) (const char *query, int query_len,
+												  const char *const *candidates,
+												  const int *candidate_lens, int n,
+												 int ins_c, int del_c, int sub_c,
+												  int max_d, int *distances);
+
+	/* soundex(str); code must have room for FUZZYSTRMATCH_SOUNDEX_SIZE */
+	void		(*soundex) (const char *str, int len, char *code);
+
+	/*
+	 * dmetaphone(str) and dmetaphone_alt(str); primary and alternate must
+	 * each have room for FUZZYSTRMATCH_DMETAPHONE_SIZE
+	 */
+	void		(*dmetaphone) (const char *str, int len,
+										   char *primary, char *alternate);
+
+	/* metaphone(str, max_len); the result is palloc'd */
+	char	   *(*metaphone) (const char *str, int len, int max_len);
+} FuzzyStrMatchAPI;
+
+/*
+ * Look up the published interface, loading the fuzzystrmatch library first
+ * if necessary, and check that it provides at least the given version.
+ */
+static inline const FuzzyStrMatchAPI *
+fuzzystrmatch_get_api(int min_version)
+{
+	const FuzzyStrMatchAPI **slot;
+
+	slot = (const FuzzyStrMatchAPI **)
+		find_rendezvous_variable(FUZZYSTRMATCH_API_RENDEZVOUS);
+	if (*slot == NULL)
+		load_external_function("$libdir/fuzzystrmatch", "_PG_init", false, NULL);
+	if (*slot == NULL || (*slot)->version < min_version)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("fuzzystrmatch C interface version %d is not available",
+						min_version)));
+	return *slot;
+}
+
+#endif   /* FUZZYSTRMATCH_API_H */
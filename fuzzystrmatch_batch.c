@@ -0,0 +1,1245 @@
+/*
+ * fuzzystrmatch_batch.c
+ *
+ * A scan node that evaluates fuzzystrmatch calls a batch of rows at a time.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_batch.c
+ *
+ * "SELECT id FROM t WHERE levenshtein_less_equal(name, $1, 2) <= 2" calls
+ * the function once per row through fmgr, detoasting and setting up the
+ * query afresh each time.  When this module is loaded (which, for the
+ * planner hook to see every query, means shared_preload_libraries or
+ * session_preload_libraries), a planner hook offers a custom scan of a
+ * table as an alternative to its sequential scan whenever the table's
+ * conditions, or for a single-table query its target list, contain calls of
+ *
+ *		levenshtein(x, q), levenshtein_less_equal(x, q, k),
+ *		soundex(x), metaphone(x, n), dmetaphone(x), dmetaphone_alt(x)
+ *
+ * where x depends on the row and q, k and n do not.  The node reads up to
+ * fuzzystrmatch.batch_size rows, evaluating on each the conditions that
+ * come before the first one with a call.  It then takes the remaining
+ * conditions one at a time: it runs each call the condition is the first
+ * to need for all the rows still left (the distances through
+ * levenshtein_batch_internal(), the phonetic codes in one scratch context),
+ * and then evaluates the condition on those rows.  Last, it computes the
+ * calls that only the target list needs for the rows still left, and
+ * returns those rows one by one.
+ *
+ * No SQL changes: the calls become extra columns of the node's scan tuple
+ * (custom_scan_tlist), and setrefs.c replaces each occurrence of the same
+ * expression in the conditions and the target list with a reference to
+ * that column.  The conditions are all evaluated by the node itself, so
+ * that it knows which rows are left, and the plan's own qual stays empty.
+ *
+ * The conditions are taken in the order the planner gives them, the order
+ * a sequential scan would evaluate them in, so a call is only computed for
+ * rows that every earlier condition accepted, just as a sequential scan
+ * would compute it; an error such as an over-long argument cannot come
+ * from a row an earlier condition rejects.  A call under a CASE, COALESCE,
+ * NULLIF, GREATEST/LEAST or AND/OR/NOT is left alone, since the expression
+ * around it may exist to decide whether it is evaluated at all ("CASE WHEN
+ * length(x) < 256 THEN levenshtein(x, q) END"); so is a call that appears
+ * under such an expression in a condition before the first that makes it
+ * directly, and a call the target list needs that also appears in the
+ * conditions only under such an expression, as those would otherwise read
+ * its column before it has been computed.
+ *
+ * Batched distances don't go through the levenshtein memo
+ * (fuzzystrmatch.memoize): each row's call is computed exactly once anyway.
+ * Sampled calls are written to the capture file
+ * (fuzzystrmatch_capture.c) like any other, under the name of the function
+ * the call stands for.
+ *
+ * The node is only offered for tables scanned without row locks, outside
+ * UPDATE and DELETE, and needs PostgreSQL 9.6 or later.  Nor is it offered
+ * when any condition comes from a row-level security policy or a
+ * security_barrier view, or must wait for one (security_level > 0): the
+ * planner orders those conditions so that a leaky function of the user's
+ * never sees a row a policy hides, and the node is not worth the risk of
+ * getting that wrong.
+ */
+#include "postgres.h"
+
+#include "fuzzystrmatch.h"
+#include "utils/guc.h"
+
+/* the default batch size, and the largest accepted */
+#define FZB_DEFAULT_BATCH_SIZE	512
+#define FZB_MAX_BATCH_SIZE		65536
+
+int			fuzzystrmatch_batch_size = FZB_DEFAULT_BATCH_SIZE;
+
+#if PG_VERSION_NUM >= 90600
+
+#if PG_VERSION_NUM >= 120000
+#include "access/tableam.h"
+#else
+#include "access/heapam.h"
+#include "access/relscan.h"
+#endif
+#include "catalog/pg_class.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_proc.h"
+#include "commands/explain.h"
+#include "executor/executor.h"
+#include "nodes/extensible.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/cost.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
+#include "optimizer/restrictinfo.h"
+#if PG_VERSION_NUM >= 120000
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/clauses.h"
+#include "optimizer/var.h"
+#endif
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+
+#include "soundex.c"
+
+/* API differences between the server versions we build against */
+#if PG_VERSION_NUM >= 120000
+#define fzb_table_begin(rel, snapshot)	table_beginscan((rel), (snapshot), 0, NULL)
+#define fzb_table_end(scan)				table_endscan(scan)
+#define fzb_table_rescan(scan)			table_rescan((scan), NULL)
+#define fzb_heap_slot(rel)				table_slot_create((rel), NULL)
+#define fzb_row_slot(rel) \
+	MakeSingleTupleTableSlot(RelationGetDescr(rel), &TTSOpsHeapTuple)
+typedef TableScanDesc FzbScanDesc;
+#else
+#define fzb_table_begin(rel, snapshot)	heap_beginscan((rel), (snapshot), 0, NULL)
+#define fzb_table_end(scan)				heap_endscan(scan)
+#define fzb_table_rescan(scan)			heap_rescan((scan), NULL)
+#define fzb_heap_slot(rel)	MakeSingleTupleTableSlot(RelationGetDescr(rel))
+#define fzb_row_slot(rel)	MakeSingleTupleTableSlot(RelationGetDescr(rel))
+typedef HeapScanDesc FzbScanDesc;
+#endif
+#if PG_VERSION_NUM >= 130000
+#define fzb_lnext(list, cell)			lnext((list), (cell))
+#else
+#define fzb_lnext(list, cell)			lnext(cell)
+#endif
+#if PG_VERSION_NUM >= 110000
+#define fzb_explain_int(label, value, es) \
+	ExplainPropertyInteger((label), NULL, (value), (es))
+#else
+#define fzb_explain_int(label, value, es) \
+	ExplainPropertyInteger((label), (value), (es))
+#endif
+#if PG_VERSION_NUM >= 100000
+typedef ExprState *FzbQual;
+#define fzb_init_qual(qual, parent)		ExecInitQual((qual), (parent))
+#define fzb_qual(qual, econtext)		ExecQual((qual), (econtext))
+#define fzb_eval(state, econtext, isnull) \
+	ExecEvalExpr((state), (econtext), (isnull))
+#define fzb_has_target_srfs(parse)		((parse)->hasTargetSRFs)
+#else
+typedef List *FzbQual;
+#define fzb_init_qual(qual, parent) \
+	((List *) ExecInitExpr((Expr *) (qual), (parent)))
+#define fzb_qual(qual, econtext)		ExecQual((qual), (econtext), false)
+#define fzb_eval(state, econtext, isnull) \
+	ExecEvalExpr((state), (econtext), (isnull), NULL)
+#define fzb_has_target_srfs(parse) \
+	expression_returns_set((Node *) (parse)->targetList)
+#endif
+
+/* the calls the node can evaluate, and how many arguments each takes */
+typedef enum
+{
+	FZB_NONE,
+	FZB_LEVENSHTEIN,			/* (x, q) */
+	FZB_LEVENSHTEIN_LESS_EQUAL, /* (x, q, k) */
+	FZB_SOUNDEX,				/* (x) */
+	FZB_METAPHONE,				/* (x, n) */
+	FZB_DMETAPHONE,				/* (x) */
+	FZB_DMETAPHONE_ALT			/* (x) */
+} FzbKind;
+
+static const struct
+{
+	const char *symbol;
+	int			nargs;
+} fzb_functions[] = {
+	{NULL, 0},
+	{"levenshtein", 2},
+	{"levenshtein_less_equal", 3},
+	{"soundex", 1},
+	{"metaphone", 2},
+	{"dmetaphone", 1},
+	{"dmetaphone_alt", 1}
+};
+
+extern Datum levenshtein(PG_FUNCTION_ARGS);
+extern Datum levenshtein_less_equal(PG_FUNCTION_ARGS);
+extern Datum soundex(PG_FUNCTION_ARGS);
+extern Datum metaphone(PG_FUNCTION_ARGS);
+extern Datum dmetaphone(PG_FUNCTION_ARGS);
+extern Datum dmetaphone_alt(PG_FUNCTION_ARGS);
+
+static const PGFunction fzb_addresses[] = {
+	NULL,
+	levenshtein,
+	levenshtein_less_equal,
+	soundex,
+	metaphone,
+	dmetaphone,
+	dmetaphone_alt
+};
+
+/*
+ * Plan-time state.  custom_private holds nplain, nfuzzy, nqual_calls, then
+ * for each of the nfuzzy conditions the number of calls computed before it
+ * is evaluated, and then the kind of each call; custom_exprs holds the
+ * nplain leading conditions that read no call, the nfuzzy conditions after
+ * them, and then the arguments of each call in turn, the row-dependent one
+ * first.  custom_scan_tlist is the Vars the node reads from the table
+ * followed by the calls, in the order they are computed, the first
+ * nqual_calls of which are needed by the conditions.
+ */
+#define FZB_PRIVATE_NPLAIN		0
+#define FZB_PRIVATE_NFUZZY		1
+#define FZB_PRIVATE_NQUAL_CALLS	2
+#define FZB_PRIVATE_BOUNDS		3
+
+/* A call, as evaluated by the executor */
+typedef struct
+{
+	FzbKind		kind;
+	Oid			funcid;			/* the function, for the capture file */
+	ExprState  *arg;			/* the row-dependent argument */
+	ExprState  *query;			/* levenshtein: the other string */
+	ExprState  *limit;			/* max_d or the metaphone length */
+	Datum	   *values;			/* one per row of the batch */
+	bool	   *nulls;
+} FzbCall;
+
+typedef struct
+{
+	CustomScanState css;
+
+	/* the scan tuple: nvars table columns, then the calls */
+	int			nvars;
+	AttrNumber *attnos;
+	int			ncalls;
+	int			nqual_calls;
+	FzbCall    *calls;
+	FzbQual		plain_qual;
+	int			nfuzzy;
+	FzbQual    *fuzzy_quals;	/* one per condition, in order */
+	int		   *bounds;			/* the calls computed before each */
+
+	FzbScanDesc scan;
+	TupleTableSlot *heap_slot;
+	bool		scan_done;
+
+	/* the current batch */
+	int			batch_size;
+	TupleTableSlot **rows;
+	bool	   *keep;
+	int			nrows;
+	int			next;
+	MemoryContext batch_context;	/* the batch's call results */
+	MemoryContext scratch_context;	/* reset after every call */
+
+	/* for EXPLAIN ANALYZE */
+	int64		nbatches;
+} FuzzyBatchState;
+
+static set_rel_pathlist_hook_type prev_set_rel_pathlist_hook = NULL;
+
+static CustomPathMethods fzb_path_methods;
+static CustomScanMethods fzb_scan_methods;
+static CustomExecMethods fzb_exec_methods;
+
+typedef struct
+{
+	Index		rti;
+	List	   *calls;
+} FzbCollectContext;
+
+/*
+ * Which of our functions a function is, if any.  The catalog entry is
+ * checked before the symbol is resolved, so that no other library is ever
+ * loaded by this.
+ */
+static FzbKind
+fzb_function_kind(Oid funcid, int nargs)
+{
+	HeapTuple	tuple;
+	Form_pg_proc proc;
+	Datum		datum;
+	bool		isnull;
+	char	   *probin;
+	char	   *prosrc;
+	FzbKind		kind = FZB_NONE;
+	int			k;
+
+	tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid));
+	if (!HeapTupleIsValid(tuple))
+		return FZB_NONE;
+	proc = (Form_pg_proc) GETSTRUCT(tuple);
+	if (proc->prolang != ClanguageId || proc->proretset)
+	{
+		ReleaseSysCache(tuple);
+		return FZB_NONE;
+	}
+
+	datum = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_probin, &isnull);
+	probin = isnull ? NULL : TextDatumGetCString(datum);
+	datum = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_prosrc, &isnull);
+	prosrc = isnull ? NULL : TextDatumGetCString(datum);
+	ReleaseSysCache(tuple);
+	if (probin == NULL || prosrc == NULL ||
+		strstr(probin, "fuzzystrmatch") == NULL)
+		return FZB_NONE;
+
+	for (k = FZB_LEVENSHTEIN; k <= FZB_DMETAPHONE_ALT; k++)
+	{
+		if (strcmp(prosrc, fzb_functions[k].symbol) == 0 &&
+			nargs == fzb_functions[k].nargs &&
+			(void *) load_external_function(probin, prosrc, false, NULL) ==
+			(void *) fzb_addresses[k])
+		{
+			kind = (FzbKind) k;
+			break;
+		}
+	}
+	return kind;
+}
+
+static bool fzb_contains_call_walker(Node *node, void *context);
+
+/* Whether an argument is the same for every row */
+static bool
+fzb_row_invariant(Node *arg)
+{
+	return !contain_var_clause(arg) && !contain_volatile_functions(arg);
+}
+
+/*
+ * Whether an argument depends on the row in a way the node can evaluate:
+ * through ordinary columns of the scanned table only, and without volatile
+ * functions or calls the node would evaluate itself.
+ */
+static bool
+fzb_row_dependent(Node *arg, Index rti)
+{
+	List	   *vars;
+	ListCell   *lc;
+	bool		ok = true;
+
+	if (!contain_var_clause(arg) || contain_volatile_functions(arg) ||
+		fzb_contains_call_walker(arg, NULL))
+		return false;
+
+	vars = pull_var_clause(arg, PVC_INCLUDE_PLACEHOLDERS);
+	foreach(lc, vars)
+	{
+		Var		   *var = (Var *) lfirst(lc);
+
+		if (!IsA(var, Var) || var->varno != rti || var->varattno <= 0)
+			ok = false;
+	}
+	list_free(vars);
+	return ok;
+}
+
+/*
+ * If expr is a call the node can evaluate, return its kind, and its
+ * arguments with the row-dependent one first.
+ */
+static FzbKind
+fzb_call(Node *node, Index rti, List **args)
+{
+	FuncExpr   *func;
+	FzbKind		kind;
+	ListCell   *lc;
+
+	if (node == NULL || !IsA(node, FuncExpr))
+		return FZB_NONE;
+	func = (FuncExpr *) node;
+	if (func->funcretset)
+		return FZB_NONE;
+	kind = fzb_function_kind(func->funcid, list_length(func->args));
+	if (kind == FZB_NONE)
+		return FZB_NONE;
+
+	/* levenshtein is symmetric, so the row may be on either side */
+	if ((kind == FZB_LEVENSHTEIN || kind == FZB_LEVENSHTEIN_LESS_EQUAL) &&
+		!fzb_row_dependent((Node *) linitial(func->args), rti))
+		*args = list_concat(list_make2(lsecond(func->args),
+									   linitial(func->args)),
+							list_copy_tail(func->args, 2));
+	else
+		*args = list_copy(func->args);
+
+	if (!fzb_row_dependent((Node *) linitial(*args), rti))
+		return FZB_NONE;
+	foreach(lc, *args)
+	{
+		if (lc != list_head(*args) && !fzb_row_invariant((Node *) lfirst(lc)))
+			return FZB_NONE;
+	}
+	return kind;
+}
+
+static bool
+fzb_contains_call_walker(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+	if (IsA(node, FuncExpr) &&
+		fzb_function_kind(((FuncExpr *) node)->funcid,
+						  list_length(((FuncExpr *) node)->args)) != FZB_NONE)
+		return true;
+	return expression_tree_walker(node, fzb_contains_call_walker, context);
+}
+
+/*
+ * Whether evaluating node may skip some of its arguments, so that calls
+ * below it must be left to it
+ */
+static bool
+fzb_conditional(Node *node)
+{
+	return IsA(node, CaseExpr) || IsA(node, CoalesceExpr) ||
+		IsA(node, NullIfExpr) || IsA(node, MinMaxExpr) || IsA(node, BoolExpr);
+}
+
+/*
+ * Collect the distinct calls in an expression that the node can evaluate,
+ * other than those under a conditional expression
+ */
+static bool
+fzb_collect_walker(Node *node, FzbCollectContext *context)
+{
+	List	   *args;
+
+	if (node == NULL || fzb_conditional(node))
+		return false;
+	if (fzb_call(node, context->rti, &args) != FZB_NONE)
+	{
+		if (!list_member(context->calls, node))
+			context->calls = lappend(context->calls, node);
+		return false;
+	}
+	return expression_tree_walker(node, fzb_collect_walker, (void *) context);
+}
+
+static bool
+fzb_contains_expr_walker(Node *node, Node *expr)
+{
+	if (node == NULL)
+		return false;
+	if (equal(node, expr))
+		return true;
+	return expression_tree_walker(node, fzb_contains_expr_walker,
+								  (void *) expr);
+}
+
+/*
+ * Whether the final target list of the query will be computed by the scan
+ * of this relation, so that calls in it are worth batching.
+ */
+static bool
+fzb_scan_computes_tlist(PlannerInfo *root)
+{
+	Query	   *parse = root->parse;
+
+	return bms_membership(root->all_baserels) == BMS_SINGLETON &&
+		!parse->hasAggs && !parse->hasWindowFuncs &&
+		parse->groupClause == NIL && parse->groupingSets == NIL &&
+		parse->havingQual == NULL && parse->setOperations == NULL &&
+		!fzb_has_target_srfs(parse);
+}
+
+static bool
+fzb_plain_vars(List *exprs, Index rti)
+{
+	ListCell   *lc;
+
+	foreach(lc, exprs)
+	{
+		Var		   *var = (Var *) lfirst(lc);
+
+		if (!IsA(var, Var) || var->varno != rti || var->varattno <= 0 ||
+			var->varlevelsup != 0)
+			return false;
+	}
+	return true;
+}
+
+static void
+fzb_set_rel_pathlist(PlannerInfo *root, RelOptInfo *rel, Index rti,
+					 RangeTblEntry *rte)
+{
+	FzbCollectContext context;
+	List	   *vars;
+	List	   *quals = NIL;
+	ListCell   *lc;
+	Path	   *seqpath = NULL;
+	CustomPath *cpath;
+	int			nqual_calls;
+	Cost		saving;
+
+	if (prev_set_rel_pathlist_hook)
+		prev_set_rel_pathlist_hook(root, rel, rti, rte);
+
+	if (fuzzystrmatch_batch_size <= 0 ||
+		rel->reloptkind != RELOPT_BASEREL ||
+		rte->rtekind != RTE_RELATION || rte->inh ||
+		(rte->relkind != RELKIND_RELATION && rte->relkind != RELKIND_MATVIEW) ||
+		root->parse->commandType != CMD_SELECT || root->rowMarks != NIL)
+		return;
+
+	foreach(lc, rel->pathlist)
+	{
+		Path	   *path = (Path *) lfirst(lc);
+
+		if (path->pathtype == T_SeqScan && path->param_info == NULL &&
+			!path->parallel_aware)
+			seqpath = path;
+	}
+	if (seqpath == NULL || !fzb_plain_vars(rel->reltarget->exprs, rti))
+		return;
+
+	/* the calls the conditions need come first */
+	context.rti = rti;
+	context.calls = NIL;
+	foreach(lc, rel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+		if (rinfo->pseudoconstant)
+			continue;
+#if PG_VERSION_NUM >= 100000
+		if (rinfo->security_level > 0)
+			return;
+#endif
+		vars = pull_var_clause((Node *) rinfo->clause, PVC_INCLUDE_PLACEHOLDERS);
+		if (!fzb_plain_vars(vars, rti))
+			return;
+		fzb_collect_walker((Node *) rinfo->clause, &context);
+		quals = lappend(quals, rinfo->clause);
+	}
+	nqual_calls = list_length(context.calls);
+
+	/*
+	 * then those of the target list, except any the conditions only make
+	 * under a conditional expression: they would be computed after the
+	 * conditions that read them
+	 */
+	if (fzb_scan_computes_tlist(root))
+	{
+		FzbCollectContext tlist_context;
+
+		tlist_context.rti = rti;
+		tlist_context.calls = NIL;
+		fzb_collect_walker((Node *) root->parse->targetList, &tlist_context);
+		foreach(lc, tlist_context.calls)
+		{
+			Node	   *call = (Node *) lfirst(lc);
+
+			if (!list_member(context.calls, call) &&
+				!fzb_contains_expr_walker((Node *) quals, call))
+				context.calls = lappend(context.calls, call);
+		}
+	}
+	list_free(quals);
+	if (context.calls == NIL)
+		return;
+
+	/*
+	 * Batching saves most of the per-row overhead of each call, though not
+	 * the work of the call itself; count that as half an operator per call.
+	 */
+	saving = 0.5 * cpu_operator_cost * list_length(context.calls) *
+		Max(rel->tuples, 1.0);
+
+	cpath = makeNode(CustomPath);
+	cpath->path.pathtype = T_CustomScan;
+	cpath->path.parent = rel;
+	cpath->path.pathtarget = rel->reltarget;
+	cpath->path.param_info = NULL;
+	cpath->path.parallel_aware = false;
+	cpath->path.parallel_safe = false;
+	cpath->path.parallel_workers = 0;
+	cpath->path.rows = rel->rows;
+	cpath->path.startup_cost = seqpath->startup_cost;
+	cpath->path.total_cost = Max(seqpath->total_cost - saving,
+								 seqpath->startup_cost);
+	cpath->path.pathkeys = NIL;
+#if PG_VERSION_NUM >= 150000
+	cpath->flags = CUSTOMPATH_SUPPORT_PROJECTION;
+#else
+	cpath->flags = 0;
+#endif
+	cpath->custom_paths = NIL;
+	cpath->custom_private = lcons(makeInteger(nqual_calls), context.calls);
+	cpath->methods = &fzb_path_methods;
+
+	add_path(rel, &cpath->path);
+}
+
+static bool
+fzb_tlist_has(List *tlist, Node *expr)
+{
+	ListCell   *lc;
+
+	foreach(lc, tlist)
+	{
+		if (equal(((TargetEntry *) lfirst(lc))->expr, expr))
+			return true;
+	}
+	return false;
+}
+
+static Plan *
+fzb_plan_path(PlannerInfo *root, RelOptInfo *rel, CustomPath *best_path,
+			  List *tlist, List *clauses, List *custom_plans)
+{
+	CustomScan *cscan = makeNode(CustomScan);
+	int			npath_qual_calls = intVal(linitial(best_path->custom_private));
+	List	   *path_calls = list_copy_tail(best_path->custom_private, 1);
+	List	   *quals = extract_actual_clauses(clauses, false);
+	List	   *calls = NIL;
+	List	   *plain = NIL;
+	List	   *fuzzy = NIL;
+	List	   *bounds = NIL;
+	List	   *scan_tlist = NIL;
+	List	   *private;
+	List	   *vars;
+	ListCell   *lc;
+	int			i;
+
+	/*
+	 * The conditions come in the order a sequential scan would evaluate
+	 * them in.  Each call the conditions need is computed just before the
+	 * first that makes it directly, unless an earlier one makes it under a
+	 * conditional expression, in which case it is left to the expressions.
+	 */
+	foreach(lc, quals)
+	{
+		Node	   *qual = (Node *) lfirst(lc);
+		FzbCollectContext context;
+		ListCell   *call;
+
+		context.rti = rel->relid;
+		context.calls = NIL;
+		fzb_collect_walker(qual, &context);
+		foreach(call, context.calls)
+		{
+			if (!list_member(calls, lfirst(call)) &&
+				!fzb_contains_expr_walker((Node *) plain, lfirst(call)) &&
+				!fzb_contains_expr_walker((Node *) fuzzy, lfirst(call)))
+				calls = lappend(calls, lfirst(call));
+		}
+		list_free(context.calls);
+
+		if (fuzzy == NIL && calls == NIL)
+			plain = lappend(plain, qual);
+		else
+		{
+			fuzzy = lappend(fuzzy, qual);
+			bounds = lappend(bounds, makeInteger(list_length(calls)));
+		}
+	}
+
+	/* then the calls only the target list needs */
+	i = 0;
+	foreach(lc, path_calls)
+	{
+		if (i++ >= npath_qual_calls)
+			calls = lappend(calls, lfirst(lc));
+	}
+
+	/*
+	 * Every column the conditions, the calls or the relation's output read;
+	 * the latter rather than tlist, which is empty when a projection is
+	 * going to replace it.
+	 */
+	vars = pull_var_clause((Node *) list_make3(rel->reltarget->exprs,
+											   quals, calls),
+						   PVC_INCLUDE_PLACEHOLDERS);
+	foreach(lc, vars)
+	{
+		Node	   *var = (Node *) lfirst(lc);
+
+		if (!fzb_tlist_has(scan_tlist, var))
+			scan_tlist = lappend(scan_tlist,
+								 makeTargetEntry((Expr *) var,
+												 list_length(scan_tlist) + 1,
+												 NULL, false));
+	}
+
+	private = list_make3(makeInteger(list_length(plain)),
+						 makeInteger(list_length(fuzzy)),
+						 makeInteger(bounds == NIL ? 0 :
+									 intVal(llast(bounds))));
+	private = list_concat(private, bounds);
+	cscan->custom_exprs = list_concat(plain, fuzzy);
+	foreach(lc, calls)
+	{
+		List	   *args;
+		FzbKind		kind = fzb_call((Node *) lfirst(lc), rel->relid, &args);
+
+		Assert(kind != FZB_NONE);
+		private = lappend(private, makeInteger(kind));
+		cscan->custom_exprs = list_concat(cscan->custom_exprs, args);
+		scan_tlist = lappend(scan_tlist,
+							 makeTargetEntry((Expr *) lfirst(lc),
+											 list_length(scan_tlist) + 1,
+											 NULL, false));
+	}
+
+	cscan->scan.plan.targetlist = tlist;
+	cscan->scan.plan.qual = NIL;
+	cscan->scan.scanrelid = rel->relid;
+	cscan->flags = best_path->flags;
+	cscan->custom_plans = NIL;
+	cscan->custom_private = private;
+	cscan->custom_scan_tlist = scan_tlist;
+	cscan->methods = &fzb_scan_methods;
+
+	return &cscan->scan.plan;
+}
+
+static Node *
+fzb_create_state(CustomScan *cscan)
+{
+	FuzzyBatchState *state;
+
+	state = (FuzzyBatchState *) newNode(sizeof(FuzzyBatchState),
+										T_CustomScanState);
+	state->css.methods = &fzb_exec_methods;
+	return (Node *) state;
+}
+
+static void
+fzb_begin(CustomScanState *node, EState *estate, int eflags)
+{
+	FuzzyBatchState *state = (FuzzyBatchState *) node;
+	CustomScan *cscan = (CustomScan *) node->ss.ps.plan;
+	Relation	rel = node->ss.ss_currentRelation;
+	List	   *private = cscan->custom_private;
+	int			nplain = intVal(list_nth(private, FZB_PRIVATE_NPLAIN));
+	int			nfuzzy = intVal(list_nth(private, FZB_PRIVATE_NFUZZY));
+	int			kinds = FZB_PRIVATE_BOUNDS + nfuzzy;
+	ListCell   *expr;
+	ListCell   *lc;
+	List	   *plain = NIL;
+	int			i;
+
+	state->ncalls = list_length(private) - kinds;
+	state->nqual_calls = intVal(list_nth(private, FZB_PRIVATE_NQUAL_CALLS));
+	state->nvars = list_length(cscan->custom_scan_tlist) - state->ncalls;
+	state->batch_size = Max(fuzzystrmatch_batch_size, 1);
+
+	state->attnos = palloc(Max(state->nvars, 1) * sizeof(AttrNumber));
+	i = 0;
+	foreach(lc, cscan->custom_scan_tlist)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+		if (i < state->nvars)
+			state->attnos[i] = ((Var *) tle->expr)->varattno;
+		i++;
+	}
+
+	state->calls = palloc0(Max(state->ncalls, 1) * sizeof(FzbCall));
+	i = 0;
+	foreach(lc, cscan->custom_scan_tlist)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+		if (i >= state->nvars)
+			state->calls[i - state->nvars].funcid =
+				((FuncExpr *) tle->expr)->funcid;
+		i++;
+	}
+
+	state->nfuzzy = nfuzzy;
+	state->fuzzy_quals = palloc(Max(nfuzzy, 1) * sizeof(FzbQual));
+	state->bounds = palloc(Max(nfuzzy, 1) * sizeof(int));
+	expr = list_head(cscan->custom_exprs);
+	for (i = 0; i < nplain + nfuzzy; i++)
+	{
+		if (i < nplain)
+			plain = lappend(plain, lfirst(expr));
+		else
+		{
+			state->fuzzy_quals[i - nplain] =
+				fzb_init_qual(list_make1(lfirst(expr)), &node->ss.ps);
+			state->bounds[i - nplain] =
+				intVal(list_nth(private, FZB_PRIVATE_BOUNDS + i - nplain));
+		}
+		expr = fzb_lnext(cscan->custom_exprs, expr);
+	}
+	state->plain_qual = fzb_init_qual(plain, &node->ss.ps);
+
+	for (i = 0; i < state->ncalls; i++)
+	{
+		FzbCall    *call = &state->calls[i];
+		int			nargs;
+
+		call->kind = (FzbKind) intVal(list_nth(private, kinds + i));
+		nargs = fzb_functions[call->kind].nargs;
+		call->arg = ExecInitExpr((Expr *) lfirst(expr), &node->ss.ps);
+		expr = fzb_lnext(cscan->custom_exprs, expr);
+		if (call->kind == FZB_LEVENSHTEIN ||
+			call->kind == FZB_LEVENSHTEIN_LESS_EQUAL)
+		{
+			call->query = ExecInitExpr((Expr *) lfirst(expr), &node->ss.ps);
+			expr = fzb_lnext(cscan->custom_exprs, expr);
+			nargs--;
+		}
+		if (nargs > 1)
+		{
+			call->limit = ExecInitExpr((Expr *) lfirst(expr), &node->ss.ps);
+			expr = fzb_lnext(cscan->custom_exprs, expr);
+		}
+		call->values = palloc(state->batch_size * sizeof(Datum));
+		call->nulls = palloc(state->batch_size * sizeof(bool));
+	}
+
+	state->rows = palloc(state->batch_size * sizeof(TupleTableSlot *));
+	for (i = 0; i < state->batch_size; i++)
+		state->rows[i] = fzb_row_slot(rel);
+	state->keep = palloc(state->batch_size * sizeof(bool));
+	state->heap_slot = fzb_heap_slot(rel);
+	state->batch_context = AllocSetContextCreate(CurrentMemoryContext,
+												 "fuzzystrmatch batch scan",
+												 ALLOCSET_DEFAULT_MINSIZE,
+												 ALLOCSET_DEFAULT_INITSIZE,
+												 ALLOCSET_DEFAULT_MAXSIZE);
+	state->scratch_context = AllocSetContextCreate(CurrentMemoryContext,
+												   "fuzzystrmatch batch scratch",
+												   ALLOCSET_SMALL_MINSIZE,
+												   ALLOCSET_SMALL_INITSIZE,
+												   ALLOCSET_DEFAULT_MAXSIZE);
+
+	if (!(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+		state->scan = fzb_table_begin(rel, estate->es_snapshot);
+}
+
+#if PG_VERSION_NUM < 120000
+static bool
+fzb_table_getnext(FzbScanDesc scan, TupleTableSlot *slot)
+{
+	HeapTuple	tuple = heap_getnext(scan, ForwardScanDirection);
+
+	if (tuple == NULL)
+	{
+		ExecClearTuple(slot);
+		return false;
+	}
+	ExecStoreTuple(tuple, slot, scan->rs_cbuf, false);
+	return true;
+}
+#else
+#define fzb_table_getnext(scan, slot) \
+	table_scan_getnextslot((scan), ForwardScanDirection, (slot))
+#endif
+
+/*
+ * Make the scan tuple that of a row: its columns, and the first ncomputed
+ * calls' results for it (the rest are NULL).
+ */
+static TupleTableSlot *
+fzb_fill(FuzzyBatchState *state, TupleTableSlot *row, int r, int ncomputed)
+{
+	TupleTableSlot *slot = state->css.ss.ss_ScanTupleSlot;
+	int			i;
+
+	ExecClearTuple(slot);
+	for (i = 0; i < state->nvars; i++)
+		slot->tts_values[i] = slot_getattr(row, state->attnos[i],
+										   &slot->tts_isnull[i]);
+	for (i = 0; i < state->ncalls; i++)
+	{
+		if (i < ncomputed)
+		{
+			slot->tts_values[state->nvars + i] = state->calls[i].values[r];
+			slot->tts_isnull[state->nvars + i] = state->calls[i].nulls[r];
+		}
+		else
+		{
+			slot->tts_values[state->nvars + i] = (Datum) 0;
+			slot->tts_isnull[state->nvars + i] = true;
+		}
+	}
+	return ExecStoreVirtualTuple(slot);
+}
+
+/*
+ * Evaluate a row-invariant argument, returning false if it is NULL, which
+ * makes the (strict) call NULL for every row.
+ */
+static bool
+fzb_eval_invariant(FuzzyBatchState *state, ExprState *expr, Datum *value)
+{
+	bool		isnull;
+
+	*value = fzb_eval(expr, state->css.ss.ps.ps_ExprContext, &isnull);
+	return !isnull;
+}
+
+/*
+ * Write a sampled distance to the capture file.  The batch computed it
+ * along with the others, so it is computed again on its own here for the
+ * capture to time a single call.  The row's string comes first whichever
+ * side of the call it was on; with unit costs that gives the same distance.
+ */
+static void
+fzb_capture_distance(FzbCall *call, const char *q, int q_len,
+					 const char *str, int len, int max_d)
+{
+	FuzzyCaptureRecord rec;
+	instr_time	start;
+	int			result;
+
+	INSTR_TIME_SET_CURRENT(start);
+	levenshtein_batch_internal(q, q_len, &str, &len, 1, 1, 1, 1, max_d,
+							   &result);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.flags = call->kind == FZB_LEVENSHTEIN_LESS_EQUAL ?
+		FUZZY_CAPTURE_BOUNDED : 0;
+	rec.ins_c = 1;
+	rec.del_c = 1;
+	rec.sub_c = 1;
+	rec.trans_c = 0;
+	rec.max_d = max_d;
+	rec.result = result;
+	fuzzy_capture_write_function(call->funcid, &rec, str, len, q, q_len,
+								 start);
+}
+
+/* Compute call i for the rows of the batch that are still kept */
+static void
+fzb_compute(FuzzyBatchState *state, int i, int ncomputed)
+{
+	FzbCall    *call = &state->calls[i];
+	ExprContext *econtext = state->css.ss.ps.ps_ExprContext;
+	const char **strs = palloc(state->nrows * sizeof(char *));
+	int		   *lens = palloc(state->nrows * sizeof(int));
+	int		   *rownums = palloc(state->nrows * sizeof(int));
+	int		   *distances;
+	int			n = 0;
+	Datum		query = (Datum) 0;
+	Datum		limit = (Datum) 0;
+	bool		valid = true;
+	int			r;
+
+	for (r = 0; r < state->nrows; r++)
+		call->nulls[r] = true;
+
+	if (call->query != NULL && !fzb_eval_invariant(state, call->query, &query))
+		valid = false;
+	if (call->limit != NULL && !fzb_eval_invariant(state, call->limit, &limit))
+		valid = false;
+	if (!valid)
+		return;
+
+	/* the row-dependent argument of each row */
+	for (r = 0; r < state->nrows; r++)
+	{
+		Datum		value;
+		bool		isnull;
+		struct varlena *str;
+
+		if (!state->keep[r])
+			continue;
+		econtext->ecxt_scantuple = fzb_fill(state, state->rows[r], r,
+											ncomputed);
+		value = fzb_eval(call->arg, econtext, &isnull);
+		if (isnull)
+			continue;
+		str = pg_detoast_datum_packed((struct varlena *) DatumGetPointer(value));
+		strs[n] = VARDATA_ANY(str);
+		lens[n] = VARSIZE_ANY_EXHDR(str);
+		rownums[n] = r;
+		n++;
+	}
+
+	switch (call->kind)
+	{
+		case FZB_LEVENSHTEIN:
+		case FZB_LEVENSHTEIN_LESS_EQUAL:
+			{
+				struct varlena *q;
+				int			max_d = -1;
+
+				q = pg_detoast_datum_packed((struct varlena *) DatumGetPointer(query));
+				if (call->kind == FZB_LEVENSHTEIN_LESS_EQUAL)
+					max_d = DatumGetInt32(limit);
+				distances = palloc(Max(n, 1) * sizeof(int));
+				levenshtein_batch_internal(VARDATA_ANY(q), VARSIZE_ANY_EXHDR(q),
+										   (const char *const *) strs, lens,
+										   n, 1, 1, 1, max_d, distances);
+				for (r = 0; r < n; r++)
+				{
+					call->values[rownums[r]] = Int32GetDatum(distances[r]);
+					call->nulls[rownums[r]] = false;
+					if (fuzzy_capture_sampled())
+						fzb_capture_distance(call, VARDATA_ANY(q),
+											 VARSIZE_ANY_EXHDR(q),
+											 strs[r], lens[r], max_d);
+				}
+			}
+			break;
+		default:
+			for (r = 0; r < n; r++)
+			{
+				MemoryContext oldcontext;
+				char		code[Max(SOUNDEX_LEN, DMETAPHONE_CODE_LEN) + 1];
+				char		alternate[DMETAPHONE_CODE_LEN + 1];
+				char	   *result = code;
+				text	   *value;
+				bool		sampled;
+				instr_time	start;
+
+				if ((r & 1023) == 0)
+					CHECK_FOR_INTERRUPTS();
+
+				/* the capture file only knows soundex among these */
+				sampled = call->kind == FZB_SOUNDEX && fuzzy_capture_sampled();
+				if (sampled)
+					INSTR_TIME_SET_CURRENT(start);
+				else
+					INSTR_TIME_SET_ZERO(start);
+				oldcontext = MemoryContextSwitchTo(state->scratch_context);
+				switch (call->kind)
+				{
+					case FZB_SOUNDEX:
+						_soundex(pnstrdup(strs[r], lens[r]), code);
+						break;
+					case FZB_METAPHONE:
+						result = metaphone_internal(strs[r], lens[r],
+													DatumGetInt32(limit));
+						break;
+					case FZB_DMETAPHONE:
+					case FZB_DMETAPHONE_ALT:
+						dmetaphone_codes(pnstrdup(strs[r], lens[r]),
+										 code, alternate);
+						if (call->kind == FZB_DMETAPHONE_ALT)
+							result = alternate;
+						break;
+					default:
+						elog(ERROR, "unrecognized fuzzystrmatch call kind %d",
+							 (int) call->kind);
+				}
+				MemoryContextSwitchTo(oldcontext);
+
+				if (sampled)
+				{
+					FuzzyCaptureRecord rec;
+
+					memset(&rec, 0, sizeof(rec));
+					rec.max_d = -1;
+					fuzzy_capture_write_function(call->funcid, &rec,
+												 strs[r], lens[r],
+												 NULL, 0, start);
+				}
+
+				value = cstring_to_text(result);
+				call->values[rownums[r]] = PointerGetDatum(value);
+				call->nulls[rownums[r]] = false;
+				MemoryContextReset(state->scratch_context);
+			}
+			break;
+	}
+}
+
+/* Read and evaluate the next batch; returns false at the end of the table */
+static bool
+fzb_next_batch(FuzzyBatchState *state)
+{
+	ExprContext *econtext = state->css.ss.ps.ps_ExprContext;
+	MemoryContext oldcontext;
+	int			computed = 0;
+	int			i;
+	int			r;
+
+	state->nrows = 0;
+	state->next = 0;
+	MemoryContextReset(state->batch_context);
+
+	/* rows passing the conditions before the first that reads a call */
+	while (state->nrows < state->batch_size && !state->scan_done)
+	{
+		if (!fzb_table_getnext(state->scan, state->heap_slot))
+		{
+			state->scan_done = true;
+			break;
+		}
+		econtext->ecxt_scantuple = fzb_fill(state, state->heap_slot, 0, 0);
+		if (!fzb_qual(state->plain_qual, econtext))
+		{
+			InstrCountFiltered1(state, 1);
+			ResetExprContext(econtext);
+			continue;
+		}
+		ResetExprContext(econtext);
+		ExecCopySlot(state->rows[state->nrows], state->heap_slot);
+		state->keep[state->nrows] = true;
+		state->nrows++;
+	}
+	if (state->nrows == 0)
+		return false;
+	state->nbatches++;
+
+	oldcontext = MemoryContextSwitchTo(state->batch_context);
+
+	/*
+	 * the other conditions one at a time, each after the calls it is the
+	 * first to need, for the rows the earlier ones left
+	 */
+	for (i = 0; i < state->nfuzzy; i++)
+	{
+		for (; computed < state->bounds[i]; computed++)
+			fzb_compute(state, computed, computed);
+		for (r = 0; r < state->nrows; r++)
+		{
+			if (!state->keep[r])
+				continue;
+			econtext->ecxt_scantuple = fzb_fill(state, state->rows[r], r,
+												computed);
+			if (!fzb_qual(state->fuzzy_quals[i], econtext))
+			{
+				InstrCountFiltered1(state, 1);
+				state->keep[r] = false;
+			}
+		}
+	}
+
+	/* then the calls only the target list needs, for the rows left */
+	for (i = state->nqual_calls; i < state->ncalls; i++)
+		fzb_compute(state, i, i);
+
+	MemoryContextSwitchTo(oldcontext);
+	return true;
+}
+
+static TupleTableSlot *
+fzb_access(ScanState *ss)
+{
+	FuzzyBatchState *state = (FuzzyBatchState *) ss;
+
+	for (;;)
+	{
+		while (state->next < state->nrows)
+		{
+			int			r = state->next++;
+
+			if (state->keep[r])
+				return fzb_fill(state, state->rows[r], r, state->ncalls);
+		}
+		if (!fzb_next_batch(state))
+			return ExecClearTuple(ss->ss_ScanTupleSlot);
+	}
+}
+
+/* rows are only ever locked by other plan nodes, so there is no recheck */
+static bool
+fzb_recheck(ScanState *ss, TupleTableSlot *slot)
+{
+	return true;
+}
+
+static TupleTableSlot *
+fzb_exec(CustomScanState *node)
+{
+	return ExecScan(&node->ss, (ExecScanAccessMtd) fzb_access,
+					(ExecScanRecheckMtd) fzb_recheck);
+}
+
+static void
+fzb_end(CustomScanState *node)
+{
+	FuzzyBatchState *state = (FuzzyBatchState *) node;
+	int			i;
+
+	if (state->scan != NULL)
+		fzb_table_end(state->scan);
+	for (i = 0; i < state->batch_size; i++)
+		ExecDropSingleTupleTableSlot(state->rows[i]);
+	ExecDropSingleTupleTableSlot(state->heap_slot);
+	MemoryContextDelete(state->batch_context);
+	MemoryContextDelete(state->scratch_context);
+}
+
+static void
+fzb_rescan_node(CustomScanState *node)
+{
+	FuzzyBatchState *state = (FuzzyBatchState *) node;
+
+	ExecScanReScan(&node->ss);
+	if (state->scan != NULL)
+		fzb_table_rescan(state->scan);
+	state->scan_done = false;
+	state->nrows = 0;
+	state->next = 0;
+}
+
+static void
+fzb_explain(CustomScanState *node, List *ancestors, ExplainState *es)
+{
+	FuzzyBatchState *state = (FuzzyBatchState *) node;
+
+	fzb_explain_int("Batched Calls", state->ncalls, es);
+	fzb_explain_int("Batch Size", state->batch_size, es);
+	if (es->analyze)
+		fzb_explain_int("Batches", state->nbatches, es);
+}
+
+void
+fuzzystrmatch_batch_init(void)
+{
+	DefineCustomIntVariable("fuzzystrmatch.batch_size",
+	   "Rows per batch in which fuzzystrmatch calls in scans are evaluated.",
+							"0 turns batching off.",
+							&fuzzystrmatch_batch_size,
+							FZB_DEFAULT_BATCH_SIZE,
+							0,
+							FZB_MAX_BATCH_SIZE,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	fzb_path_methods.CustomName = "FuzzyBatchScan";
+	fzb_path_methods.PlanCustomPath = fzb_plan_path;
+
+	fzb_scan_methods.CustomName = "FuzzyBatchScan";
+	fzb_scan_methods.CreateCustomScanState = fzb_create_state;
+	RegisterCustomScanMethods(&fzb_scan_methods);
+
+	fzb_exec_methods.CustomName = "FuzzyBatchScan";
+	fzb_exec_methods.BeginCustomScan = fzb_begin;
+	fzb_exec_methods.ExecCustomScan = fzb_exec;
+	fzb_exec_methods.EndCustomScan = fzb_end;
+	fzb_exec_methods.ReScanCustomScan = fzb_rescan_node;
+	fzb_exec_methods.ExplainCustomScan = fzb_explain;
+
+	prev_set_rel_pathlist_hook = set_rel_pathlist_hook;
+	set_rel_pathlist_hook = fzb_set_rel_pathlist;
+}
+
+#else							/* PG_VERSION_NUM < 90600 */
+
+/* custom scans can't be planned before 9.6; there is nothing to set up */
+void
+fuzzystrmatch_batch_init(void)
+{
+}
+
+#endif   /* PG_VERSION_NUM >= 90600 */
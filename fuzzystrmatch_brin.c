@@ -0,0 +1,368 @@
+/*
+ * fuzzystrmatch_brin.c
+ *
+ * Phonetic match operators, and a BRIN operator class summarizing each
+ * block range by a bloom filter of phonetic codes.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_brin.c
+ *
+ * "a #= b" is soundex(a) = soundex(b), and "a ##= b" holds when a primary
+ * or alternate Double Metaphone code of a equals one of b's (empty codes
+ * never match).  A btree on soundex(col) or dmetaphone(col) answers such
+ * searches exactly but is a sizeable fraction of the table; on a large,
+ * append-only table brin_phonetic_bloom_ops answers them from a summary of
+ * one bloom filter per block range instead.
+ *
+ * Each value added to a range puts its soundex code and both of its Double
+ * Metaphone codes into the range's filter, each tagged with its encoder so
+ * that codes of different encoders never collide.  A search computes the
+ * query's codes the same way and skips every range whose filter lacks them
+ * all; the heap rows of the remaining ranges are rechecked with the
+ * operator, so false positives cost time but never wrong answers.
+ *
+ * The filter has a fixed FPB_BITS bits, set by FPB_HASHES hashes per code.
+ * Its false positive rate grows with the number of distinct codes in a
+ * range, which is what pages_per_range controls; with the default of 128
+ * pages a range holds a few thousand codes and the filter stays selective.
+ *
+ * BRIN first appeared in 9.5; on older servers only the operators exist.
+ */
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 90500
+#include "access/brin_internal.h"
+#include "access/brin_tuple.h"
+#endif
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#include "access/skey.h"
+#include "catalog/pg_type.h"
+#include "fuzzystrmatch.h"
+#include "utils/builtins.h"
+#include "utils/typcache.h"
+
+#include "soundex.c"
+
+#define FPB_SOUNDEX_STRATEGY	1	/* #= */
+#define FPB_DMETAPHONE_STRATEGY 2	/* ##= */
+
+/* size of a range's filter; it must fit in a BRIN tuple on one page */
+#define FPB_BITS				32768
+#define FPB_BYTES				(FPB_BITS / 8)
+#define FPB_HASHES				4
+
+/* tags of the codes in the filter */
+#define FPB_TAG_SOUNDEX			'S'
+#define FPB_TAG_DMETAPHONE		'D'
+
+/* the codes a string is summarized and searched by */
+typedef struct
+{
+	char		soundex[SOUNDEX_LEN + 1];
+	char		primary[DMETAPHONE_CODE_LEN + 1];
+	char		alternate[DMETAPHONE_CODE_LEN + 1];
+} FpbCodes;
+
+extern Datum soundex_match(PG_FUNCTION_ARGS);
+extern Datum dmetaphone_match(PG_FUNCTION_ARGS);
+
+static void
+fpb_codes(text *t, FpbCodes *codes)
+{
+	char	   *str = text_to_cstring(t);
+
+	_soundex(str, codes->soundex);
+	dmetaphone_codes(str, codes->primary, codes->alternate);
+	pfree(str);
+}
+
+/* Does one of a's nonempty Double Metaphone codes equal one of b's? */
+static bool
+fpb_dmetaphone_match(const FpbCodes *a, const FpbCodes *b)
+{
+	const char *ac[2] = {a->primary, a->alternate};
+	const char *bc[2] = {b->primary, b->alternate};
+	int			i,
+				j;
+
+	for (i = 0; i < 2; i++)
+	{
+		if (ac[i][0] == '\0')
+			continue;
+		for (j = 0; j < 2; j++)
+		{
+			if (strcmp(ac[i], bc[j]) == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * soundex_match(a, b): the function behind #=, true when the soundex codes
+ * are equal
+ */
+PG_FUNCTION_INFO_V1(soundex_match);
+Datum
+soundex_match(PG_FUNCTION_ARGS)
+{
+	char	   *a = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char	   *b = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char		acode[SOUNDEX_LEN + 1];
+	char		bcode[SOUNDEX_LEN + 1];
+
+	_soundex(a, acode);
+	_soundex(b, bcode);
+	PG_RETURN_BOOL(strcmp(acode, bcode) == 0);
+}
+
+/*
+ * dmetaphone_match(a, b): the function behind ##=, true when some primary
+ * or alternate code of a equals one of b
+ */
+PG_FUNCTION_INFO_V1(dmetaphone_match);
+Datum
+dmetaphone_match(PG_FUNCTION_ARGS)
+{
+	FpbCodes	a;
+	FpbCodes	b;
+
+	fpb_codes(PG_GETARG_TEXT_PP(0), &a);
+	fpb_codes(PG_GETARG_TEXT_PP(1), &b);
+	PG_RETURN_BOOL(fpb_dmetaphone_match(&a, &b));
+}
+
+#if PG_VERSION_NUM >= 90500
+
+extern Datum bfuzzy_opcinfo(PG_FUNCTION_ARGS);
+extern Datum bfuzzy_add_value(PG_FUNCTION_ARGS);
+extern Datum bfuzzy_consistent(PG_FUNCTION_ARGS);
+extern Datum bfuzzy_union(PG_FUNCTION_ARGS);
+
+/*
+ * The FPB_HASHES bit positions of a tagged code, by double hashing.
+ */
+static void
+fpb_positions(char tag, const char *code, uint32 *positions)
+{
+	char		key[1 + Max(SOUNDEX_LEN, DMETAPHONE_CODE_LEN)];
+	int			len = strlen(code);
+	uint32		h1;
+	uint32		h2;
+	int			i;
+
+	key[0] = tag;
+	memcpy(key + 1, code, len);
+	h1 = DatumGetUInt32(hash_any((const unsigned char *) key, len + 1));
+	h2 = DatumGetUInt32(hash_uint32(h1)) | 1;
+	for (i = 0; i < FPB_HASHES; i++)
+		positions[i] = (h1 + i * h2) % FPB_BITS;
+}
+
+static bool
+fpb_test(const uint8 *bits, char tag, const char *code)
+{
+	uint32		positions[FPB_HASHES];
+	int			i;
+
+	fpb_positions(tag, code, positions);
+	for (i = 0; i < FPB_HASHES; i++)
+	{
+		if (!(bits[positions[i] >> 3] & (1 << (positions[i] & 7))))
+			return false;
+	}
+	return true;
+}
+
+static void
+fpb_set(uint8 *bits, char tag, const char *code)
+{
+	uint32		positions[FPB_HASHES];
+	int			i;
+
+	fpb_positions(tag, code, positions);
+	for (i = 0; i < FPB_HASHES; i++)
+		bits[positions[i] >> 3] |= (uint8) (1 << (positions[i] & 7));
+}
+
+/* Would adding these codes change the filter? */
+static bool
+fpb_missing(const uint8 *bits, const FpbCodes *codes)
+{
+	return !fpb_test(bits, FPB_TAG_SOUNDEX, codes->soundex) ||
+		!fpb_test(bits, FPB_TAG_DMETAPHONE, codes->primary) ||
+		!fpb_test(bits, FPB_TAG_DMETAPHONE, codes->alternate);
+}
+
+static bytea *
+fpb_new_filter(const uint8 *copy_from)
+{
+	bytea	   *filter = palloc(VARHDRSZ + FPB_BYTES);
+
+	SET_VARSIZE(filter, VARHDRSZ + FPB_BYTES);
+	if (copy_from)
+		memcpy(VARDATA(filter), copy_from, FPB_BYTES);
+	else
+		memset(VARDATA(filter), 0, FPB_BYTES);
+	return filter;
+}
+
+/* The bits of a stored filter, detoasted if need be */
+static const uint8 *
+fpb_bits(Datum d)
+{
+	bytea	   *filter = DatumGetByteaPP(d);
+
+	if (VARSIZE_ANY_EXHDR(filter) != FPB_BYTES)
+		elog(ERROR, "invalid phonetic bloom filter");
+	return (const uint8 *) VARDATA_ANY(filter);
+}
+
+PG_FUNCTION_INFO_V1(bfuzzy_opcinfo);
+Datum
+bfuzzy_opcinfo(PG_FUNCTION_ARGS)
+{
+	BrinOpcInfo *result;
+
+	result = palloc0(MAXALIGN(SizeofBrinOpcInfo(1)));
+	result->oi_nstored = 1;
+#if PG_VERSION_NUM >= 140000
+	result->oi_regular_nulls = true;
+#endif
+	result->oi_opaque = NULL;
+	result->oi_typcache[0] = lookup_type_cache(BYTEAOID, 0);
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * Add a value to a range's summary; returns true if the summary changed.
+ * A filter is only copied when the value brings a code it lacks, which
+ * after the first few rows of a range is rare.
+ */
+PG_FUNCTION_INFO_V1(bfuzzy_add_value);
+Datum
+bfuzzy_add_value(PG_FUNCTION_ARGS)
+{
+	BrinValues *column = (BrinValues *) PG_GETARG_POINTER(1);
+	Datum		newval = PG_GETARG_DATUM(2);
+	bool		isnull = PG_GETARG_BOOL(3);
+	FpbCodes	codes;
+	bytea	   *filter;
+
+	/* before 14, nulls are ours to track */
+	if (isnull)
+	{
+		if (column->bv_hasnulls)
+			PG_RETURN_BOOL(false);
+		column->bv_hasnulls = true;
+		PG_RETURN_BOOL(true);
+	}
+
+	fpb_codes(DatumGetTextPP(newval), &codes);
+
+	if (column->bv_allnulls)
+		filter = fpb_new_filter(NULL);
+	else
+	{
+		const uint8 *bits = fpb_bits(column->bv_values[0]);
+
+		if (!fpb_missing(bits, &codes))
+			PG_RETURN_BOOL(false);
+		filter = fpb_new_filter(bits);
+		pfree(DatumGetPointer(column->bv_values[0]));
+	}
+
+	fpb_set((uint8 *) VARDATA(filter), FPB_TAG_SOUNDEX, codes.soundex);
+	fpb_set((uint8 *) VARDATA(filter), FPB_TAG_DMETAPHONE, codes.primary);
+	fpb_set((uint8 *) VARDATA(filter), FPB_TAG_DMETAPHONE, codes.alternate);
+	column->bv_values[0] = PointerGetDatum(filter);
+	column->bv_allnulls = false;
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Could the range hold a value matching the scan key?
+ */
+PG_FUNCTION_INFO_V1(bfuzzy_consistent);
+Datum
+bfuzzy_consistent(PG_FUNCTION_ARGS)
+{
+	BrinValues *column = (BrinValues *) PG_GETARG_POINTER(1);
+	ScanKey		key = (ScanKey) PG_GETARG_POINTER(2);
+	const uint8 *bits;
+	FpbCodes	codes;
+
+	/* before 14, IS [NOT] NULL keys and all-null ranges come to us */
+	if (key->sk_flags & SK_ISNULL)
+	{
+		if (key->sk_flags & SK_SEARCHNULL)
+			PG_RETURN_BOOL(column->bv_allnulls || column->bv_hasnulls);
+		if (key->sk_flags & SK_SEARCHNOTNULL)
+			PG_RETURN_BOOL(!column->bv_allnulls);
+		PG_RETURN_BOOL(false);
+	}
+	if (column->bv_allnulls)
+		PG_RETURN_BOOL(false);
+
+	bits = fpb_bits(column->bv_values[0]);
+	fpb_codes(DatumGetTextPP(key->sk_argument), &codes);
+
+	switch (key->sk_strategy)
+	{
+		case FPB_SOUNDEX_STRATEGY:
+			PG_RETURN_BOOL(fpb_test(bits, FPB_TAG_SOUNDEX, codes.soundex));
+		case FPB_DMETAPHONE_STRATEGY:
+			PG_RETURN_BOOL((codes.primary[0] != '\0' &&
+							fpb_test(bits, FPB_TAG_DMETAPHONE, codes.primary)) ||
+						   (codes.alternate[0] != '\0' &&
+							fpb_test(bits, FPB_TAG_DMETAPHONE, codes.alternate)));
+		default:
+			elog(ERROR, "unrecognized strategy number: %d", key->sk_strategy);
+	}
+	PG_RETURN_BOOL(false);		/* keep compiler quiet */
+}
+
+/*
+ * Merge the summary of range b into that of range a.
+ */
+PG_FUNCTION_INFO_V1(bfuzzy_union);
+Datum
+bfuzzy_union(PG_FUNCTION_ARGS)
+{
+	BrinValues *col_a = (BrinValues *) PG_GETARG_POINTER(1);
+	BrinValues *col_b = (BrinValues *) PG_GETARG_POINTER(2);
+	const uint8 *bits_b;
+	bytea	   *filter;
+	uint8	   *bits;
+	int			i;
+
+	col_a->bv_hasnulls |= col_b->bv_hasnulls;
+	if (col_b->bv_allnulls)
+		PG_RETURN_VOID();
+
+	bits_b = fpb_bits(col_b->bv_values[0]);
+	if (col_a->bv_allnulls)
+	{
+		col_a->bv_values[0] = PointerGetDatum(fpb_new_filter(bits_b));
+		col_a->bv_allnulls = false;
+		PG_RETURN_VOID();
+	}
+
+	filter = fpb_new_filter(fpb_bits(col_a->bv_values[0]));
+	bits = (uint8 *) VARDATA(filter);
+	for (i = 0; i < FPB_BYTES; i++)
+		bits[i] |= bits_b[i];
+	pfree(DatumGetPointer(col_a->bv_values[0]));
+	col_a->bv_values[0] = PointerGetDatum(filter);
+
+	PG_RETURN_VOID();
+}
+
+#endif   /* PG_VERSION_NUM >= 90500 */
@@ -0,0 +1,103 @@
+/*
+ * fuzzystrmatch_builddict.c
+ *
+ * Compile a word list into a fuzzy dictionary image (see fuzzydict.h),
+ * which fuzzystrmatchd and fuzzy_dict_load() can then map straight into
+ * memory instead of rebuilding their indexes from the word list.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_builddict.c
+ *
+ * Usage: fuzzystrmatch_builddict [-g GENERATION] WORDFILE OUTPUT
+ *
+ * The word file holds one entry per line, in UTF-8.  The image is written
+ * to a temporary file next to OUTPUT and renamed into place, so processes
+ * that have the previous version mapped keep a consistent view of it.
+ */
+#define FZS_STANDALONE_IMPLEMENTATION
+#include "fuzzystrmatch_standalone.h"
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dmetaphone.c"
+#include "fuzzydict.c"
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: fuzzystrmatch_builddict [-g GENERATION] WORDFILE OUTPUT\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64		generation = (uint64) time(NULL);
+	char	  **words;
+	int			nwords;
+	int			skipped_tabs;
+	int			skipped_long;
+	char	   *image;
+	uint64		size;
+	char	   *tmp_path;
+	FILE	   *fp;
+	int			opt;
+
+	while ((opt = getopt(argc, argv, "g:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'g':
+				generation = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+
+	words = fzd_read_words(argv[optind], &nwords, &skipped_tabs);
+	image = fzd_build_image(words, nwords, "UTF8", generation, &size,
+							&skipped_long);
+
+	tmp_path = fzd_malloc(strlen(argv[optind + 1]) + 16);
+	sprintf(tmp_path, "%s.tmp.%d", argv[optind + 1], (int) getpid());
+	fp = fopen(tmp_path, "wb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "fuzzystrmatch_builddict: could not create \"%s\": %s\n",
+				tmp_path, strerror(errno));
+		exit(1);
+	}
+	if (fwrite(image, 1, size, fp) != size || fflush(fp) != 0 ||
+		fsync(fileno(fp)) != 0 || fclose(fp) != 0)
+	{
+		fprintf(stderr, "fuzzystrmatch_builddict: could not write \"%s\": %s\n",
+				tmp_path, strerror(errno));
+		unlink(tmp_path);
+		exit(1);
+	}
+	if (rename(tmp_path, argv[optind + 1]) != 0)
+	{
+		fprintf(stderr, "fuzzystrmatch_builddict: could not rename \"%s\" to \"%s\": %s\n",
+				tmp_path, argv[optind + 1], strerror(errno));
+		unlink(tmp_path);
+		exit(1);
+	}
+
+	printf("%u entries, %u trie nodes, %llu bytes",
+		   ((FuzzyDictHeader *) image)->nwords,
+		   ((FuzzyDictHeader *) image)->ntrie_nodes,
+		   (unsigned long long) size);
+	if (skipped_tabs + skipped_long > 0)
+		printf(" (skipped %d entries longer than %d characters or containing tabs)",
+			   skipped_tabs + skipped_long, FZD_MAX_CHARS);
+	printf("\n");
+
+	fzd_free_image(image);
+	fzd_free_words(words, nwords);
+	return 0;
+}
@@ -0,0 +1,436 @@
+/*
+ * fuzzystrmatch_cache.c
+ *
+ * Shared-memory cache of fuzzy search results.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_cache.c
+ *
+ * Popular misspellings are looked up over and over by different backends.
+ * When fuzzystrmatch is in shared_preload_libraries and
+ * fuzzystrmatch.cache_entries is set, a fixed number of result slots is
+ * kept in shared memory; fuzzydict.c asks here before searching, and stores
+ * what it found afterwards.  Keys and values are opaque byte strings to this
+ * file.  The caller puts everything the result depends on into the key,
+ * including the version of the dictionary and of its pending changes, so a
+ * changed dictionary simply stops matching its old entries, which then age
+ * out.
+ *
+ * The cache is set-associative: a key's hash picks a set of FZC_WAYS slots,
+ * and replacement within a set is by the clock algorithm, which approximates
+ * LRU using a reference bit that every hit sets.
+ *
+ * Lookups take no lock.  Each slot carries a sequence number which a writer
+ * makes odd before it changes the slot and even again afterwards, so a
+ * reader copies the slot and then checks that the number was even and is
+ * unchanged; if not, it just treats the slot as a miss.  Writers only hold
+ * their set's spinlock while choosing a victim and marking it odd, not while
+ * copying.  Hit statistics are kept in several stripes with their own
+ * spinlocks, so backends counting at the same time seldom meet.
+ */
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#include "access/htup_details.h"
+#include "fuzzystrmatch.h"
+#include "miscadmin.h"
+#include "storage/barrier.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+
+/* slots per set */
+#define FZC_WAYS				8
+
+/* statistics stripes */
+#define FZC_STAT_STRIPES		16
+
+typedef struct FzcSlot
+{
+	volatile uint32 seq;		/* odd while the slot is being written */
+	volatile bool used;			/* clock reference bit */
+	uint32		hash;
+	uint16		key_len;		/* 0 if the slot is empty */
+	uint16		value_len;
+	char		key[FUZZY_CACHE_KEY_MAX];
+	char		value[FUZZY_CACHE_VALUE_MAX];
+} FzcSlot;
+
+typedef struct FzcSet
+{
+	slock_t		mutex;			/* protects hand, and making slots odd */
+	int			hand;
+} FzcSet;
+
+typedef struct FzcStats
+{
+	slock_t		mutex;
+	uint64		hits;
+	uint64		misses;
+	uint64		inserts;
+	uint64		evictions;
+} FzcStats;
+
+typedef struct FzcShared
+{
+	int			nsets;
+	FzcStats	stats[FZC_STAT_STRIPES];
+	FzcSet		sets[1];		/* VARIABLE LENGTH; then the slots */
+} FzcShared;
+
+int			fuzzystrmatch_cache_entries = 0;
+
+static FzcShared *fzc = NULL;
+static FzcSlot *fzc_slots = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+extern Datum fuzzy_cache_stats(PG_FUNCTION_ARGS);
+extern Datum fuzzy_cache_reset(PG_FUNCTION_ARGS);
+
+static int
+fzc_nsets(void)
+{
+	return (fuzzystrmatch_cache_entries + FZC_WAYS - 1) / FZC_WAYS;
+}
+
+static Size
+fzc_sets_size(int nsets)
+{
+	return MAXALIGN(add_size(offsetof(FzcShared, sets),
+							 mul_size(nsets, sizeof(FzcSet))));
+}
+
+static Size
+fzc_shmem_size(void)
+{
+	int			nsets = fzc_nsets();
+
+	return add_size(fzc_sets_size(nsets),
+					mul_size(mul_size(nsets, FZC_WAYS), sizeof(FzcSlot)));
+}
+
+static void
+fzc_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	fzc = ShmemInitStruct("fuzzystrmatch result cache", fzc_shmem_size(),
+						  &found);
+	fzc_slots = (FzcSlot *) ((char *) fzc + fzc_sets_size(fzc_nsets()));
+	if (!found)
+	{
+		int			i;
+
+		memset(fzc, 0, fzc_shmem_size());
+		fzc->nsets = fzc_nsets();
+		for (i = 0; i < fzc->nsets; i++)
+			SpinLockInit(&fzc->sets[i].mutex);
+		for (i = 0; i < FZC_STAT_STRIPES; i++)
+			SpinLockInit(&fzc->stats[i].mutex);
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+fzc_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+	RequestAddinShmemSpace(fzc_shmem_size());
+}
+#endif
+
+void
+fuzzystrmatch_cache_init(void)
+{
+	DefineCustomIntVariable("fuzzystrmatch.cache_entries",
+		   "Number of fuzzy search results kept in the shared result cache.",
+				  "Only takes effect with fuzzystrmatch in shared_preload_libraries.",
+							&fuzzystrmatch_cache_entries,
+							0,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	if (!process_shared_preload_libraries_in_progress ||
+		fuzzystrmatch_cache_entries == 0)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = fzc_shmem_request;
+#else
+	RequestAddinShmemSpace(fzc_shmem_size());
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = fzc_shmem_startup;
+}
+
+static void
+fzc_count(uint64 hits, uint64 misses, uint64 inserts, uint64 evictions)
+{
+	FzcStats   *stats = &fzc->stats[MyProcPid % FZC_STAT_STRIPES];
+
+	SpinLockAcquire(&stats->mutex);
+	stats->hits += hits;
+	stats->misses += misses;
+	stats->inserts += inserts;
+	stats->evictions += evictions;
+	SpinLockRelease(&stats->mutex);
+}
+
+/* Whether there is a cache to use, so callers can skip building keys */
+bool
+fuzzy_cache_enabled(void)
+{
+	return fzc != NULL;
+}
+
+static inline FzcSlot *
+fzc_set_slots(int set)
+{
+	return fzc_slots + (Size) set * FZC_WAYS;
+}
+
+/*
+ * Look a key up, returning its value in *value.  Returns false if it's not
+ * there, or if the cache isn't enabled.
+ */
+bool
+fuzzy_cache_get(const char *key, int key_len, StringInfo value)
+{
+	uint32		hash;
+	FzcSlot    *slots;
+	int			i;
+
+	if (fzc == NULL || key_len <= 0 || key_len > FUZZY_CACHE_KEY_MAX)
+		return false;
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) key, key_len));
+	slots = fzc_set_slots(hash % fzc->nsets);
+	for (i = 0; i < FZC_WAYS; i++)
+	{
+		FzcSlot    *slot = &slots[i];
+		uint32		seq = slot->seq;
+		int			value_len;
+
+		pg_read_barrier();
+		if ((seq & 1) != 0 || slot->hash != hash ||
+			slot->key_len != key_len ||
+			memcmp(slot->key, key, key_len) != 0)
+			continue;
+		value_len = slot->value_len;
+		if (value_len > FUZZY_CACHE_VALUE_MAX)
+			continue;
+		resetStringInfo(value);
+		appendBinaryStringInfo(value, slot->value, value_len);
+		pg_read_barrier();
+		if (slot->seq != seq)
+			continue;
+
+		slot->used = true;
+		fzc_count(1, 0, 0, 0);
+		return true;
+	}
+
+	fzc_count(0, 1, 0, 0);
+	return false;
+}
+
+/*
+ * Store a value under a key, unless the cache isn't enabled or either is
+ * too long for a slot.
+ */
+void
+fuzzy_cache_put(const char *key, int key_len, const char *value, int value_len)
+{
+	uint32		hash;
+	FzcSet	   *set;
+	FzcSlot    *slots;
+	FzcSlot    *victim = NULL;
+	bool		evicted = false;
+	int			i;
+
+	if (fzc == NULL || key_len <= 0 || key_len > FUZZY_CACHE_KEY_MAX ||
+		value_len > FUZZY_CACHE_VALUE_MAX)
+		return;
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) key, key_len));
+	set = &fzc->sets[hash % fzc->nsets];
+	slots = fzc_set_slots(hash % fzc->nsets);
+
+	SpinLockAcquire(&set->mutex);
+	for (i = 0; i < FZC_WAYS; i++)
+	{
+		FzcSlot    *slot = &slots[i];
+
+		if ((slot->seq & 1) != 0)
+			continue;
+		if (slot->hash == hash && slot->key_len == key_len &&
+			memcmp(slot->key, key, key_len) == 0)
+		{
+			/* someone else just stored it */
+			SpinLockRelease(&set->mutex);
+			return;
+		}
+		if (slot->key_len == 0 && victim == NULL)
+			victim = slot;
+	}
+	for (i = 0; victim == NULL && i < 2 * FZC_WAYS; i++)
+	{
+		FzcSlot    *slot = &slots[set->hand];
+
+		set->hand = (set->hand + 1) % FZC_WAYS;
+		if ((slot->seq & 1) != 0)
+			continue;
+		if (slot->used)
+			slot->used = false;
+		else
+		{
+			victim = slot;
+			evicted = true;
+		}
+	}
+	if (victim == NULL)
+	{
+		/* every slot is being written */
+		SpinLockRelease(&set->mutex);
+		return;
+	}
+	victim->seq++;
+	SpinLockRelease(&set->mutex);
+
+	pg_write_barrier();
+	victim->hash = hash;
+	victim->key_len = key_len;
+	memcpy(victim->key, key, key_len);
+	victim->value_len = value_len;
+	memcpy(victim->value, value, value_len);
+	victim->used = true;
+	pg_write_barrier();
+	victim->seq++;
+
+	fzc_count(0, 0, 1, evicted ? 1 : 0);
+}
+
+/*
+ * fuzzy_cache_stats() returns (entries, used, hits, misses, inserts,
+ * evictions, hit_ratio)
+ */
+PG_FUNCTION_INFO_V1(fuzzy_cache_stats);
+Datum
+fuzzy_cache_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[7];
+	bool		nulls[7] = {false, false, false, false, false, false, false};
+	int64		used = 0;
+	uint64		hits = 0,
+				misses = 0,
+				inserts = 0,
+				evictions = 0;
+	int64		i;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	if (fzc != NULL)
+	{
+		for (i = 0; i < (int64) fzc->nsets * FZC_WAYS; i++)
+			if (fzc_slots[i].key_len != 0)
+				used++;
+		for (i = 0; i < FZC_STAT_STRIPES; i++)
+		{
+			FzcStats   *stats = &fzc->stats[i];
+
+			SpinLockAcquire(&stats->mutex);
+			hits += stats->hits;
+			misses += stats->misses;
+			inserts += stats->inserts;
+			evictions += stats->evictions;
+			SpinLockRelease(&stats->mutex);
+		}
+	}
+
+	values[0] = Int64GetDatum(fzc != NULL ? (int64) fzc->nsets * FZC_WAYS : 0);
+	values[1] = Int64GetDatum(used);
+	values[2] = Int64GetDatum((int64) hits);
+	values[3] = Int64GetDatum((int64) misses);
+	values[4] = Int64GetDatum((int64) inserts);
+	values[5] = Int64GetDatum((int64) evictions);
+	if (hits + misses > 0)
+		values[6] = Float8GetDatum((double) hits / (double) (hits + misses));
+	else
+		nulls[6] = true;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * fuzzy_cache_reset() empties the cache and zeroes its statistics.  Slots
+ * being written at the time keep what is written to them.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_cache_reset);
+Datum
+fuzzy_cache_reset(PG_FUNCTION_ARGS)
+{
+	int			s;
+	int			i;
+
+	if (fzc == NULL)
+		PG_RETURN_VOID();
+
+	for (s = 0; s < fzc->nsets; s++)
+	{
+		FzcSet	   *set = &fzc->sets[s];
+		FzcSlot    *slots = fzc_set_slots(s);
+
+		SpinLockAcquire(&set->mutex);
+		for (i = 0; i < FZC_WAYS; i++)
+		{
+			FzcSlot    *slot = &slots[i];
+
+			if ((slot->seq & 1) != 0 || slot->key_len == 0)
+				continue;
+			slot->seq++;
+			pg_write_barrier();
+			slot->key_len = 0;
+			slot->used = false;
+			pg_write_barrier();
+			slot->seq++;
+		}
+		SpinLockRelease(&set->mutex);
+	}
+	for (i = 0; i < FZC_STAT_STRIPES; i++)
+	{
+		FzcStats   *stats = &fzc->stats[i];
+
+		SpinLockAcquire(&stats->mutex);
+		stats->hits = stats->misses = stats->inserts = stats->evictions = 0;
+		SpinLockRelease(&stats->mutex);
+	}
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,400 @@
+/*
+ * fuzzystrmatch_capture.c
+ *
+ * Sampling of function calls into a binary log, for offline replay.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_capture.c
+ *
+ * With fuzzystrmatch.capture_file set and fuzzystrmatch.capture_rate above
+ * zero, that fraction of the calls to the Levenshtein and soundex functions
+ * of fuzzystrmatch.c is appended to the file: which function was called,
+ * its costs and bound, the lengths of its inputs, what it returned and how
+ * long it took, and as much of the inputs themselves as
+ * fuzzystrmatch.capture_inputs allows (see fuzzycapture.h for the format).
+ * fuzzystrmatch_replay feeds such a log back through the standalone builds
+ * of the same kernels, so that changes to them can be measured against the
+ * workload a server actually sees.
+ *
+ * The file is opened by each backend the first time it has something to
+ * write and kept open.  A relative name is taken relative to the data
+ * directory.  If it can't be opened or written, a warning is given and
+ * capturing stops in that backend until the setting changes.
+ *
+ * The decision to sample is made before the call, so that only sampled
+ * calls pay for reading the clock; calls that are not sampled cost one
+ * comparison when capturing is off and a random number when it is on.
+ */
+#include "postgres.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
+#include "fuzzystrmatch.h"
+#include "lib/stringinfo.h"
+#include "mb/pg_wchar.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+
+char	   *fuzzystrmatch_capture_file = NULL;
+double		fuzzystrmatch_capture_rate = 0.0;
+int			fuzzystrmatch_capture_inputs = FUZZY_CAPTURE_INPUTS_NONE;
+
+static const struct config_enum_entry capture_inputs_options[] = {
+	{"none", FUZZY_CAPTURE_INPUTS_NONE, false},
+	{"hashed", FUZZY_CAPTURE_INPUTS_HASHED, false},
+	{"scrambled", FUZZY_CAPTURE_INPUTS_SCRAMBLED, false},
+	{"raw", FUZZY_CAPTURE_INPUTS_RAW, false},
+	{NULL, 0, false}
+};
+
+/* ranges of characters that scrambling permutes among themselves */
+typedef struct
+{
+	uint32		lo;
+	uint32		n;
+	uint32		mult;			/* coprime to n */
+	uint32		add;
+} FcapRange;
+
+enum
+{
+	FCAP_LOWER,
+	FCAP_UPPER,
+	FCAP_DIGIT,
+	FCAP_UTF8_2,
+	FCAP_UTF8_3,
+	FCAP_UTF8_4,
+	FCAP_NRANGES
+};
+
+static FcapRange fcap_ranges[FCAP_NRANGES] = {
+	{'a', 26, 0, 0},
+	{'A', 26, 0, 0},
+	{'0', 10, 0, 0},
+	{0x80, 0x800 - 0x80, 0, 0},
+	{0x800, 0x10000 - 0x800, 0, 0},
+	{0x10000, 0x110000 - 0x10000, 0, 0}
+};
+static bool fcap_keyed = false;
+
+static int	fcap_fd = -1;
+static bool fcap_failed = false;	/* gave up until the file changes */
+
+static uint64
+fcap_random(void)
+{
+#if PG_VERSION_NUM >= 150000
+	return pg_prng_uint64(&pg_global_prng_state);
+#else
+	return ((uint64) random() << 42) ^ ((uint64) random() << 21) ^
+		(uint64) random();
+#endif
+}
+
+static uint32
+fcap_gcd(uint32 a, uint32 b)
+{
+	while (b != 0)
+	{
+		uint32		t = a % b;
+
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Pick this backend's scrambling permutations */
+static void
+fcap_make_key(void)
+{
+	int			i;
+
+	for (i = 0; i < FCAP_NRANGES; i++)
+	{
+		FcapRange  *r = &fcap_ranges[i];
+
+		r->mult = 1 + fcap_random() % (r->n - 1);
+		while (fcap_gcd(r->mult, r->n) != 1)
+			r->mult = r->mult % (r->n - 1) + 1;
+		r->add = fcap_random() % r->n;
+	}
+	fcap_keyed = true;
+}
+
+static uint32
+fcap_permute(const FcapRange *r, uint32 c)
+{
+	return r->lo + (uint32) (((uint64) r->mult * (c - r->lo) + r->add) % r->n);
+}
+
+/*
+ * Replace every character of a UTF-8 string, in place, by its image under
+ * the backend's permutations.  Surrogates can't occur in valid UTF-8, so
+ * they are skipped by walking the cycle on through them, which keeps the
+ * three-byte permutation a permutation of the valid characters.
+ */
+static void
+fcap_scramble(char *s, int len)
+{
+	unsigned char *p = (unsigned char *) s;
+	unsigned char *end = p + len;
+
+	if (!fcap_keyed)
+		fcap_make_key();
+
+	while (p < end)
+	{
+		int			l = pg_utf_mblen(p);
+		uint32		c;
+
+		if (p + l > end)
+			break;
+		switch (l)
+		{
+			case 1:
+				if (*p >= 'a' && *p <= 'z')
+					*p = fcap_permute(&fcap_ranges[FCAP_LOWER], *p);
+				else if (*p >= 'A' && *p <= 'Z')
+					*p = fcap_permute(&fcap_ranges[FCAP_UPPER], *p);
+				else if (*p >= '0' && *p <= '9')
+					*p = fcap_permute(&fcap_ranges[FCAP_DIGIT], *p);
+				break;
+			case 2:
+				c = ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+				c = fcap_permute(&fcap_ranges[FCAP_UTF8_2], c);
+				p[0] = 0xc0 | (c >> 6);
+				p[1] = 0x80 | (c & 0x3f);
+				break;
+			case 3:
+				c = ((p[0] & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+				do
+					c = fcap_permute(&fcap_ranges[FCAP_UTF8_3], c);
+				while (c >= 0xd800 && c <= 0xdfff);
+				p[0] = 0xe0 | (c >> 12);
+				p[1] = 0x80 | ((c >> 6) & 0x3f);
+				p[2] = 0x80 | (c & 0x3f);
+				break;
+			case 4:
+				c = ((p[0] & 0x07) << 18) | ((p[1] & 0x3f) << 12) |
+					((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+				c = fcap_permute(&fcap_ranges[FCAP_UTF8_4], c);
+				p[0] = 0xf0 | (c >> 18);
+				p[1] = 0x80 | ((c >> 12) & 0x3f);
+				p[2] = 0x80 | ((c >> 6) & 0x3f);
+				p[3] = 0x80 | (c & 0x3f);
+				break;
+		}
+		p += l;
+	}
+}
+
+/* Append what capture_inputs keeps of one input; returns its size */
+static uint32
+fcap_append_input(StringInfo buf, const char *s, int len)
+{
+	char	   *utf8;
+	int			utf8_len;
+	uint32		hash;
+
+	switch (fuzzystrmatch_capture_inputs)
+	{
+		case FUZZY_CAPTURE_INPUTS_HASHED:
+			hash = DatumGetUInt32(hash_any((const unsigned char *) s, len));
+			appendBinaryStringInfo(buf, (char *) &hash, sizeof(hash));
+			return sizeof(hash);
+
+		case FUZZY_CAPTURE_INPUTS_SCRAMBLED:
+		case FUZZY_CAPTURE_INPUTS_RAW:
+			utf8 = pg_server_to_any(s, len, PG_UTF8);
+			utf8_len = (utf8 == s) ? len : strlen(utf8);
+			if (fuzzystrmatch_capture_inputs == FUZZY_CAPTURE_INPUTS_SCRAMBLED)
+			{
+				if (utf8 == s)
+					utf8 = pnstrdup(s, len);
+				fcap_scramble(utf8, utf8_len);
+			}
+			appendBinaryStringInfo(buf, utf8, utf8_len);
+			if (utf8 != s)
+				pfree(utf8);
+			return utf8_len;
+
+		default:
+			return 0;
+	}
+}
+
+static void
+fcap_assign_file(const char *newval, void *extra)
+{
+	if (fcap_fd >= 0)
+		close(fcap_fd);
+	fcap_fd = -1;
+	fcap_failed = false;
+}
+
+void
+fuzzystrmatch_capture_init(void)
+{
+	DefineCustomStringVariable("fuzzystrmatch.capture_file",
+			"File that sampled fuzzystrmatch calls are appended to.",
+							   "Empty disables capturing.",
+							   &fuzzystrmatch_capture_file,
+							   "",
+							   PGC_SUSET,
+							   0,
+							   NULL,
+							   fcap_assign_file,
+							   NULL);
+
+	DefineCustomRealVariable("fuzzystrmatch.capture_rate",
+				"Fraction of fuzzystrmatch calls written to the capture file.",
+							 NULL,
+							 &fuzzystrmatch_capture_rate,
+							 0.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("fuzzystrmatch.capture_inputs",
+				 "How much of the inputs of captured calls is written.",
+							 "One of none, hashed, scrambled or raw.",
+							 &fuzzystrmatch_capture_inputs,
+							 FUZZY_CAPTURE_INPUTS_NONE,
+							 capture_inputs_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+}
+
+/*
+ * Should the call about to be made be captured?  If so, the caller reads
+ * the clock, makes the call, and passes everything to fuzzy_capture_write().
+ */
+bool
+fuzzy_capture_sampled(void)
+{
+	double		r;
+
+	if (fuzzystrmatch_capture_rate <= 0.0 || fcap_failed ||
+		fuzzystrmatch_capture_file == NULL ||
+		fuzzystrmatch_capture_file[0] == '\0')
+		return false;
+
+#if PG_VERSION_NUM >= 150000
+	r = pg_prng_double(&pg_global_prng_state);
+#else
+	r = (double) random() / ((double) MAX_RANDOM_VALUE + 1.0);
+#endif
+	return r < fuzzystrmatch_capture_rate;
+}
+
+/*
+ * Append a record for a sampled call that started at start.  The caller
+ * fills in the costs, bound, flags and result of rec; the rest is done
+ * here.  b may be NULL for functions of one string.
+ */
+void
+fuzzy_capture_write(FunctionCallInfo fcinfo, FuzzyCaptureRecord *rec,
+					const char *a, int a_len, const char *b, int b_len,
+					instr_time start)
+{
+	/* DirectFunctionCall callers have no FmgrInfo to name the function */
+	fuzzy_capture_write_function(fcinfo->flinfo != NULL ?
+								 fcinfo->flinfo->fn_oid : InvalidOid,
+								 rec, a, a_len, b, b_len, start);
+}
+
+/*
+ * The same for a call made without fmgr, such as one of a batch evaluated
+ * by fuzzystrmatch_batch.c: funcid names the function the call stands for.
+ */
+void
+fuzzy_capture_write_function(Oid funcid, FuzzyCaptureRecord *rec,
+							 const char *a, int a_len,
+							 const char *b, int b_len, instr_time start)
+{
+	instr_time	elapsed;
+	double		ns;
+	char	   *name;
+	StringInfoData buf;
+	FuzzyCaptureRecord *hdr;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, start);
+	ns = INSTR_TIME_GET_DOUBLE(elapsed) * 1e9;
+
+	if (fcap_fd < 0)
+	{
+		fcap_fd = open(fuzzystrmatch_capture_file,
+					   O_WRONLY | O_APPEND | O_CREAT | PG_BINARY,
+					   S_IRUSR | S_IWUSR);
+		if (fcap_fd < 0)
+		{
+			fcap_failed = true;
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not open capture file \"%s\": %m",
+							fuzzystrmatch_capture_file)));
+			return;
+		}
+	}
+
+	name = NULL;
+	if (OidIsValid(funcid))
+		name = get_func_name(funcid);
+	if (name == NULL)
+		name = "unknown";
+
+	rec->magic = FUZZY_CAPTURE_MAGIC;
+	rec->name_len = strlen(name);
+	rec->inputs = fuzzystrmatch_capture_inputs;
+	rec->a_chars = pg_mbstrlen_with_len(a, a_len);
+	rec->b_chars = b ? pg_mbstrlen_with_len(b, b_len) : 0;
+	rec->elapsed_ns = ns >= (double) UINT_MAX ? UINT_MAX : (uint32) ns;
+
+	/* the header goes first, and gets its sizes once they are known */
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, (char *) rec, sizeof(FuzzyCaptureRecord));
+	appendBinaryStringInfo(&buf, name, rec->name_len);
+	rec->a_size = fcap_append_input(&buf, a, a_len);
+	rec->b_size = b ? fcap_append_input(&buf, b, b_len) : 0;
+	hdr = (FuzzyCaptureRecord *) buf.data;
+	hdr->a_size = rec->a_size;
+	hdr->b_size = rec->b_size;
+
+	errno = 0;
+	if (write(fcap_fd, buf.data, buf.len) != buf.len)
+	{
+		/* a short write without an error is presumably out of space */
+		if (errno == 0)
+			errno = ENOSPC;
+		fcap_failed = true;
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not write to capture file \"%s\": %m",
+						fuzzystrmatch_capture_file)));
+		close(fcap_fd);
+		fcap_fd = -1;
+	}
+	pfree(buf.data);
+}
@@ -0,0 +1,611 @@
+/*
+ * fuzzystrmatch_dedupe.c
+ *
+ * Blocked duplicate detection over the result of a query, within work_mem.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_dedupe.c
+ *
+ * fuzzy_dedupe(query, max_d) runs a query returning (id, word) rows, groups
+ * the words into blocks by soundex code, and returns every pair in the same
+ * block within Levenshtein distance max_d; fuzzy_block_distances(query)
+ * returns every pair in the same block with its distance.  Comparing only
+ * within blocks is what makes the quadratic step affordable, but common
+ * surnames make for blocks of a hundred thousand words, so nothing here
+ * assumes that the input, or even one block, fits in memory.
+ *
+ * While the input fits in work_mem it is simply kept, sorted by block and
+ * compared.  Beyond that, every row goes to a temporary file while the
+ * total size of each block is counted.  A block still larger than work_mem
+ * is split by a secondary key, the first DEDUPE_SUBKEY_PHONEMES phonemes of
+ * the word's metaphone, since words with different longer codes are rarely
+ * close anyway; pairs across the split are no longer compared.  The blocks
+ * are then packed first-fit into batches of at most work_mem, each written
+ * to its own temporary file and compared in memory in turn.  A block that
+ * even the secondary key leaves too large gets a batch of its own, which is
+ * compared by block nested loop: a work_mem-sized chunk of it is held in
+ * memory while the rest of the file is streamed past it.
+ */
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "storage/buffile.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+#include "soundex.c"
+
+/* API differences between the server versions we build against */
+#if PG_VERSION_NUM >= 160000
+#define dedupe_buffile_read(file, ptr, size) \
+	BufFileReadMaybeEOF((file), (ptr), (size), true)
+#else
+#define dedupe_buffile_read(file, ptr, size) \
+	BufFileRead((file), (ptr), (size))
+#endif
+#if PG_VERSION_NUM >= 90500
+#define DEDUPE_HASH_FLAGS	(HASH_ELEM | HASH_BLOBS | HASH_CONTEXT)
+#else
+#define DEDUPE_HASH_FLAGS	(HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT)
+#endif
+
+/* soundex code, then optionally '.' and the secondary key; NUL-padded */
+#define DEDUPE_KEY_LEN			16
+
+/* length of the metaphone used to split oversized blocks */
+#define DEDUPE_SUBKEY_PHONEMES	8
+
+/* bytes of the word the secondary key is computed from */
+#define DEDUPE_SUBKEY_BYTES		64
+
+/* rows fetched from the query at a time */
+#define DEDUPE_FETCH_ROWS		1000
+
+typedef struct DedupeEntry
+{
+	int64		id;
+	int32		len;			/* bytes in word, excluding the terminator */
+	char		key[DEDUPE_KEY_LEN];
+	char		word[1];		/* VARIABLE LENGTH */
+} DedupeEntry;
+
+/* size of the part of an entry written before the word */
+#define DEDUPE_HEADER_SIZE		offsetof(DedupeEntry, word)
+
+/* memory an entry is charged for, including its slot in the entry array */
+#define DEDUPE_ENTRY_SPACE(len) \
+	(MAXALIGN(DEDUPE_HEADER_SIZE + (len) + 1) + sizeof(DedupeEntry *))
+
+/* per-block totals, kept once the input has spilled */
+typedef struct DedupeBlock
+{
+	char		key[DEDUPE_KEY_LEN];	/* hash key; must be first */
+	Size		space;
+	bool		split;			/* too large; its words go to subblocks */
+	int			batch;
+} DedupeBlock;
+
+typedef struct
+{
+	int			max_d;			/* -1 for all pairs */
+	Size		limit;			/* work_mem, in bytes */
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	MemoryContext context;		/* lasts for the whole call */
+	MemoryContext entry_context;	/* holds the entries in memory */
+	MemoryContext kernel_context;	/* reset after every distance */
+	DedupeEntry **entries;
+	int			nentries;
+	int			maxentries;
+	Size		space;			/* charged for the entries in memory */
+	HTAB	   *blocks;			/* once spilled, DedupeBlocks by key */
+	BufFile    *input;			/* once spilled, every entry read */
+} DedupeState;
+
+extern Datum fuzzy_dedupe(PG_FUNCTION_ARGS);
+extern Datum fuzzy_block_distances(PG_FUNCTION_ARGS);
+
+static int
+dedupe_entry_cmp(const void *a, const void *b)
+{
+	const DedupeEntry *ea = *(const DedupeEntry *const *) a;
+	const DedupeEntry *eb = *(const DedupeEntry *const *) b;
+
+	return memcmp(ea->key, eb->key, DEDUPE_KEY_LEN);
+}
+
+static void
+dedupe_write(BufFile *file, DedupeEntry *entry)
+{
+	Size		size = DEDUPE_HEADER_SIZE + entry->len;
+
+#if PG_VERSION_NUM >= 130000
+	BufFileWrite(file, entry, size);
+#else
+	if (BufFileWrite(file, entry, size) != size)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to temporary file: %m")));
+#endif
+}
+
+/* Read the next entry, allocated in the entry context; NULL at the end */
+static DedupeEntry *
+dedupe_read(DedupeState *state, BufFile *file)
+{
+	DedupeEntry header;
+	DedupeEntry *entry;
+	size_t		nread;
+
+	nread = dedupe_buffile_read(file, &header, DEDUPE_HEADER_SIZE);
+	if (nread == 0)
+		return NULL;
+	if (nread != DEDUPE_HEADER_SIZE)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from temporary file: %m")));
+
+	entry = MemoryContextAlloc(state->entry_context,
+							   DEDUPE_HEADER_SIZE + header.len + 1);
+	memcpy(entry, &header, DEDUPE_HEADER_SIZE);
+	if (dedupe_buffile_read(file, entry->word, header.len) != header.len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from temporary file: %m")));
+	entry->word[header.len] = '\0';
+	return entry;
+}
+
+static void
+dedupe_rewind(BufFile *file)
+{
+	if (BufFileSeek(file, 0, 0L, SEEK_SET) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not rewind temporary file: %m")));
+}
+
+/* Replace an entry's soundex key with soundex plus secondary key */
+static void
+dedupe_subkey(DedupeEntry *entry)
+{
+	char	   *code;
+
+	code = metaphone_internal(entry->word, Min(entry->len, DEDUPE_SUBKEY_BYTES),
+							  DEDUPE_SUBKEY_PHONEMES);
+	entry->key[SOUNDEX_LEN] = '.';
+	strncpy(entry->key + SOUNDEX_LEN + 1, code,
+			DEDUPE_KEY_LEN - SOUNDEX_LEN - 2);
+	pfree(code);
+}
+
+static void
+dedupe_compare(DedupeState *state, DedupeEntry *a, DedupeEntry *b)
+{
+	MemoryContext oldcontext;
+	int			d;
+
+	CHECK_FOR_INTERRUPTS();
+
+	/* the kernel doesn't free its rows */
+	oldcontext = MemoryContextSwitchTo(state->kernel_context);
+	d = levenshtein_less_equal_internal(a->word, a->len, b->word, b->len,
+										1, 1, 1, 0, state->max_d);
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(state->kernel_context);
+
+	if (state->max_d < 0 || d <= state->max_d)
+	{
+		Datum		values[3];
+		bool		nulls[3] = {false, false, false};
+
+		values[0] = Int64GetDatum(Min(a->id, b->id));
+		values[1] = Int64GetDatum(Max(a->id, b->id));
+		values[2] = Int32GetDatum(d);
+		tuplestore_putvalues(state->tupstore, state->tupdesc, values, nulls);
+	}
+}
+
+static void
+dedupe_hold(DedupeState *state, DedupeEntry *entry)
+{
+	if (state->nentries == state->maxentries)
+	{
+		state->maxentries *= 2;
+		state->entries = repalloc_huge(state->entries,
+							   state->maxentries * sizeof(DedupeEntry *));
+	}
+	state->entries[state->nentries++] = entry;
+	state->space += DEDUPE_ENTRY_SPACE(entry->len);
+}
+
+static void
+dedupe_release(DedupeState *state)
+{
+	MemoryContextReset(state->entry_context);
+	state->nentries = 0;
+	state->space = 0;
+}
+
+/* Compare every pair of held entries with the same key */
+static void
+dedupe_compare_held(DedupeState *state)
+{
+	int			start;
+	int			end;
+
+	qsort(state->entries, state->nentries, sizeof(DedupeEntry *),
+		  dedupe_entry_cmp);
+	for (start = 0; start < state->nentries; start = end)
+	{
+		int			i,
+					j;
+
+		end = start + 1;
+		while (end < state->nentries &&
+			   memcmp(state->entries[end]->key, state->entries[start]->key,
+					  DEDUPE_KEY_LEN) == 0)
+			end++;
+		for (i = start; i < end; i++)
+			for (j = i + 1; j < end; j++)
+				dedupe_compare(state, state->entries[i], state->entries[j]);
+	}
+}
+
+static DedupeBlock *
+dedupe_count(DedupeState *state, DedupeEntry *entry)
+{
+	DedupeBlock *block;
+	bool		found;
+
+	block = hash_search(state->blocks, entry->key, HASH_ENTER, &found);
+	if (!found)
+	{
+		block->space = 0;
+		block->split = false;
+		block->batch = -1;
+	}
+	block->space += DEDUPE_ENTRY_SPACE(entry->len);
+	return block;
+}
+
+/* Add an input row, spilling everything to a file once work_mem is full */
+static void
+dedupe_add(DedupeState *state, DedupeEntry *entry)
+{
+	if (state->input == NULL)
+	{
+		HASHCTL		ctl;
+		MemoryContext oldcontext;
+		int			i;
+
+		if (state->space + DEDUPE_ENTRY_SPACE(entry->len) <= state->limit)
+		{
+			dedupe_hold(state, entry);
+			return;
+		}
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = DEDUPE_KEY_LEN;
+		ctl.entrysize = sizeof(DedupeBlock);
+#if PG_VERSION_NUM < 90500
+		ctl.hash = tag_hash;
+#endif
+		ctl.hcxt = state->context;
+		state->blocks = hash_create("fuzzy_dedupe blocks", 1024, &ctl,
+									DEDUPE_HASH_FLAGS);
+
+		/* we're called inside SPI, whose memory is gone by the time we read */
+		oldcontext = MemoryContextSwitchTo(state->context);
+		state->input = BufFileCreateTemp(false);
+		MemoryContextSwitchTo(oldcontext);
+		for (i = 0; i < state->nentries; i++)
+		{
+			dedupe_count(state, state->entries[i]);
+			dedupe_write(state->input, state->entries[i]);
+		}
+		dedupe_release(state);
+	}
+
+	dedupe_count(state, entry);
+	dedupe_write(state->input, entry);
+	pfree(entry);
+}
+
+static int
+dedupe_block_cmp(const void *a, const void *b)
+{
+	const DedupeBlock *ba = *(const DedupeBlock *const *) a;
+	const DedupeBlock *bb = *(const DedupeBlock *const *) b;
+
+	/* largest first */
+	return ba->space < bb->space ? 1 : ba->space > bb->space ? -1 : 0;
+}
+
+/*
+ * Block nested loop over a batch holding a single block too large for
+ * work_mem: each chunk that fits is compared within itself and then with
+ * every entry after it in the file.
+ */
+static void
+dedupe_nested_loop(DedupeState *state, BufFile *file)
+{
+	int			fileno = 0;
+	off_t		offset = 0;
+
+	for (;;)
+	{
+		DedupeEntry *entry;
+		int			chunk_fileno;
+		off_t		chunk_offset;
+		int			i,
+					j;
+
+		if (BufFileSeek(file, fileno, offset, SEEK_SET) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not seek in temporary file: %m")));
+		while (state->space < state->limit &&
+			   (entry = dedupe_read(state, file)) != NULL)
+			dedupe_hold(state, entry);
+		if (state->nentries == 0)
+			break;
+		BufFileTell(file, &chunk_fileno, &chunk_offset);
+
+		for (i = 0; i < state->nentries; i++)
+			for (j = i + 1; j < state->nentries; j++)
+				dedupe_compare(state, state->entries[i], state->entries[j]);
+
+		/* entries outside the chunk go in the entry context too */
+		while ((entry = dedupe_read(state, file)) != NULL)
+		{
+			for (i = 0; i < state->nentries; i++)
+				dedupe_compare(state, state->entries[i], entry);
+			pfree(entry);
+		}
+
+		dedupe_release(state);
+		fileno = chunk_fileno;
+		offset = chunk_offset;
+	}
+}
+
+/*
+ * Having spilled, plan batches from the block sizes, distribute the input
+ * among them and compare each batch in turn.
+ */
+static void
+dedupe_spilled(DedupeState *state)
+{
+	HASH_SEQ_STATUS status;
+	DedupeBlock *block;
+	DedupeBlock **blocks;
+	long		nblocks = 0;
+	bool		any_split = false;
+	Size	   *batch_space;
+	bool	   *batch_nested;
+	BufFile   **batch_files;
+	int			nbatches = 0;
+	DedupeEntry *entry;
+	long		i;
+	int			b;
+
+	/* count the subblocks of blocks too large for a batch */
+	hash_seq_init(&status, state->blocks);
+	while ((block = hash_seq_search(&status)) != NULL)
+	{
+		if (block->space > state->limit)
+			block->split = any_split = true;
+	}
+	if (any_split)
+	{
+		dedupe_rewind(state->input);
+		while ((entry = dedupe_read(state, state->input)) != NULL)
+		{
+			block = hash_search(state->blocks, entry->key, HASH_FIND, NULL);
+			if (block->split)
+			{
+				dedupe_subkey(entry);
+				dedupe_count(state, entry);
+			}
+			pfree(entry);
+		}
+	}
+
+	/* pack the blocks into batches, first fit decreasing */
+	blocks = palloc(Max(hash_get_num_entries(state->blocks), 1) *
+					sizeof(DedupeBlock *));
+	hash_seq_init(&status, state->blocks);
+	while ((block = hash_seq_search(&status)) != NULL)
+	{
+		if (!block->split)
+			blocks[nblocks++] = block;
+	}
+	qsort(blocks, nblocks, sizeof(DedupeBlock *), dedupe_block_cmp);
+
+	batch_space = palloc(Max(nblocks, 1) * sizeof(Size));
+	batch_nested = palloc(Max(nblocks, 1) * sizeof(bool));
+	for (i = 0; i < nblocks; i++)
+	{
+		block = blocks[i];
+		for (b = 0; b < nbatches; b++)
+		{
+			if (!batch_nested[b] &&
+				batch_space[b] + block->space <= state->limit)
+				break;
+		}
+		if (b == nbatches)
+		{
+			batch_space[b] = 0;
+			batch_nested[b] = block->space > state->limit;
+			nbatches++;
+		}
+		batch_space[b] += block->space;
+		block->batch = b;
+	}
+
+	/* distribute the input */
+	batch_files = palloc(Max(nbatches, 1) * sizeof(BufFile *));
+	for (b = 0; b < nbatches; b++)
+		batch_files[b] = BufFileCreateTemp(false);
+	dedupe_rewind(state->input);
+	while ((entry = dedupe_read(state, state->input)) != NULL)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		block = hash_search(state->blocks, entry->key, HASH_FIND, NULL);
+		if (block->split)
+		{
+			dedupe_subkey(entry);
+			block = hash_search(state->blocks, entry->key, HASH_FIND, NULL);
+		}
+		dedupe_write(batch_files[block->batch], entry);
+		pfree(entry);
+	}
+	BufFileClose(state->input);
+	state->input = NULL;
+
+	for (b = 0; b < nbatches; b++)
+	{
+		dedupe_rewind(batch_files[b]);
+		if (batch_nested[b])
+			dedupe_nested_loop(state, batch_files[b]);
+		else
+		{
+			while ((entry = dedupe_read(state, batch_files[b])) != NULL)
+				dedupe_hold(state, entry);
+			dedupe_compare_held(state);
+			dedupe_release(state);
+		}
+		BufFileClose(batch_files[b]);
+	}
+}
+
+static Datum
+dedupe_run(FunctionCallInfo fcinfo, int max_d)
+{
+	char	   *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	MemoryContext callcontext = CurrentMemoryContext;
+	DedupeState state;
+	Portal		portal;
+
+	memset(&state, 0, sizeof(state));
+	state.context = callcontext;
+	state.max_d = max_d;
+	state.limit = (Size) work_mem * 1024L;
+	state.tupstore = init_materialize_srf(fcinfo, &state.tupdesc);
+	state.entry_context = AllocSetContextCreate(callcontext,
+												"fuzzy_dedupe entries",
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+	state.kernel_context = AllocSetContextCreate(callcontext,
+												 "fuzzy_dedupe kernel",
+												 ALLOCSET_DEFAULT_MINSIZE,
+												 ALLOCSET_DEFAULT_INITSIZE,
+												 ALLOCSET_DEFAULT_MAXSIZE);
+	state.maxentries = 1024;
+	state.entries = MemoryContextAlloc(callcontext,
+									   state.maxentries * sizeof(DedupeEntry *));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+	portal = SPI_cursor_open_with_args(NULL, query, 0, NULL, NULL, NULL,
+									   true, 0);
+	for (;;)
+	{
+		TupleDesc	tupdesc;
+		Oid			id_type;
+		uint64		i;
+
+		SPI_cursor_fetch(portal, true, DEDUPE_FETCH_ROWS);
+		if (SPI_processed == 0)
+			break;
+
+		tupdesc = SPI_tuptable->tupdesc;
+		id_type = SPI_gettypeid(tupdesc, 1);
+		if (tupdesc->natts != 2 ||
+			(id_type != INT8OID && id_type != INT4OID))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("query must return an integer id and a word")));
+
+		for (i = 0; i < SPI_processed; i++)
+		{
+			HeapTuple	tuple = SPI_tuptable->vals[i];
+			DedupeEntry *entry;
+			Datum		id;
+			bool		isnull;
+			char	   *word;
+			int			len;
+
+			id = SPI_getbinval(tuple, tupdesc, 1, &isnull);
+			word = SPI_getvalue(tuple, tupdesc, 2);
+			if (isnull || word == NULL)
+				continue;
+
+			len = strlen(word);
+			entry = MemoryContextAllocZero(state.entry_context,
+										   DEDUPE_HEADER_SIZE + len + 1);
+			entry->id = id_type == INT8OID ? DatumGetInt64(id) :
+				(int64) DatumGetInt32(id);
+			entry->len = len;
+			memcpy(entry->word, word, len + 1);
+			_soundex(word, entry->key);
+			pfree(word);
+
+			dedupe_add(&state, entry);
+		}
+		SPI_freetuptable(SPI_tuptable);
+	}
+	SPI_cursor_close(portal);
+	SPI_finish();
+
+	if (state.input == NULL)
+		dedupe_compare_held(&state);
+	else
+		dedupe_spilled(&state);
+
+	MemoryContextDelete(state.entry_context);
+	MemoryContextDelete(state.kernel_context);
+	return (Datum) 0;
+}
+
+/*
+ * fuzzy_dedupe(query text, max_d int) returns setof (id1, id2, distance)
+ *
+ * The pairs of rows in the same block whose words are within Levenshtein
+ * distance max_d, each once with id1 < id2.  The query must return an
+ * integer id and a word; rows with either null are ignored.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_dedupe);
+Datum
+fuzzy_dedupe(PG_FUNCTION_ARGS)
+{
+	int			max_d = PG_GETARG_INT32(1);
+
+	if (max_d < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("max_d must not be negative")));
+	return dedupe_run(fcinfo, max_d);
+}
+
+/*
+ * fuzzy_block_distances(query text) returns setof (id1, id2, distance)
+ *
+ * The distance matrix of each block: every pair of rows in the same block
+ * with the Levenshtein distance between their words.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_block_distances);
+Datum
+fuzzy_block_distances(PG_FUNCTION_ARGS)
+{
+	return dedupe_run(fcinfo, -1);
+}
@@ -0,0 +1,631 @@
+/*
+ * fuzzystrmatch_gist.c
+ *
+ * GiST operator class for edit distance searches over text.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_gist.c
+ *
+ * gist_fuzzy_ops indexes a text column so that "col %~ query" (Levenshtein
+ * distance at most fuzzystrmatch.radius) and "ORDER BY col <~> query"
+ * (nearest by Levenshtein distance) can use the index.
+ *
+ * Each key is a signature of the strings below it: the range of their
+ * lengths in characters, a bitmap of the characters that occur in them, and
+ * a bitmap of the bigrams that occur in them after padding each string with
+ * a sentinel at both ends.  Characters and bigrams are hashed into the
+ * bitmaps, so a set bit only means "possibly present", but a clear bit means
+ * "absent from every string below".  Two lower bounds on the unit-cost
+ * distance between the query and any string below a key follow from that:
+ *
+ * - No query character whose bit is clear can be matched, so at most
+ *	 m - miss of its m characters are; since an alignment of strings of
+ *	 lengths m and n with k matches costs at least max(m, n) - k, the
+ *	 distance is at least max(m, n) - min(m - miss, n), for the most
+ *	 favourable n in the key's length range.
+ * - A padded string of m characters has m + 1 bigrams and one edit
+ *	 destroys at most two of them, so if gmiss of the query's bigrams are
+ *	 absent the distance is at least ceil(gmiss / 2).
+ *
+ * Union only ever ORs bitmaps and widens length ranges, so both bounds stay
+ * valid all the way up the tree; they serve as the consistent function's
+ * filter and as the KNN distance of inner keys.  Leaf keys also carry the
+ * string itself (unless it is too long for the kernel), which lets leaves
+ * be answered exactly with the levenshtein.c kernel, without a heap recheck.
+ */
+#include "postgres.h"
+
+#include "access/gist.h"
+#include "access/skey.h"
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+
+#define FSG_WITHIN_STRATEGY		1	/* %~ */
+#define FSG_DISTANCE_STRATEGY	2	/* <~> */
+
+#define FSG_CHAR_BITS			256
+#define FSG_GRAM_BITS			512
+#define FSG_CHAR_BYTES			(FSG_CHAR_BITS / 8)
+#define FSG_GRAM_BYTES			(FSG_GRAM_BITS / 8)
+
+/* the key stores the string, which follows the fixed part */
+#define FSG_HAS_TEXT			0x0001
+
+typedef struct
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	uint16		flags;
+	uint16		unused;
+	int32		minlen;			/* shortest string below, in characters */
+	int32		maxlen;			/* longest string below, in characters */
+	uint8		chars[FSG_CHAR_BYTES];
+	uint8		grams[FSG_GRAM_BYTES];
+} FuzzySig;
+
+#define FSG_TEXT(sig)			((char *) (sig) + sizeof(FuzzySig))
+#define FSG_TEXT_BYTES(sig)		(VARSIZE(sig) - sizeof(FuzzySig))
+
+#define FSG_GETBIT(map, i)		(((map)[(i) >> 3] >> ((i) & 7)) & 1)
+#define FSG_SETBIT(map, i)		((map)[(i) >> 3] |= (uint8) (1 << ((i) & 7)))
+
+/* the query, preprocessed once per scan and kept in fn_extra */
+typedef struct
+{
+	int			bytes;
+	char	   *data;
+	int			m;				/* length in characters */
+	uint8	   *char_bits;		/* bit of each character, [m] */
+	uint16	   *gram_bits;		/* bit of each padded bigram, [m + 1] */
+} FsgQuery;
+
+int			fuzzystrmatch_radius = 2;
+
+extern Datum levenshtein_within_radius(PG_FUNCTION_ARGS);
+extern Datum gfuzzy_in(PG_FUNCTION_ARGS);
+extern Datum gfuzzy_out(PG_FUNCTION_ARGS);
+extern Datum gfuzzy_consistent(PG_FUNCTION_ARGS);
+extern Datum gfuzzy_distance(PG_FUNCTION_ARGS);
+extern Datum gfuzzy_compress(PG_FUNCTION_ARGS);
+extern Datum gfuzzy_decompress(PG_FUNCTION_ARGS);
+extern Datum gfuzzy_union(PG_FUNCTION_ARGS);
+extern Datum gfuzzy_penalty(PG_FUNCTION_ARGS);
+extern Datum gfuzzy_picksplit(PG_FUNCTION_ARGS);
+extern Datum gfuzzy_same(PG_FUNCTION_ARGS);
+
+void
+fuzzystrmatch_gist_init(void)
+{
+	DefineCustomIntVariable("fuzzystrmatch.radius",
+		"Largest Levenshtein distance at which the %~ operator matches.",
+							NULL,
+							&fuzzystrmatch_radius,
+							2,
+							0,
+							MAX_LEVENSHTEIN_STRLEN,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/*
+ * Characters are identified by their encoded bytes; no server encoding has
+ * characters longer than four bytes, and 0 stands for the padding sentinel,
+ * since text cannot contain NULs.
+ */
+static inline uint32
+fsg_char_code(const char *p, int len)
+{
+	uint32		code = 0;
+	int			i;
+
+	for (i = 0; i < len; i++)
+		code = (code << 8) | (unsigned char) p[i];
+	return code;
+}
+
+static inline int
+fsg_char_bit(uint32 code)
+{
+	return (code * 0x9E3779B1) >> 24;
+}
+
+static inline int
+fsg_gram_bit(uint32 a, uint32 b)
+{
+	uint32		h = a * 0x9E3779B1;
+
+	h ^= b + 0x7F4A7C15 + (h << 6) + (h >> 2);
+	return (h * 0x85EBCA6B) >> 23;
+}
+
+/* number of bits set in "add" but not in "base" */
+static int
+fsg_popcount_new(const uint8 *base, const uint8 *add, int nbytes)
+{
+	int			count = 0;
+	int			i;
+
+	for (i = 0; i < nbytes; i++)
+	{
+		uint8		b = add[i] & ~base[i];
+
+		while (b)
+		{
+			b &= b - 1;
+			count++;
+		}
+	}
+	return count;
+}
+
+/* Build the leaf key for a string */
+static FuzzySig *
+fsg_make_leaf(const char *str, int bytes)
+{
+	int			nchars = pg_mbstrlen_with_len(str, bytes);
+	bool		keep_text = nchars <= MAX_LEVENSHTEIN_STRLEN;
+	Size		size = sizeof(FuzzySig) + (keep_text ? bytes : 0);
+	FuzzySig   *sig = palloc0(size);
+	const char *p = str;
+	const char *end = str + bytes;
+	uint32		prev = 0;
+
+	SET_VARSIZE(sig, size);
+	sig->minlen = sig->maxlen = nchars;
+	while (p < end)
+	{
+		int			len = pg_mblen(p);
+		uint32		code = fsg_char_code(p, len);
+
+		FSG_SETBIT(sig->chars, fsg_char_bit(code));
+		FSG_SETBIT(sig->grams, fsg_gram_bit(prev, code));
+		prev = code;
+		p += len;
+	}
+	FSG_SETBIT(sig->grams, fsg_gram_bit(prev, 0));
+
+	if (keep_text)
+	{
+		sig->flags |= FSG_HAS_TEXT;
+		memcpy(FSG_TEXT(sig), str, bytes);
+	}
+	return sig;
+}
+
+/* Widen an inner key so that it also covers "add" */
+static void
+fsg_merge(FuzzySig *sig, const FuzzySig *add)
+{
+	int			i;
+
+	sig->minlen = Min(sig->minlen, add->minlen);
+	sig->maxlen = Max(sig->maxlen, add->maxlen);
+	for (i = 0; i < FSG_CHAR_BYTES; i++)
+		sig->chars[i] |= add->chars[i];
+	for (i = 0; i < FSG_GRAM_BYTES; i++)
+		sig->grams[i] |= add->grams[i];
+}
+
+static FuzzySig *
+fsg_make_inner(const FuzzySig *from)
+{
+	FuzzySig   *sig = palloc(sizeof(FuzzySig));
+
+	memcpy(sig, from, sizeof(FuzzySig));
+	SET_VARSIZE(sig, sizeof(FuzzySig));
+	sig->flags = 0;
+	return sig;
+}
+
+/* How much an inner key grows when "add" is merged into it */
+static float
+fsg_growth(const FuzzySig *sig, const FuzzySig *add)
+{
+	int			growth;
+
+	growth = fsg_popcount_new(sig->chars, add->chars, FSG_CHAR_BYTES) +
+		fsg_popcount_new(sig->grams, add->grams, FSG_GRAM_BYTES);
+	if (add->minlen < sig->minlen)
+		growth += sig->minlen - add->minlen;
+	if (add->maxlen > sig->maxlen)
+		growth += add->maxlen - sig->maxlen;
+	return (float) growth;
+}
+
+/* Symmetric dissimilarity of two keys, used to pick split seeds */
+static int
+fsg_difference(const FuzzySig *a, const FuzzySig *b)
+{
+	return fsg_popcount_new(a->chars, b->chars, FSG_CHAR_BYTES) +
+		fsg_popcount_new(b->chars, a->chars, FSG_CHAR_BYTES) +
+		fsg_popcount_new(a->grams, b->grams, FSG_GRAM_BYTES) +
+		fsg_popcount_new(b->grams, a->grams, FSG_GRAM_BYTES) +
+		Abs(a->minlen - b->minlen) + Abs(a->maxlen - b->maxlen);
+}
+
+/* Get the preprocessed query, reusing the one from the previous call */
+static FsgQuery *
+fsg_get_query(FunctionCallInfo fcinfo, text *query)
+{
+	FsgQuery   *q = (FsgQuery *) fcinfo->flinfo->fn_extra;
+	const char *str = VARDATA_ANY(query);
+	int			bytes = VARSIZE_ANY_EXHDR(query);
+	MemoryContext oldcontext;
+	const char *p;
+	uint32		prev = 0;
+	int			i;
+
+	if (q != NULL && q->bytes == bytes && memcmp(q->data, str, bytes) == 0)
+		return q;
+
+	if (q != NULL)
+	{
+		pfree(q->data);
+		pfree(q->char_bits);
+		pfree(q->gram_bits);
+		pfree(q);
+	}
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	q = palloc(sizeof(FsgQuery));
+	q->bytes = bytes;
+	q->data = palloc(bytes + 1);
+	memcpy(q->data, str, bytes);
+	q->m = pg_mbstrlen_with_len(str, bytes);
+	q->char_bits = palloc(q->m + 1);
+	q->gram_bits = palloc((q->m + 1) * sizeof(uint16));
+	MemoryContextSwitchTo(oldcontext);
+
+	p = q->data;
+	for (i = 0; i < q->m; i++)
+	{
+		int			len = pg_mblen(p);
+		uint32		code = fsg_char_code(p, len);
+
+		q->char_bits[i] = fsg_char_bit(code);
+		q->gram_bits[i] = fsg_gram_bit(prev, code);
+		prev = code;
+		p += len;
+	}
+	q->gram_bits[q->m] = fsg_gram_bit(prev, 0);
+
+	fcinfo->flinfo->fn_extra = q;
+	return q;
+}
+
+/* max(m, n) - min(m - miss, n): the character bound for a string of n */
+static inline int
+fsg_char_bound(int m, int miss, int n)
+{
+	return Max(m, n) - Min(m - miss, n);
+}
+
+/*
+ * Lower bound on the Levenshtein distance between the query and any string
+ * covered by the key; see the file header comment.
+ */
+static int
+fsg_lower_bound(const FsgQuery *q, const FuzzySig *sig)
+{
+	int			miss = 0;
+	int			gmiss = 0;
+	int			lo,
+				hi;
+	int			bound;
+	int			i;
+
+	for (i = 0; i < q->m; i++)
+		if (!FSG_GETBIT(sig->chars, q->char_bits[i]))
+			miss++;
+	for (i = 0; i <= q->m; i++)
+		if (!FSG_GETBIT(sig->grams, q->gram_bits[i]))
+			gmiss++;
+
+	/*
+	 * The character bound is smallest for n in [m - miss, m], so the best n
+	 * in the key's range is one of those two points clamped into it.
+	 */
+	lo = Min(Max(q->m - miss, sig->minlen), sig->maxlen);
+	hi = Min(Max(q->m, sig->minlen), sig->maxlen);
+	bound = Min(fsg_char_bound(q->m, miss, lo), fsg_char_bound(q->m, miss, hi));
+
+	return Max(bound, (gmiss + 1) / 2);
+}
+
+/*
+ * levenshtein_within_radius(a, b): the function behind %~, true when the
+ * unit-cost distance is at most fuzzystrmatch.radius
+ */
+PG_FUNCTION_INFO_V1(levenshtein_within_radius);
+Datum
+levenshtein_within_radius(PG_FUNCTION_ARGS)
+{
+	text	   *a = PG_GETARG_TEXT_PP(0);
+	text	   *b = PG_GETARG_TEXT_PP(1);
+	int			radius = fuzzystrmatch_radius;
+
+	PG_RETURN_BOOL(levenshtein_less_equal_internal(VARDATA_ANY(a),
+												   VARSIZE_ANY_EXHDR(a),
+												   VARDATA_ANY(b),
+												   VARSIZE_ANY_EXHDR(b),
+												   1, 1, 1, 0, radius) <= radius);
+}
+
+/* The key type is internal to the index; it has no text representation */
+PG_FUNCTION_INFO_V1(gfuzzy_in);
+Datum
+gfuzzy_in(PG_FUNCTION_ARGS)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("gfuzzy_in not implemented")));
+	PG_RETURN_DATUM(0);
+}
+
+PG_FUNCTION_INFO_V1(gfuzzy_out);
+Datum
+gfuzzy_out(PG_FUNCTION_ARGS)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("gfuzzy_out not implemented")));
+	PG_RETURN_DATUM(0);
+}
+
+PG_FUNCTION_INFO_V1(gfuzzy_consistent);
+Datum
+gfuzzy_consistent(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	text	   *query = PG_GETARG_TEXT_PP(1);
+	StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);
+
+	/* Oid		subtype = PG_GETARG_OID(3); */
+	bool	   *recheck = (bool *) PG_GETARG_POINTER(4);
+	FuzzySig   *sig = (FuzzySig *) DatumGetPointer(entry->key);
+	FsgQuery   *q = fsg_get_query(fcinfo, query);
+	int			radius = fuzzystrmatch_radius;
+
+	if (strategy != FSG_WITHIN_STRATEGY)
+		elog(ERROR, "unrecognized strategy number: %d", strategy);
+
+	*recheck = false;
+	if (fsg_lower_bound(q, sig) > radius)
+		PG_RETURN_BOOL(false);
+	if (!GIST_LEAF(entry))
+		PG_RETURN_BOOL(true);
+
+	if (!(sig->flags & FSG_HAS_TEXT))
+	{
+		/* too long to store; let the operator decide (and complain) */
+		*recheck = true;
+		PG_RETURN_BOOL(true);
+	}
+	PG_RETURN_BOOL(levenshtein_less_equal_internal(q->data, q->bytes,
+												   FSG_TEXT(sig),
+												   FSG_TEXT_BYTES(sig),
+												   1, 1, 1, 0, radius) <= radius);
+}
+
+/*
+ * Distance for KNN searches: the lower bound for inner keys, and the exact
+ * distance for leaves.  A leaf whose string was too long to store gets the
+ * lower bound too; from 9.5 on, GiST passes a fifth argument through which
+ * we ask for the ordering operator to be rechecked, which then raises the
+ * same error a sequential scan would have.
+ */
+PG_FUNCTION_INFO_V1(gfuzzy_distance);
+Datum
+gfuzzy_distance(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	text	   *query = PG_GETARG_TEXT_PP(1);
+	StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);
+	FuzzySig   *sig = (FuzzySig *) DatumGetPointer(entry->key);
+	FsgQuery   *q = fsg_get_query(fcinfo, query);
+
+	if (strategy != FSG_DISTANCE_STRATEGY)
+		elog(ERROR, "unrecognized strategy number: %d", strategy);
+
+	if (GIST_LEAF(entry) && (sig->flags & FSG_HAS_TEXT))
+		PG_RETURN_FLOAT8((float8)
+						 levenshtein_less_equal_internal(q->data, q->bytes,
+														 FSG_TEXT(sig),
+														 FSG_TEXT_BYTES(sig),
+														 1, 1, 1, 0, -1));
+
+	if (GIST_LEAF(entry) && PG_NARGS() > 4)
+		*((bool *) PG_GETARG_POINTER(4)) = true;
+	PG_RETURN_FLOAT8((float8) fsg_lower_bound(q, sig));
+}
+
+PG_FUNCTION_INFO_V1(gfuzzy_compress);
+Datum
+gfuzzy_compress(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	GISTENTRY  *retval = entry;
+
+	if (entry->leafkey)
+	{
+		text	   *val = DatumGetTextPP(entry->key);
+		FuzzySig   *sig = fsg_make_leaf(VARDATA_ANY(val),
+										VARSIZE_ANY_EXHDR(val));
+
+		retval = (GISTENTRY *) palloc(sizeof(GISTENTRY));
+		gistentryinit(*retval, PointerGetDatum(sig),
+					  entry->rel, entry->page,
+					  entry->offset, FALSE);
+	}
+	PG_RETURN_POINTER(retval);
+}
+
+PG_FUNCTION_INFO_V1(gfuzzy_decompress);
+Datum
+gfuzzy_decompress(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	GISTENTRY  *retval;
+	text	   *key;
+
+	key = (text *) PG_DETOAST_DATUM(entry->key);
+	if (key == (text *) DatumGetPointer(entry->key))
+		PG_RETURN_POINTER(entry);
+
+	retval = (GISTENTRY *) palloc(sizeof(GISTENTRY));
+	gistentryinit(*retval, PointerGetDatum(key),
+				  entry->rel, entry->page,
+				  entry->offset, FALSE);
+	PG_RETURN_POINTER(retval);
+}
+
+PG_FUNCTION_INFO_V1(gfuzzy_union);
+Datum
+gfuzzy_union(PG_FUNCTION_ARGS)
+{
+	GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+	int		   *size = (int *) PG_GETARG_POINTER(1);
+	FuzzySig   *result;
+	int			i;
+
+	result = fsg_make_inner((FuzzySig *) DatumGetPointer(entryvec->vector[0].key));
+	for (i = 1; i < entryvec->n; i++)
+		fsg_merge(result, (FuzzySig *) DatumGetPointer(entryvec->vector[i].key));
+
+	*size = VARSIZE(result);
+	PG_RETURN_POINTER(result);
+}
+
+PG_FUNCTION_INFO_V1(gfuzzy_penalty);
+Datum
+gfuzzy_penalty(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *origentry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	GISTENTRY  *newentry = (GISTENTRY *) PG_GETARG_POINTER(1);
+	float	   *penalty = (float *) PG_GETARG_POINTER(2);
+
+	*penalty = fsg_growth((FuzzySig *) DatumGetPointer(origentry->key),
+						  (FuzzySig *) DatumGetPointer(newentry->key));
+	PG_RETURN_POINTER(penalty);
+}
+
+typedef struct
+{
+	OffsetNumber pos;
+	float		cost;			/* preference for one side over the other */
+} FsgSplitCost;
+
+static int
+fsg_split_cost_cmp(const void *a, const void *b)
+{
+	float		ca = ((const FsgSplitCost *) a)->cost;
+	float		cb = ((const FsgSplitCost *) b)->cost;
+
+	if (ca == cb)
+		return 0;
+	return (ca > cb) ? -1 : 1;
+}
+
+/*
+ * Guttman-style split: seed each side with the two most dissimilar keys,
+ * then hand out the rest, most decided first, to whichever side grows less.
+ */
+PG_FUNCTION_INFO_V1(gfuzzy_picksplit);
+Datum
+gfuzzy_picksplit(PG_FUNCTION_ARGS)
+{
+	GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+	GIST_SPLITVEC *v = (GIST_SPLITVEC *) PG_GETARG_POINTER(1);
+	OffsetNumber maxoff = entryvec->n - 1;
+	OffsetNumber i,
+				j;
+	OffsetNumber seed_left = FirstOffsetNumber,
+				seed_right = OffsetNumberNext(FirstOffsetNumber);
+	int			worst = -1;
+	FuzzySig   *left,
+			   *right;
+	FsgSplitCost *costs;
+	int			ncosts = 0;
+
+#define KEY(i)	((FuzzySig *) DatumGetPointer(entryvec->vector[(i)].key))
+
+	for (i = FirstOffsetNumber; i < maxoff; i = OffsetNumberNext(i))
+	{
+		for (j = OffsetNumberNext(i); j <= maxoff; j = OffsetNumberNext(j))
+		{
+			int			d = fsg_difference(KEY(i), KEY(j));
+
+			if (d > worst)
+			{
+				worst = d;
+				seed_left = i;
+				seed_right = j;
+			}
+		}
+	}
+
+	v->spl_left = (OffsetNumber *) palloc((maxoff + 1) * sizeof(OffsetNumber));
+	v->spl_right = (OffsetNumber *) palloc((maxoff + 1) * sizeof(OffsetNumber));
+	v->spl_nleft = 0;
+	v->spl_nright = 0;
+
+	left = fsg_make_inner(KEY(seed_left));
+	right = fsg_make_inner(KEY(seed_right));
+	v->spl_left[v->spl_nleft++] = seed_left;
+	v->spl_right[v->spl_nright++] = seed_right;
+
+	costs = (FsgSplitCost *) palloc(maxoff * sizeof(FsgSplitCost));
+	for (i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i))
+	{
+		if (i == seed_left || i == seed_right)
+			continue;
+		costs[ncosts].pos = i;
+		costs[ncosts].cost = Abs(fsg_growth(left, KEY(i)) -
+								 fsg_growth(right, KEY(i)));
+		ncosts++;
+	}
+	qsort(costs, ncosts, sizeof(FsgSplitCost), fsg_split_cost_cmp);
+
+	for (j = 0; j < ncosts; j++)
+	{
+		FuzzySig   *key = KEY(costs[j].pos);
+		float		grow_left = fsg_growth(left, key);
+		float		grow_right = fsg_growth(right, key);
+
+		if (grow_left < grow_right ||
+			(grow_left == grow_right && v->spl_nleft <= v->spl_nright))
+		{
+			fsg_merge(left, key);
+			v->spl_left[v->spl_nleft++] = costs[j].pos;
+		}
+		else
+		{
+			fsg_merge(right, key);
+			v->spl_right[v->spl_nright++] = costs[j].pos;
+		}
+	}
+
+#undef KEY
+
+	v->spl_ldatum = PointerGetDatum(left);
+	v->spl_rdatum = PointerGetDatum(right);
+	PG_RETURN_POINTER(v);
+}
+
+PG_FUNCTION_INFO_V1(gfuzzy_same);
+Datum
+gfuzzy_same(PG_FUNCTION_ARGS)
+{
+	FuzzySig   *a = (FuzzySig *) PG_GETARG_POINTER(0);
+	FuzzySig   *b = (FuzzySig *) PG_GETARG_POINTER(1);
+	bool	   *result = (bool *) PG_GETARG_POINTER(2);
+
+	*result = VARSIZE(a) == VARSIZE(b) && memcmp(a, b, VARSIZE(a)) == 0;
+	PG_RETURN_POINTER(result);
+}
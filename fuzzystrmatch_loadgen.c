@@ -0,0 +1,426 @@
+/*
+ * fuzzystrmatch_loadgen.c
+ *
+ * Load generator for fuzzystrmatchd.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_loadgen.c
+ *
+ * Usage: fuzzystrmatch_loadgen -s SOCKET -d WORDFILE [-c CLIENTS]
+ *			[-p DEPTH] [-n REQUESTS] [-k MAX_D] [-e EDITS] [-m MIX] [-r SEED]
+ *
+ * Opens CLIENTS connections and keeps DEPTH requests in flight on each of
+ * them until REQUESTS responses have been received in total.  Queries are
+ * dictionary words with up to EDITS random single-character edits applied.
+ * MIX gives the relative weights of LEV, SOUNDEX and DMETAPHONE requests as
+ * "lev:soundex:dmetaphone" (default 8:1:1).  At the end, client-side
+ * throughput and latency percentiles are printed, followed by the server's
+ * own STATS counters.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct
+{
+	int			fd;
+	char	   *in;
+	size_t		inlen;
+	size_t		incap;
+	double	   *sent;			/* ring of send times, one per request */
+	int			head;
+	int			inflight;
+	long		matches;
+	long		errors;
+} Conn;
+
+static char **words;
+static int	nwords;
+static int	depth = 16;
+static int	max_d = 2;
+static int	max_edits = 1;
+static int	mix[3] = {8, 1, 1};
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static void
+load_words(const char *path)
+{
+	FILE	   *fp = fopen(path, "r");
+	char	   *line = NULL;
+	size_t		cap = 0;
+	ssize_t		len;
+	int			wcap = 1024;
+
+	if (fp == NULL)
+		die(path);
+	words = malloc(wcap * sizeof(char *));
+	while ((len = getline(&line, &cap, fp)) != -1)
+	{
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0 || strchr(line, '\t') != NULL)
+			continue;
+		if (nwords == wcap)
+			words = realloc(words, (wcap *= 2) * sizeof(char *));
+		words[nwords++] = strdup(line);
+	}
+	free(line);
+	fclose(fp);
+	if (nwords == 0)
+	{
+		fprintf(stderr, "fuzzystrmatch_loadgen: no words in \"%s\"\n", path);
+		exit(1);
+	}
+}
+
+/* Build one request line into buf, which must hold at least 1024 bytes */
+static int
+make_request(char *buf)
+{
+	char		q[512];
+	const char *w = words[rand() % nwords];
+	int			len = (int) strlen(w);
+	int			edits = rand() % (max_edits + 1);
+	int			pick = rand() % (mix[0] + mix[1] + mix[2]);
+	int			e;
+
+	if (len > 250)
+		len = 250;
+	memcpy(q, w, len);
+	for (e = 0; e < edits; e++)
+	{
+		int			pos = len > 0 ? rand() % len : 0;
+		char		c = 'a' + rand() % 26;
+
+		switch (rand() % 3)
+		{
+			case 0:				/* substitute */
+				if (len > 0)
+					q[pos] = c;
+				break;
+			case 1:				/* insert */
+				memmove(q + pos + 1, q + pos, len - pos);
+				q[pos] = c;
+				len++;
+				break;
+			case 2:				/* delete */
+				if (len > 1)
+				{
+					memmove(q + pos, q + pos + 1, len - pos - 1);
+					len--;
+				}
+				break;
+		}
+	}
+	q[len] = '\0';
+
+	if (pick < mix[0])
+		return sprintf(buf, "LEV\t%d\t%s\n", max_d, q);
+	else if (pick < mix[0] + mix[1])
+		return sprintf(buf, "SOUNDEX\t%s\n", q);
+	else
+		return sprintf(buf, "DMETAPHONE\t%s\n", q);
+}
+
+static void
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t		n = write(fd, buf, len);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+			{
+				struct pollfd p;
+
+				p.fd = fd;
+				p.events = POLLOUT;
+				poll(&p, 1, -1);
+				continue;
+			}
+			die("write");
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void
+send_requests(Conn *c, int count)
+{
+	char		buf[1024];
+	int			i;
+
+	for (i = 0; i < count; i++)
+	{
+		int			len = make_request(buf);
+
+		c->sent[(c->head + c->inflight) % depth] = now_seconds();
+		c->inflight++;
+		write_all(c->fd, buf, len);
+	}
+}
+
+static int
+connect_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0)
+		die("socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		die("connect");
+	return fd;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double		da = *(const double *) a;
+	double		db = *(const double *) b;
+
+	return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static void
+print_server_stats(const char *path)
+{
+	int			fd = connect_socket(path);
+	char		buf[8192];
+	size_t		len = 0;
+	char	   *p;
+
+	write_all(fd, "STATS\n", 6);
+	while (len < sizeof(buf) - 1)
+	{
+		ssize_t		n = read(fd, buf + len, sizeof(buf) - 1 - len);
+
+		if (n <= 0)
+			break;
+		len += n;
+		if (memchr(buf, '\n', len) != NULL)
+			break;
+	}
+	buf[len] = '\0';
+	close(fd);
+
+	printf("server:\n");
+	for (p = strtok(buf, "\t\n"); p != NULL; p = strtok(NULL, "\t\n"))
+		if (strcmp(p, "OK") != 0)
+			printf("  %s\n", p);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: fuzzystrmatch_loadgen -s SOCKET -d WORDFILE [-c CLIENTS] [-p DEPTH]\n"
+			"         [-n REQUESTS] [-k MAX_D] [-e EDITS] [-m LEV:SOUNDEX:DMETAPHONE] [-r SEED]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *socket_path = NULL;
+	const char *word_path = NULL;
+	int			nclients = 4;
+	long		total = 100000;
+	long		issued = 0;
+	long		done = 0;
+	double	   *latencies;
+	Conn	   *conns;
+	struct pollfd *pfds;
+	double		start,
+				elapsed;
+	long		matches = 0,
+				errors = 0;
+	int			opt;
+	int			i;
+
+	srand(1);
+	while ((opt = getopt(argc, argv, "s:d:c:p:n:k:e:m:r:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'd':
+				word_path = optarg;
+				break;
+			case 'c':
+				nclients = atoi(optarg);
+				break;
+			case 'p':
+				depth = atoi(optarg);
+				break;
+			case 'n':
+				total = atol(optarg);
+				break;
+			case 'k':
+				max_d = atoi(optarg);
+				break;
+			case 'e':
+				max_edits = atoi(optarg);
+				break;
+			case 'm':
+				if (sscanf(optarg, "%d:%d:%d", &mix[0], &mix[1], &mix[2]) != 3 ||
+					mix[0] < 0 || mix[1] < 0 || mix[2] < 0 ||
+					mix[0] + mix[1] + mix[2] == 0)
+					usage();
+				break;
+			case 'r':
+				srand(atoi(optarg));
+				break;
+			default:
+				usage();
+		}
+	}
+	if (socket_path == NULL || word_path == NULL ||
+		nclients < 1 || depth < 1 || total < 1 || max_d < 0 || max_edits < 0)
+		usage();
+
+	load_words(word_path);
+
+	conns = calloc(nclients, sizeof(Conn));
+	pfds = calloc(nclients, sizeof(struct pollfd));
+	latencies = malloc(total * sizeof(double));
+	for (i = 0; i < nclients; i++)
+	{
+		conns[i].fd = connect_socket(socket_path);
+		fcntl(conns[i].fd, F_SETFL, O_NONBLOCK);
+		conns[i].sent = malloc(depth * sizeof(double));
+		conns[i].incap = 65536;
+		conns[i].in = malloc(conns[i].incap);
+	}
+
+	start = now_seconds();
+	for (i = 0; i < nclients && issued < total; i++)
+	{
+		int			n = (int) (total - issued < depth ? total - issued : depth);
+
+		send_requests(&conns[i], n);
+		issued += n;
+	}
+
+	while (done < total)
+	{
+		for (i = 0; i < nclients; i++)
+		{
+			pfds[i].fd = conns[i].fd;
+			pfds[i].events = conns[i].inflight > 0 ? POLLIN : 0;
+		}
+		if (poll(pfds, nclients, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			die("poll");
+		}
+
+		for (i = 0; i < nclients; i++)
+		{
+			Conn	   *c = &conns[i];
+			char	   *nl;
+			size_t		off = 0;
+			int			completed = 0;
+			ssize_t		n;
+
+			if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			if (c->incap - c->inlen < 4096)
+				c->in = realloc(c->in, c->incap *= 2);
+			n = read(c->fd, c->in + c->inlen, c->incap - c->inlen);
+			if (n == 0)
+			{
+				fprintf(stderr, "fuzzystrmatch_loadgen: server closed connection\n");
+				exit(1);
+			}
+			if (n < 0)
+			{
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				die("read");
+			}
+			c->inlen += n;
+
+			while ((nl = memchr(c->in + off, '\n', c->inlen - off)) != NULL)
+			{
+				if (strncmp(c->in + off, "OK\t", 3) == 0)
+					c->matches += atol(c->in + off + 3);
+				else
+					c->errors++;
+				latencies[done++] = now_seconds() - c->sent[c->head];
+				c->head = (c->head + 1) % depth;
+				c->inflight--;
+				completed++;
+				off = (nl - c->in) + 1;
+			}
+			memmove(c->in, c->in + off, c->inlen - off);
+			c->inlen -= off;
+
+			/* keep the pipeline full */
+			if (issued < total && completed > 0)
+			{
+				int			more = (int) (total - issued < completed ?
+										  total - issued : completed);
+
+				send_requests(c, more);
+				issued += more;
+			}
+		}
+	}
+	elapsed = now_seconds() - start;
+
+	for (i = 0; i < nclients; i++)
+	{
+		matches += conns[i].matches;
+		errors += conns[i].errors;
+		close(conns[i].fd);
+	}
+
+	qsort(latencies, total, sizeof(double), double_cmp);
+	printf("client:\n");
+	printf("  requests=%ld\n  errors=%ld\n  matches=%ld\n", total, errors, matches);
+	printf("  elapsed_s=%.3f\n  throughput_rps=%.1f\n", elapsed, total / elapsed);
+	printf("  latency_p50_us=%.1f\n  latency_p90_us=%.1f\n"
+		   "  latency_p99_us=%.1f\n  latency_max_us=%.1f\n",
+		   latencies[(long) (total * 0.50)] * 1e6,
+		   latencies[(long) (total * 0.90)] * 1e6,
+		   latencies[(long) (total * 0.99)] * 1e6,
+		   latencies[total - 1] * 1e6);
+
+	print_server_stats(socket_path);
+	return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,893 @@
+/*
+ * fuzzystrmatch_neighbourhood.c
+ *
+ * Edit neighbourhoods of a query, and index probes built from them.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_neighbourhood.c
+ *
+ * fuzzy_neighbourhood(query, k, alphabet) returns every string within
+ * Levenshtein distance k of query whose characters are all in alphabet or
+ * in query, once each and in byte order.  For a short query and k = 1 that
+ * is a few hundred strings: n deletions, and n substitutions and n + 1
+ * insertions of each alphabet character.  Each further level applies the
+ * same edits to the strings the previous one added, so the size grows
+ * roughly as the k-th power of that; the strings are counted against
+ * fuzzystrmatch.result_memory_limit.
+ *
+ * Probing a plain btree index for each of those strings is much cheaper
+ * than any scan that computes distances, but it only finds rows that are
+ * among the strings: a value with a character outside the alphabet is not,
+ * and neither is one too long for the Levenshtein functions, which would
+ * make a scan computing distances fail.  fuzzy_within_alphabet(value,
+ * alphabet) is true when value is neither, so a table that declares
+ *
+ *		CHECK (fuzzy_within_alphabet(col, 'alphabet'))
+ *
+ * guarantees that the neighbourhood of a query holds every value of col
+ * within the radius.  When this module is loaded (which, for the planner
+ * hook to see every query, means shared_preload_libraries or
+ * session_preload_libraries), a planner hook looks at the conditions ANDed
+ * together in each WHERE clause for
+ *
+ *		levenshtein_less_equal(col, 'query', k) <= r	(r <= k)
+ *		levenshtein(col, 'query') <= r
+ *
+ * and the same with < and with the comparison or the arguments the other
+ * way round, where col is a column of a table with such a constraint,
+ * validated and, if the scan includes child tables, inherited by them, and
+ * with a valid, non-partial btree index that starts with col.  If the query
+ * is short enough for the Levenshtein functions and the neighbourhood of
+ * radius r over the constraint's alphabet has at most
+ * fuzzystrmatch.neighbourhood_max_variants strings, estimated from the
+ * lengths before generating any, the condition
+ *
+ *		col = ANY ('{...}'::text[])
+ *
+ * is added next to the original one, which the planner can answer with the
+ * index.  The original condition is kept and still checks every row the
+ * probes return; since no value that can satisfy it is left out, and no
+ * comparison could have failed, the result is the same, and whether to use
+ * the index is left to the planner's costing.  With r > k the bounded
+ * function can return any value above k for a more distant string, so such
+ * conditions are left alone.  Dropping the constraint invalidates the
+ * plans that relied on it, as for any change to the table's definition.
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/table.h"
+#else
+#include "access/heapam.h"
+#endif
+#include "catalog/pg_am.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_index.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_operator.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/planner.h"
+#include "parser/parsetree.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/fmgroids.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+
+#if PG_VERSION_NUM >= 120000
+#define fzh_table_open(relid, lockmode)		table_open((relid), (lockmode))
+#define fzh_table_close(rel, lockmode)		table_close((rel), (lockmode))
+#else
+#define fzh_table_open(relid, lockmode)		heap_open((relid), (lockmode))
+#define fzh_table_close(rel, lockmode)		heap_close((rel), (lockmode))
+#endif
+#if PG_VERSION_NUM >= 110000
+#define fzh_attisnull(tuple, attnum)		heap_attisnull((tuple), (attnum), NULL)
+#else
+#define fzh_attisnull(tuple, attnum)		heap_attisnull((tuple), (attnum))
+#endif
+
+/* the default for fuzzystrmatch.neighbourhood_max_variants */
+#define FZH_DEFAULT_MAX_VARIANTS	1000
+#define FZH_MAX_VARIANTS			1000000
+
+/* MAX_LEVENSHTEIN_STRLEN in levenshtein.c */
+#define FZH_MAX_STRLEN				255
+
+int			fuzzystrmatch_neighbourhood_max_variants = FZH_DEFAULT_MAX_VARIANTS;
+
+static planner_hook_type prev_planner_hook = NULL;
+
+/* a string of the neighbourhood */
+typedef struct
+{
+	char	   *data;
+	int			len;
+} FzhString;
+
+/* a growing array of them */
+typedef struct
+{
+	FzhString  *items;
+	int			n;
+	int			size;
+} FzhStrings;
+
+/* the functions whose comparisons are rewritten */
+typedef enum
+{
+	FZH_NONE,
+	FZH_LEVENSHTEIN,			/* (x, q) */
+	FZH_LEVENSHTEIN_LESS_EQUAL,	/* (x, q, k) */
+	FZH_WITHIN_ALPHABET			/* (x, alphabet), in CHECK constraints */
+} FzhKind;
+
+extern Datum levenshtein(PG_FUNCTION_ARGS);
+extern Datum levenshtein_less_equal(PG_FUNCTION_ARGS);
+extern Datum fuzzy_neighbourhood(PG_FUNCTION_ARGS);
+extern Datum fuzzy_within_alphabet(PG_FUNCTION_ARGS);
+
+static int
+fzh_string_cmp(const void *a, const void *b)
+{
+	const FzhString *sa = (const FzhString *) a;
+	const FzhString *sb = (const FzhString *) b;
+	int			r = memcmp(sa->data, sb->data, Min(sa->len, sb->len));
+
+	if (r != 0)
+		return r;
+	return sa->len - sb->len;
+}
+
+static void
+fzh_append(FzhStrings *strings, char *data, int len)
+{
+	if (strings->n == strings->size)
+	{
+		strings->size = Max(strings->size * 2, 64);
+		if (strings->items == NULL)
+			strings->items = palloc(strings->size * sizeof(FzhString));
+		else
+			strings->items = repalloc(strings->items,
+									  strings->size * sizeof(FzhString));
+	}
+	strings->items[strings->n].data = data;
+	strings->items[strings->n].len = len;
+	strings->n++;
+}
+
+/* Sort strings and drop repeats */
+static void
+fzh_sort_unique(FzhStrings *strings)
+{
+	int			kept = 0;
+	int			i;
+
+	if (strings->n < 2)
+		return;
+	qsort(strings->items, strings->n, sizeof(FzhString), fzh_string_cmp);
+	for (i = 1; i < strings->n; i++)
+	{
+		if (fzh_string_cmp(&strings->items[i], &strings->items[kept]) != 0)
+			strings->items[++kept] = strings->items[i];
+	}
+	strings->n = kept + 1;
+}
+
+/*
+ * Split a string into its characters, as strings pointing into it, and
+ * return how many there are; chars must have room for len of them.
+ */
+static int
+fzh_split_chars(const char *s, int len, FzhString *chars)
+{
+	int			n = 0;
+	int			i = 0;
+
+	while (i < len)
+	{
+		int			l = pg_mblen(s + i);
+
+		chars[n].data = (char *) s + i;
+		chars[n].len = l;
+		n++;
+		i += l;
+	}
+	return n;
+}
+
+/*
+ * Append to out every string one edit away from s: with each of its
+ * characters deleted or replaced by another of alpha, and with each
+ * character of alpha inserted at each position.  *bytes is increased by
+ * the memory the new strings take.
+ */
+static void
+fzh_edits(const FzhString *s, const FzhString *alpha, int nalpha,
+		  FzhStrings *out, Size *bytes)
+{
+	FzhString  *chars = palloc((s->len + 1) * sizeof(FzhString));
+	int			n = fzh_split_chars(s->data, s->len, chars);
+	int			i,
+				a;
+
+	for (i = 0; i <= n; i++)
+	{
+		int			off = i < n ? chars[i].data - s->data : s->len;
+
+		/* delete character i */
+		if (i < n)
+		{
+			int			len = s->len - chars[i].len;
+			char	   *v = palloc(len + 1);
+
+			memcpy(v, s->data, off);
+			memcpy(v + off, s->data + off + chars[i].len, len - off);
+			fzh_append(out, v, len);
+			*bytes += len + 1;
+		}
+
+		for (a = 0; a < nalpha; a++)
+		{
+			int			len;
+			char	   *v;
+
+			/* replace character i */
+			if (i < n && (alpha[a].len != chars[i].len ||
+						  memcmp(alpha[a].data, chars[i].data,
+								 chars[i].len) != 0))
+			{
+				len = s->len - chars[i].len + alpha[a].len;
+				v = palloc(len + 1);
+				memcpy(v, s->data, off);
+				memcpy(v + off, alpha[a].data, alpha[a].len);
+				memcpy(v + off + alpha[a].len, s->data + off + chars[i].len,
+					   s->len - off - chars[i].len);
+				fzh_append(out, v, len);
+				*bytes += len + 1;
+			}
+
+			/* insert before character i */
+			len = s->len + alpha[a].len;
+			v = palloc(len + 1);
+			memcpy(v, s->data, off);
+			memcpy(v + off, alpha[a].data, alpha[a].len);
+			memcpy(v + off + alpha[a].len, s->data + off, s->len - off);
+			fzh_append(out, v, len);
+			*bytes += len + 1;
+		}
+	}
+	pfree(chars);
+}
+
+/*
+ * The distinct characters of alphabet and of the query, sorted; these are
+ * the ones edits may introduce.
+ */
+static FzhString *
+fzh_alphabet(const char *query, int query_len,
+			 const char *alphabet, int alphabet_len, int *nalpha)
+{
+	FzhStrings	chars;
+
+	chars.size = query_len + alphabet_len + 1;
+	chars.items = palloc(chars.size * sizeof(FzhString));
+	chars.n = fzh_split_chars(alphabet, alphabet_len, chars.items);
+	chars.n += fzh_split_chars(query, query_len, chars.items + chars.n);
+	fzh_sort_unique(&chars);
+	*nalpha = chars.n;
+	return chars.items;
+}
+
+/*
+ * Every string within distance k of query over the characters of alphabet
+ * and of the query, sorted and distinct.  Memory comes from the current
+ * context, and with check_memory is checked against
+ * fuzzystrmatch.result_memory_limit as the strings are generated; the planner
+ * hook bounds the count beforehand instead, so that planning never fails.
+ */
+static FzhStrings
+fzh_neighbourhood(const char *query, int query_len, int k,
+				  const char *alphabet, int alphabet_len, bool check_memory)
+{
+	FzhStrings	all;
+	FzhStrings	level;
+	FzhString  *alpha;
+	int			nalpha;
+	Size		bytes = 0;
+	int			step;
+
+	alpha = fzh_alphabet(query, query_len, alphabet, alphabet_len, &nalpha);
+
+	memset(&all, 0, sizeof(all));
+	memset(&level, 0, sizeof(level));
+	fzh_append(&level, pnstrdup(query, query_len), query_len);
+
+	for (step = 0; step < k && level.n > 0; step++)
+	{
+		FzhStrings	next;
+		FzhStrings	merged;
+		int			i,
+					j;
+
+		memset(&next, 0, sizeof(next));
+		for (i = 0; i < level.n; i++)
+		{
+			CHECK_FOR_INTERRUPTS();
+			fzh_edits(&level.items[i], alpha, nalpha, &next, &bytes);
+			if (check_memory)
+				fuzzy_check_result_memory(NULL,
+										bytes + next.size * sizeof(FzhString));
+		}
+		fzh_sort_unique(&next);
+
+		/*
+		 * Keep the last level with the rest, and make the strings this one
+		 * found that no earlier one had the next to expand.
+		 */
+		memset(&merged, 0, sizeof(merged));
+		for (i = 0; i < level.n; i++)
+			fzh_append(&merged, level.items[i].data, level.items[i].len);
+		for (i = 0; i < all.n; i++)
+			fzh_append(&merged, all.items[i].data, all.items[i].len);
+		fzh_sort_unique(&merged);
+
+		level.n = 0;
+		for (i = 0, j = 0; i < next.n; i++)
+		{
+			while (j < merged.n &&
+				   fzh_string_cmp(&merged.items[j], &next.items[i]) < 0)
+				j++;
+			if (j == merged.n ||
+				fzh_string_cmp(&merged.items[j], &next.items[i]) != 0)
+				fzh_append(&level, next.items[i].data, next.items[i].len);
+		}
+		if (all.items != NULL)
+			pfree(all.items);
+		all = merged;
+		pfree(next.items);
+	}
+
+	for (step = 0; step < level.n; step++)
+		fzh_append(&all, level.items[step].data, level.items[step].len);
+	fzh_sort_unique(&all);
+	return all;
+}
+
+/*
+ * fuzzy_neighbourhood(query, k, alphabet): the strings within distance k
+ * of query, over the characters of alphabet and query
+ */
+PG_FUNCTION_INFO_V1(fuzzy_neighbourhood);
+Datum
+fuzzy_neighbourhood(PG_FUNCTION_ARGS)
+{
+	text	   *query = PG_GETARG_TEXT_PP(0);
+	int			k = PG_GETARG_INT32(1);
+	text	   *alphabet = PG_GETARG_TEXT_PP(2);
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	MemoryContext scratch;
+	MemoryContext oldcontext;
+	FzhStrings	strings;
+	int			i;
+
+	if (k < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("k must not be negative")));
+
+	tupstore = init_materialize_srf(fcinfo, &tupdesc);
+
+	scratch = AllocSetContextCreate(CurrentMemoryContext,
+									"fuzzy_neighbourhood",
+									ALLOCSET_DEFAULT_MINSIZE,
+									ALLOCSET_DEFAULT_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(scratch);
+	strings = fzh_neighbourhood(VARDATA_ANY(query), VARSIZE_ANY_EXHDR(query),
+								k, VARDATA_ANY(alphabet),
+								VARSIZE_ANY_EXHDR(alphabet), true);
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < strings.n; i++)
+	{
+		Datum		value;
+		bool		isnull = false;
+
+		value = PointerGetDatum(cstring_to_text_with_len(strings.items[i].data,
+													strings.items[i].len));
+		tuplestore_putvalues(tupstore, tupdesc, &value, &isnull);
+		pfree(DatumGetPointer(value));
+	}
+	MemoryContextDelete(scratch);
+
+	return (Datum) 0;
+}
+
+/*
+ * fuzzy_within_alphabet(value, alphabet): whether value is made of
+ * characters of alphabet only, and no longer than the Levenshtein functions
+ * take; see the top of the file for what declaring it in a CHECK constraint
+ * allows
+ */
+PG_FUNCTION_INFO_V1(fuzzy_within_alphabet);
+Datum
+fuzzy_within_alphabet(PG_FUNCTION_ARGS)
+{
+	text	   *value = PG_GETARG_TEXT_PP(0);
+	text	   *alphabet = PG_GETARG_TEXT_PP(1);
+	const char *s = VARDATA_ANY(value);
+	int			len = VARSIZE_ANY_EXHDR(value);
+	FzhString  *alpha;
+	int			nalpha;
+	int			nchars = 0;
+	int			i = 0;
+	bool		within = true;
+
+	alpha = fzh_alphabet("", 0, VARDATA_ANY(alphabet),
+						 VARSIZE_ANY_EXHDR(alphabet), &nalpha);
+	while (i < len && within)
+	{
+		FzhString	c;
+
+		c.data = (char *) s + i;
+		c.len = pg_mblen(s + i);
+		within = ++nchars <= FZH_MAX_STRLEN &&
+			bsearch(&c, alpha, nalpha, sizeof(FzhString),
+					fzh_string_cmp) != NULL;
+		i += c.len;
+	}
+	pfree(alpha);
+
+	PG_RETURN_BOOL(within);
+}
+
+/* A non-null constant, under any relabelling, or NULL */
+static Const *
+fzh_const(Node *node)
+{
+	while (node != NULL && IsA(node, RelabelType))
+		node = (Node *) ((RelabelType *) node)->arg;
+	if (node == NULL || !IsA(node, Const) || ((Const *) node)->constisnull)
+		return NULL;
+	return (Const *) node;
+}
+
+/*
+ * Which of the functions looked for a function is, if any; see
+ * fzb_function_kind() in fuzzystrmatch_batch.c.
+ */
+static FzhKind
+fzh_function_kind(Oid funcid, int nargs)
+{
+	HeapTuple	tuple;
+	Form_pg_proc proc;
+	Datum		datum;
+	bool		isnull;
+	char	   *probin;
+	char	   *prosrc;
+	PGFunction	address = NULL;
+	FzhKind		kind = FZH_NONE;
+
+	tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid));
+	if (!HeapTupleIsValid(tuple))
+		return FZH_NONE;
+	proc = (Form_pg_proc) GETSTRUCT(tuple);
+	if (proc->prolang != ClanguageId || proc->proretset)
+	{
+		ReleaseSysCache(tuple);
+		return FZH_NONE;
+	}
+
+	datum = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_probin, &isnull);
+	probin = isnull ? NULL : TextDatumGetCString(datum);
+	datum = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_prosrc, &isnull);
+	prosrc = isnull ? NULL : TextDatumGetCString(datum);
+	ReleaseSysCache(tuple);
+	if (probin == NULL || prosrc == NULL ||
+		strstr(probin, "fuzzystrmatch") == NULL)
+		return FZH_NONE;
+
+	if (strcmp(prosrc, "levenshtein") == 0 && nargs == 2)
+	{
+		kind = FZH_LEVENSHTEIN;
+		address = levenshtein;
+	}
+	else if (strcmp(prosrc, "levenshtein_less_equal") == 0 && nargs == 3)
+	{
+		kind = FZH_LEVENSHTEIN_LESS_EQUAL;
+		address = levenshtein_less_equal;
+	}
+	else if (strcmp(prosrc, "fuzzy_within_alphabet") == 0 && nargs == 2)
+	{
+		kind = FZH_WITHIN_ALPHABET;
+		address = fuzzy_within_alphabet;
+	}
+	if (kind != FZH_NONE &&
+		(void *) load_external_function(probin, prosrc, false, NULL) !=
+		(void *) address)
+		kind = FZH_NONE;
+	return kind;
+}
+
+/* Whether a table has a usable btree index whose first column is attno */
+static bool
+fzh_has_btree(Relation rel, AttrNumber attno)
+{
+	List	   *indexes = RelationGetIndexList(rel);
+	bool		found = false;
+	ListCell   *lc;
+
+	foreach(lc, indexes)
+	{
+		Oid			indexoid = lfirst_oid(lc);
+		HeapTuple	tuple;
+		Form_pg_index index;
+		bool		usable;
+
+		tuple = SearchSysCache1(INDEXRELID, ObjectIdGetDatum(indexoid));
+		if (!HeapTupleIsValid(tuple))
+			continue;
+		index = (Form_pg_index) GETSTRUCT(tuple);
+		usable = index->indisvalid && index->indnatts > 0 &&
+			index->indkey.values[0] == attno &&
+			fzh_attisnull(tuple, Anum_pg_index_indpred);
+		ReleaseSysCache(tuple);
+		if (!usable)
+			continue;
+
+		tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(indexoid));
+		if (!HeapTupleIsValid(tuple))
+			continue;
+		found = ((Form_pg_class) GETSTRUCT(tuple))->relam == BTREE_AM_OID;
+		ReleaseSysCache(tuple);
+		if (found)
+			break;
+	}
+	list_free(indexes);
+	return found;
+}
+
+/*
+ * The alphabet of a fuzzy_within_alphabet(col, 'alphabet') check among the
+ * conjuncts of a CHECK constraint's expression, where col is column attno,
+ * or NULL
+ */
+static char *
+fzh_check_alphabet(Node *node, AttrNumber attno)
+{
+	FuncExpr   *call;
+	Node	   *arg;
+	Const	   *alphabet;
+
+	if (IsA(node, BoolExpr) && ((BoolExpr *) node)->boolop == AND_EXPR)
+	{
+		ListCell   *lc;
+
+		foreach(lc, ((BoolExpr *) node)->args)
+		{
+			char	   *found = fzh_check_alphabet(lfirst(lc), attno);
+
+			if (found != NULL)
+				return found;
+		}
+		return NULL;
+	}
+	if (!IsA(node, FuncExpr))
+		return NULL;
+	call = (FuncExpr *) node;
+	if (fzh_function_kind(call->funcid, list_length(call->args)) !=
+		FZH_WITHIN_ALPHABET)
+		return NULL;
+
+	arg = linitial(call->args);
+	while (IsA(arg, RelabelType))
+		arg = (Node *) ((RelabelType *) arg)->arg;
+	alphabet = fzh_const(lsecond(call->args));
+	if (!IsA(arg, Var) || ((Var *) arg)->varattno != attno ||
+		alphabet == NULL)
+		return NULL;
+	return TextDatumGetCString(alphabet->constvalue);
+}
+
+/*
+ * The alphabet a table's CHECK constraints guarantee the values of column
+ * attno to be made of, and short enough, or NULL.  Constraints not yet
+ * validated, and with inh those that child tables do not inherit, say
+ * nothing about the rows a scan returns; nor do those of foreign tables,
+ * which are not enforced.
+ */
+static char *
+fzh_alphabet_of(Relation rel, AttrNumber attno, bool inh)
+{
+	TupleConstr *constr = RelationGetDescr(rel)->constr;
+	int			i;
+
+	switch (rel->rd_rel->relkind)
+	{
+		case RELKIND_RELATION:
+#if PG_VERSION_NUM >= 100000
+		case RELKIND_PARTITIONED_TABLE:
+#endif
+			break;
+		default:
+			return NULL;
+	}
+	if (constr == NULL)
+		return NULL;
+	for (i = 0; i < constr->num_check; i++)
+	{
+		ConstrCheck *check = &constr->check[i];
+		char	   *alphabet;
+
+		if (!check->ccvalid || (inh && check->ccnoinherit))
+			continue;
+		alphabet = fzh_check_alphabet(stringToNode(check->ccbin), attno);
+		if (alphabet != NULL)
+			return alphabet;
+	}
+	return NULL;
+}
+
+/*
+ * An upper bound on the size of the neighbourhood of radius r of a query of
+ * n characters over nalpha characters.
+ */
+static double
+fzh_estimate(int n, int nalpha, int r)
+{
+	double		level = 1.0 + n + (double) n * nalpha + (double) (n + 1) * nalpha;
+	double		estimate = 1.0;
+	int			i;
+
+	for (i = 0; i < r && estimate <= FZH_MAX_VARIANTS; i++)
+		estimate *= level;
+	return estimate;
+}
+
+/*
+ * If a condition is one that can be rewritten (see the top of the file),
+ * return the condition to add next to it, otherwise NULL.
+ */
+static Node *
+fzh_probe_for(Query *parse, OpExpr *op)
+{
+	Node	   *call_node;
+	Const	   *bound;
+	bool		strict;
+	FuncExpr   *call;
+	FzhKind		kind;
+	int			radius;
+	Node	   *col_arg;
+	Const	   *query;
+	Node	   *col;
+	RangeTblEntry *rte;
+	Relation	rel;
+	char	   *alphabet;
+	bool		usable;
+	text	   *q;
+	int			q_len;
+	int			nalpha;
+	MemoryContext scratch;
+	MemoryContext oldcontext;
+	FzhStrings	strings;
+	Datum	   *elems;
+	ArrayType  *array;
+	ScalarArrayOpExpr *saop;
+	int			i;
+
+	if (list_length(op->args) != 2)
+		return NULL;
+	switch (op->opfuncid)
+	{
+		case F_INT4LE:
+		case F_INT4LT:
+			call_node = linitial(op->args);
+			bound = fzh_const(lsecond(op->args));
+			strict = op->opfuncid == F_INT4LT;
+			break;
+		case F_INT4GE:
+		case F_INT4GT:
+			call_node = lsecond(op->args);
+			bound = fzh_const(linitial(op->args));
+			strict = op->opfuncid == F_INT4GT;
+			break;
+		default:
+			return NULL;
+	}
+	if (bound == NULL || !IsA(call_node, FuncExpr))
+		return NULL;
+	call = (FuncExpr *) call_node;
+	kind = fzh_function_kind(call->funcid, list_length(call->args));
+	if (kind != FZH_LEVENSHTEIN && kind != FZH_LEVENSHTEIN_LESS_EQUAL)
+		return NULL;
+
+	radius = DatumGetInt32(bound->constvalue) - (strict ? 1 : 0);
+	if (radius < 0)
+		return NULL;
+	if (kind == FZH_LEVENSHTEIN_LESS_EQUAL)
+	{
+		Const	   *max_d = fzh_const(lthird(call->args));
+
+		if (max_d == NULL || radius > DatumGetInt32(max_d->constvalue))
+			return NULL;
+	}
+
+	/* one argument a column, the other a constant */
+	query = fzh_const(lsecond(call->args));
+	col_arg = linitial(call->args);
+	if (query == NULL)
+	{
+		query = fzh_const(linitial(call->args));
+		col_arg = lsecond(call->args);
+	}
+	if (query == NULL)
+		return NULL;
+	col = col_arg;
+	while (IsA(col, RelabelType))
+		col = (Node *) ((RelabelType *) col)->arg;
+	if (!IsA(col, Var) || ((Var *) col)->varlevelsup != 0 ||
+		((Var *) col)->varattno <= 0)
+		return NULL;
+	rte = rt_fetch(((Var *) col)->varno, parse->rtable);
+	if (rte->rtekind != RTE_RELATION)
+		return NULL;
+
+	/* a longer query makes the functions fail, which must not change */
+	q = DatumGetTextPP(query->constvalue);
+	q_len = VARSIZE_ANY_EXHDR(q);
+	if (pg_mbstrlen_with_len(VARDATA_ANY(q), q_len) > FZH_MAX_STRLEN)
+		return NULL;
+
+	rel = fzh_table_open(rte->relid, NoLock);
+	alphabet = fzh_alphabet_of(rel, ((Var *) col)->varattno, rte->inh);
+	usable = alphabet != NULL;
+	if (usable)
+	{
+		pfree(fzh_alphabet(VARDATA_ANY(q), q_len, alphabet, strlen(alphabet),
+						   &nalpha));
+		usable = fzh_estimate(pg_mbstrlen_with_len(VARDATA_ANY(q), q_len),
+							  nalpha, radius) <=
+			fuzzystrmatch_neighbourhood_max_variants &&
+			fzh_has_btree(rel, ((Var *) col)->varattno);
+	}
+	fzh_table_close(rel, NoLock);
+	if (!usable)
+		return NULL;
+
+	scratch = AllocSetContextCreate(CurrentMemoryContext,
+									"fuzzystrmatch neighbourhood",
+									ALLOCSET_DEFAULT_MINSIZE,
+									ALLOCSET_DEFAULT_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(scratch);
+	strings = fzh_neighbourhood(VARDATA_ANY(q), q_len, radius,
+								alphabet, strlen(alphabet), false);
+	MemoryContextSwitchTo(oldcontext);
+	elems = palloc(strings.n * sizeof(Datum));
+	for (i = 0; i < strings.n; i++)
+		elems[i] = PointerGetDatum(cstring_to_text_with_len(strings.items[i].data,
+													strings.items[i].len));
+	array = construct_array(elems, strings.n, TEXTOID, -1, false, 'i');
+	MemoryContextDelete(scratch);
+
+	saop = makeNode(ScalarArrayOpExpr);
+	saop->opno = TextEqualOperator;
+	saop->opfuncid = F_TEXTEQ;
+	saop->useOr = true;
+	saop->inputcollid = exprCollation(col_arg);
+	saop->args = list_make2(copyObject(col_arg),
+							makeConst(TEXTARRAYOID, -1, DEFAULT_COLLATION_OID,
+									  -1, PointerGetDatum(array),
+									  false, false));
+	saop->location = -1;
+	return (Node *) saop;
+}
+
+/* Collect the conditions to add for the conjuncts of a WHERE clause */
+static void
+fzh_collect(Query *parse, Node *node, List **probes)
+{
+	if (node == NULL)
+		return;
+	if (IsA(node, BoolExpr) && ((BoolExpr *) node)->boolop == AND_EXPR)
+	{
+		ListCell   *lc;
+
+		foreach(lc, ((BoolExpr *) node)->args)
+			fzh_collect(parse, lfirst(lc), probes);
+	}
+	else if (IsA(node, OpExpr))
+	{
+		Node	   *probe = fzh_probe_for(parse, (OpExpr *) node);
+
+		if (probe != NULL)
+			*probes = lappend(*probes, probe);
+	}
+}
+
+/* Add the probes to a query's WHERE clause, and those of its subqueries */
+static void
+fzh_rewrite_query(Query *parse)
+{
+	ListCell   *lc;
+
+	foreach(lc, parse->rtable)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+		if (rte->rtekind == RTE_SUBQUERY)
+			fzh_rewrite_query(rte->subquery);
+	}
+	foreach(lc, parse->cteList)
+	{
+		CommonTableExpr *cte = (CommonTableExpr *) lfirst(lc);
+
+		if (IsA(cte->ctequery, Query))
+			fzh_rewrite_query((Query *) cte->ctequery);
+	}
+
+	if (parse->jointree != NULL && parse->jointree->quals != NULL)
+	{
+		List	   *probes = NIL;
+
+		fzh_collect(parse, parse->jointree->quals, &probes);
+		if (probes != NIL)
+			parse->jointree->quals = (Node *)
+				makeBoolExpr(AND_EXPR,
+							 lcons(parse->jointree->quals, probes), -1);
+	}
+}
+
+#if PG_VERSION_NUM >= 130000
+static PlannedStmt *
+fzh_planner(Query *parse, const char *query_string, int cursorOptions,
+			ParamListInfo boundParams)
+#else
+static PlannedStmt *
+fzh_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
+#endif
+{
+	if (fuzzystrmatch_neighbourhood_max_variants > 0)
+		fzh_rewrite_query(parse);
+
+#if PG_VERSION_NUM >= 130000
+	if (prev_planner_hook)
+		return prev_planner_hook(parse, query_string, cursorOptions,
+								 boundParams);
+	return standard_planner(parse, query_string, cursorOptions, boundParams);
+#else
+	if (prev_planner_hook)
+		return prev_planner_hook(parse, cursorOptions, boundParams);
+	return standard_planner(parse, cursorOptions, boundParams);
+#endif
+}
+
+void
+fuzzystrmatch_neighbourhood_init(void)
+{
+	DefineCustomIntVariable("fuzzystrmatch.neighbourhood_max_variants",
+		  "Largest neighbourhood a levenshtein condition is turned into probes for.",
+							"0 disables turning levenshtein conditions into index probes.",
+							&fuzzystrmatch_neighbourhood_max_variants,
+							FZH_DEFAULT_MAX_VARIANTS,
+							0,
+							FZH_MAX_VARIANTS,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	prev_planner_hook = planner_hook;
+	planner_hook = fzh_planner;
+}
@@ -0,0 +1,572 @@
+/*
+ * fuzzystrmatch_parallel.c
+ *
+ * Parallel fuzzy search over a candidate array using dynamic background
+ * workers.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_parallel.c
+ *
+ * fuzzy_search_parallel(query, candidates, max_d) returns the candidates
+ * within Levenshtein distance max_d of the query, like filtering with
+ * levenshtein_less_equal() but using several processes.  The leader copies
+ * the query and candidates into a dynamic shared memory segment and
+ * launches up to fuzzystrmatch.max_workers workers.  Workers and leader
+ * then repeatedly claim chunks of candidates under a spinlock, so fast and
+ * slow processes even out; each worker sends the (candidate number,
+ * distance) pairs it finds back to the leader through its own shm_mq,
+ * while the leader turns them into result rows.
+ *
+ * The workers only run the kernel on bytes in shared memory, so they do not
+ * connect to a database: all they take from the leader is its encoding.
+ * Any error in a worker is passed back and re-raised by the leader, and if
+ * the leader errors out (including on cancellation) it terminates the
+ * workers before propagating the error.
+ */
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/spin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#if PG_VERSION_NUM >= 100000
+#include "pgstat.h"
+#endif
+
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+
+/* API differences between the server versions we build against */
+#if PG_VERSION_NUM >= 90500
+#define fzp_dsm_create(size)	dsm_create((size), 0)
+#define FZP_LATCH				MyLatch
+#else
+#define fzp_dsm_create(size)	dsm_create(size)
+#define FZP_LATCH				(&MyProc->procLatch)
+#endif
+#if PG_VERSION_NUM >= 100000
+#define fzp_toc_lookup(toc, key)	shm_toc_lookup((toc), (key), false)
+#define fzp_wait_latch() \
+	WaitLatch(FZP_LATCH, WL_LATCH_SET | WL_POSTMASTER_DEATH, 0, PG_WAIT_EXTENSION)
+#else
+#define fzp_toc_lookup(toc, key)	shm_toc_lookup((toc), (key))
+#define fzp_wait_latch() \
+	WaitLatch(FZP_LATCH, WL_LATCH_SET | WL_POSTMASTER_DEATH, 0)
+#endif
+
+#define FZP_MAGIC				0x465a5331
+#define FZP_KEY_HEADER			0
+#define FZP_KEY_QUERY			1
+#define FZP_KEY_OFFSETS			2
+#define FZP_KEY_DATA			3
+#define FZP_KEY_QUEUE_BASE		100
+
+/* candidates handed out at a time, and at most one message's worth */
+#define FZP_CHUNK_SIZE			1024
+
+/* don't start a worker for fewer candidates than this */
+#define FZP_MIN_CANDIDATES_PER_WORKER	(4 * FZP_CHUNK_SIZE)
+
+#define FZP_QUEUE_SIZE			(64 * 1024)
+#define FZP_ERRMSG_LEN			256
+
+typedef struct
+{
+	slock_t		mutex;
+	int			encoding;
+	int			max_d;
+	int			query_bytes;
+	uint32		ncandidates;
+
+	/* protected by mutex */
+	uint32		next_candidate;
+	int			nattached;		/* workers that have taken a queue */
+	int			nfinished;		/* workers that completed normally */
+	bool		failed;
+	char		errmsg[FZP_ERRMSG_LEN];
+} FzpHeader;
+
+typedef struct
+{
+	uint32		candidate;
+	int32		distance;
+} FzpMatch;
+
+/* the shared state as seen by one process */
+typedef struct
+{
+	FzpHeader  *hdr;
+	const char *query;
+	const uint32 *offsets;		/* ncandidates + 1 entries */
+	const char *data;
+} FzpShared;
+
+int			fuzzystrmatch_max_workers = 4;
+
+extern Datum fuzzy_search_parallel(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT void fuzzy_search_worker_main(Datum main_arg);
+
+void
+fuzzystrmatch_parallel_init(void)
+{
+	DefineCustomIntVariable("fuzzystrmatch.max_workers",
+			 "Maximum number of background workers per parallel fuzzy search.",
+							NULL,
+							&fuzzystrmatch_max_workers,
+							4,
+							0,
+							MAX_BACKENDS,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/*
+ * Claim the next chunk of candidates; returns false when none are left, or
+ * when a worker has failed and the search is being abandoned.
+ */
+static bool
+fzp_claim_chunk(FzpHeader *hdr, uint32 *start, uint32 *end)
+{
+	volatile FzpHeader *vhdr = hdr;
+	bool		result;
+
+	SpinLockAcquire(&hdr->mutex);
+	*start = vhdr->next_candidate;
+	*end = Min(*start + FZP_CHUNK_SIZE, vhdr->ncandidates);
+	vhdr->next_candidate = *end;
+	result = *start < *end && !vhdr->failed;
+	SpinLockRelease(&hdr->mutex);
+
+	return result;
+}
+
+/* Compare the query with candidates [start, end); returns the match count */
+static int
+fzp_search_chunk(FzpShared *sh, uint32 start, uint32 end, FzpMatch *matches,
+				 MemoryContext chunk_context)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(chunk_context);
+	int			nmatches = 0;
+	int			max_d = sh->hdr->max_d;
+	uint32		i;
+
+	for (i = start; i < end; i++)
+	{
+		int			d;
+
+		d = levenshtein_less_equal_internal(sh->query, sh->hdr->query_bytes,
+											sh->data + sh->offsets[i],
+											sh->offsets[i + 1] - sh->offsets[i],
+											1, 1, 1, 0, max_d);
+		if (d <= max_d)
+		{
+			matches[nmatches].candidate = i;
+			matches[nmatches].distance = d;
+			nmatches++;
+		}
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(chunk_context);
+	return nmatches;
+}
+
+static void
+fzp_attach_shared(shm_toc *toc, FzpShared *sh)
+{
+	sh->hdr = fzp_toc_lookup(toc, FZP_KEY_HEADER);
+	sh->query = fzp_toc_lookup(toc, FZP_KEY_QUERY);
+	sh->offsets = fzp_toc_lookup(toc, FZP_KEY_OFFSETS);
+	sh->data = fzp_toc_lookup(toc, FZP_KEY_DATA);
+}
+
+/*
+ * Background worker entry point.  main_arg is the handle of the segment set
+ * up by the leader.
+ */
+void
+fuzzy_search_worker_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	shm_toc    *toc;
+	FzpShared	sh;
+	volatile FzpHeader *vhdr;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+	MemoryContext chunk_context;
+	FzpMatch   *matches;
+	int			worker_number;
+	uint32		start,
+				end;
+
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "fuzzystrmatch worker");
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+	toc = shm_toc_attach(FZP_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("bad magic number in dynamic shared memory segment")));
+	fzp_attach_shared(toc, &sh);
+	vhdr = sh.hdr;
+
+	SpinLockAcquire(&sh.hdr->mutex);
+	worker_number = vhdr->nattached++;
+	SpinLockRelease(&sh.hdr->mutex);
+
+	mq = fzp_toc_lookup(toc, FZP_KEY_QUEUE_BASE + worker_number);
+	shm_mq_set_sender(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+	SetDatabaseEncoding(sh.hdr->encoding);
+	chunk_context = AllocSetContextCreate(TopMemoryContext,
+										  "fuzzystrmatch worker",
+										  ALLOCSET_DEFAULT_MINSIZE,
+										  ALLOCSET_DEFAULT_INITSIZE,
+										  ALLOCSET_DEFAULT_MAXSIZE);
+	matches = palloc(FZP_CHUNK_SIZE * sizeof(FzpMatch));
+
+	PG_TRY();
+	{
+		while (fzp_claim_chunk(sh.hdr, &start, &end))
+		{
+			int			nmatches;
+
+			CHECK_FOR_INTERRUPTS();
+
+			nmatches = fzp_search_chunk(&sh, start, end, matches, chunk_context);
+			if (nmatches > 0 &&
+				shm_mq_send(mqh, nmatches * sizeof(FzpMatch), matches,
+							false) != SHM_MQ_SUCCESS)
+			{
+				/* the leader has gone away; nobody wants the answer */
+				proc_exit(0);
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(TopMemoryContext);
+		edata = CopyErrorData();
+		SpinLockAcquire(&sh.hdr->mutex);
+		if (!vhdr->failed)
+		{
+			vhdr->failed = true;
+			strlcpy((char *) vhdr->errmsg, edata->message, FZP_ERRMSG_LEN);
+		}
+		SpinLockRelease(&sh.hdr->mutex);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	SpinLockAcquire(&sh.hdr->mutex);
+	vhdr->nfinished++;
+	SpinLockRelease(&sh.hdr->mutex);
+
+	dsm_detach(seg);
+	proc_exit(0);
+}
+
+static void
+fzp_put_matches(Tuplestorestate *tupstore, TupleDesc tupdesc,
+				Datum *candidates, const FzpMatch *matches, int nmatches)
+{
+	int			i;
+
+	for (i = 0; i < nmatches; i++)
+	{
+		Datum		values[2];
+		bool		nulls[2] = {false, false};
+
+		values[0] = candidates[matches[i].candidate];
+		values[1] = Int32GetDatum(matches[i].distance);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+}
+
+/*
+ * fuzzy_search_parallel(query text, candidates text[], max_d int,
+ *						 OUT candidate text, OUT distance int)
+ *	returns setof record
+ *
+ * Rows come back in no particular order.  Null candidates are ignored.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_search_parallel);
+Datum
+fuzzy_search_parallel(PG_FUNCTION_ARGS)
+{
+	text	   *query = PG_GETARG_TEXT_PP(0);
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(1);
+	int			max_d = PG_GETARG_INT32(2);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = init_materialize_srf(fcinfo, &tupdesc);
+	Datum	   *elems;
+	bool	   *elem_nulls;
+	int			nelems;
+	Datum	   *candidates;
+	uint32		ncandidates = 0;
+	uint64		data_size = 0;
+	int			nworkers;
+	int			nlaunched = 0;
+	shm_toc_estimator e;
+	Size		segsize;
+	dsm_segment *seg;
+	shm_toc    *toc;
+	FzpShared	sh;
+	volatile FzpHeader *vhdr;
+	uint32	   *offsets;
+	char	   *data;
+	shm_mq_handle **mqh;
+	BackgroundWorkerHandle **handles;
+	MemoryContext chunk_context;
+	FzpMatch   *matches;
+	uint32		start,
+				end;
+	int			i;
+
+	if (max_d < 0)
+		return (Datum) 0;
+
+	/* catch an over-long query here rather than once in every worker */
+	if (pg_mbstrlen_with_len(VARDATA_ANY(query),
+							 VARSIZE_ANY_EXHDR(query)) > MAX_LEVENSHTEIN_STRLEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("argument exceeds the maximum length of %d bytes",
+						MAX_LEVENSHTEIN_STRLEN)));
+
+	deconstruct_array(array, TEXTOID, -1, false, 'i',
+					  &elems, &elem_nulls, &nelems);
+	candidates = palloc(Max(nelems, 1) * sizeof(Datum));
+	for (i = 0; i < nelems; i++)
+	{
+		if (elem_nulls[i])
+			continue;
+		candidates[ncandidates++] = elems[i];
+		data_size += VARSIZE_ANY_EXHDR(DatumGetPointer(elems[i]));
+	}
+	if (data_size > MaxAllocSize)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("candidate array is too large for a parallel search")));
+
+	nworkers = Min(fuzzystrmatch_max_workers,
+				   ncandidates / FZP_MIN_CANDIDATES_PER_WORKER);
+#if PG_VERSION_NUM >= 100000
+	nworkers = Min(nworkers, max_parallel_workers);
+#endif
+	nworkers = Min(nworkers, max_worker_processes);
+
+	chunk_context = AllocSetContextCreate(CurrentMemoryContext,
+										  "fuzzy_search_parallel",
+										  ALLOCSET_DEFAULT_MINSIZE,
+										  ALLOCSET_DEFAULT_INITSIZE,
+										  ALLOCSET_DEFAULT_MAXSIZE);
+	matches = palloc(FZP_CHUNK_SIZE * sizeof(FzpMatch));
+
+	/* set up the shared state; with no workers it simply lives locally */
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, sizeof(FzpHeader));
+	shm_toc_estimate_chunk(&e, VARSIZE_ANY_EXHDR(query));
+	shm_toc_estimate_chunk(&e, (ncandidates + 1) * sizeof(uint32));
+	shm_toc_estimate_chunk(&e, data_size);
+	for (i = 0; i < nworkers; i++)
+		shm_toc_estimate_chunk(&e, FZP_QUEUE_SIZE);
+	shm_toc_estimate_keys(&e, 4 + nworkers);
+	segsize = shm_toc_estimate(&e);
+
+	if (nworkers > 0)
+	{
+		seg = fzp_dsm_create(segsize);
+		toc = shm_toc_create(FZP_MAGIC, dsm_segment_address(seg), segsize);
+	}
+	else
+	{
+		seg = NULL;
+		toc = shm_toc_create(FZP_MAGIC, palloc(segsize), segsize);
+	}
+
+	sh.hdr = shm_toc_allocate(toc, sizeof(FzpHeader));
+	vhdr = sh.hdr;
+	SpinLockInit(&sh.hdr->mutex);
+	sh.hdr->encoding = GetDatabaseEncoding();
+	sh.hdr->max_d = max_d;
+	sh.hdr->query_bytes = VARSIZE_ANY_EXHDR(query);
+	sh.hdr->ncandidates = ncandidates;
+	sh.hdr->next_candidate = 0;
+	sh.hdr->nattached = 0;
+	sh.hdr->nfinished = 0;
+	sh.hdr->failed = false;
+	sh.hdr->errmsg[0] = '\0';
+	shm_toc_insert(toc, FZP_KEY_HEADER, sh.hdr);
+
+	sh.query = shm_toc_allocate(toc, VARSIZE_ANY_EXHDR(query));
+	memcpy((char *) sh.query, VARDATA_ANY(query), VARSIZE_ANY_EXHDR(query));
+	shm_toc_insert(toc, FZP_KEY_QUERY, (void *) sh.query);
+
+	offsets = shm_toc_allocate(toc, (ncandidates + 1) * sizeof(uint32));
+	data = shm_toc_allocate(toc, data_size);
+	offsets[0] = 0;
+	for (i = 0; i < (int) ncandidates; i++)
+	{
+		text	   *t = (text *) DatumGetPointer(candidates[i]);
+
+		memcpy(data + offsets[i], VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t));
+		offsets[i + 1] = offsets[i] + VARSIZE_ANY_EXHDR(t);
+	}
+	shm_toc_insert(toc, FZP_KEY_OFFSETS, offsets);
+	shm_toc_insert(toc, FZP_KEY_DATA, data);
+	sh.offsets = offsets;
+	sh.data = data;
+
+	/* create the queues and launch as many workers as we can get */
+	mqh = palloc0(Max(nworkers, 1) * sizeof(shm_mq_handle *));
+	handles = palloc0(Max(nworkers, 1) * sizeof(BackgroundWorkerHandle *));
+	for (i = 0; i < nworkers; i++)
+	{
+		shm_mq	   *mq = shm_mq_create(shm_toc_allocate(toc, FZP_QUEUE_SIZE),
+									   FZP_QUEUE_SIZE);
+
+		shm_toc_insert(toc, FZP_KEY_QUEUE_BASE + i, mq);
+		shm_mq_set_receiver(mq, MyProc);
+		mqh[i] = shm_mq_attach(mq, seg, NULL);
+	}
+	for (i = 0; i < nworkers; i++)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		snprintf(worker.bgw_name, BGW_MAXLEN, "fuzzystrmatch worker");
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "fuzzystrmatch");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "fuzzy_search_worker_main");
+		worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+		worker.bgw_notify_pid = MyProcPid;
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handles[i]))
+			break;
+		shm_mq_set_handle(mqh[i], handles[i]);
+		nlaunched++;
+	}
+	/* queues nobody will write to are simply never read */
+
+	PG_TRY();
+	{
+		int			nlive = nlaunched;
+
+		while (nlive > 0)
+		{
+			bool		progress = false;
+			bool		failed;
+
+			for (i = 0; i < nlaunched; i++)
+			{
+				shm_mq_result res;
+				Size		nbytes;
+				void	   *msg;
+
+				if (mqh[i] == NULL)
+					continue;
+				res = shm_mq_receive(mqh[i], &nbytes, &msg, true);
+				if (res == SHM_MQ_SUCCESS)
+				{
+					fzp_put_matches(tupstore, tupdesc, candidates,
+									(FzpMatch *) msg,
+									nbytes / sizeof(FzpMatch));
+					progress = true;
+				}
+				else if (res == SHM_MQ_DETACHED)
+				{
+					mqh[i] = NULL;
+					nlive--;
+					progress = true;
+				}
+			}
+
+			SpinLockAcquire(&sh.hdr->mutex);
+			failed = vhdr->failed;
+			SpinLockRelease(&sh.hdr->mutex);
+			if (failed)
+				break;
+
+			/* do our share of the work while the workers are busy */
+			if (!progress && fzp_claim_chunk(sh.hdr, &start, &end))
+			{
+				int			n = fzp_search_chunk(&sh, start, end, matches,
+												 chunk_context);
+
+				fzp_put_matches(tupstore, tupdesc, candidates, matches, n);
+				progress = true;
+			}
+
+			if (!progress)
+			{
+				int			rc = fzp_wait_latch();
+
+				if (rc & WL_POSTMASTER_DEATH)
+					proc_exit(1);
+				ResetLatch(FZP_LATCH);
+			}
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		/* without workers, or if they all went away early, finish alone */
+		while (fzp_claim_chunk(sh.hdr, &start, &end))
+		{
+			int			n = fzp_search_chunk(&sh, start, end, matches,
+											 chunk_context);
+
+			fzp_put_matches(tupstore, tupdesc, candidates, matches, n);
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		/* the workers are all gone, so the header is ours alone now */
+		if (vhdr->failed)
+			ereport(ERROR,
+					(errmsg("%s", (const char *) vhdr->errmsg),
+					 errcontext("parallel fuzzy search worker")));
+		if (vhdr->nfinished < vhdr->nattached)
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("parallel fuzzy search worker exited unexpectedly")));
+	}
+	PG_CATCH();
+	{
+		for (i = 0; i < nlaunched; i++)
+			TerminateBackgroundWorker(handles[i]);
+		if (seg != NULL)
+			dsm_detach(seg);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (seg != NULL)
+		dsm_detach(seg);
+	MemoryContextDelete(chunk_context);
+
+	return (Datum) 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * fuzzystrmatch_pivot.c
+ *
+ * Pivot-based (LAESA) filtering for edit distance searches without an index.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_pivot.c
+ *
+ * A table keeps, next to each string s, its distances d(s, p_i) to a few
+ * fixed pivot strings p_i, for example as smallint columns maintained by a
+ * trigger.  Since unit-cost Levenshtein distance is a metric, the triangle
+ * inequality gives
+ *
+ *		d(q, s) >= max_i |d(q, p_i) - d(s, p_i)|
+ *
+ * so once the query's own pivot distances are known, most rows can be
+ * rejected by comparing small integers, and only the rest need the kernel:
+ *
+ *		SELECT word FROM words
+ *		 WHERE fuzzy_pivot_filter(word, ARRAY[pd1, pd2, pd3, pd4],
+ *								  'recieve', fuzzy_pivot_distances('recieve', pivots),
+ *								  2);
+ *
+ * Pivots work best when they are far from each other and from most strings,
+ * which fuzzy_choose_pivots() approximates by farthest-first selection from
+ * a sample.
+ */
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+
+extern Datum fuzzy_choose_pivots(PG_FUNCTION_ARGS);
+extern Datum fuzzy_pivot_distances(PG_FUNCTION_ARGS);
+extern Datum fuzzy_pivot_filter(PG_FUNCTION_ARGS);
+
+static inline int
+pivot_distance(text *a, text *b)
+{
+	return levenshtein_less_equal_internal(VARDATA_ANY(a), VARSIZE_ANY_EXHDR(a),
+										   VARDATA_ANY(b), VARSIZE_ANY_EXHDR(b),
+										   1, 1, 1, 0, -1);
+}
+
+/* Check a pivot distance vector and return its elements */
+static int16 *
+pivot_vector(ArrayType *array, int *n)
+{
+	if (ARR_NDIM(array) > 1 || ARR_HASNULL(array) ||
+		ARR_ELEMTYPE(array) != INT2OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pivot distances must be a one-dimensional smallint array without nulls")));
+	*n = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+	return (int16 *) ARR_DATA_PTR(array);
+}
+
+/*
+ * Compute the distance from pivot to every sample string, lowering nearest[]
+ * (each string's distance to its nearest pivot so far) if given, and return
+ * the index of the string that is then farthest from the pivots.
+ */
+static int
+pivot_scan(text *pivot, text **sample, int nsample, int *nearest,
+		   MemoryContext kernel_context, int *farthest_distance)
+{
+	int			farthest = 0;
+	int			best = -1;
+	int			i;
+
+	for (i = 0; i < nsample; i++)
+	{
+		MemoryContext oldcontext;
+		int			d;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* the kernel doesn't free its rows */
+		oldcontext = MemoryContextSwitchTo(kernel_context);
+		d = pivot_distance(pivot, sample[i]);
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(kernel_context);
+
+		if (nearest != NULL)
+			d = nearest[i] = Min(nearest[i], d);
+		if (d > best)
+		{
+			best = d;
+			farthest = i;
+		}
+	}
+
+	*farthest_distance = best;
+	return farthest;
+}
+
+/*
+ * fuzzy_choose_pivots(sample text[], npivots int) returns text[]
+ *
+ * Farthest-first traversal: start from the sample string farthest from the
+ * first one, then repeatedly add the string whose distance to its nearest
+ * chosen pivot is largest.  Costs npivots * |sample| distance computations.
+ * Fewer than npivots are returned if the sample runs out of distinct strings.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_choose_pivots);
+Datum
+fuzzy_choose_pivots(PG_FUNCTION_ARGS)
+{
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(0);
+	int			npivots = PG_GETARG_INT32(1);
+	Datum	   *elems;
+	bool	   *elem_nulls;
+	int			nelems;
+	text	  **sample;
+	int			nsample = 0;
+	int		   *nearest;
+	Datum	   *pivots;
+	int			nchosen = 0;
+	MemoryContext kernel_context;
+	int			next;
+	int			distance;
+	int			i;
+
+	if (npivots < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of pivots must not be negative")));
+
+	deconstruct_array(array, TEXTOID, -1, false, 'i',
+					  &elems, &elem_nulls, &nelems);
+	sample = palloc(Max(nelems, 1) * sizeof(text *));
+	for (i = 0; i < nelems; i++)
+	{
+		if (elem_nulls[i])
+			continue;
+		sample[nsample++] = DatumGetTextPP(elems[i]);
+	}
+	npivots = Min(npivots, nsample);
+
+	pivots = palloc(Max(npivots, 1) * sizeof(Datum));
+	nearest = palloc(Max(nsample, 1) * sizeof(int));
+	for (i = 0; i < nsample; i++)
+		nearest[i] = INT_MAX;
+
+	kernel_context = AllocSetContextCreate(CurrentMemoryContext,
+										   "fuzzy_choose_pivots",
+										   ALLOCSET_DEFAULT_MINSIZE,
+										   ALLOCSET_DEFAULT_INITSIZE,
+										   ALLOCSET_DEFAULT_MAXSIZE);
+
+	if (npivots > 0)
+	{
+		next = pivot_scan(sample[0], sample, nsample, NULL,
+						  kernel_context, &distance);
+		for (;;)
+		{
+			pivots[nchosen++] = PointerGetDatum(sample[next]);
+			if (nchosen == npivots)
+				break;
+			next = pivot_scan(sample[next], sample, nsample, nearest,
+							  kernel_context, &distance);
+			/* everything left duplicates a pivot */
+			if (distance <= 0)
+				break;
+		}
+	}
+
+	MemoryContextDelete(kernel_context);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(pivots, nchosen, TEXTOID,
+										  -1, false, 'i'));
+}
+
+/*
+ * fuzzy_pivot_distances(str text, pivots text[]) returns smallint[]
+ *
+ * The distance from str to each pivot, in one call.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_pivot_distances);
+Datum
+fuzzy_pivot_distances(PG_FUNCTION_ARGS)
+{
+	text	   *str = PG_GETARG_TEXT_PP(0);
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(1);
+	Datum	   *elems;
+	bool	   *elem_nulls;
+	int			nelems;
+	Datum	   *dists;
+	int			i;
+
+	deconstruct_array(array, TEXTOID, -1, false, 'i',
+					  &elems, &elem_nulls, &nelems);
+	dists = palloc(Max(nelems, 1) * sizeof(Datum));
+	for (i = 0; i < nelems; i++)
+	{
+		if (elem_nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("pivots must not be null")));
+		dists[i] = Int16GetDatum(pivot_distance(str,
+												DatumGetTextPP(elems[i])));
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(dists, nelems, INT2OID,
+										  sizeof(int16), true, 's'));
+}
+
+/*
+ * fuzzy_pivot_filter(str text, str_dists smallint[],
+ *					  query text, query_dists smallint[], max_d int)
+ *
+ * True if the Levenshtein distance between str and query is at most max_d,
+ * like levenshtein_less_equal(str, query, max_d) <= max_d, but only running
+ * the kernel when the pivot distances can't rule the pair out.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_pivot_filter);
+Datum
+fuzzy_pivot_filter(PG_FUNCTION_ARGS)
+{
+	ArrayType  *str_array = PG_GETARG_ARRAYTYPE_P(1);
+	ArrayType  *query_array = PG_GETARG_ARRAYTYPE_P(3);
+	int			max_d = PG_GETARG_INT32(4);
+	int16	   *str_dists;
+	int16	   *query_dists;
+	int			nstr;
+	int			nquery;
+	text	   *str;
+	text	   *query;
+	int			i;
+
+	str_dists = pivot_vector(str_array, &nstr);
+	query_dists = pivot_vector(query_array, &nquery);
+	if (nstr != nquery)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("pivot distance arrays have different lengths (%d and %d)",
+						nstr, nquery)));
+
+	if (max_d < 0)
+		PG_RETURN_BOOL(false);
+	for (i = 0; i < nstr; i++)
+	{
+		if (Abs(str_dists[i] - query_dists[i]) > max_d)
+			PG_RETURN_BOOL(false);
+	}
+
+	str = PG_GETARG_TEXT_PP(0);
+	query = PG_GETARG_TEXT_PP(2);
+	PG_RETURN_BOOL(levenshtein_less_equal_internal(VARDATA_ANY(str),
+												   VARSIZE_ANY_EXHDR(str),
+												   VARDATA_ANY(query),
+												   VARSIZE_ANY_EXHDR(query),
+												   1, 1, 1, 0, max_d) <= max_d);
+}
@@ -0,0 +1,446 @@
+/*
+ * fuzzystrmatch_qgram.c
+ *
+ * q-gram set similarity (Jaccard, Dice, overlap) as a cheap first filter.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_qgram.c
+ *
+ * A string of m characters, padded with q - 1 sentinels at each end, has
+ * m + q - 1 q-grams.  Each gram is hashed to 32 bits and the hashes are
+ * sorted, so comparing two strings is a merge of two sorted arrays, with no
+ * dynamic programming at all.  Grams are counted with multiplicity ("abab"
+ * has the bigram "ab" twice), which keeps the measures closer to edit
+ * distance: one edit changes at most q grams.
+ *
+ * qgram_array() exposes the sorted hash array as an int[] so that it can be
+ * stored in a column, and every measure has a form taking two such arrays,
+ * which skips the extraction entirely.  qgram_jaccard_at_least() answers
+ * only "is the similarity at least t", and can usually answer "no" from the
+ * array sizes alone, or part way through the merge.
+ */
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#include "catalog/pg_type.h"
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+
+/* longest gram we hash, in characters */
+#define MAX_QGRAM_LEN		8
+
+/* gallop through the longer array when it is this many times longer */
+#define QGRAM_GALLOP_RATIO	8
+
+typedef enum
+{
+	QGRAM_JACCARD,
+	QGRAM_DICE,
+	QGRAM_OVERLAP
+} QgramMeasure;
+
+extern Datum qgram_array(PG_FUNCTION_ARGS);
+extern Datum qgram_jaccard(PG_FUNCTION_ARGS);
+extern Datum qgram_jaccard_arrays(PG_FUNCTION_ARGS);
+extern Datum qgram_dice(PG_FUNCTION_ARGS);
+extern Datum qgram_dice_arrays(PG_FUNCTION_ARGS);
+extern Datum qgram_overlap(PG_FUNCTION_ARGS);
+extern Datum qgram_overlap_arrays(PG_FUNCTION_ARGS);
+extern Datum qgram_jaccard_at_least(PG_FUNCTION_ARGS);
+extern Datum qgram_jaccard_at_least_arrays(PG_FUNCTION_ARGS);
+
+static int
+uint32_cmp(const void *a, const void *b)
+{
+	uint32		x = *(const uint32 *) a;
+	uint32		y = *(const uint32 *) b;
+
+	if (x == y)
+		return 0;
+	return (x < y) ? -1 : 1;
+}
+
+/*
+ * Extract the sorted gram hashes of a string.  The padding sentinel is a NUL
+ * byte, which cannot occur in text.
+ */
+static uint32 *
+qgram_extract(const char *str, int bytes, int q, int *ngrams)
+{
+	int			nchars = pg_mbstrlen_with_len(str, bytes);
+	int			npadded = nchars + 2 * (q - 1);
+	const char **starts;
+	int		   *lens;
+	uint32	   *grams;
+	int			n;
+	const char *p = str;
+	int			i;
+
+	if (q < 1 || q > MAX_QGRAM_LEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("q-gram length must be between 1 and %d",
+						MAX_QGRAM_LEN)));
+
+	/* where each character of the padded string starts, and its length */
+	starts = palloc((npadded + 1) * sizeof(char *));
+	lens = palloc((npadded + 1) * sizeof(int));
+	for (i = 0; i < npadded; i++)
+	{
+		if (i < q - 1 || i >= q - 1 + nchars)
+		{
+			starts[i] = "";
+			lens[i] = 1;
+		}
+		else
+		{
+			starts[i] = p;
+			lens[i] = pg_mblen(p);
+			p += lens[i];
+		}
+	}
+
+	n = npadded - q + 1;
+	grams = palloc(Max(n, 1) * sizeof(uint32));
+	for (i = 0; i < n; i++)
+	{
+		char		buf[MAX_QGRAM_LEN * MAX_MULTIBYTE_CHAR_LEN];
+		int			len = 0;
+		int			k;
+
+		for (k = i; k < i + q; k++)
+		{
+			memcpy(buf + len, starts[k], lens[k]);
+			len += lens[k];
+		}
+		grams[i] = DatumGetUInt32(hash_any((const unsigned char *) buf, len));
+	}
+	qsort(grams, n, sizeof(uint32), uint32_cmp);
+
+	pfree(starts);
+	pfree(lens);
+	*ngrams = n;
+	return grams;
+}
+
+static uint32 *
+qgram_extract_text(text *t, int q, int *ngrams)
+{
+	return qgram_extract(VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t), q, ngrams);
+}
+
+/*
+ * The contents of a stored gram array.  Arrays made by qgram_array() are
+ * already sorted; anything else is sorted into a copy.
+ */
+static uint32 *
+qgram_array_contents(ArrayType *array, int *ngrams)
+{
+	uint32	   *grams;
+	int			n;
+	int			i;
+
+	if (ARR_NDIM(array) > 1 || ARR_HASNULL(array) ||
+		ARR_ELEMTYPE(array) != INT4OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("q-gram array must be a one-dimensional integer array without nulls")));
+
+	n = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+	grams = (uint32 *) ARR_DATA_PTR(array);
+	for (i = 1; i < n; i++)
+	{
+		if (grams[i - 1] > grams[i])
+		{
+			uint32	   *copy = palloc(n * sizeof(uint32));
+
+			memcpy(copy, grams, n * sizeof(uint32));
+			qsort(copy, n, sizeof(uint32), uint32_cmp);
+			grams = copy;
+			break;
+		}
+	}
+
+	*ngrams = n;
+	return grams;
+}
+
+/*
+ * Size of the multiset intersection of two sorted arrays.  If needed > 0,
+ * gives up as soon as the result is certain to fall short of it, returning
+ * something less than needed.
+ *
+ * When one array is much longer than the other, each element of the short
+ * one is located in the long one by galloping (exponential then binary
+ * search) instead of stepping through every element in between.
+ */
+static int
+qgram_intersect(const uint32 *a, int na, const uint32 *b, int nb, int needed)
+{
+	int			count = 0;
+	int			i = 0;
+	int			j = 0;
+
+	if (na > nb)
+	{
+		const uint32 *t = a;
+		int			nt = na;
+
+		a = b;
+		na = nb;
+		b = t;
+		nb = nt;
+	}
+
+	if ((int64) na * QGRAM_GALLOP_RATIO < nb)
+	{
+		for (i = 0; i < na && j < nb; i++)
+		{
+			uint32		x = a[i];
+			int			lo = j;
+			int			hi;
+			int			step = 1;
+
+			if (count + Min(na - i, nb - j) < needed)
+				return count;
+
+			/* find hi with b[hi] >= x, doubling the step */
+			hi = j;
+			while (hi < nb && b[hi] < x)
+			{
+				lo = hi + 1;
+				hi += step;
+				step *= 2;
+			}
+			if (hi > nb)
+				hi = nb;
+
+			/* and the first such position in [lo, hi] */
+			while (lo < hi)
+			{
+				int			mid = lo + (hi - lo) / 2;
+
+				if (b[mid] < x)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			j = lo;
+			if (j < nb && b[j] == x)
+			{
+				count++;
+				j++;
+			}
+		}
+		return count;
+	}
+
+	while (i < na && j < nb)
+	{
+		if (count + Min(na - i, nb - j) < needed)
+			return count;
+		if (a[i] < b[j])
+			i++;
+		else if (a[i] > b[j])
+			j++;
+		else
+		{
+			count++;
+			i++;
+			j++;
+		}
+	}
+	return count;
+}
+
+static Datum
+qgram_result(QgramMeasure measure, int common, int na, int nb)
+{
+	switch (measure)
+	{
+		case QGRAM_JACCARD:
+			if (na + nb - common == 0)
+				PG_RETURN_FLOAT8(0.0);
+			PG_RETURN_FLOAT8((float8) common / (na + nb - common));
+		case QGRAM_DICE:
+			if (na + nb == 0)
+				PG_RETURN_FLOAT8(0.0);
+			PG_RETURN_FLOAT8(2.0 * common / (na + nb));
+		case QGRAM_OVERLAP:
+			PG_RETURN_INT32(common);
+	}
+	return (Datum) 0;			/* keep compiler quiet */
+}
+
+static Datum
+qgram_compare_text(FunctionCallInfo fcinfo, QgramMeasure measure)
+{
+	text	   *a = PG_GETARG_TEXT_PP(0);
+	text	   *b = PG_GETARG_TEXT_PP(1);
+	int			q = PG_GETARG_INT32(2);
+	uint32	   *ga;
+	uint32	   *gb;
+	int			na;
+	int			nb;
+
+	ga = qgram_extract_text(a, q, &na);
+	gb = qgram_extract_text(b, q, &nb);
+	return qgram_result(measure, qgram_intersect(ga, na, gb, nb, 0), na, nb);
+}
+
+static Datum
+qgram_compare_arrays(FunctionCallInfo fcinfo, QgramMeasure measure)
+{
+	uint32	   *ga;
+	uint32	   *gb;
+	int			na;
+	int			nb;
+
+	ga = qgram_array_contents(PG_GETARG_ARRAYTYPE_P(0), &na);
+	gb = qgram_array_contents(PG_GETARG_ARRAYTYPE_P(1), &nb);
+	return qgram_result(measure, qgram_intersect(ga, na, gb, nb, 0), na, nb);
+}
+
+/*
+ * Whether the Jaccard similarity of two gram arrays is at least threshold.
+ * The similarity can't exceed min(na, nb) / max(na, nb), and reaching
+ * threshold takes an intersection of at least t * (na + nb) / (1 + t).
+ */
+static bool
+qgram_jaccard_reaches(const uint32 *ga, int na, const uint32 *gb, int nb,
+					  float8 threshold)
+{
+	int			needed;
+	int			common;
+
+	if (threshold <= 0.0)
+		return true;
+	if (na + nb == 0)
+		return false;
+	if ((float8) Min(na, nb) < threshold * Max(na, nb))
+		return false;
+
+	/* rounded down, so that rounding can't reject a pair that qualifies */
+	needed = (int) (threshold * (na + nb) / (1.0 + threshold));
+	common = qgram_intersect(ga, na, gb, nb, needed);
+	return common >= threshold * (na + nb - common);
+}
+
+/*
+ * qgram_array(str text, q int) returns int[]
+ */
+PG_FUNCTION_INFO_V1(qgram_array);
+Datum
+qgram_array(PG_FUNCTION_ARGS)
+{
+	text	   *str = PG_GETARG_TEXT_PP(0);
+	int			q = PG_GETARG_INT32(1);
+	uint32	   *grams;
+	int			n;
+	Datum	   *elems;
+	int			i;
+
+	grams = qgram_extract_text(str, q, &n);
+	elems = palloc(Max(n, 1) * sizeof(Datum));
+	for (i = 0; i < n; i++)
+		elems[i] = Int32GetDatum((int32) grams[i]);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, n, INT4OID,
+										  sizeof(int32), true, 'i'));
+}
+
+PG_FUNCTION_INFO_V1(qgram_jaccard);
+Datum
+qgram_jaccard(PG_FUNCTION_ARGS)
+{
+	return qgram_compare_text(fcinfo, QGRAM_JACCARD);
+}
+
+PG_FUNCTION_INFO_V1(qgram_jaccard_arrays);
+Datum
+qgram_jaccard_arrays(PG_FUNCTION_ARGS)
+{
+	return qgram_compare_arrays(fcinfo, QGRAM_JACCARD);
+}
+
+PG_FUNCTION_INFO_V1(qgram_dice);
+Datum
+qgram_dice(PG_FUNCTION_ARGS)
+{
+	return qgram_compare_text(fcinfo, QGRAM_DICE);
+}
+
+PG_FUNCTION_INFO_V1(qgram_dice_arrays);
+Datum
+qgram_dice_arrays(PG_FUNCTION_ARGS)
+{
+	return qgram_compare_arrays(fcinfo, QGRAM_DICE);
+}
+
+PG_FUNCTION_INFO_V1(qgram_overlap);
+Datum
+qgram_overlap(PG_FUNCTION_ARGS)
+{
+	return qgram_compare_text(fcinfo, QGRAM_OVERLAP);
+}
+
+PG_FUNCTION_INFO_V1(qgram_overlap_arrays);
+Datum
+qgram_overlap_arrays(PG_FUNCTION_ARGS)
+{
+	return qgram_compare_arrays(fcinfo, QGRAM_OVERLAP);
+}
+
+/*
+ * qgram_jaccard_at_least(a text, b text, q int, threshold float8)
+ */
+PG_FUNCTION_INFO_V1(qgram_jaccard_at_least);
+Datum
+qgram_jaccard_at_least(PG_FUNCTION_ARGS)
+{
+	text	   *a = PG_GETARG_TEXT_PP(0);
+	text	   *b = PG_GETARG_TEXT_PP(1);
+	int			q = PG_GETARG_INT32(2);
+	float8		threshold = PG_GETARG_FLOAT8(3);
+	uint32	   *ga;
+	uint32	   *gb;
+	int			na;
+	int			nb;
+
+	ga = qgram_extract_text(a, q, &na);
+	gb = qgram_extract_text(b, q, &nb);
+	PG_RETURN_BOOL(qgram_jaccard_reaches(ga, na, gb, nb, threshold));
+}
+
+/*
+ * qgram_jaccard_at_least(a int[], b int[], threshold float8)
+ */
+PG_FUNCTION_INFO_V1(qgram_jaccard_at_least_arrays);
+Datum
+qgram_jaccard_at_least_arrays(PG_FUNCTION_ARGS)
+{
+	ArrayType  *a = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType  *b = PG_GETARG_ARRAYTYPE_P(1);
+	float8		threshold = PG_GETARG_FLOAT8(2);
+	uint32	   *ga;
+	uint32	   *gb;
+	int			na;
+	int			nb;
+
+	/* the size bound needs no array contents at all */
+	na = ArrayGetNItems(ARR_NDIM(a), ARR_DIMS(a));
+	nb = ArrayGetNItems(ARR_NDIM(b), ARR_DIMS(b));
+	if (threshold > 0.0 && (float8) Min(na, nb) < threshold * Max(na, nb))
+		PG_RETURN_BOOL(false);
+
+	ga = qgram_array_contents(a, &na);
+	gb = qgram_array_contents(b, &nb);
+	PG_RETURN_BOOL(qgram_jaccard_reaches(ga, na, gb, nb, threshold));
+}
@@ -0,0 +1,516 @@
+/*
+ * fuzzystrmatch_replay.c
+ *
+ * Replays a capture log (see fuzzycapture.h) through the kernels.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_replay.c
+ *
+ * Usage: fuzzystrmatch_replay [-n REPEAT] [-r SEED] LOGFILE...
+ *
+ * Every captured call is made again, REPEAT times (default 10), against
+ * the standalone builds of levenshtein.c and soundex.c, and for each SQL
+ * function the distribution of the time per call is printed next to the
+ * time the call took in the backend.  The backend's figure includes fmgr
+ * overhead, detoasting and memoization, so the two are not expected to
+ * agree; the replay figures are what to compare between builds of the
+ * kernels.
+ *
+ * Calls captured with raw or scrambled inputs are replayed exactly, and
+ * their results are checked against the captured ones (for difference(),
+ * only with raw inputs, since scrambling changes soundex codes).  For the
+ * others only the lengths are known, so inputs of those lengths are made
+ * up from SEED: the second string is derived from the first with as many
+ * changes as the captured distance suggests, so that bounded calls give up
+ * about as early as they did.  Hashed inputs with the same hash get the
+ * same made-up string.  Such calls are timed but not checked.
+ */
+#define FZS_STANDALONE_IMPLEMENTATION
+#include "fuzzystrmatch_standalone.h"
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fuzzycapture.h"
+#include "soundex.c"
+#include "levenshtein.c"
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+
+#define DEFAULT_REPEAT		10
+
+typedef enum
+{
+	OP_DISTANCE,
+	OP_SOUNDEX,
+	OP_DIFFERENCE,
+	OP_UNKNOWN
+} ReplayOp;
+
+typedef struct
+{
+	const FuzzyCaptureRecord *rec;
+	int			function;		/* index into functions[] */
+	ReplayOp	op;
+	char	   *a;				/* NUL-terminated */
+	int			a_len;
+	char	   *b;
+	int			b_len;
+	bool		checked;		/* the captured result must be reproduced */
+} Call;
+
+typedef struct
+{
+	char	   *name;
+	ReplayOp	op;
+	long		calls;
+	long		mismatches;
+	long		errors;
+	double	   *replay_ns;
+	double	   *captured_ns;
+} Function;
+
+static Function *functions;
+static int	nfunctions;
+static unsigned long long replay_seed = 1;
+static unsigned long long rng_state;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: fuzzystrmatch_replay [-n REPEAT] [-r SEED] LOGFILE...\n");
+	exit(2);
+}
+
+static void *
+xmalloc(size_t size)
+{
+	void	   *p = malloc(size > 0 ? size : 1);
+
+	if (p == NULL)
+	{
+		fprintf(stderr, "fuzzystrmatch_replay: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double		x = *(const double *) a;
+	double		y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* xorshift64*, so that made-up inputs don't depend on the C library */
+static unsigned long long
+next_random(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static void
+seed_random(unsigned long long seed)
+{
+	rng_state = (seed ^ replay_seed) * 0x9E3779B97F4A7C15ULL + 1;
+	next_random();
+}
+
+static char *
+read_file(const char *path, size_t *size)
+{
+	FILE	   *fp = fopen(path, "rb");
+	char	   *data;
+	size_t		cap = 1 << 20;
+	size_t		len = 0;
+	size_t		n;
+
+	if (fp == NULL)
+	{
+		fprintf(stderr, "fuzzystrmatch_replay: could not open \"%s\": %s\n",
+				path, strerror(errno));
+		exit(1);
+	}
+	data = xmalloc(cap);
+	while ((n = fread(data + len, 1, cap - len, fp)) > 0)
+	{
+		len += n;
+		if (len == cap)
+		{
+			data = realloc(data, cap *= 2);
+			if (data == NULL)
+			{
+				fprintf(stderr, "fuzzystrmatch_replay: out of memory\n");
+				exit(1);
+			}
+		}
+	}
+	if (ferror(fp))
+	{
+		fprintf(stderr, "fuzzystrmatch_replay: could not read \"%s\": %s\n",
+				path, strerror(errno));
+		exit(1);
+	}
+	fclose(fp);
+	*size = len;
+	return data;
+}
+
+static int
+lookup_function(const char *name, int name_len)
+{
+	Function   *f;
+	int			i;
+
+	for (i = 0; i < nfunctions; i++)
+	{
+		if ((int) strlen(functions[i].name) == name_len &&
+			memcmp(functions[i].name, name, name_len) == 0)
+			return i;
+	}
+
+	functions = realloc(functions, (nfunctions + 1) * sizeof(Function));
+	f = &functions[nfunctions];
+	memset(f, 0, sizeof(Function));
+	f->name = xmalloc(name_len + 1);
+	memcpy(f->name, name, name_len);
+	f->name[name_len] = '\0';
+	if (strcmp(f->name, "soundex") == 0)
+		f->op = OP_SOUNDEX;
+	else if (strcmp(f->name, "difference") == 0)
+		f->op = OP_DIFFERENCE;
+	else if (strstr(f->name, "levenshtein") != NULL)
+		f->op = OP_DISTANCE;
+	else
+		f->op = OP_UNKNOWN;
+	return nfunctions++;
+}
+
+static char *
+copy_input(const char *data, int len)
+{
+	char	   *s = xmalloc(len + 1);
+
+	memcpy(s, data, len);
+	s[len] = '\0';
+	return s;
+}
+
+static char *
+random_word(int chars)
+{
+	char	   *s = xmalloc(chars + 1);
+	int			i;
+
+	for (i = 0; i < chars; i++)
+		s[i] = 'a' + next_random() % 26;
+	s[chars] = '\0';
+	return s;
+}
+
+/*
+ * Make up the inputs of a call of which only the lengths (and perhaps
+ * hashes) are known.
+ */
+static void
+make_up_inputs(Call *call, const char *payload, long index)
+{
+	const FuzzyCaptureRecord *rec = call->rec;
+	unsigned int hash;
+	int			common;
+	int			changes;
+	int			i;
+
+	if (rec->inputs == FUZZY_CAPTURE_INPUTS_HASHED && rec->a_size == sizeof(hash))
+	{
+		memcpy(&hash, payload, sizeof(hash));
+		seed_random(hash);
+	}
+	else
+		seed_random(index);
+	call->a = random_word(rec->a_chars);
+	call->a_len = rec->a_chars;
+
+	if (rec->inputs == FUZZY_CAPTURE_INPUTS_HASHED && rec->b_size == sizeof(hash))
+	{
+		memcpy(&hash, payload + rec->a_size, sizeof(hash));
+		seed_random(hash);
+	}
+
+	/* b is a, cut or extended to its length, with some letters changed */
+	call->b = random_word(rec->b_chars);
+	call->b_len = rec->b_chars;
+	common = Min(rec->a_chars, rec->b_chars);
+	memcpy(call->b, call->a, common);
+	if (call->op != OP_DISTANCE)
+		return;
+	changes = rec->result - abs(rec->a_chars - rec->b_chars);
+	changes = Max(0, Min(changes, common));
+	for (i = 0; i < changes; i++)
+		call->b[next_random() % (common > 0 ? common : 1)] =
+			'a' + next_random() % 26;
+}
+
+/* One replay of a call; returns its result, or -1 for soundex */
+static int
+run_call(const Call *call)
+{
+	const FuzzyCaptureRecord *rec = call->rec;
+	char		code_a[SOUNDEX_LEN + 1];
+	char		code_b[SOUNDEX_LEN + 1];
+	int			result = -1;
+	int			i;
+
+	switch (call->op)
+	{
+		case OP_DISTANCE:
+			if (rec->flags & FUZZY_CAPTURE_BOUNDED)
+				result = levenshtein_less_equal_internal(call->a, call->a_len,
+														 call->b, call->b_len,
+														 rec->ins_c, rec->del_c,
+														 rec->sub_c, rec->trans_c,
+														 rec->max_d);
+			else
+				result = levenshtein_internal(call->a, call->a_len,
+											  call->b, call->b_len,
+											  rec->ins_c, rec->del_c,
+											  rec->sub_c, rec->trans_c);
+			break;
+		case OP_SOUNDEX:
+			_soundex(call->a, code_a);
+			break;
+		case OP_DIFFERENCE:
+			_soundex(call->a, code_a);
+			_soundex(call->b, code_b);
+			result = 0;
+			for (i = 0; i < SOUNDEX_LEN; i++)
+			{
+				if (code_a[i] == code_b[i])
+					result++;
+			}
+			break;
+		case OP_UNKNOWN:
+			break;
+	}
+	fzs_arena_reset();
+	return result;
+}
+
+/* Split the logs into calls; records of functions we can't run are dropped */
+static Call *
+parse_logs(char **paths, int npaths, long *ncalls, long *nskipped)
+{
+	Call	   *volatile calls = NULL;
+	volatile long n = 0;
+	long		cap = 0;
+	int			p;
+
+	*nskipped = 0;
+	for (p = 0; p < npaths; p++)
+	{
+		size_t		size;
+		char	   *data = read_file(paths[p], &size);
+		size_t		off = 0;
+
+		while (off < size)
+		{
+			const char *name = data + off + sizeof(FuzzyCaptureRecord);
+			FuzzyCaptureRecord *rec;
+			const char *payload;
+			size_t		len;
+			Call	   *call;
+
+			/* records are not aligned in the file; keep an aligned copy */
+			rec = xmalloc(sizeof(FuzzyCaptureRecord));
+			if (size - off >= sizeof(FuzzyCaptureRecord))
+			{
+				memcpy(rec, data + off, sizeof(FuzzyCaptureRecord));
+				if (rec->magic != FUZZY_CAPTURE_MAGIC)
+				{
+					fprintf(stderr, "fuzzystrmatch_replay: \"%s\": bad record at offset %lu\n",
+							paths[p], (unsigned long) off);
+					exit(1);
+				}
+				len = sizeof(FuzzyCaptureRecord) + rec->name_len +
+					(size_t) rec->a_size + rec->b_size;
+			}
+			else
+				len = sizeof(FuzzyCaptureRecord);
+			if (size - off < len)
+			{
+				fprintf(stderr, "fuzzystrmatch_replay: \"%s\": truncated record at offset %lu\n",
+						paths[p], (unsigned long) off);
+				exit(1);
+			}
+			payload = name + rec->name_len;
+			off += len;
+
+			if (n == cap)
+			{
+				cap = cap ? cap * 2 : 1024;
+				calls = realloc(calls, cap * sizeof(Call));
+				if (calls == NULL)
+				{
+					fprintf(stderr, "fuzzystrmatch_replay: out of memory\n");
+					exit(1);
+				}
+			}
+			call = &calls[n];
+			memset(call, 0, sizeof(Call));
+			call->rec = rec;
+			call->function = lookup_function(name, rec->name_len);
+			call->op = functions[call->function].op;
+			if (call->op == OP_UNKNOWN)
+			{
+				(*nskipped)++;
+				continue;
+			}
+
+			if (rec->inputs == FUZZY_CAPTURE_INPUTS_RAW ||
+				rec->inputs == FUZZY_CAPTURE_INPUTS_SCRAMBLED)
+			{
+				call->a = copy_input(payload, rec->a_size);
+				call->a_len = rec->a_size;
+				call->b = copy_input(payload + rec->a_size, rec->b_size);
+				call->b_len = rec->b_size;
+
+				/*
+				 * Scrambling keeps distances, but not soundex codes, so only
+				 * raw inputs reproduce those.
+				 */
+				call->checked = call->op == OP_DISTANCE ||
+					(call->op == OP_DIFFERENCE &&
+					 rec->inputs == FUZZY_CAPTURE_INPUTS_RAW);
+			}
+			else
+				make_up_inputs(call, payload, n);
+			n++;
+		}
+		free(data);
+	}
+	*ncalls = n;
+	return calls;
+}
+
+static void
+print_percentiles(const char *what, double *ns, long n)
+{
+	qsort(ns, n, sizeof(double), double_cmp);
+	printf("  %s_p50_ns=%.0f\n  %s_p90_ns=%.0f\n"
+		   "  %s_p99_ns=%.0f\n  %s_max_ns=%.0f\n",
+		   what, ns[(long) (n * 0.50)], what, ns[(long) (n * 0.90)],
+		   what, ns[(long) (n * 0.99)], what, ns[n - 1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	volatile int repeat = DEFAULT_REPEAT;
+	Call	   *calls;
+	long		ncalls;
+	long		nskipped;
+	long		i;
+	int			c;
+
+	while ((c = getopt(argc, argv, "n:r:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				repeat = atoi(optarg);
+				break;
+			case 'r':
+				replay_seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind >= argc || repeat < 1)
+		usage();
+
+	calls = parse_logs(argv + optind, argc - optind, &ncalls, &nskipped);
+
+	for (i = 0; i < nfunctions; i++)
+	{
+		functions[i].replay_ns = xmalloc(ncalls * sizeof(double));
+		functions[i].captured_ns = xmalloc(ncalls * sizeof(double));
+	}
+
+	for (i = 0; i < ncalls; i++)
+	{
+		Call	   *call = &calls[i];
+		Function   *f = &functions[call->function];
+		volatile int result = -1;
+		volatile bool failed = false;
+		double		start;
+		int			r;
+
+		/* once untimed, to check the result and warm up */
+		FZS_TRY();
+		{
+			result = run_call(call);
+		}
+		FZS_CATCH();
+		{
+			failed = true;
+		}
+		FZS_END_TRY();
+		fzs_arena_reset();
+		if (failed)
+		{
+			f->errors++;
+			continue;
+		}
+		if (call->checked && result != call->rec->result)
+			f->mismatches++;
+
+		start = now_ns();
+		for (r = 0; r < repeat; r++)
+			run_call(call);
+		f->replay_ns[f->calls] = (now_ns() - start) / repeat;
+		f->captured_ns[f->calls] = call->rec->elapsed_ns;
+		f->calls++;
+	}
+
+	printf("records=%ld skipped=%ld repeat=%d\n",
+		   ncalls + nskipped, nskipped, repeat);
+	for (i = 0; i < nfunctions; i++)
+	{
+		Function   *f = &functions[i];
+
+		if (f->op == OP_UNKNOWN)
+		{
+			printf("%s: not replayed\n", f->name);
+			continue;
+		}
+		printf("%s:\n", f->name);
+		printf("  calls=%ld\n  errors=%ld\n  mismatches=%ld\n",
+			   f->calls, f->errors, f->mismatches);
+		if (f->calls == 0)
+			continue;
+		print_percentiles("replay", f->replay_ns, f->calls);
+		print_percentiles("captured", f->captured_ns, f->calls);
+	}
+
+	for (i = 0; i < nfunctions; i++)
+	{
+		if (functions[i].mismatches > 0)
+			return 1;
+	}
+	return 0;
+}
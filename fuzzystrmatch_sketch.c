@@ -0,0 +1,216 @@
+/*
+ * fuzzystrmatch_sketch.c
+ *
+ * Fixed-size sketches of long texts, for estimating edit distance.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_sketch.c
+ *
+ * Even levenshtein_less_equal() costs O(n * k) per pair, which is too much
+ * for near-duplicate detection over long documents.  fuzzy_sketch() reduces
+ * a text of any length to a sketch of fixed size in one pass, and
+ * fuzzy_sketch_distance() estimates the edit distance of two texts from
+ * their sketches in time independent of the texts' length.  Candidates can
+ * then be verified exactly with levenshtein() or levenshtein_less_equal().
+ *
+ * The estimator is the q-gram distance: the text, padded with q - 1
+ * sentinels at each end as in fuzzystrmatch_qgram.c, is viewed as the
+ * vector v counting how often each q-gram occurs in it.  One edit changes
+ * at most q grams, each of which disappears and is replaced by another, so
+ * for edit distance K
+ *
+ *		|v(x) - v(y)|_1 <= 2 * q * K
+ *
+ * always, with equality (up to one gram per insertion or deletion) when the
+ * edits lie at least q characters apart and create or destroy no gram that
+ * occurs elsewhere.  fuzzy_sketch_distance() returns |v(x) - v(y)|_1 / (2q),
+ * which is thus a lower bound on K that is close to it for sparse edits,
+ * and falls below it as edits crowd within q characters of each other.
+ *
+ * v itself is as large as the text, so the sketch folds it into
+ * FZS_COUNTERS counters as a count sketch: each gram adds +1 or -1 to one
+ * counter, both chosen by hash.  The squared distance between two sketches'
+ * counters estimates |v(x) - v(y)|_2 squared without bias, with standard
+ * error at most sqrt(2 / FZS_COUNTERS), about 9%; that equals the L1
+ * distance above whenever no gram's count differs by more than one.
+ * Identical texts always estimate to exactly 0.  Sketches are only
+ * comparable when built with the same q.
+ *
+ * Grams are hashed by a rolling hash over per-character hashes, so building
+ * a sketch takes O(n) time and no memory beyond the sketch.
+ */
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "utils/builtins.h"
+
+/* counters in a sketch; must be a power of 2 */
+#define FZS_COUNTERS		256
+
+/* longest gram, in characters */
+#define FZS_MAX_Q			16
+
+#define FZS_VERSION			1
+
+/* multiplier of the rolling gram hash */
+#define FZS_ROLL			UINT64CONST(0x9e3779b97f4a7c15)
+
+/* format of a sketch, stored unaligned in a bytea */
+typedef struct
+{
+	uint32		version;
+	int32		q;
+	int64		nchars;			/* length of the text */
+	int64		counters[FZS_COUNTERS];
+} FzsSketch;
+
+extern Datum fuzzy_sketch(PG_FUNCTION_ARGS);
+extern Datum fuzzy_sketch_distance(PG_FUNCTION_ARGS);
+
+/* the finalizer of splitmix64 */
+static inline uint64
+fzs_mix(uint64 x)
+{
+	x ^= x >> 30;
+	x *= UINT64CONST(0xbf58476d1ce4e5b9);
+	x ^= x >> 27;
+	x *= UINT64CONST(0x94d049bb133111eb);
+	x ^= x >> 31;
+	return x;
+}
+
+static void
+fzs_build(const char *str, int bytes, int q, FzsSketch *sketch)
+{
+	const char *p = str;
+	uint64		window[FZS_MAX_Q];
+	uint64		roll = 0;
+	uint64		roll_q = 1;		/* FZS_ROLL ** q, to drop the oldest */
+	int64		nchars = pg_mbstrlen_with_len(str, bytes);
+	int64		npadded = nchars + 2 * (q - 1);
+	int64		i;
+
+	if (q < 1 || q > FZS_MAX_Q)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("q-gram length must be between 1 and %d",
+						FZS_MAX_Q)));
+
+	memset(sketch, 0, sizeof(FzsSketch));
+	sketch->version = FZS_VERSION;
+	sketch->q = q;
+	sketch->nchars = nchars;
+
+	memset(window, 0, sizeof(window));
+	for (i = 0; i < q; i++)
+		roll_q *= FZS_ROLL;
+
+	for (i = 0; i < npadded; i++)
+	{
+		uint64		c;
+
+		/* sentinels hash to 0, real characters to something odd */
+		if (i < q - 1 || i >= q - 1 + nchars)
+			c = 0;
+		else
+		{
+			int			len = pg_mblen(p);
+
+			c = ((uint64) DatumGetUInt32(hash_any((const unsigned char *) p,
+												  len)) << 1) | 1;
+			p += len;
+		}
+
+		roll = roll * FZS_ROLL + c - window[i % q] * roll_q;
+		window[i % q] = c;
+
+		if (i >= q - 1)
+		{
+			uint64		h = fzs_mix(roll);
+
+			sketch->counters[h & (FZS_COUNTERS - 1)] +=
+				(h & (UINT64CONST(1) << 63)) ? 1 : -1;
+		}
+
+		if ((i & 0xFFFF) == 0)
+			CHECK_FOR_INTERRUPTS();
+	}
+}
+
+static void
+fzs_unpack(bytea *b, FzsSketch *sketch)
+{
+	if (VARSIZE_ANY_EXHDR(b) != sizeof(FzsSketch))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid fuzzy sketch")));
+	memcpy(sketch, VARDATA_ANY(b), sizeof(FzsSketch));
+	if (sketch->version != FZS_VERSION)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("fuzzy sketch version %u is not supported",
+						sketch->version)));
+}
+
+/*
+ * fuzzy_sketch(str, q) returns the sketch of a text's q-grams.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_sketch);
+Datum
+fuzzy_sketch(PG_FUNCTION_ARGS)
+{
+	text	   *str = PG_GETARG_TEXT_PP(0);
+	int32		q = PG_GETARG_INT32(1);
+	bytea	   *result = palloc(VARHDRSZ + sizeof(FzsSketch));
+	FzsSketch	sketch;
+
+	fzs_build(VARDATA_ANY(str), VARSIZE_ANY_EXHDR(str), q, &sketch);
+	SET_VARSIZE(result, VARHDRSZ + sizeof(FzsSketch));
+	memcpy(VARDATA(result), &sketch, sizeof(FzsSketch));
+	PG_RETURN_BYTEA_P(result);
+}
+
+/*
+ * fuzzy_sketch_distance(a, b) estimates the edit distance between the texts
+ * two sketches were built from.  The estimate is clamped to the bounds the
+ * lengths alone impose.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_sketch_distance);
+Datum
+fuzzy_sketch_distance(PG_FUNCTION_ARGS)
+{
+	FzsSketch	a;
+	FzsSketch	b;
+	double		sq = 0;
+	double		estimate;
+	int			i;
+
+	fzs_unpack(PG_GETARG_BYTEA_PP(0), &a);
+	fzs_unpack(PG_GETARG_BYTEA_PP(1), &b);
+	if (a.q != b.q)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("fuzzy sketches of %d-grams and %d-grams cannot be compared",
+						a.q, b.q)));
+
+	for (i = 0; i < FZS_COUNTERS; i++)
+	{
+		double		d = (double) (a.counters[i] - b.counters[i]);
+
+		sq += d * d;
+	}
+	estimate = sq / (2 * a.q);
+
+	estimate = Max(estimate, (double) Abs(a.nchars - b.nchars));
+	estimate = Min(estimate, (double) Max(a.nchars, b.nchars));
+
+	PG_RETURN_FLOAT8(estimate);
+}
@@ -0,0 +1,340 @@
+/*
+ * fuzzystrmatch_spgist.c
+ *
+ * SP-GiST operator class for edit distance searches over the text radix tree.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_spgist.c
+ *
+ * spgist_fuzzy_ops builds exactly the radix tree of the built-in text_ops,
+ * using its config, choose and picksplit functions, and answers
+ * "col %~ query" (Levenshtein distance at most fuzzystrmatch.radius) by
+ * walking it.  The built-in consistent functions reject strategies they
+ * don't know, so an existing text_ops index can't be taught the operator;
+ * the tree is the same, but the index has to be built with this class.
+ *
+ * Every inner tuple stands for the prefix its strings share, reconstructed
+ * from the labels and prefixes on the way down.  Along the walk we carry,
+ * for each scan key, the row of the Levenshtein matrix of that prefix
+ * against the query: row[j] is the distance between the prefix and the
+ * query's first j characters.  Extending the prefix by a character takes
+ * one O(m) step, and since every entry of the row only grows as the prefix
+ * does, a subtree whose row has no entry within the radius cannot contain
+ * a match and is skipped.  The tree branches on bytes, so a multibyte
+ * character split across levels is held back until all of it has been
+ * seen.
+ *
+ * From 9.6 on the row is carried down as the traversal value; before that
+ * it is recomputed from the reconstructed prefix at every inner tuple.
+ * Leaves are decided exactly with the levenshtein.c kernel on the
+ * reconstructed string, without a heap recheck.
+ */
+#include "postgres.h"
+
+#include "access/skey.h"
+#include "access/spgist.h"
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+
+#define FSP_WITHIN_STRATEGY		1	/* %~ */
+
+/* one scan key's query, split into characters */
+typedef struct
+{
+	const char *data;
+	int			bytes;
+	int			m;				/* length in characters */
+	int		   *starts;			/* byte offset of each character */
+	int		   *lens;			/* byte length of each character */
+	int			row_offset;		/* where its row starts in FspRows.rows */
+} FspKey;
+
+/* the matrix rows of a prefix, one per scan key */
+typedef struct
+{
+	int32		consumed;		/* bytes of the prefix folded into the rows */
+	int32		nrows;			/* entries in rows, over all the keys */
+	int32		rows[1];		/* VARIABLE LENGTH */
+} FspRows;
+
+#define FSP_ROWS_SIZE(n)		(offsetof(FspRows, rows) + (n) * sizeof(int32))
+
+extern Datum spgfuzzy_inner_consistent(PG_FUNCTION_ARGS);
+extern Datum spgfuzzy_leaf_consistent(PG_FUNCTION_ARGS);
+
+static FspKey *
+fsp_keys(ScanKey scankeys, int nkeys, int *nrows)
+{
+	FspKey	   *keys = palloc(Max(nkeys, 1) * sizeof(FspKey));
+	int			i;
+
+	*nrows = 0;
+	for (i = 0; i < nkeys; i++)
+	{
+		text	   *query;
+		FspKey	   *key = &keys[i];
+		const char *p;
+		int			j;
+
+		if (scankeys[i].sk_strategy != FSP_WITHIN_STRATEGY)
+			elog(ERROR, "unrecognized strategy number: %d",
+				 scankeys[i].sk_strategy);
+
+		query = DatumGetTextPP(scankeys[i].sk_argument);
+		key->data = VARDATA_ANY(query);
+		key->bytes = VARSIZE_ANY_EXHDR(query);
+		key->m = pg_mbstrlen_with_len(key->data, key->bytes);
+		if (key->m > MAX_LEVENSHTEIN_STRLEN)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("argument exceeds the maximum length of %d bytes",
+							MAX_LEVENSHTEIN_STRLEN)));
+
+		key->starts = palloc((key->m + 1) * sizeof(int));
+		key->lens = palloc((key->m + 1) * sizeof(int));
+		for (p = key->data, j = 0; j < key->m; j++)
+		{
+			key->starts[j] = p - key->data;
+			key->lens[j] = pg_mblen(p);
+			p += key->lens[j];
+		}
+		key->row_offset = *nrows;
+		*nrows += key->m + 1;
+	}
+	return keys;
+}
+
+/* The rows of the empty prefix */
+static FspRows *
+fsp_initial_rows(FspKey *keys, int nkeys, int nrows)
+{
+	FspRows    *rows = palloc(FSP_ROWS_SIZE(nrows));
+	int			i,
+				j;
+
+	rows->consumed = 0;
+	rows->nrows = nrows;
+	for (i = 0; i < nkeys; i++)
+	{
+		for (j = 0; j <= keys[i].m; j++)
+			rows->rows[keys[i].row_offset + j] = j;
+	}
+	return rows;
+}
+
+static FspRows *
+fsp_copy_rows(const FspRows *rows)
+{
+	FspRows    *copy = palloc(FSP_ROWS_SIZE(rows->nrows));
+
+	memcpy(copy, rows, FSP_ROWS_SIZE(rows->nrows));
+	return copy;
+}
+
+/*
+ * Fold the complete characters of prefix[rows->consumed .. nbytes) into the
+ * rows.  A character cut off at nbytes is left for a later call.
+ */
+static void
+fsp_advance(FspRows *rows, FspKey *keys, int nkeys,
+			const char *prefix, int nbytes)
+{
+	while (rows->consumed < nbytes)
+	{
+		const char *c = prefix + rows->consumed;
+		int			clen = pg_mblen(c);
+		int			i;
+
+		if (rows->consumed + clen > nbytes)
+			break;
+
+		for (i = 0; i < nkeys; i++)
+		{
+			FspKey	   *key = &keys[i];
+			int32	   *row = rows->rows + key->row_offset;
+			int			diag = row[0];
+			int			j;
+
+			row[0]++;
+			for (j = 1; j <= key->m; j++)
+			{
+				int			above = row[j];
+				int			d = diag;
+
+				if (key->lens[j - 1] != clen ||
+					memcmp(key->data + key->starts[j - 1], c, clen) != 0)
+					d++;
+				d = Min(d, above + 1);
+				d = Min(d, row[j - 1] + 1);
+				row[j] = d;
+				diag = above;
+			}
+		}
+		rows->consumed += clen;
+	}
+}
+
+/* Can a string beginning with this prefix be within radius of every query? */
+static bool
+fsp_viable(const FspRows *rows, FspKey *keys, int nkeys, int radius)
+{
+	int			i,
+				j;
+
+	for (i = 0; i < nkeys; i++)
+	{
+		const int32 *row = rows->rows + keys[i].row_offset;
+		bool		viable = false;
+
+		for (j = 0; j <= keys[i].m && !viable; j++)
+			viable = row[j] <= radius;
+		if (!viable)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Inner tuples: the labels are the next byte of the strings below, or zero
+ * or less for none (the end of the string, or the dummy labels of an
+ * allTheSame tuple), as in the built-in text_ops.
+ */
+PG_FUNCTION_INFO_V1(spgfuzzy_inner_consistent);
+Datum
+spgfuzzy_inner_consistent(PG_FUNCTION_ARGS)
+{
+	spgInnerConsistentIn *in = (spgInnerConsistentIn *) PG_GETARG_POINTER(0);
+	spgInnerConsistentOut *out = (spgInnerConsistentOut *) PG_GETARG_POINTER(1);
+	text	   *reconstr = NULL;
+	text	   *prefix = NULL;
+	int			prefix_bytes = 0;
+	int			max_len;
+	char	   *buf;
+	FspKey	   *keys;
+	int			nrows;
+	FspRows    *base;
+	int			radius = fuzzystrmatch_radius;
+	int			i;
+
+	if (DatumGetPointer(in->reconstructedValue) != NULL)
+		reconstr = DatumGetTextPP(in->reconstructedValue);
+	Assert(reconstr == NULL ? in->level == 0 :
+		   VARSIZE_ANY_EXHDR(reconstr) == in->level);
+	if (in->hasPrefix)
+	{
+		prefix = DatumGetTextPP(in->prefixDatum);
+		prefix_bytes = VARSIZE_ANY_EXHDR(prefix);
+	}
+
+	/* the reconstructed string, the prefix, and room for one label */
+	max_len = in->level + prefix_bytes + 1;
+	buf = palloc(max_len);
+	if (in->level > 0)
+		memcpy(buf, VARDATA_ANY(reconstr), in->level);
+	if (prefix_bytes > 0)
+		memcpy(buf + in->level, VARDATA_ANY(prefix), prefix_bytes);
+
+	keys = fsp_keys(in->scankeys, in->nkeys, &nrows);
+#if PG_VERSION_NUM >= 90600
+	if (in->traversalValue != NULL)
+		base = fsp_copy_rows((FspRows *) in->traversalValue);
+	else
+#endif
+		base = fsp_initial_rows(keys, in->nkeys, nrows);
+	fsp_advance(base, keys, in->nkeys, buf, max_len - 1);
+
+	out->nNodes = 0;
+	out->nodeNumbers = (int *) palloc(sizeof(int) * in->nNodes);
+	out->levelAdds = (int *) palloc(sizeof(int) * in->nNodes);
+	out->reconstructedValues = (Datum *) palloc(sizeof(Datum) * in->nNodes);
+#if PG_VERSION_NUM >= 90600
+	out->traversalValues = (void **) palloc(sizeof(void *) * in->nNodes);
+#endif
+
+	/* rows only grow, so if the shared part rules a match out, all is done */
+	if (!fsp_viable(base, keys, in->nkeys, radius))
+		PG_RETURN_VOID();
+
+	for (i = 0; i < in->nNodes; i++)
+	{
+		int16		label = DatumGetInt16(in->nodeLabels[i]);
+		int			this_len = max_len - 1;
+		FspRows    *rows = base;
+
+		if (label > 0)
+		{
+			buf[max_len - 1] = (char) label;
+			this_len = max_len;
+			rows = fsp_copy_rows(base);
+			fsp_advance(rows, keys, in->nkeys, buf, this_len);
+			if (!fsp_viable(rows, keys, in->nkeys, radius))
+				continue;
+		}
+
+		out->nodeNumbers[out->nNodes] = i;
+		out->levelAdds[out->nNodes] = this_len - in->level;
+		out->reconstructedValues[out->nNodes] =
+			PointerGetDatum(cstring_to_text_with_len(buf, this_len));
+#if PG_VERSION_NUM >= 90600
+		{
+			MemoryContext oldcontext;
+
+			oldcontext = MemoryContextSwitchTo(in->traversalMemoryContext);
+			out->traversalValues[out->nNodes] = fsp_copy_rows(rows);
+			MemoryContextSwitchTo(oldcontext);
+		}
+#endif
+		out->nNodes++;
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Leaves: the stored datum is what is left of the string below the
+ * reconstructed prefix.
+ */
+PG_FUNCTION_INFO_V1(spgfuzzy_leaf_consistent);
+Datum
+spgfuzzy_leaf_consistent(PG_FUNCTION_ARGS)
+{
+	spgLeafConsistentIn *in = (spgLeafConsistentIn *) PG_GETARG_POINTER(0);
+	spgLeafConsistentOut *out = (spgLeafConsistentOut *) PG_GETARG_POINTER(1);
+	text	   *leaf = DatumGetTextPP(in->leafDatum);
+	int			leaf_bytes = VARSIZE_ANY_EXHDR(leaf);
+	int			full_bytes = in->level + leaf_bytes;
+	text	   *full = (text *) palloc(VARHDRSZ + full_bytes);
+	int			radius = fuzzystrmatch_radius;
+	int			i;
+
+	SET_VARSIZE(full, VARHDRSZ + full_bytes);
+	if (in->level > 0)
+		memcpy(VARDATA(full),
+			   VARDATA_ANY(DatumGetTextPP(in->reconstructedValue)),
+			   in->level);
+	if (leaf_bytes > 0)
+		memcpy(VARDATA(full) + in->level, VARDATA_ANY(leaf), leaf_bytes);
+
+	out->leafValue = PointerGetDatum(full);
+	out->recheck = false;
+
+	for (i = 0; i < in->nkeys; i++)
+	{
+		text	   *query;
+
+		if (in->scankeys[i].sk_strategy != FSP_WITHIN_STRATEGY)
+			elog(ERROR, "unrecognized strategy number: %d",
+				 in->scankeys[i].sk_strategy);
+
+		query = DatumGetTextPP(in->scankeys[i].sk_argument);
+		if (levenshtein_less_equal_internal(VARDATA_ANY(query),
+											VARSIZE_ANY_EXHDR(query),
+											VARDATA(full), full_bytes,
+											1, 1, 1, 0, radius) > radius)
+			PG_RETURN_BOOL(false);
+	}
+	PG_RETURN_BOOL(true);
+}
@@ -0,0 +1,241 @@
+/*
+ * fuzzystrmatch_standalone.h
+ *
+ * Minimal stand-ins for the backend facilities used by the string kernels,
+ * so that levenshtein.c, soundex.c and dmetaphone.c can be compiled into
+ * programs that run outside the server (see fuzzystrmatchd.c).
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_standalone.h
+ *
+ * Only what the kernels actually use is provided here.  Strings are assumed
+ * to be UTF-8; memory comes from a simple bump arena which the caller resets
+ * once the results of a batch have been consumed, in the same way the
+ * backend relies on memory context cleanup; and ereport(ERROR) longjmps to
+ * the innermost FZS_TRY block, or exits if there is none.
+ */
+#ifndef FUZZYSTRMATCH_STANDALONE_H
+#define FUZZYSTRMATCH_STANDALONE_H
+
+#include <ctype.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef FUZZYSTRMATCH_STANDALONE
+#define FUZZYSTRMATCH_STANDALONE
+#endif
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+typedef int32_t int32;
+typedef int64_t int64;
+
+#ifndef Min
+#define Min(x, y)		((x) < (y) ? (x) : (y))
+#define Max(x, y)		((x) > (y) ? (x) : (y))
+#endif
+
+#ifndef pg_attribute_printf
+#if defined(__GNUC__)
+#define pg_attribute_printf(f,a) __attribute__((format(printf, f, a)))
+#else
+#define pg_attribute_printf(f,a)
+#endif
+#endif
+
+#define lengthof(array)		(sizeof (array) / sizeof ((array)[0]))
+
+#define AssertArg(condition)	((void) 0)
+#define Assert(condition)		((void) 0)
+
+#define CHECK_FOR_INTERRUPTS()	((void) 0)
+
+/*
+ * Error reporting.  Only the ereport(ERROR, (errcode(...), errmsg(...)))
+ * and elog(ERROR, ...) shapes used by the kernels are supported.
+ */
+#define ERROR		20
+#define ERRCODE_INVALID_PARAMETER_VALUE		0
+#define ERRCODE_ZERO_LENGTH_CHARACTER_STRING	0
+
+extern char fzs_errmsg_buf[256];
+extern jmp_buf *fzs_exception_stack;
+
+static inline int
+errcode(int sqlerrcode)
+{
+	(void) sqlerrcode;
+	return 0;
+}
+
+static inline int errmsg(const char *fmt,...) pg_attribute_printf(1, 2);
+
+static inline int
+errmsg(const char *fmt,...)
+{
+	va_list		ap;
+
+	va_start(ap, fmt);
+	vsnprintf(fzs_errmsg_buf, sizeof(fzs_errmsg_buf), fmt, ap);
+	va_end(ap);
+	return 0;
+}
+
+static inline void
+fzs_throw(void)
+{
+	if (fzs_exception_stack != NULL)
+		longjmp(*fzs_exception_stack, 1);
+	fprintf(stderr, "ERROR:  %s\n", fzs_errmsg_buf);
+	exit(1);
+}
+
+#define ereport(elevel, rest)	((void) rest, fzs_throw())
+#define elog(elevel, ...)		((void) errmsg(__VA_ARGS__), fzs_throw())
+
+/*
+ * FZS_TRY() { ... } FZS_CATCH() { ... } FZS_END_TRY();
+ *
+ * A cut-down PG_TRY: on error, the catch block runs with the message in
+ * fzs_errmsg_buf.  Blocks must not be left by return or goto.
+ */
+#define FZS_TRY() \
+	do { \
+		jmp_buf    *fzs_save_stack = fzs_exception_stack; \
+		jmp_buf		fzs_local_jmp; \
+		if (setjmp(fzs_local_jmp) == 0) \
+		{ \
+			fzs_exception_stack = &fzs_local_jmp;
+#define FZS_CATCH() \
+		} \
+		else \
+		{ \
+			fzs_exception_stack = fzs_save_stack;
+#define FZS_END_TRY() \
+		} \
+		fzs_exception_stack = fzs_save_stack; \
+	} while (0)
+
+/*
+ * Memory.  palloc'd chunks live until the next fzs_arena_reset(); pfree is
+ * a no-op, as it effectively is for the kernels inside the backend too.
+ */
+extern void *fzs_arena_alloc(size_t size);
+extern void fzs_arena_reset(void);
+
+#define palloc(sz)			fzs_arena_alloc(sz)
+#define palloc0(sz)			memset(fzs_arena_alloc(sz), 0, (sz))
+#define pfree(p)			((void) (p))
+
+/*
+ * Multibyte support: UTF-8 only.
+ */
+static inline int
+pg_mblen(const char *mbstr)
+{
+	unsigned char c = (unsigned char) *mbstr;
+
+	if ((c & 0x80) == 0)
+		return 1;
+	else if ((c & 0xe0) == 0xc0)
+		return 2;
+	else if ((c & 0xf0) == 0xe0)
+		return 3;
+	else if ((c & 0xf8) == 0xf0)
+		return 4;
+	return 1;
+}
+
+static inline int
+pg_mbstrlen_with_len(const char *mbstr, int limit)
+{
+	int			len = 0;
+
+	while (limit > 0 && *mbstr)
+	{
+		int			l = pg_mblen(mbstr);
+
+		limit -= l;
+		mbstr += l;
+		len++;
+	}
+	return len;
+}
+
+/*
+ * Storage for the above.  Exactly one translation unit per program must
+ * define FZS_STANDALONE_IMPLEMENTATION before including this header.
+ */
+#ifdef FZS_STANDALONE_IMPLEMENTATION
+
+#define FZS_ARENA_BLOCK_SIZE	(64 * 1024)
+
+typedef struct FzsArenaBlock
+{
+	struct FzsArenaBlock *next;
+	size_t		size;
+	size_t		used;
+	/* data follows, suitably aligned */
+	double		data[1];
+} FzsArenaBlock;
+
+char		fzs_errmsg_buf[256];
+jmp_buf    *fzs_exception_stack = NULL;
+
+static FzsArenaBlock *fzs_arena_head = NULL;
+
+void *
+fzs_arena_alloc(size_t size)
+{
+	FzsArenaBlock *blk = fzs_arena_head;
+	void	   *result;
+
+	size = (size + 15) & ~((size_t) 15);
+	if (blk == NULL || blk->size - blk->used < size)
+	{
+		size_t		bsize = Max(size, (size_t) FZS_ARENA_BLOCK_SIZE);
+
+		blk = malloc(offsetof(FzsArenaBlock, data) + bsize);
+		if (blk == NULL)
+		{
+			snprintf(fzs_errmsg_buf, sizeof(fzs_errmsg_buf), "out of memory");
+			fzs_throw();
+		}
+		blk->size = bsize;
+		blk->used = 0;
+		blk->next = fzs_arena_head;
+		fzs_arena_head = blk;
+	}
+	result = (char *) blk->data + blk->used;
+	blk->used += size;
+	return result;
+}
+
+void
+fzs_arena_reset(void)
+{
+	FzsArenaBlock *blk = fzs_arena_head;
+
+	if (blk == NULL)
+		return;
+
+	/* keep the newest block around for reuse, release the rest */
+	while (blk->next != NULL)
+	{
+		FzsArenaBlock *next = blk->next;
+
+		blk->next = next->next;
+		free(next);
+	}
+	blk->used = 0;
+}
+#endif   /* FZS_STANDALONE_IMPLEMENTATION */
+
+#endif   /* FUZZYSTRMATCH_STANDALONE_H */
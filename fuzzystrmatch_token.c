@@ -0,0 +1,287 @@
+/*
+ * fuzzystrmatch_token.c
+ *
+ * Levenshtein distance ignoring word order.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_token.c
+ *
+ * levenshtein_token_sort(a, b) splits both strings into whitespace-separated
+ * tokens, sorts each string's tokens and joins them with single spaces, and
+ * returns the distance between the results, so that "Smith John" and
+ * "John Smith" are at distance 0.
+ *
+ * levenshtein_token_set(a, b) also forgets repeated tokens, and then only
+ * counts the tokens the strings don't share: with S the sorted tokens common
+ * to both, and A and B those only in a and only in b, it is the smallest of
+ * the distances between "S", "S A" and "S B".  "S" is a prefix of the other
+ * two, so the first two of those are simply differences in length, and a
+ * string whose tokens are all among the other's is at distance 0 from it.
+ *
+ * Tokens are compared bytewise, not by collation; only the order matters,
+ * and only within one call.  Everything for one call is carved out of a
+ * single scratch allocation, and the joined strings are compared with the
+ * levenshtein.c kernel, bounded in the _less_equal variants.
+ */
+#include "postgres.h"
+
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+
+typedef struct
+{
+	const char *data;
+	int			len;
+} FztToken;
+
+/* one string, split and sorted */
+typedef struct
+{
+	FztToken   *tokens;
+	int			ntokens;
+} FztTokens;
+
+extern Datum levenshtein_token_sort(PG_FUNCTION_ARGS);
+extern Datum levenshtein_token_sort_less_equal(PG_FUNCTION_ARGS);
+extern Datum levenshtein_token_set(PG_FUNCTION_ARGS);
+extern Datum levenshtein_token_set_less_equal(PG_FUNCTION_ARGS);
+
+static inline bool
+fzt_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+		c == '\f' || c == '\v';
+}
+
+static int
+fzt_token_cmp(const void *a, const void *b)
+{
+	const FztToken *ta = (const FztToken *) a;
+	const FztToken *tb = (const FztToken *) b;
+	int			r = memcmp(ta->data, tb->data, Min(ta->len, tb->len));
+
+	if (r != 0)
+		return r;
+	return ta->len - tb->len;
+}
+
+/*
+ * Split a string into tokens, which point into it, and sort them; tokens
+ * must have room for len / 2 + 1 of them.
+ */
+static void
+fzt_split(const char *s, int len, bool dedupe, FztToken *tokens,
+		  FztTokens *out)
+{
+	int			n = 0;
+	int			i = 0;
+
+	while (i < len)
+	{
+		int			start;
+
+		while (i < len && fzt_is_space(s[i]))
+			i++;
+		if (i == len)
+			break;
+		start = i;
+		while (i < len && !fzt_is_space(s[i]))
+			i++;
+		tokens[n].data = s + start;
+		tokens[n].len = i - start;
+		n++;
+	}
+	qsort(tokens, n, sizeof(FztToken), fzt_token_cmp);
+
+	if (dedupe && n > 1)
+	{
+		int			kept = 1;
+
+		for (i = 1; i < n; i++)
+		{
+			if (fzt_token_cmp(&tokens[i], &tokens[kept - 1]) != 0)
+				tokens[kept++] = tokens[i];
+		}
+		n = kept;
+	}
+	out->tokens = tokens;
+	out->ntokens = n;
+}
+
+/* Append a token to buf[*pos], after a space unless it comes first */
+static inline void
+fzt_append(char *buf, int *pos, const FztToken *token)
+{
+	if (*pos > 0)
+		buf[(*pos)++] = ' ';
+	memcpy(buf + *pos, token->data, token->len);
+	*pos += token->len;
+}
+
+static int
+fzt_token_sort(FunctionCallInfo fcinfo, int max_d)
+{
+	text	   *a = PG_GETARG_TEXT_PP(0);
+	text	   *b = PG_GETARG_TEXT_PP(1);
+	int			a_len = VARSIZE_ANY_EXHDR(a);
+	int			b_len = VARSIZE_ANY_EXHDR(b);
+	char	   *arena;
+	FztTokens	ta;
+	FztTokens	tb;
+	char	   *ja;
+	char	   *jb;
+	int			ja_len = 0;
+	int			jb_len = 0;
+	int			i;
+
+	arena = palloc((a_len / 2 + 1 + b_len / 2 + 1) * sizeof(FztToken) +
+				   a_len + b_len);
+	fzt_split(VARDATA_ANY(a), a_len, false, (FztToken *) arena, &ta);
+	fzt_split(VARDATA_ANY(b), b_len, false, ta.tokens + a_len / 2 + 1, &tb);
+	ja = (char *) (tb.tokens + b_len / 2 + 1);
+	jb = ja + a_len;
+
+	for (i = 0; i < ta.ntokens; i++)
+		fzt_append(ja, &ja_len, &ta.tokens[i]);
+	for (i = 0; i < tb.ntokens; i++)
+		fzt_append(jb, &jb_len, &tb.tokens[i]);
+
+	return levenshtein_less_equal_internal(ja, ja_len, jb, jb_len,
+										   1, 1, 1, 0, max_d);
+}
+
+static int
+fzt_token_set(FunctionCallInfo fcinfo, int max_d)
+{
+	text	   *a = PG_GETARG_TEXT_PP(0);
+	text	   *b = PG_GETARG_TEXT_PP(1);
+	int			a_len = VARSIZE_ANY_EXHDR(a);
+	int			b_len = VARSIZE_ANY_EXHDR(b);
+	char	   *arena;
+	FztTokens	ta;
+	FztTokens	tb;
+	char	   *sa;				/* "S A" */
+	char	   *sb;				/* "S B" */
+	int			s_len = 0;
+	int			sa_len;
+	int			sb_len;
+	int			s_chars;
+	int			best;
+	int			i,
+				j;
+
+	arena = palloc((a_len / 2 + 1 + b_len / 2 + 1) * sizeof(FztToken) +
+				   2 * (a_len + b_len + 1));
+	fzt_split(VARDATA_ANY(a), a_len, true, (FztToken *) arena, &ta);
+	fzt_split(VARDATA_ANY(b), b_len, true, ta.tokens + a_len / 2 + 1, &tb);
+	sa = (char *) (tb.tokens + b_len / 2 + 1);
+	sb = sa + a_len + b_len + 1;
+
+	/* S, written at the head of both buffers */
+	for (i = 0, j = 0; i < ta.ntokens && j < tb.ntokens;)
+	{
+		int			cmp = fzt_token_cmp(&ta.tokens[i], &tb.tokens[j]);
+
+		if (cmp == 0)
+		{
+			fzt_append(sa, &s_len, &ta.tokens[i]);
+			i++;
+			j++;
+		}
+		else if (cmp < 0)
+			i++;
+		else
+			j++;
+	}
+	memcpy(sb, sa, s_len);
+	s_chars = pg_mbstrlen_with_len(sa, s_len);
+
+	/* then the tokens only one of them has */
+	sa_len = sb_len = s_len;
+	for (i = 0, j = 0; i < ta.ntokens || j < tb.ntokens;)
+	{
+		int			cmp;
+
+		if (i == ta.ntokens)
+			cmp = 1;
+		else if (j == tb.ntokens)
+			cmp = -1;
+		else
+			cmp = fzt_token_cmp(&ta.tokens[i], &tb.tokens[j]);
+
+		if (cmp == 0)
+		{
+			i++;
+			j++;
+		}
+		else if (cmp < 0)
+			fzt_append(sa, &sa_len, &ta.tokens[i++]);
+		else
+			fzt_append(sb, &sb_len, &tb.tokens[j++]);
+	}
+
+	/* S is a prefix of both, so these two are pure insertions */
+	best = Min(pg_mbstrlen_with_len(sa, sa_len),
+			   pg_mbstrlen_with_len(sb, sb_len)) - s_chars;
+	if (best > 0)
+	{
+		int			bound = best - 1;
+		int			d;
+
+		if (max_d >= 0)
+			bound = Min(bound, max_d);
+		d = levenshtein_less_equal_internal(sa, sa_len, sb, sb_len,
+											1, 1, 1, 0, bound);
+		best = Min(best, d);
+	}
+	if (max_d >= 0 && best > max_d)
+		best = max_d + 1;
+	return best;
+}
+
+/*
+ * levenshtein_token_sort(a, b): the distance between a and b with their
+ * tokens sorted
+ */
+PG_FUNCTION_INFO_V1(levenshtein_token_sort);
+Datum
+levenshtein_token_sort(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32(fzt_token_sort(fcinfo, -1));
+}
+
+/*
+ * levenshtein_token_sort_less_equal(a, b, max_d): the same, but only exact
+ * up to max_d; a greater distance comes back as some value above max_d
+ */
+PG_FUNCTION_INFO_V1(levenshtein_token_sort_less_equal);
+Datum
+levenshtein_token_sort_less_equal(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32(fzt_token_sort(fcinfo, PG_GETARG_INT32(2)));
+}
+
+/*
+ * levenshtein_token_set(a, b): the distance between a and b counting only
+ * the tokens they don't share
+ */
+PG_FUNCTION_INFO_V1(levenshtein_token_set);
+Datum
+levenshtein_token_set(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32(fzt_token_set(fcinfo, -1));
+}
+
+/*
+ * levenshtein_token_set_less_equal(a, b, max_d): the same, but only exact
+ * up to max_d; a greater distance comes back as some value above max_d
+ */
+PG_FUNCTION_INFO_V1(levenshtein_token_set_less_equal);
+Datum
+levenshtein_token_set_less_equal(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32(fzt_token_set(fcinfo, PG_GETARG_INT32(2)));
+}
@@ -0,0 +1,335 @@
+/*
+ * fuzzystrmatch_topk.c
+ *
+ * Top-k nearest strings of a table column, scanned in order of length.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_topk.c
+ *
+ * With unit costs, the Levenshtein distance between two strings is at least
+ * the difference of their lengths in characters; levenshtein_less_equal()
+ * relies on the same bound to give up early.  fuzzy_topk(rel, col, query, k)
+ * turns it into a scan strategy: it reads the rows whose column is exactly
+ * as long as the query, then those one character shorter and longer, two
+ * characters, and so on outwards.  Once k words have been found, a bucket
+ * whose length differs from the query's by at least the k-th best distance
+ * cannot hold a better word, and neither can any bucket beyond it, so the
+ * search stops there.
+ *
+ * Each bucket is read with "WHERE length(col) = $1", which is meant to be
+ * answered from an expression index:
+ *
+ *		CREATE INDEX ON words (length(word));
+ *
+ * Without one every bucket costs a sequential scan and the function is
+ * much slower than a plain ORDER BY levenshtein(...) LIMIT k.  The range of
+ * lengths present is found first with min() and max(), which the same index
+ * answers cheaply, so lengths no row has are never probed.
+ *
+ * Candidates are compared with levenshtein_less_equal_internal() bounded by
+ * the k-th best distance so far, so that most of those that cannot make the
+ * list are rejected after a few rows of the matrix.  Words longer than the
+ * kernels accept are never read.
+ */
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+
+/* rows fetched from a bucket at a time */
+#define TOPK_FETCH_ROWS		1000
+
+typedef struct TopkEntry
+{
+	int			distance;
+	char	   *word;
+} TopkEntry;
+
+typedef struct
+{
+	int			k;
+	int			n;				/* entries in the heap */
+	TopkEntry  *heap;			/* max-heap on distance */
+	MemoryContext context;		/* holds the words in the heap */
+	MemoryContext kernel_context;	/* reset after every distance */
+} TopkState;
+
+extern Datum fuzzy_topk(PG_FUNCTION_ARGS);
+
+/* The distance a candidate must beat, or -1 while the heap is filling */
+static inline int
+topk_bound(TopkState *state)
+{
+	return state->n < state->k ? -1 : state->heap[0].distance;
+}
+
+static void
+topk_sift_down(TopkState *state, int i)
+{
+	TopkEntry  *heap = state->heap;
+
+	for (;;)
+	{
+		int			largest = i;
+		int			l = 2 * i + 1;
+		int			r = l + 1;
+		TopkEntry	tmp;
+
+		if (l < state->n && heap[l].distance > heap[largest].distance)
+			largest = l;
+		if (r < state->n && heap[r].distance > heap[largest].distance)
+			largest = r;
+		if (largest == i)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[largest];
+		heap[largest] = tmp;
+		i = largest;
+	}
+}
+
+static void
+topk_offer(TopkState *state, const char *word, int len, int distance)
+{
+	TopkEntry  *heap = state->heap;
+	bool		replace = state->n == state->k;
+	int			i;
+
+	if (replace)
+	{
+		pfree(heap[0].word);
+		i = 0;
+	}
+	else
+	{
+		/* sift up */
+		i = state->n++;
+		while (i > 0 && heap[(i - 1) / 2].distance < distance)
+		{
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+	}
+	heap[i].distance = distance;
+	heap[i].word = MemoryContextAlloc(state->context, len + 1);
+	memcpy(heap[i].word, word, len + 1);
+	if (replace)
+		topk_sift_down(state, 0);
+}
+
+static int
+topk_entry_cmp(const void *a, const void *b)
+{
+	const TopkEntry *ea = (const TopkEntry *) a;
+	const TopkEntry *eb = (const TopkEntry *) b;
+
+	if (ea->distance != eb->distance)
+		return ea->distance < eb->distance ? -1 : 1;
+	return strcmp(ea->word, eb->word);
+}
+
+/*
+ * Offer every word of one length bucket.  Returns false once the k-th best
+ * distance has fallen to gap, after which no word this far from the query's
+ * length can improve on the list.
+ */
+static bool
+topk_bucket(TopkState *state, SPIPlanPtr plan, int length, int gap,
+			const char *query, int query_len)
+{
+	Portal		portal;
+	Datum		arg = Int32GetDatum(length);
+	bool		more = true;
+
+	portal = SPI_cursor_open(NULL, plan, &arg, " ", true);
+	while (more)
+	{
+		TupleDesc	tupdesc;
+		uint64		i;
+
+		SPI_cursor_fetch(portal, true, TOPK_FETCH_ROWS);
+		if (SPI_processed == 0)
+			break;
+
+		tupdesc = SPI_tuptable->tupdesc;
+		for (i = 0; i < SPI_processed; i++)
+		{
+			char	   *word = SPI_getvalue(SPI_tuptable->vals[i], tupdesc, 1);
+			int			bound = topk_bound(state);
+			MemoryContext oldcontext;
+			int			len;
+			int			d;
+
+			if (bound >= 0 && bound <= gap)
+			{
+				more = false;
+				break;
+			}
+			if (word == NULL)
+				continue;
+
+			CHECK_FOR_INTERRUPTS();
+
+			/* the kernel doesn't free its rows */
+			len = strlen(word);
+			oldcontext = MemoryContextSwitchTo(state->kernel_context);
+			d = levenshtein_less_equal_internal(query, query_len, word, len,
+												1, 1, 1, 0,
+												bound < 0 ? -1 : bound - 1);
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextReset(state->kernel_context);
+
+			if (bound < 0 || d < bound)
+				topk_offer(state, word, len, d);
+			pfree(word);
+		}
+		SPI_freetuptable(SPI_tuptable);
+	}
+	SPI_cursor_close(portal);
+
+	return more;
+}
+
+/*
+ * fuzzy_topk(rel regclass, col text, query text, k int)
+ * returns setof (word, distance)
+ *
+ * The k values of rel.col nearest to query by Levenshtein distance, nearest
+ * first.  Of words tied at the k-th distance, those closest to the query in
+ * length are kept.  Null values are ignored.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_topk);
+Datum
+fuzzy_topk(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	char	   *col = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	text	   *query_t = PG_GETARG_TEXT_PP(2);
+	int32		k = PG_GETARG_INT32(3);
+	const char *query = VARDATA_ANY(query_t);
+	int			query_len = VARSIZE_ANY_EXHDR(query_t);
+	int			query_chars = pg_mbstrlen_with_len(query, query_len);
+	MemoryContext callcontext = CurrentMemoryContext;
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	TopkState	state;
+	char	   *relname;
+	char	   *nspname;
+	const char *colname;
+	StringInfoData sql;
+	Oid			argtype = INT4OID;
+	SPIPlanPtr	plan;
+	bool		isnull;
+	int			min_len;
+	int			max_len;
+	int			gap;
+	int			i;
+
+	if (k < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("k must not be negative")));
+	if (query_chars > MAX_LEVENSHTEIN_STRLEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("argument exceeds the maximum length of %d bytes",
+						MAX_LEVENSHTEIN_STRLEN)));
+
+	relname = get_rel_name(relid);
+	nspname = relname ? get_namespace_name(get_rel_namespace(relid)) : NULL;
+	if (relname == NULL || nspname == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("relation with OID %u does not exist", relid)));
+	relname = quote_qualified_identifier(nspname, relname);
+	colname = quote_identifier(col);
+
+	tupstore = init_materialize_srf(fcinfo, &tupdesc);
+	if (k == 0)
+		return (Datum) 0;
+
+	memset(&state, 0, sizeof(state));
+	state.k = k;
+	state.context = callcontext;
+	state.heap = MemoryContextAlloc(callcontext, k * sizeof(TopkEntry));
+	state.kernel_context = AllocSetContextCreate(callcontext,
+												 "fuzzy_topk kernel",
+												 ALLOCSET_DEFAULT_MINSIZE,
+												 ALLOCSET_DEFAULT_INITSIZE,
+												 ALLOCSET_DEFAULT_MAXSIZE);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	/* the lengths present, so empty buckets are never probed */
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "SELECT min(length(%s)), max(length(%s)) FROM %s",
+					 colname, colname, relname);
+	if (SPI_execute(sql.data, true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "could not find the lengths of %s.%s", relname, colname);
+	min_len = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+										  SPI_tuptable->tupdesc, 1, &isnull));
+	if (isnull)
+	{
+		/* no rows, or only nulls */
+		SPI_finish();
+		MemoryContextDelete(state.kernel_context);
+		return (Datum) 0;
+	}
+	max_len = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+										  SPI_tuptable->tupdesc, 2, &isnull));
+	max_len = Min(max_len, MAX_LEVENSHTEIN_STRLEN);
+	SPI_freetuptable(SPI_tuptable);
+
+	resetStringInfo(&sql);
+	appendStringInfo(&sql, "SELECT %s FROM %s WHERE length(%s) = $1",
+					 colname, relname, colname);
+	plan = SPI_prepare(sql.data, 1, &argtype);
+	if (plan == NULL)
+		elog(ERROR, "SPI_prepare failed: %s",
+			 SPI_result_code_string(SPI_result));
+
+	for (gap = 0;; gap++)
+	{
+		int			shorter = query_chars - gap;
+		int			longer = query_chars + gap;
+		int			bound = topk_bound(&state);
+
+		if (bound >= 0 && bound <= gap)
+			break;
+		if (shorter < min_len && longer > max_len)
+			break;
+
+		if (shorter >= min_len && shorter <= max_len &&
+			!topk_bucket(&state, plan, shorter, gap, query, query_len))
+			break;
+		if (gap > 0 && longer >= min_len && longer <= max_len &&
+			!topk_bucket(&state, plan, longer, gap, query, query_len))
+			break;
+	}
+
+	SPI_finish();
+	MemoryContextDelete(state.kernel_context);
+
+	qsort(state.heap, state.n, sizeof(TopkEntry), topk_entry_cmp);
+	for (i = 0; i < state.n; i++)
+	{
+		Datum		values[2];
+		bool		nulls[2] = {false, false};
+
+		values[0] = CStringGetTextDatum(state.heap[i].word);
+		values[1] = Int32GetDatum(state.heap[i].distance);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
@@ -0,0 +1,381 @@
+/*
+ * fuzzystrmatch_window.c
+ *
+ * Sorted-neighbourhood matching as a window function.
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatch_window.c
+ *
+ * The sorted-neighbourhood method of record linkage sorts the records by a
+ * key and compares each only with the w records before it.  In plain SQL
+ * that takes w lag() calls and w levenshtein() calls per row, each of which
+ * detoasts and decodes both strings again.  Used as
+ *
+ *		fuzzy_neighbour_match(name, w, k) OVER (ORDER BY soundex(name), name)
+ *
+ * the window function returns the offsets (1 for the previous row, up to w)
+ * of the preceding rows of the partition whose value is within Levenshtein
+ * distance k of the current row's.
+ *
+ * The last w values are kept, already decoded, in a ring buffer, so each row
+ * is prepared once however many rows it is compared with.  Preparing a value
+ * of at most 64 characters also builds its match masks, the bitmap of the
+ * positions at which each of its characters occurs, and comparisons against
+ * it then run Myers' bit-parallel algorithm, one machine word per character
+ * of the other string.  Longer values fall back to the levenshtein.c kernel
+ * bounded by k.  Either way, a pair whose lengths differ by more than k is
+ * rejected without looking at the characters.
+ */
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "fuzzystrmatch.h"
+#include "mb/pg_wchar.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "windowapi.h"
+
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+
+/* longest value that gets match masks: one bit per character */
+#define FZN_MASK_CHARS			64
+
+/* largest window, to keep the ring buffer within reason */
+#define FZN_MAX_WINDOW			100000
+
+/* a value in the ring buffer, allocated as one chunk */
+typedef struct
+{
+	bool		isnull;
+	int			nbytes;
+	int			m;				/* length in characters */
+	char	   *bytes;
+	pg_wchar   *chars;
+	int			npeq;			/* distinct characters, when masked */
+	pg_wchar   *peq_chars;		/* sorted */
+	uint64	   *peq_masks;		/* positions of each of them */
+} FznEntry;
+
+/* kept in fn_extra */
+typedef struct
+{
+	MemoryContext context;		/* holds the entries */
+	int			w;
+	int			k;
+	int			next;			/* slot the next entry goes in */
+	int			count;			/* entries in the ring */
+	FznEntry  **ring;
+} FznState;
+
+/* partition-local memory, zeroed when a partition starts */
+typedef struct
+{
+	bool		started;
+	int64		next_pos;		/* position the ring buffer is ready for */
+} FznPartition;
+
+typedef struct
+{
+	pg_wchar	c;
+	int			pos;
+} FznCharPos;
+
+extern Datum fuzzy_neighbour_match(PG_FUNCTION_ARGS);
+
+static int
+fzn_charpos_cmp(const void *a, const void *b)
+{
+	const FznCharPos *ca = (const FznCharPos *) a;
+	const FznCharPos *cb = (const FznCharPos *) b;
+
+	if (ca->c != cb->c)
+		return ca->c < cb->c ? -1 : 1;
+	return ca->pos - cb->pos;
+}
+
+static FznEntry *
+fzn_prepare(FznState *state, text *value)
+{
+	FznEntry   *entry;
+	int			nbytes;
+	int			m;
+	bool		masked;
+	Size		size;
+	char	   *p;
+
+	if (value == NULL)
+	{
+		entry = MemoryContextAllocZero(state->context, sizeof(FznEntry));
+		entry->isnull = true;
+		return entry;
+	}
+
+	nbytes = VARSIZE_ANY_EXHDR(value);
+	m = pg_mbstrlen_with_len(VARDATA_ANY(value), nbytes);
+	masked = m <= FZN_MASK_CHARS;
+
+	size = MAXALIGN(sizeof(FznEntry)) + MAXALIGN((m + 1) * sizeof(pg_wchar));
+	if (masked)
+		size += MAXALIGN(m * sizeof(pg_wchar)) + m * sizeof(uint64);
+	size += nbytes;
+
+	p = MemoryContextAllocZero(state->context, size);
+	entry = (FznEntry *) p;
+	p += MAXALIGN(sizeof(FznEntry));
+	entry->chars = (pg_wchar *) p;
+	p += MAXALIGN((m + 1) * sizeof(pg_wchar));
+	if (masked)
+	{
+		entry->peq_chars = (pg_wchar *) p;
+		p += MAXALIGN(m * sizeof(pg_wchar));
+		entry->peq_masks = (uint64 *) p;
+		p += m * sizeof(uint64);
+	}
+	entry->bytes = p;
+	memcpy(entry->bytes, VARDATA_ANY(value), nbytes);
+	entry->nbytes = nbytes;
+	entry->m = pg_mb2wchar_with_len(entry->bytes, entry->chars, nbytes);
+	entry->npeq = masked ? 0 : -1;
+
+	if (masked && entry->m > 0)
+	{
+		FznCharPos *cp = palloc(entry->m * sizeof(FznCharPos));
+		int			i;
+
+		for (i = 0; i < entry->m; i++)
+		{
+			cp[i].c = entry->chars[i];
+			cp[i].pos = i;
+		}
+		qsort(cp, entry->m, sizeof(FznCharPos), fzn_charpos_cmp);
+		for (i = 0; i < entry->m; i++)
+		{
+			if (i == 0 || cp[i].c != cp[i - 1].c)
+			{
+				entry->peq_chars[entry->npeq] = cp[i].c;
+				entry->peq_masks[entry->npeq++] = 0;
+			}
+			entry->peq_masks[entry->npeq - 1] |= UINT64CONST(1) << cp[i].pos;
+		}
+		pfree(cp);
+	}
+
+	return entry;
+}
+
+/* The positions at which c occurs in a masked entry */
+static inline uint64
+fzn_peq(const FznEntry *entry, pg_wchar c)
+{
+	int			lo = 0;
+	int			hi = entry->npeq - 1;
+
+	while (lo <= hi)
+	{
+		int			mid = (lo + hi) / 2;
+
+		if (entry->peq_chars[mid] == c)
+			return entry->peq_masks[mid];
+		if (entry->peq_chars[mid] < c)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return 0;
+}
+
+/*
+ * Levenshtein distance between a masked entry and a string of n characters,
+ * by Myers' algorithm in Hyyrö's formulation for whole strings: the column
+ * of the matrix is kept as bit vectors of its vertical deltas, and score
+ * tracks its last entry.  Returns k + 1 as soon as the distance must exceed
+ * k.
+ */
+static int
+fzn_myers(const FznEntry *pattern, const pg_wchar *t, int n, int k)
+{
+	uint64		pv = ~UINT64CONST(0);
+	uint64		mv = 0;
+	uint64		last = UINT64CONST(1) << (pattern->m - 1);
+	int			score = pattern->m;
+	int			j;
+
+	for (j = 0; j < n; j++)
+	{
+		uint64		eq = fzn_peq(pattern, t[j]);
+		uint64		xv = eq | mv;
+		uint64		xh = (((eq & pv) + pv) ^ pv) | eq;
+		uint64		ph = mv | ~(xh | pv);
+		uint64		mh = pv & xh;
+
+		if (ph & last)
+			score++;
+		else if (mh & last)
+			score--;
+
+		/* the top row goes up by one per character of t */
+		ph = (ph << 1) | 1;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+
+		/* the rest of t can lower the score by one per character at most */
+		if (score - (n - j - 1) > k)
+			return k + 1;
+	}
+	return score;
+}
+
+/* Is the distance between two entries at most k? */
+static bool
+fzn_within(const FznEntry *a, const FznEntry *b, int k)
+{
+	if (a->isnull || b->isnull || Abs(a->m - b->m) > k)
+		return false;
+	if (a->m == 0 || b->m == 0)
+		return true;			/* the length test settled it */
+	if (a->npeq >= 0)
+		return fzn_myers(a, b->chars, b->m, k) <= k;
+	if (b->npeq >= 0)
+		return fzn_myers(b, a->chars, a->m, k) <= k;
+	return levenshtein_less_equal_internal(a->bytes, a->nbytes,
+										   b->bytes, b->nbytes,
+										   1, 1, 1, 0, k) <= k;
+}
+
+static void
+fzn_push(FznState *state, FznEntry *entry)
+{
+	if (state->w == 0)
+	{
+		pfree(entry);
+		return;
+	}
+	if (state->count == state->w)
+		pfree(state->ring[state->next]);
+	else
+		state->count++;
+	state->ring[state->next] = entry;
+	state->next = (state->next + 1) % state->w;
+}
+
+/*
+ * fuzzy_neighbour_match(value text, w int, k int) returns int[]
+ *
+ * Window function: the offsets, nearest first, of those of the w preceding
+ * rows of the partition whose value is within Levenshtein distance k of the
+ * current row's.  Null values match nothing; the result is null when the
+ * current value is.  w and k must be the same for every row of a partition.
+ */
+PG_FUNCTION_INFO_V1(fuzzy_neighbour_match);
+Datum
+fuzzy_neighbour_match(PG_FUNCTION_ARGS)
+{
+	WindowObject winobj = PG_WINDOW_OBJECT();
+	FznPartition *part;
+	FznState   *state = (FznState *) fcinfo->flinfo->fn_extra;
+	int64		pos = WinGetCurrentPosition(winobj);
+	Datum		value;
+	bool		value_null;
+	bool		w_null;
+	bool		k_null;
+	int32		w;
+	int32		k;
+	FznEntry   *cur;
+	Datum	   *offsets;
+	int			noffsets = 0;
+	int			off;
+
+	value = WinGetFuncArgCurrent(winobj, 0, &value_null);
+	w = DatumGetInt32(WinGetFuncArgCurrent(winobj, 1, &w_null));
+	k = DatumGetInt32(WinGetFuncArgCurrent(winobj, 2, &k_null));
+	if (w_null || k_null)
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("window size and distance must not be null")));
+	if (w < 0 || w > FZN_MAX_WINDOW)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("window size must be between 0 and %d",
+						FZN_MAX_WINDOW)));
+	if (k < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("k must not be negative")));
+
+	if (state == NULL)
+	{
+		state = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+									   sizeof(FznState));
+		state->context = AllocSetContextCreate(fcinfo->flinfo->fn_mcxt,
+											   "fuzzy_neighbour_match",
+											   ALLOCSET_DEFAULT_MINSIZE,
+											   ALLOCSET_DEFAULT_INITSIZE,
+											   ALLOCSET_DEFAULT_MAXSIZE);
+		fcinfo->flinfo->fn_extra = state;
+	}
+
+	part = (FznPartition *) WinGetPartitionLocalMemory(winobj,
+													   sizeof(FznPartition));
+	if (!part->started)
+	{
+		/* a new partition: forget the last one's rows */
+		MemoryContextReset(state->context);
+		state->w = w;
+		state->k = k;
+		state->ring = MemoryContextAlloc(state->context,
+										 Max(w, 1) * sizeof(FznEntry *));
+		state->next = 0;
+		state->count = 0;
+		part->started = true;
+		part->next_pos = pos;
+	}
+	else if (w != state->w || k != state->k)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("window size and distance must be the same for every row of a partition")));
+
+	if (pos != part->next_pos)
+	{
+		/* not called for the rows in order; refill the ring from the rows */
+		while (state->count > 0)
+		{
+			state->next = (state->next + state->w - 1) % state->w;
+			pfree(state->ring[state->next]);
+			state->count--;
+		}
+		for (off = (int) Min((int64) w, pos); off >= 1; off--)
+		{
+			bool		isnull;
+			bool		isout;
+			Datum		prev;
+
+			prev = WinGetFuncArgInPartition(winobj, 0, -off,
+											WINDOW_SEEK_CURRENT, false,
+											&isnull, &isout);
+			fzn_push(state, fzn_prepare(state,
+										isnull || isout ? NULL :
+										DatumGetTextPP(prev)));
+		}
+	}
+
+	cur = fzn_prepare(state, value_null ? NULL : DatumGetTextPP(value));
+	offsets = palloc(Max(state->count, 1) * sizeof(Datum));
+	for (off = 1; off <= state->count; off++)
+	{
+		FznEntry   *prev = state->ring[(state->next - off + state->w) % state->w];
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (fzn_within(prev, cur, k))
+			offsets[noffsets++] = Int32GetDatum(off);
+	}
+	fzn_push(state, cur);
+	part->next_pos = pos + 1;
+
+	if (value_null)
+		PG_RETURN_NULL();
+	PG_RETURN_ARRAYTYPE_P(construct_array(offsets, noffsets, INT4OID,
+										  sizeof(int32), true, 'i'));
+}
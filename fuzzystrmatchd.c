@@ -0,0 +1,953 @@
+/*
+ * fuzzystrmatchd.c
+ *
+ * A small standalone daemon that answers fuzzy lookups against a resident
+ * dictionary over a Unix-domain socket, using the same kernels as the
+ * extension (levenshtein.c, soundex.c and dmetaphone.c).
+ *
+ * contrib/fuzzystrmatch/fuzzystrmatchd.c
+ *
+ * Usage: fuzzystrmatchd -s SOCKET -d DICTIONARY [-b MAX_BATCH]
+ *
+ * DICTIONARY is either a compiled dictionary (see fuzzydict.h and
+ * fuzzystrmatch_builddict), which is mapped into memory as it is, or a plain
+ * word list with one entry per line, which is compiled into the same form
+ * at startup.  Either way we search the length index and the soundex and
+ * double metaphone code indexes of the image.
+ *
+ * The protocol is line based.  Requests and responses are newline-terminated
+ * and their fields are separated by tabs; every request gets exactly one
+ * response line, and responses on a connection come back in request order,
+ * so clients may pipeline.
+ *
+ *	PING					-> OK
+ *	DIST a b				-> OK distance
+ *	LEV max_d query			-> OK n word1 d1 ... wordn dn
+ *	SOUNDEX query			-> OK n word1 ... wordn
+ *	DMETAPHONE query		-> OK n word1 ... wordn
+ *	STATS					-> OK name=value ...
+ *
+ * Failures are reported as "ERR message".
+ *
+ * Every time round the event loop we collect the complete requests that
+ * are waiting on all connections (up to MAX_BATCH of them) and process them
+ * as one batch.  LEV requests in a batch are evaluated together: we walk the
+ * length index once, and each candidate is compared against every query in
+ * the batch whose length is close enough for the candidate to qualify, so
+ * candidate data is touched once per batch rather than once per request.
+ */
+#define FZS_STANDALONE_IMPLEMENTATION
+#include "fuzzystrmatch_standalone.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "soundex.c"
+#include "levenshtein.c"
+#define LEVENSHTEIN_LESS_EQUAL
+#include "levenshtein.c"
+#include "dmetaphone.c"
+#include "fuzzydict.c"
+
+#define DEFAULT_MAX_BATCH		256
+#define MAX_REQUEST_LEN			(64 * 1024)
+#define LATENCY_BUCKETS			32
+
+/* Request kinds */
+typedef enum
+{
+	REQ_PING,
+	REQ_DIST,
+	REQ_LEV,
+	REQ_SOUNDEX,
+	REQ_DMETAPHONE,
+	REQ_STATS,
+	REQ_INVALID,
+	NUM_REQ_KINDS
+} RequestKind;
+
+static const char *const request_names[NUM_REQ_KINDS] = {
+	"ping", "dist", "lev", "soundex", "dmetaphone", "stats", "invalid"
+};
+
+/* Growable byte buffer */
+typedef struct
+{
+	char	   *data;
+	size_t		len;
+	size_t		cap;
+} StrBuf;
+
+typedef struct
+{
+	int			fd;
+	StrBuf		in;
+	StrBuf		out;
+	size_t		out_sent;
+	bool		closing;
+} Client;
+
+typedef struct
+{
+	Client	   *client;
+	RequestKind kind;
+	char	   *arg1;
+	int			arg1_len;
+	char	   *arg2;
+	int			arg2_len;
+	int			arg1_chars;
+	int			max_d;
+	int			nmatches;
+	double		received;
+	size_t		line_offset;	/* start of request text in batch buffer */
+	StrBuf		reply;
+} Request;
+
+typedef struct
+{
+	double		started;
+	unsigned long long requests[NUM_REQ_KINDS];
+	unsigned long long batches;
+	unsigned long long batched_requests;
+	unsigned long long max_batch;
+	unsigned long long lev_comparisons;
+	unsigned long long connections;
+	unsigned long long latency_hist[LATENCY_BUCKETS];
+	double		latency_sum;
+} Counters;
+
+static FuzzyDict dict;
+static Counters counters;
+static volatile sig_atomic_t shutdown_requested = 0;
+
+
+static void *
+xmalloc(size_t size)
+{
+	void	   *p = malloc(size);
+
+	if (p == NULL)
+	{
+		fprintf(stderr, "fuzzystrmatchd: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+buf_reserve(StrBuf *buf, size_t more)
+{
+	if (buf->len + more <= buf->cap)
+		return;
+	if (buf->cap == 0)
+		buf->cap = 256;
+	while (buf->len + more > buf->cap)
+		buf->cap *= 2;
+	buf->data = realloc(buf->data, buf->cap);
+	if (buf->data == NULL)
+	{
+		fprintf(stderr, "fuzzystrmatchd: out of memory\n");
+		exit(1);
+	}
+}
+
+static void
+buf_append(StrBuf *buf, const char *data, size_t len)
+{
+	buf_reserve(buf, len);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void buf_printf(StrBuf *buf, const char *fmt,...) pg_attribute_printf(2, 3);
+
+static void
+buf_printf(StrBuf *buf, const char *fmt,...)
+{
+	va_list		ap;
+	int			needed;
+
+	va_start(ap, fmt);
+	needed = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	buf_reserve(buf, needed + 1);
+	va_start(ap, fmt);
+	vsnprintf(buf->data + buf->len, needed + 1, fmt, ap);
+	va_end(ap);
+	buf->len += needed;
+}
+
+static void
+buf_free(StrBuf *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = buf->cap = 0;
+}
+
+
+/*
+ * Dictionary loading
+ */
+
+static bool
+is_compiled_dictionary(int fd)
+{
+	char		magic[8];
+
+	return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+		memcmp(magic, FZD_MAGIC, sizeof(magic)) == 0;
+}
+
+static void
+load_dictionary(const char *path)
+{
+	const char *image;
+	uint64		size;
+	const char *problem;
+	int			fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "fuzzystrmatchd: could not open \"%s\": %s\n",
+				path, strerror(errno));
+		exit(1);
+	}
+
+	if (is_compiled_dictionary(fd))
+	{
+		struct stat st;
+
+		if (fstat(fd, &st) < 0)
+		{
+			fprintf(stderr, "fuzzystrmatchd: could not stat \"%s\": %s\n",
+					path, strerror(errno));
+			exit(1);
+		}
+		size = st.st_size;
+		image = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (image == MAP_FAILED)
+		{
+			fprintf(stderr, "fuzzystrmatchd: could not map \"%s\": %s\n",
+					path, strerror(errno));
+			exit(1);
+		}
+		close(fd);
+	}
+	else
+	{
+		char	  **words;
+		int			nwords;
+		int			skipped_tabs;
+		int			skipped_long;
+
+		close(fd);
+		words = fzd_read_words(path, &nwords, &skipped_tabs);
+		image = fzd_build_image(words, nwords, "UTF8", 1, &size, &skipped_long);
+		fzd_free_words(words, nwords);
+		if (skipped_tabs + skipped_long > 0)
+			fprintf(stderr, "fuzzystrmatchd: skipped %d entries longer than %d characters or containing tabs\n",
+					skipped_tabs + skipped_long, FZD_MAX_CHARS);
+	}
+
+	problem = fzd_attach(&dict, image, size);
+	if (problem != NULL)
+	{
+		fprintf(stderr, "fuzzystrmatchd: could not load \"%s\": %s\n",
+				path, problem);
+		exit(1);
+	}
+	if (strcmp(dict.hdr->encoding, "UTF8") != 0)
+	{
+		fprintf(stderr, "fuzzystrmatchd: dictionary \"%s\" is in encoding %s, but only UTF8 is supported\n",
+				path, dict.hdr->encoding);
+		exit(1);
+	}
+
+	fprintf(stderr, "fuzzystrmatchd: loaded %u entries from \"%s\"\n",
+			dict.hdr->nwords, path);
+}
+
+
+/*
+ * Request parsing
+ */
+
+/*
+ * Split off the next tab-separated field of *line (which is NUL-terminated).
+ * Returns NULL if there are no more fields.
+ */
+static char *
+next_field(char **line, int *len)
+{
+	char	   *start = *line;
+	char	   *tab;
+
+	if (start == NULL)
+		return NULL;
+	tab = strchr(start, '\t');
+	if (tab != NULL)
+	{
+		*tab = '\0';
+		*line = tab + 1;
+	}
+	else
+		*line = NULL;
+	*len = strlen(start);
+	return start;
+}
+
+static void
+parse_request(Request *req, char *line)
+{
+	char	   *verb;
+	char	   *f;
+	int			len;
+
+	req->kind = REQ_INVALID;
+	verb = next_field(&line, &len);
+	if (verb == NULL)
+		return;
+
+	if (strcmp(verb, "PING") == 0)
+	{
+		if (line == NULL)
+			req->kind = REQ_PING;
+	}
+	else if (strcmp(verb, "STATS") == 0)
+	{
+		if (line == NULL)
+			req->kind = REQ_STATS;
+	}
+	else if (strcmp(verb, "DIST") == 0)
+	{
+		req->arg1 = next_field(&line, &req->arg1_len);
+		req->arg2 = next_field(&line, &req->arg2_len);
+		if (req->arg2 != NULL && line == NULL)
+			req->kind = REQ_DIST;
+	}
+	else if (strcmp(verb, "LEV") == 0)
+	{
+		char	   *end;
+
+		f = next_field(&line, &len);
+		req->arg1 = next_field(&line, &req->arg1_len);
+		if (f == NULL || req->arg1 == NULL || line != NULL)
+			return;
+		req->max_d = (int) strtol(f, &end, 10);
+		if (*end != '\0' || end == f || req->max_d < 0)
+			return;
+		req->arg1_chars = pg_mbstrlen_with_len(req->arg1, req->arg1_len);
+		if (req->arg1_chars > MAX_LEVENSHTEIN_STRLEN)
+			return;
+		req->kind = REQ_LEV;
+	}
+	else if (strcmp(verb, "SOUNDEX") == 0)
+	{
+		req->arg1 = next_field(&line, &req->arg1_len);
+		if (req->arg1 != NULL && line == NULL)
+			req->kind = REQ_SOUNDEX;
+	}
+	else if (strcmp(verb, "DMETAPHONE") == 0)
+	{
+		req->arg1 = next_field(&line, &req->arg1_len);
+		if (req->arg1 != NULL && line == NULL)
+			req->kind = REQ_DMETAPHONE;
+	}
+}
+
+
+/*
+ * Request execution
+ */
+
+static void
+append_match(Request *req, uint32 word, int distance)
+{
+	int			len;
+	const char *str = fzd_word(&dict, word, &len);
+
+	buf_append(&req->reply, "\t", 1);
+	buf_append(&req->reply, str, len);
+	if (distance >= 0)
+		buf_printf(&req->reply, "\t%d", distance);
+	req->nmatches++;
+}
+
+/*
+ * Report the words carrying either of two codes (code2 may be NULL).  Each
+ * code's run in the index is sorted by word number, so a merge of the runs
+ * reports every matching word exactly once.
+ */
+static void
+exec_code_lookup(Request *req, const FuzzyDictCodeEntry *idx, uint32 n,
+				 const char *code1, const char *code2)
+{
+	uint32		a,
+				a_end,
+				b,
+				b_end;
+
+	fzd_code_range(idx, n, code1, &a, &a_end);
+	if (code2 != NULL && strcmp(code1, code2) != 0)
+		fzd_code_range(idx, n, code2, &b, &b_end);
+	else
+		b = b_end = 0;
+
+	while (a < a_end || b < b_end)
+	{
+		uint32		wa = a < a_end ? idx[a].word : FZD_NO_WORD;
+		uint32		wb = b < b_end ? idx[b].word : FZD_NO_WORD;
+
+		append_match(req, Min(wa, wb), -1);
+		if (wa <= wb)
+			a++;
+		if (wb <= wa)
+			b++;
+	}
+}
+
+static int
+request_chars_cmp(const void *a, const void *b)
+{
+	const Request *ra = *(Request *const *) a;
+	const Request *rb = *(Request *const *) b;
+
+	return ra->arg1_chars - rb->arg1_chars;
+}
+
+/*
+ * Evaluate all the LEV requests of a batch in one sweep over the length
+ * index.  With unit costs a candidate of length L can only be within max_d
+ * of a query of length q if |L - q| <= max_d, so for each length bucket we
+ * only consider the queries whose window covers it.
+ */
+static void
+exec_lev_batch(Request **lev, int nlev)
+{
+	int			maxwin = 0;
+	int			lo = 0;
+	int			len;
+	int			r;
+
+	if (nlev == 0)
+		return;
+
+	qsort(lev, nlev, sizeof(Request *), request_chars_cmp);
+	for (r = 0; r < nlev; r++)
+		maxwin = Max(maxwin, lev[r]->max_d);
+
+	for (len = 0; len <= FZD_MAX_CHARS; len++)
+	{
+		uint32		first = dict.length_start[len];
+		uint32		last = dict.length_start[len + 1];
+		uint32		c;
+		int			hi;
+
+		if (first == last)
+			continue;
+
+		/* queries are sorted by length; skip those too short for this bucket */
+		while (lo < nlev && lev[lo]->arg1_chars + maxwin < len)
+			lo++;
+		if (lo == nlev)
+			break;
+		for (hi = lo; hi < nlev && lev[hi]->arg1_chars - maxwin <= len; hi++)
+			;
+		if (hi == lo)
+			continue;
+
+		for (c = first; c < last; c++)
+		{
+			uint32		word = dict.by_length[c];
+			int			wlen;
+			const char *wstr = fzd_word(&dict, word, &wlen);
+
+			for (r = lo; r < hi; r++)
+			{
+				Request    *req = lev[r];
+				int			d;
+
+				if (abs(req->arg1_chars - len) > req->max_d)
+					continue;
+				counters.lev_comparisons++;
+				d = levenshtein_less_equal_internal(req->arg1, req->arg1_len,
+													wstr, wlen,
+													1, 1, 1, 0, req->max_d);
+				if (d <= req->max_d)
+					append_match(req, word, d);
+			}
+		}
+		/* DP rows from this bucket are no longer needed */
+		fzs_arena_reset();
+	}
+}
+
+static void
+exec_stats(Request *req)
+{
+	double		uptime = now_seconds() - counters.started;
+	unsigned long long total = 0;
+	unsigned long long seen;
+	unsigned long long answered = 0;
+	double		pct[] = {0.5, 0.9, 0.99};
+	int			k,
+				b;
+
+	for (k = 0; k < NUM_REQ_KINDS; k++)
+		total += counters.requests[k];
+	for (b = 0; b < LATENCY_BUCKETS; b++)
+		answered += counters.latency_hist[b];
+
+	buf_printf(&req->reply, "\tentries=%u\tuptime_s=%.3f\tconnections=%llu",
+			   dict.hdr->nwords, uptime, counters.connections);
+	for (k = 0; k < NUM_REQ_KINDS; k++)
+		buf_printf(&req->reply, "\treq_%s=%llu", request_names[k],
+				   counters.requests[k]);
+	buf_printf(&req->reply, "\trequests=%llu\tthroughput_rps=%.1f",
+			   total, uptime > 0 ? total / uptime : 0.0);
+	buf_printf(&req->reply, "\tbatches=%llu\tavg_batch=%.2f\tmax_batch=%llu",
+			   counters.batches,
+			   counters.batches ?
+			   (double) counters.batched_requests / counters.batches : 0.0,
+			   counters.max_batch);
+	buf_printf(&req->reply, "\tlev_comparisons=%llu", counters.lev_comparisons);
+	buf_printf(&req->reply, "\tlatency_avg_us=%.1f",
+			   answered ? counters.latency_sum * 1e6 / answered : 0.0);
+
+	/* percentiles are reported as the upper edge of their log2 bucket */
+	for (k = 0; k < (int) lengthof(pct); k++)
+	{
+		seen = 0;
+		for (b = 0; b < LATENCY_BUCKETS; b++)
+		{
+			seen += counters.latency_hist[b];
+			if (answered > 0 && seen >= pct[k] * answered)
+				break;
+		}
+		buf_printf(&req->reply, "\tlatency_p%g_us=%llu", pct[k] * 100,
+				   answered ? (1ULL << b) : 0ULL);
+	}
+}
+
+static void
+record_latency(double seconds)
+{
+	double		us = seconds * 1e6;
+	int			b = 0;
+
+	while (b < LATENCY_BUCKETS - 1 && (double) (1ULL << b) < us)
+		b++;
+	counters.latency_hist[b]++;
+	counters.latency_sum += seconds;
+}
+
+static void
+execute_batch(Request *batch, int nbatch)
+{
+	Request   **lev = xmalloc(nbatch * sizeof(Request *));
+	int			nlev = 0;
+	int			i;
+
+	counters.batches++;
+	counters.batched_requests += nbatch;
+	if ((unsigned long long) nbatch > counters.max_batch)
+		counters.max_batch = nbatch;
+
+	for (i = 0; i < nbatch; i++)
+	{
+		Request    *req = &batch[i];
+
+		counters.requests[req->kind]++;
+		FZS_TRY();
+		{
+			switch (req->kind)
+			{
+				case REQ_PING:
+					break;
+				case REQ_DIST:
+					buf_printf(&req->reply, "\t%d",
+							   levenshtein_internal(req->arg1, req->arg1_len,
+													req->arg2, req->arg2_len,
+													1, 1, 1, 0));
+					break;
+				case REQ_LEV:
+					lev[nlev++] = req;
+					break;
+				case REQ_SOUNDEX:
+					{
+						char		code[SOUNDEX_LEN + 1];
+
+						_soundex(req->arg1, code);
+						exec_code_lookup(req, dict.soundex, dict.hdr->nsoundex,
+										 code, NULL);
+					}
+					break;
+				case REQ_DMETAPHONE:
+					{
+						char		primary[DMETAPHONE_CODE_LEN + 1];
+						char		alternate[DMETAPHONE_CODE_LEN + 1];
+
+						dmetaphone_codes(req->arg1, primary, alternate);
+						exec_code_lookup(req, dict.dmetaphone,
+										 dict.hdr->ndmetaphone,
+										 primary, alternate);
+					}
+					break;
+				case REQ_STATS:
+				case REQ_INVALID:
+				case NUM_REQ_KINDS:
+					break;
+			}
+		}
+		FZS_CATCH();
+		{
+			req->reply.len = 0;
+			req->kind = REQ_INVALID;
+			buf_printf(&req->reply, "%s", fzs_errmsg_buf);
+		}
+		FZS_END_TRY();
+	}
+
+	exec_lev_batch(lev, nlev);
+	free(lev);
+
+	/* STATS last, so that it accounts for the batch it arrived in */
+	for (i = 0; i < nbatch; i++)
+		if (batch[i].kind == REQ_STATS)
+			exec_stats(&batch[i]);
+
+	for (i = 0; i < nbatch; i++)
+	{
+		Request    *req = &batch[i];
+		StrBuf	   *out = &req->client->out;
+
+		if (req->kind == REQ_INVALID)
+		{
+			buf_append(out, "ERR\t", 4);
+			if (req->reply.len > 0)
+				buf_append(out, req->reply.data, req->reply.len);
+			else
+				buf_append(out, "invalid request", 15);
+		}
+		else if (req->kind == REQ_LEV || req->kind == REQ_SOUNDEX ||
+				 req->kind == REQ_DMETAPHONE)
+		{
+			buf_printf(out, "OK\t%d", req->nmatches);
+			buf_append(out, req->reply.data, req->reply.len);
+		}
+		else
+		{
+			buf_append(out, "OK", 2);
+			buf_append(out, req->reply.data, req->reply.len);
+		}
+		buf_append(out, "\n", 1);
+		buf_free(&req->reply);
+		record_latency(now_seconds() - req->received);
+	}
+
+	fzs_arena_reset();
+}
+
+
+/*
+ * Connection handling
+ */
+
+static bool
+client_read(Client *c)
+{
+	for (;;)
+	{
+		ssize_t		n;
+
+		buf_reserve(&c->in, 8192);
+		n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+		if (n > 0)
+		{
+			c->in.len += n;
+			continue;
+		}
+		if (n == 0)
+			return false;
+		if (errno == EINTR)
+			continue;
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+}
+
+static bool
+client_write(Client *c)
+{
+	while (c->out_sent < c->out.len)
+	{
+		ssize_t		n = write(c->fd, c->out.data + c->out_sent,
+							  c->out.len - c->out_sent);
+
+		if (n > 0)
+			c->out_sent += n;
+		else if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		else
+			return false;
+	}
+	c->out.len = c->out_sent = 0;
+	return true;
+}
+
+/*
+ * Move complete request lines from a client's input buffer into the batch.
+ * Returns the number of requests taken.  A request line that is still
+ * incomplete stays in the buffer.
+ */
+static int
+take_requests(Client *c, Request *batch, int room, double now, StrBuf *lines)
+{
+	size_t		consumed = 0;
+	int			taken = 0;
+
+	while (taken < room && !c->closing)
+	{
+		char	   *start = c->in.data + consumed;
+		char	   *nl = memchr(start, '\n', c->in.len - consumed);
+		size_t		len;
+		Request    *req;
+
+		if (nl == NULL)
+		{
+			if (c->in.len - consumed > MAX_REQUEST_LEN)
+			{
+				buf_printf(&c->out, "ERR\trequest too long\n");
+				c->closing = true;
+			}
+			break;
+		}
+		len = nl - start;
+		if (len > 0 && start[len - 1] == '\r')
+			len--;
+
+		/*
+		 * The request text is copied into "lines", which may still move as
+		 * it grows; the request's fields are pointed into it only once the
+		 * whole batch has been gathered.
+		 */
+		req = &batch[taken++];
+		memset(req, 0, sizeof(Request));
+		req->client = c;
+		req->received = now;
+		req->line_offset = lines->len;
+		buf_append(lines, start, len);
+		buf_append(lines, "", 1);
+		consumed += (nl - start) + 1;
+	}
+
+	memmove(c->in.data, c->in.data + consumed, c->in.len - consumed);
+	c->in.len -= consumed;
+	return taken;
+}
+
+static bool
+has_complete_request(Client *c)
+{
+	return !c->closing && c->in.len > 0 &&
+		memchr(c->in.data, '\n', c->in.len) != NULL;
+}
+
+static void
+handle_signal(int signo)
+{
+	(void) signo;
+	shutdown_requested = 1;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: fuzzystrmatchd -s SOCKET -d DICTIONARY [-b MAX_BATCH]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *socket_path = NULL;
+	const char *dict_path = NULL;
+	int			max_batch = DEFAULT_MAX_BATCH;
+	int			listen_fd;
+	struct sockaddr_un addr;
+	Client	  **clients = NULL;
+	int			nclients = 0;
+	struct pollfd *pfds = NULL;
+	Request    *batch;
+	StrBuf		lines = {NULL, 0, 0};
+	int			opt;
+	int			i;
+
+	while ((opt = getopt(argc, argv, "s:d:b:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'd':
+				dict_path = optarg;
+				break;
+			case 'b':
+				max_batch = atoi(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (socket_path == NULL || dict_path == NULL || max_batch < 1)
+		usage();
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "fuzzystrmatchd: socket path too long\n");
+		exit(1);
+	}
+
+	load_dictionary(dict_path);
+	batch = xmalloc(max_batch * sizeof(Request));
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+	{
+		perror("fuzzystrmatchd: socket");
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		listen(listen_fd, 128) < 0)
+	{
+		perror("fuzzystrmatchd: bind");
+		exit(1);
+	}
+	fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	counters.started = now_seconds();
+	fprintf(stderr, "fuzzystrmatchd: listening on \"%s\"\n", socket_path);
+
+	while (!shutdown_requested)
+	{
+		int			timeout = -1;
+		int			nbatch = 0;
+		double		now;
+
+		/* don't sleep if requests are already waiting in an input buffer */
+		for (i = 0; i < nclients; i++)
+			if (has_complete_request(clients[i]))
+				timeout = 0;
+
+		pfds = realloc(pfds, (nclients + 1) * sizeof(struct pollfd));
+		pfds[0].fd = listen_fd;
+		pfds[0].events = POLLIN;
+		for (i = 0; i < nclients; i++)
+		{
+			pfds[i + 1].fd = clients[i]->fd;
+			pfds[i + 1].events = POLLIN;
+			if (clients[i]->out.len > clients[i]->out_sent)
+				pfds[i + 1].events |= POLLOUT;
+		}
+
+		if (poll(pfds, nclients + 1, timeout) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("fuzzystrmatchd: poll");
+			break;
+		}
+
+		/* read whatever has arrived, and flush pending output */
+		for (i = 0; i < nclients; i++)
+		{
+			Client	   *c = clients[i];
+			short		rev = pfds[i + 1].revents;
+
+			if ((rev & (POLLIN | POLLHUP | POLLERR)) && !client_read(c))
+				c->closing = true;
+			if ((rev & POLLOUT) && !client_write(c))
+				c->closing = true;
+		}
+
+		/* gather one batch across all connections */
+		now = now_seconds();
+		lines.len = 0;
+		for (i = 0; i < nclients && nbatch < max_batch; i++)
+			nbatch += take_requests(clients[i], batch + nbatch,
+									max_batch - nbatch, now, &lines);
+		for (i = 0; i < nbatch; i++)
+			parse_request(&batch[i], lines.data + batch[i].line_offset);
+		if (nbatch > 0)
+			execute_batch(batch, nbatch);
+
+		/* try to send responses straight away, then drop dead connections */
+		for (i = 0; i < nclients; i++)
+		{
+			Client	   *c = clients[i];
+
+			if (c->out.len > c->out_sent && !client_write(c))
+				c->out.len = c->out_sent = 0;
+			if (c->closing && c->out.len == c->out_sent)
+			{
+				close(c->fd);
+				buf_free(&c->in);
+				buf_free(&c->out);
+				free(c);
+				clients[i--] = clients[--nclients];
+			}
+		}
+
+		/* accept new connections */
+		if (pfds[0].revents & POLLIN)
+		{
+			int			fd;
+
+			while ((fd = accept(listen_fd, NULL, NULL)) >= 0)
+			{
+				Client	   *c = xmalloc(sizeof(Client));
+
+				memset(c, 0, sizeof(Client));
+				c->fd = fd;
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				clients = realloc(clients, (nclients + 1) * sizeof(Client *));
+				clients[nclients++] = c;
+				counters.connections++;
+			}
+		}
+	}
+
+	close(listen_fd);
+	unlink(socket_path);
+	return 0;
+}
@@ -25,18 +25,186 @@
  */
 
 /*
- * External declarations for exported functions
+ * This file is #included (twice, with and without LEVENSHTEIN_LESS_EQUAL) by
+ * fuzzystrmatch.c and by the standalone programs built from this directory.
+ * The kernels therefore work on raw (pointer, length) strings rather than on
+ * text datums; callers are responsible for detoasting.
  */
+#ifndef FUZZYSTRMATCH_STANDALONE
+#include "miscadmin.h"
+#endif
+
 #ifdef LEVENSHTEIN_LESS_EQUAL
-static int levenshtein_less_equal_internal(text *s, text *t,
+static int levenshtein_less_equal_internal(const char *s_data, int s_bytes,
+								const char *t_data, int t_bytes,
 								int ins_c, int del_c, int sub_c, int trans_c, int max_d);
 #else
-static int levenshtein_internal(text *s, text *t,
+static int levenshtein_internal(const char *s_data, int s_bytes,
+					 const char *t_data, int t_bytes,
 					 int ins_c, int del_c, int sub_c, int trans_c);
 #endif
 
+#ifndef LEVENSHTEIN_COMMON_DEFINED
+#define LEVENSHTEIN_COMMON_DEFINED
+
 #define MAX_LEVENSHTEIN_STRLEN		255
 
+/*
+ * The row loops check for interrupts about once per this many cells, so
+ * that however long the strings are allowed to get, a call can always be
+ * cancelled promptly; at the current length limit that is a handful of
+ * checks per call at most.
+ */
+#define LEV_INTERRUPT_CELLS			16384
+
+/* Faster than memcmp(), for this use case. */
+static inline bool
+rest_of_char_same(const char *s1, const char *s2, int len)
+{
+	while (len > 0)
+	{
+		len--;
+		if (s1[len] != s2[len])
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Optimal string alignment distance: Levenshtein distance plus the swap of
+ * two adjacent characters at cost trans_c, with no character edited again
+ * after it has been swapped.  This is the distance the dameraulevenshtein
+ * functions compute.  m and n are the lengths in characters.
+ *
+ * It needs the row before the previous one as well, so it keeps three rows
+ * of int and does without the narrow cells and the diagonal band of the
+ * Levenshtein rows.  With max_d >= 0 and no negative cost it gives up once
+ * two consecutive rows are entirely above max_d, since every later cell is
+ * derived from one of those rows at no lesser cost.
+ */
+static int
+damerau_osa_rows(const char *s_data, int s_bytes, int m,
+				 const char *t_data, int t_bytes, int n,
+				 int ins_c, int del_c, int sub_c, int trans_c, int max_d)
+{
+	int		   *s_off;
+	int		   *t_off;
+	int		   *prev2;
+	int		   *prev;
+	int		   *curr;
+	bool		can_stop = max_d >= 0 && ins_c >= 0 && del_c >= 0 &&
+		sub_c >= 0 && trans_c >= 0;
+	int			prev_min = Min(0, m * del_c);
+	int			rows_per_check = Max(LEV_INTERRUPT_CELLS / (m + 1), 1);
+	int			rows_to_check = rows_per_check;
+	int			result;
+	int			i,
+				j;
+
+	/* byte offsets of each character, and of the end */
+	s_off = (int *) palloc((m + 1 + n + 1 + 3 * (m + 1)) * sizeof(int));
+	t_off = s_off + m + 1;
+	prev2 = t_off + n + 1;
+	prev = prev2 + m + 1;
+	curr = prev + m + 1;
+	s_off[0] = t_off[0] = 0;
+	for (i = 0; i < m; i++)
+		s_off[i + 1] = s_off[i] +
+			(m == s_bytes ? 1 : pg_mblen(s_data + s_off[i]));
+	for (j = 0; j < n; j++)
+		t_off[j + 1] = t_off[j] +
+			(n == t_bytes ? 1 : pg_mblen(t_data + t_off[j]));
+
+	/* is character si of s the same as character ti of t? */
+#define OSA_CHAR_EQ(si, ti) \
+	(s_off[(si) + 1] - s_off[si] == t_off[(ti) + 1] - t_off[ti] && \
+	 memcmp(s_data + s_off[si], t_data + t_off[ti], \
+			s_off[(si) + 1] - s_off[si]) == 0)
+
+	for (i = 0; i <= m; i++)
+		prev[i] = i * del_c;
+
+	for (j = 1; j <= n; j++)
+	{
+		int			row_min;
+		int		   *tmp;
+
+		if (--rows_to_check == 0)
+		{
+			CHECK_FOR_INTERRUPTS();
+			rows_to_check = rows_per_check;
+		}
+
+		curr[0] = row_min = j * ins_c;
+		for (i = 1; i <= m; i++)
+		{
+			int			ins = prev[i] + ins_c;
+			int			del = curr[i - 1] + del_c;
+			int			sub = prev[i - 1] +
+				(OSA_CHAR_EQ(i - 1, j - 1) ? 0 : sub_c);
+			int			d = Min(ins, Min(del, sub));
+
+			if (i > 1 && j > 1 &&
+				OSA_CHAR_EQ(i - 1, j - 2) &&
+				OSA_CHAR_EQ(i - 2, j - 1))
+				d = Min(d, prev2[i - 2] + trans_c);
+			curr[i] = d;
+			row_min = Min(row_min, d);
+		}
+
+		if (can_stop && row_min > max_d && prev_min > max_d)
+		{
+			pfree(s_off);
+			return max_d + 1;
+		}
+		prev_min = row_min;
+
+		tmp = prev2;
+		prev2 = prev;
+		prev = curr;
+		curr = tmp;
+	}
+#undef OSA_CHAR_EQ
+
+	result = prev[m];
+	pfree(s_off);
+	if (max_d >= 0 && result > max_d)
+		return max_d + 1;
+	return result;
+}
+#endif   /* LEVENSHTEIN_COMMON_DEFINED */
+
+/*
+ * The row loop, once for each width of DP cell; see levenshtein_rows.c.
+ * Narrow cells keep the rows small enough to stay in L1 cache.
+ */
+#define LEV_CELL		int
+#define LEV_CELL_NAME	int
+#define LEV_CELL_MAX	INT_MAX
+#include "levenshtein_rows.c"
+#undef LEV_CELL
+#undef LEV_CELL_NAME
+#undef LEV_CELL_MAX
+
+#ifdef LEVENSHTEIN_LESS_EQUAL
+#define LEV_SATURATE
+#endif
+#define LEV_CELL		uint16
+#define LEV_CELL_NAME	uint16
+#define LEV_CELL_MAX	0xFFFF
+#include "levenshtein_rows.c"
+#undef LEV_CELL
+#undef LEV_CELL_NAME
+#undef LEV_CELL_MAX
+#define LEV_CELL		uint8
+#define LEV_CELL_NAME	uint8
+#define LEV_CELL_MAX	0xFF
+#include "levenshtein_rows.c"
+#undef LEV_CELL
+#undef LEV_CELL_NAME
+#undef LEV_CELL_MAX
+#undef LEV_SATURATE
+
 
 /*
  * Calculates Levenshtein distance metric between supplied strings. Generally
@@ -71,53 +239,25 @@ static int levenshtein_internal(text *s, text *t,
  */
 static int
 #ifdef LEVENSHTEIN_LESS_EQUAL
-levenshtein_less_equal_internal(text *s, text *t,
+levenshtein_less_equal_internal(const char *s_data, int s_bytes,
+								const char *t_data, int t_bytes,
 								int ins_c, int del_c, int sub_c, int trans_c, int max_d)
 #else
-levenshtein_internal(text *s, text *t,
+levenshtein_internal(const char *s_data, int s_bytes,
+					 const char *t_data, int t_bytes,
 					 int ins_c, int del_c, int sub_c, int trans_c)
 #endif
 {
 	int			m,
-				n,
-				s_bytes,
-				t_bytes;
-	int		   *prev;
-	int		   *curr;
+				n;
 	int		   *s_char_len = NULL;
-	int			i,
-				j;
-	const char *s_data;
-	const char *t_data;
-	const char *y;
 
-	/*
-	 * For levenshtein_less_equal_internal, we have real variables called
-	 * start_column and stop_column; otherwise it's just short-hand for 0 and
-	 * m.
-	 */
 #ifdef LEVENSHTEIN_LESS_EQUAL
 	int			start_column,
 				stop_column;
-
-#undef START_COLUMN
-#undef STOP_COLUMN
-#define START_COLUMN start_column
-#define STOP_COLUMN stop_column
-#else
-#undef START_COLUMN
-#undef STOP_COLUMN
-#define START_COLUMN 0
-#define STOP_COLUMN m
 #endif
 
-	/* Extract a pointer to the actual character data. */
-	s_data = VARDATA_ANY(s);
-	t_data = VARDATA_ANY(t);
-
-	/* Determine length of each string in bytes and characters. */
-	s_bytes = VARSIZE_ANY_EXHDR(s);
-	t_bytes = VARSIZE_ANY_EXHDR(t);
+	/* Determine length of each string in characters. */
 	m = pg_mbstrlen_with_len(s_data, s_bytes);
 	n = pg_mbstrlen_with_len(t_data, t_bytes);
 
@@ -191,6 +331,16 @@ levenshtein_internal(text *s, text *t,
 	}
 #endif
 
+	/* A transposition cost means optimal string alignment; see above. */
+	if (trans_c != 0)
+#ifdef LEVENSHTEIN_LESS_EQUAL
+		return damerau_osa_rows(s_data, s_bytes, m, t_data, t_bytes, n,
+								ins_c, del_c, sub_c, trans_c, max_d);
+#else
+		return damerau_osa_rows(s_data, s_bytes, m, t_data, t_bytes, n,
+								ins_c, del_c, sub_c, trans_c, -1);
+#endif
+
 	/*
 	 * In order to avoid calling pg_mblen() repeatedly on each character in s,
 	 * we cache all the lengths before starting the main loop -- but if all
@@ -217,195 +367,35 @@ levenshtein_internal(text *s, text *t,
 	++m;
 	++n;
 
-	/* Previous and current rows of notional array. */
-	prev = (int *) palloc(2 * m * sizeof(int));
-	curr = prev + m;
-
 	/*
-	 * To transform the first i characters of s into the first 0 characters of
-	 * t, we must perform i deletions.
+	 * Use the narrowest cells that can hold every value we'll store: with
+	 * non-negative costs, no cell exceeds the cost of deleting all of s and
+	 * inserting all of t, and the bounded variant saturates narrow cells at
+	 * max_d + 1 anyway.
 	 */
-	for (i = START_COLUMN; i < STOP_COLUMN; i++)
-		prev[i] = i * del_c;
-
-	/* Loop through rows of the notional array */
-	for (y = t_data, j = 1; j < n; j++)
-	{
-		int		   *temp;
-		const char *x = s_data;
-		int			y_char_len = n != t_bytes + 1 ? pg_mblen(y) : 1;
-
+#undef LEV_CALL_ROWS
 #ifdef LEVENSHTEIN_LESS_EQUAL
-
-		/*
-		 * In the best case, values percolate down the diagonal unchanged, so
-		 * we must increment stop_column unless it's already on the right end
-		 * of the array.  The inner loop will read prev[stop_column], so we
-		 * have to initialize it even though it shouldn't affect the result.
-		 */
-		if (stop_column < m)
-		{
-			prev[stop_column] = max_d + 1;
-			++stop_column;
-		}
-
-		/*
-		 * The main loop fills in curr, but curr[0] needs a special case: to
-		 * transform the first 0 characters of s into the first j characters
-		 * of t, we must perform j insertions.	However, if start_column > 0,
-		 * this special case does not apply.
-		 */
-		if (start_column == 0)
-		{
-			curr[0] = j * ins_c;
-			i = 1;
-		}
-		else
-			i = start_column;
+#define LEV_CALL_ROWS(cell) \
+	levenshtein_less_equal_rows_##cell(s_data, t_data, t_bytes, m, n, \
+									   s_char_len, ins_c, del_c, sub_c, \
+									   max_d, start_column, stop_column)
 #else
-		curr[0] = j * ins_c;
-		i = 1;
+#define LEV_CALL_ROWS(cell) \
+	levenshtein_rows_##cell(s_data, t_data, t_bytes, m, n, \
+							s_char_len, ins_c, del_c, sub_c)
 #endif
-
-		/*
-		 * This inner loop is critical to performance, so we include a
-		 * fast-path to handle the (fairly common) case where no multibyte
-		 * characters are in the mix.  The fast-path is entitled to assume
-		 * that if s_char_len is not initialized then BOTH strings contain
-		 * only single-byte characters.
-		 */
-		if (s_char_len != NULL)
-		{
-			for (; i < STOP_COLUMN; i++)
-			{
-				int			ins;
-				int			del;
-				int			sub;
-				int			trans;
-				int			x_char_len = s_char_len[i - 1];
-
-				/*
-				 * Calculate costs for insertion, deletion, and substitution.
-				 *
-				 * When calculating cost for substitution, we compare the last
-				 * character of each possibly-multibyte character first,
-				 * because that's enough to rule out most mis-matches.  If we
-				 * get past that test, then we compare the lengths and the
-				 * remaining bytes.
-				 */
-				ins = prev[i] + ins_c;
-				del = curr[i - 1] + del_c;
-				if (x[x_char_len - 1] == y[y_char_len - 1]
-					&& x_char_len == y_char_len &&
-					(x_char_len == 1 || rest_of_char_same(x, y, x_char_len)))
-					sub = prev[i - 1];
-				else
-					sub = prev[i - 1] + sub_c;
-
-				/* Take the one with minimum cost. */
-				curr[i] = Min(ins, del);
-				curr[i] = Min(curr[i], sub);
-
-				/* Point to next character. */
-				x += x_char_len;
-			}
-		}
-		else
-		{
-			for (; i < STOP_COLUMN; i++)
-			{
-				int			ins;
-				int			del;
-				int			sub;
-				int			trans;
-
-				/* Calculate costs for insertion, deletion, and substitution. */
-				ins = prev[i] + ins_c;
-				del = curr[i - 1] + del_c;
-				sub = prev[i - 1] + ((*x == *y) ? 0 : sub_c);
-
-				/* Take the one with minimum cost. */
-				curr[i] = Min(ins, del);
-				curr[i] = Min(curr[i], sub);
-
-				/* Point to next character. */
-				x++;
-			}
-		}
-
-		/* Swap current row with previous row. */
-		temp = curr;
-		curr = prev;
-		prev = temp;
-
-		/* Point to next character. */
-		y += y_char_len;
+	if (ins_c >= 0 && del_c >= 0 && sub_c >= 0)
+	{
+		int64		cell_bound = (int64) (m - 1) * del_c + (int64) (n - 1) * ins_c;
 
 #ifdef LEVENSHTEIN_LESS_EQUAL
-
-		/*
-		 * This chunk of code represents a significant performance hit if used
-		 * in the case where there is no max_d bound.  This is probably not
-		 * because the max_d >= 0 test itself is expensive, but rather because
-		 * the possibility of needing to execute this code prevents tight
-		 * optimization of the loop as a whole.
-		 */
 		if (max_d >= 0)
-		{
-			/*
-			 * The "zero point" is the column of the current row where the
-			 * remaining portions of the strings are of equal length.  There
-			 * are (n - 1) characters in the target string, of which j have
-			 * been transformed.  There are (m - 1) characters in the source
-			 * string, so we want to find the value for zp where (n - 1) - j =
-			 * (m - 1) - zp.
-			 */
-			int			zp = j - (n - m);
-
-			/* Check whether the stop column can slide left. */
-			while (stop_column > 0)
-			{
-				int			ii = stop_column - 1;
-				int			net_inserts = ii - zp;
-
-				if (prev[ii] + (net_inserts > 0 ? net_inserts * ins_c :
-								-net_inserts * del_c) <= max_d)
-					break;
-				stop_column--;
-			}
-
-			/* Check whether the start column can slide right. */
-			while (start_column < stop_column)
-			{
-				int			net_inserts = start_column - zp;
-
-				if (prev[start_column] +
-					(net_inserts > 0 ? net_inserts * ins_c :
-					 -net_inserts * del_c) <= max_d)
-					break;
-
-				/*
-				 * We'll never again update these values, so we must make sure
-				 * there's nothing here that could confuse any future
-				 * iteration of the outer loop.
-				 */
-				prev[start_column] = max_d + 1;
-				curr[start_column] = max_d + 1;
-				if (start_column != 0)
-					s_data += (s_char_len != NULL) ? s_char_len[start_column - 1] : 1;
-				start_column++;
-			}
-
-			/* If they cross, we're going to exceed the bound. */
-			if (start_column >= stop_column)
-				return max_d + 1;
-		}
+			cell_bound = Min(cell_bound, (int64) max_d + 1);
 #endif
+		if (cell_bound <= 0xFF)
+			return LEV_CALL_ROWS(uint8);
+		if (cell_bound <= 0xFFFF)
+			return LEV_CALL_ROWS(uint16);
 	}
-
-	/*
-	 * Because the final value was swapped from the previous row to the
-	 * current row, that's where we'll find it.
-	 */
-	return prev[m - 1];
+	return LEV_CALL_ROWS(int);
 }
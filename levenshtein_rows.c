@@ -0,0 +1,299 @@
+/*
+ * levenshtein_rows.c
+ *
+ * The row loop of the Levenshtein kernels, for one DP cell type.
+ *
+ * contrib/fuzzystrmatch/levenshtein_rows.c
+ *
+ * This file is #included by levenshtein.c once per cell type for each of
+ * its own two inclusions, with LEV_CELL set to the cell type, LEV_CELL_NAME
+ * to a suffix for the function name and, for the narrow types of the
+ * bounded variant, LEV_SATURATE defined.  levenshtein.c has already dealt
+ * with the empty and over-long cases and chosen the start and stop columns;
+ * what remains here is filling in the notional matrix row by row.
+ *
+ * Narrow cells only work because the caller has checked that every value
+ * stored fits: all costs are non-negative, so a cell never exceeds the cost
+ * of the path that deletes all of s and inserts all of t.  The bounded
+ * variant can go further: any value above max_d is as good as max_d + 1 to
+ * it, so with LEV_SATURATE every cell is clamped there, and narrow cells
+ * can be used whenever max_d + 1 fits, however long the strings are.
+ */
+#define LEV_CONCAT2(a, b)	a##_##b
+#define LEV_CONCAT(a, b)	LEV_CONCAT2(a, b)
+
+#ifdef LEVENSHTEIN_LESS_EQUAL
+#define LEV_ROWS	LEV_CONCAT(levenshtein_less_equal_rows, LEV_CELL_NAME)
+#else
+#define LEV_ROWS	LEV_CONCAT(levenshtein_rows, LEV_CELL_NAME)
+#endif
+
+/*
+ * For the bounded variant, we have real variables called start_column and
+ * stop_column; otherwise it's just short-hand for 0 and m.
+ */
+#undef START_COLUMN
+#undef STOP_COLUMN
+#ifdef LEVENSHTEIN_LESS_EQUAL
+#define START_COLUMN start_column
+#define STOP_COLUMN stop_column
+#else
+#define START_COLUMN 0
+#define STOP_COLUMN m
+#endif
+
+/*
+ * Values are computed in int and only narrowed when stored, so that the
+ * values carried from cell to cell never need truncating.
+ */
+#ifdef LEV_SATURATE
+#define LEV_CLAMP(v)	Min((v), cap)
+#else
+#define LEV_CLAMP(v)	(v)
+#endif
+
+/*
+ * m and n include the initialization column and row, and s_char_len is
+ * NULL if both strings are single-byte only; see levenshtein.c.
+ */
+static int
+#ifdef LEVENSHTEIN_LESS_EQUAL
+LEV_ROWS(const char *s_data, const char *t_data, int t_bytes, int m, int n,
+		 const int *s_char_len, int ins_c, int del_c, int sub_c,
+		 int max_d, int start_column, int stop_column)
+#else
+LEV_ROWS(const char *s_data, const char *t_data, int t_bytes, int m, int n,
+		 const int *s_char_len, int ins_c, int del_c, int sub_c)
+#endif
+{
+	LEV_CELL   *prev;
+	LEV_CELL   *curr;
+	int			i,
+				j;
+	const char *y;
+	int			rows_per_check = Max(LEV_INTERRUPT_CELLS / m, 1);
+	int			rows_to_check = rows_per_check;
+
+#ifdef LEV_SATURATE
+	int			cap = max_d >= 0 ? max_d + 1 : LEV_CELL_MAX;
+#endif
+
+	/* Previous and current rows of notional array. */
+	prev = (LEV_CELL *) palloc(2 * m * sizeof(LEV_CELL));
+	curr = prev + m;
+
+	/*
+	 * To transform the first i characters of s into the first 0 characters of
+	 * t, we must perform i deletions.
+	 */
+	for (i = START_COLUMN; i < STOP_COLUMN; i++)
+		prev[i] = LEV_CLAMP(i * del_c);
+
+	/* Loop through rows of the notional array */
+	for (y = t_data, j = 1; j < n; j++)
+	{
+		LEV_CELL   *temp;
+		const char *x = s_data;
+		int			y_char_len = n != t_bytes + 1 ? pg_mblen(y) : 1;
+
+		if (--rows_to_check == 0)
+		{
+			CHECK_FOR_INTERRUPTS();
+			rows_to_check = rows_per_check;
+		}
+
+#ifdef LEVENSHTEIN_LESS_EQUAL
+
+		/*
+		 * In the best case, values percolate down the diagonal unchanged, so
+		 * we must increment stop_column unless it's already on the right end
+		 * of the array.  The inner loop will read prev[stop_column], so we
+		 * have to initialize it even though it shouldn't affect the result.
+		 */
+		if (stop_column < m)
+		{
+			prev[stop_column] = LEV_CLAMP(max_d + 1);
+			++stop_column;
+		}
+
+		/*
+		 * The main loop fills in curr, but curr[0] needs a special case: to
+		 * transform the first 0 characters of s into the first j characters
+		 * of t, we must perform j insertions.	However, if start_column > 0,
+		 * this special case does not apply.
+		 */
+		if (start_column == 0)
+		{
+			curr[0] = LEV_CLAMP(j * ins_c);
+			i = 1;
+		}
+		else
+			i = start_column;
+#else
+		curr[0] = LEV_CLAMP(j * ins_c);
+		i = 1;
+#endif
+
+		/*
+		 * This inner loop is critical to performance, so we include a
+		 * fast-path to handle the (fairly common) case where no multibyte
+		 * characters are in the mix.  The fast-path is entitled to assume
+		 * that if s_char_len is not initialized then BOTH strings contain
+		 * only single-byte characters.
+		 *
+		 * The left and diagonal neighbours are carried in locals, since
+		 * with char-sized cells the compiler must otherwise assume every
+		 * store into the row may have changed them, or the strings.
+		 */
+		if (s_char_len != NULL)
+		{
+			int			left = curr[i - 1];
+			int			diag = prev[i - 1];
+			char		y_last = y[y_char_len - 1];
+
+			for (; i < STOP_COLUMN; i++)
+			{
+				int			up = prev[i];
+				int			ins;
+				int			del;
+				int			sub;
+				int			x_char_len = s_char_len[i - 1];
+
+				/*
+				 * Calculate costs for insertion, deletion, and substitution.
+				 *
+				 * When calculating cost for substitution, we compare the last
+				 * character of each possibly-multibyte character first,
+				 * because that's enough to rule out most mis-matches.  If we
+				 * get past that test, then we compare the lengths and the
+				 * remaining bytes.
+				 */
+				ins = up + ins_c;
+				del = left + del_c;
+				if (x[x_char_len - 1] == y_last
+					&& x_char_len == y_char_len &&
+					(x_char_len == 1 || rest_of_char_same(x, y, x_char_len)))
+					sub = diag;
+				else
+					sub = diag + sub_c;
+
+				/* Take the one with minimum cost. */
+				ins = Min(ins, del);
+				left = LEV_CLAMP(Min(ins, sub));
+				curr[i] = left;
+				diag = up;
+
+				/* Point to next character. */
+				x += x_char_len;
+			}
+		}
+		else
+		{
+			int			left = curr[i - 1];
+			int			diag = prev[i - 1];
+			char		y_char = *y;
+
+			for (; i < STOP_COLUMN; i++)
+			{
+				int			up = prev[i];
+				int			ins;
+				int			del;
+				int			sub;
+
+				/* Calculate costs for insertion, deletion, and substitution. */
+				ins = up + ins_c;
+				del = left + del_c;
+				sub = diag + ((*x == y_char) ? 0 : sub_c);
+
+				/* Take the one with minimum cost. */
+				ins = Min(ins, del);
+				left = LEV_CLAMP(Min(ins, sub));
+				curr[i] = left;
+				diag = up;
+
+				/* Point to next character. */
+				x++;
+			}
+		}
+
+		/* Swap current row with previous row. */
+		temp = curr;
+		curr = prev;
+		prev = temp;
+
+		/* Point to next character. */
+		y += y_char_len;
+
+#ifdef LEVENSHTEIN_LESS_EQUAL
+
+		/*
+		 * This chunk of code represents a significant performance hit if used
+		 * in the case where there is no max_d bound.  This is probably not
+		 * because the max_d >= 0 test itself is expensive, but rather because
+		 * the possibility of needing to execute this code prevents tight
+		 * optimization of the loop as a whole.
+		 */
+		if (max_d >= 0)
+		{
+			/*
+			 * The "zero point" is the column of the current row where the
+			 * remaining portions of the strings are of equal length.  There
+			 * are (n - 1) characters in the target string, of which j have
+			 * been transformed.  There are (m - 1) characters in the source
+			 * string, so we want to find the value for zp where (n - 1) - j =
+			 * (m - 1) - zp.
+			 */
+			int			zp = j - (n - m);
+
+			/* Check whether the stop column can slide left. */
+			while (stop_column > 0)
+			{
+				int			ii = stop_column - 1;
+				int			net_inserts = ii - zp;
+
+				if (prev[ii] + (net_inserts > 0 ? net_inserts * ins_c :
+								-net_inserts * del_c) <= max_d)
+					break;
+				stop_column--;
+			}
+
+			/* Check whether the start column can slide right. */
+			while (start_column < stop_column)
+			{
+				int			net_inserts = start_column - zp;
+
+				if (prev[start_column] +
+					(net_inserts > 0 ? net_inserts * ins_c :
+					 -net_inserts * del_c) <= max_d)
+					break;
+
+				/*
+				 * We'll never again update these values, so we must make sure
+				 * there's nothing here that could confuse any future
+				 * iteration of the outer loop.
+				 */
+				prev[start_column] = LEV_CLAMP(max_d + 1);
+				curr[start_column] = LEV_CLAMP(max_d + 1);
+				if (start_column != 0)
+					s_data += (s_char_len != NULL) ? s_char_len[start_column - 1] : 1;
+				start_column++;
+			}
+
+			/* If they cross, we're going to exceed the bound. */
+			if (start_column >= stop_column)
+				return max_d + 1;
+		}
+#endif
+	}
+
+	/*
+	 * Because the final value was swapped from the previous row to the
+	 * current row, that's where we'll find it.
+	 */
+	return prev[m - 1];
+}
+
+#undef LEV_ROWS
+#undef LEV_CLAMP
+#undef LEV_CONCAT
+#undef LEV_CONCAT2
@@ -0,0 +1,81 @@
+/*
+ * soundex.c
+ *
+ * Soundex encoding of a string.
+ *
+ * contrib/fuzzystrmatch/soundex.c
+ *
+ * This file is #included by fuzzystrmatch.c, and also by the standalone
+ * programs that share the extension's kernels; it must therefore not depend
+ * on anything beyond what fuzzystrmatch_standalone.h provides.
+ */
+#ifndef SOUNDEX_C
+#define SOUNDEX_C
+
+static void _soundex(const char *instr, char *outstr);
+
+#define SOUNDEX_LEN 4
+
+/*									ABCDEFGHIJKLMNOPQRSTUVWXYZ */
+static const char *soundex_table = "01230120022455012623010202";
+
+static char
+soundex_code(char letter)
+{
+	letter = toupper((unsigned char) letter);
+	/* Defend against non-ASCII letters */
+	if (letter >= 'A' && letter <= 'Z')
+		return soundex_table[letter - 'A'];
+	return letter;
+}
+
+static void
+_soundex(const char *instr, char *outstr)
+{
+	int			count;
+
+	AssertArg(instr);
+	AssertArg(outstr);
+
+	outstr[SOUNDEX_LEN] = '\0';
+
+	/* Skip leading non-alphabetic characters */
+	while (!isalpha((unsigned char) instr[0]) && instr[0])
+		++instr;
+
+	/* No string left */
+	if (!instr[0])
+	{
+		outstr[0] = (char) 0;
+		return;
+	}
+
+	/* Take the first letter as is */
+	*outstr++ = (char) toupper((unsigned char) *instr++);
+
+	count = 1;
+	while (*instr && count < SOUNDEX_LEN)
+	{
+		if (isalpha((unsigned char) *instr) &&
+			soundex_code(*instr) != soundex_code(*(instr - 1)))
+		{
+			*outstr = soundex_code(instr[0]);
+			if (*outstr != '0')
+			{
+				++outstr;
+				++count;
+			}
+		}
+		++instr;
+	}
+
+	/* Fill with 0's */
+	while (count < SOUNDEX_LEN)
+	{
+		*outstr = '0';
+		++outstr;
+		++count;
+	}
+}
+
+#endif   /* SOUNDEX_C */
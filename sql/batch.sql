@@ -0,0 +1,191 @@
+--
+-- FuzzyBatchScan: batched calls must return what per-row calls return
+--
+
+-- the planner hook is installed when the library is loaded
+LOAD 'fuzzystrmatch';
+
+CREATE TABLE batch_words AS
+	SELECT i AS id, substr(md5(i::text), 1, 2 + i % 9) AS w
+	FROM generate_series(1, 2000) i;
+INSERT INTO batch_words VALUES (0, NULL), (-1, repeat('ab', 200));
+ANALYZE batch_words;
+
+-- the scan node of a query's plan, and what it batches or filters
+CREATE FUNCTION batch_plan(query text) RETURNS SETOF text
+LANGUAGE plpgsql AS $$
+DECLARE
+	line text;
+BEGIN
+	FOR line IN EXECUTE 'EXPLAIN (COSTS OFF) ' || query LOOP
+		IF line ~ 'Scan|Batched Calls|Filter' THEN
+			RETURN NEXT regexp_replace(btrim(line), '^Filter: .*', 'Filter');
+		END IF;
+	END LOOP;
+END
+$$;
+
+-- every call the node evaluates, the long row kept out by a plain condition
+CREATE VIEW batch_calls AS
+	SELECT id,
+		levenshtein(w, 'c4ca4238') AS l,
+		levenshtein('abc', w) AS l_swapped,
+		levenshtein_less_equal(w, 'abc', 3) AS le,
+		soundex(w) AS s,
+		metaphone(w, 4) AS m,
+		dmetaphone(w) AS dm,
+		dmetaphone_alt(w) AS dma
+	FROM batch_words
+	WHERE coalesce(length(w), 0) < 256;
+
+-- and the same with a condition on a call
+CREATE VIEW batch_matches AS
+	SELECT id, levenshtein(w, 'c4ca4238') AS l
+	FROM batch_words
+	WHERE length(w) < 256 AND levenshtein_less_equal(w, 'c4ca', 2) <= 2;
+
+EXPLAIN (COSTS OFF)
+SELECT id FROM batch_words
+WHERE length(w) < 256 AND levenshtein_less_equal(w, 'c4ca', 2) <= 2;
+SELECT * FROM batch_plan('SELECT * FROM batch_calls');
+SELECT * FROM batch_plan('SELECT * FROM batch_matches');
+
+SET fuzzystrmatch.batch_size = 0;
+SELECT * FROM batch_plan('SELECT * FROM batch_matches');
+CREATE TABLE batch_calls_off AS SELECT * FROM batch_calls;
+CREATE TABLE batch_matches_off AS SELECT * FROM batch_matches;
+RESET fuzzystrmatch.batch_size;
+
+CREATE TABLE batch_calls_on AS SELECT * FROM batch_calls;
+CREATE TABLE batch_matches_on AS SELECT * FROM batch_matches;
+
+-- batches much smaller than the table, with the levenshtein memo on
+SET fuzzystrmatch.batch_size = 7;
+SET fuzzystrmatch.memoize = on;
+CREATE TABLE batch_calls_small AS SELECT * FROM batch_calls;
+CREATE TABLE batch_matches_small AS SELECT * FROM batch_matches;
+RESET fuzzystrmatch.memoize;
+RESET fuzzystrmatch.batch_size;
+
+SELECT (SELECT count(*) FROM batch_calls_off) AS calls,
+	(SELECT count(*) FROM batch_matches_off) AS matches;
+SELECT count(*) AS mismatches
+FROM ((TABLE batch_calls_on EXCEPT ALL TABLE batch_calls_off)
+	  UNION ALL
+	  (TABLE batch_calls_off EXCEPT ALL TABLE batch_calls_on)
+	  UNION ALL
+	  (TABLE batch_calls_small EXCEPT ALL TABLE batch_calls_off)
+	  UNION ALL
+	  (TABLE batch_calls_off EXCEPT ALL TABLE batch_calls_small)) diff;
+SELECT count(*) AS mismatches
+FROM ((TABLE batch_matches_on EXCEPT ALL TABLE batch_matches_off)
+	  UNION ALL
+	  (TABLE batch_matches_off EXCEPT ALL TABLE batch_matches_on)
+	  UNION ALL
+	  (TABLE batch_matches_small EXCEPT ALL TABLE batch_matches_off)
+	  UNION ALL
+	  (TABLE batch_matches_off EXCEPT ALL TABLE batch_matches_small)) diff;
+
+-- a call under a conditional expression is left to it, so that the guard
+-- keeps the long row away from levenshtein
+SELECT * FROM batch_plan($q$
+	SELECT id FROM batch_words
+	WHERE CASE WHEN length(w) < 256 THEN levenshtein(w, 'c4ca') <= 2 END
+$q$);
+SELECT count(*) FROM batch_words
+WHERE CASE WHEN length(w) < 256 THEN levenshtein(w, 'c4ca') <= 2 END;
+SELECT * FROM batch_plan($q$
+	SELECT id FROM batch_words
+	WHERE length(w) >= 256 OR levenshtein(w, 'c4ca') <= 2
+$q$);
+SELECT count(*) FROM batch_words
+WHERE length(w) >= 256 OR levenshtein(w, 'c4ca') <= 2;
+SELECT * FROM batch_plan($q$
+	SELECT id, coalesce(soundex(w), '') FROM batch_words
+$q$);
+CREATE TABLE batch_guarded AS
+	SELECT id, CASE WHEN length(w) < 256 THEN levenshtein(w, 'abc') END AS d
+	FROM batch_words;
+SELECT count(d), sum(d) FROM batch_guarded;
+
+-- nor is a call of the target list batched when a condition only makes it
+-- under a conditional expression
+SELECT * FROM batch_plan($q$
+	SELECT id, levenshtein(w, 'abc') FROM batch_words
+	WHERE length(w) < 256 AND (id % 2 = 0 OR levenshtein(w, 'abc') <= 2)
+$q$);
+CREATE TABLE batch_mixed AS
+	SELECT id, levenshtein(w, 'abc') AS d FROM batch_words
+	WHERE length(w) < 256 AND (id % 2 = 0 OR levenshtein(w, 'abc') <= 2);
+SELECT count(*), sum(d) FROM batch_mixed;
+
+-- a call both made directly and under a guard is batched, and read from
+-- its column in both places
+SELECT * FROM batch_plan($q$
+	SELECT id FROM batch_words
+	WHERE length(w) < 256 AND levenshtein(w, 'abc') <= 3
+		AND (id % 2 = 0 OR levenshtein(w, 'abc') <= 2)
+$q$);
+SELECT count(*) FROM batch_words
+WHERE length(w) < 256 AND levenshtein(w, 'abc') <= 3
+	AND (id % 2 = 0 OR levenshtein(w, 'abc') <= 2);
+
+-- an unguarded call still reaches the long row
+\set VERBOSITY terse
+SELECT count(*) FROM batch_words WHERE levenshtein(w, 'c4ca') <= 2;
+\set VERBOSITY default
+
+-- the conditions are taken in the order a sequential scan takes them, and
+-- each call is only made for the rows the earlier ones accepted, so that
+-- the long values behind rows the first condition rejects are never read
+CREATE TABLE batch_pairs AS
+	SELECT substr(md5(i::text), 1, 3) AS a, repeat('b', 300) AS b
+	FROM generate_series(1, 200) i;
+INSERT INTO batch_pairs VALUES ('x', 'short'), ('xy', 'yy'),
+	(NULL, repeat('c', 300));
+ANALYZE batch_pairs;
+SELECT * FROM batch_plan($q$
+	SELECT a FROM batch_pairs
+	WHERE levenshtein(a, 'x') <= 1 AND levenshtein(b, 'y') <= 10
+$q$);
+SELECT a, b FROM batch_pairs
+WHERE levenshtein(a, 'x') <= 1 AND levenshtein(b, 'y') <= 10
+ORDER BY a;
+SET fuzzystrmatch.batch_size = 7;
+SELECT a, b FROM batch_pairs
+WHERE levenshtein(a, 'x') <= 1 AND levenshtein(b, 'y') <= 10
+ORDER BY a;
+RESET fuzzystrmatch.batch_size;
+\set VERBOSITY terse
+SELECT a, b FROM batch_pairs
+WHERE levenshtein(b, 'y') <= 10 AND levenshtein(a, 'x') <= 1;
+\set VERBOSITY default
+
+-- nor is the node used under row-level security, where the planner keeps a
+-- leaky condition of the user's from seeing the rows a policy hides
+CREATE TABLE batch_secrets AS
+	SELECT i AS id, substr(md5(i::text), 1, 4) AS w
+	FROM generate_series(1, 200) i;
+ALTER TABLE batch_secrets ENABLE ROW LEVEL SECURITY;
+CREATE POLICY batch_near ON batch_secrets
+	USING (levenshtein(w, 'c4ca') <= 2);
+CREATE FUNCTION batch_leak(text) RETURNS bool
+LANGUAGE plpgsql COST 0.0000001 AS $$
+BEGIN
+	RAISE NOTICE 'saw %', $1;
+	RETURN true;
+END
+$$;
+CREATE ROLE regress_batch_reader;
+GRANT SELECT ON batch_secrets TO regress_batch_reader;
+SET ROLE regress_batch_reader;
+SELECT * FROM batch_plan('SELECT id FROM batch_secrets WHERE batch_leak(w)');
+SELECT id, w FROM batch_secrets WHERE batch_leak(w) ORDER BY id;
+RESET ROLE;
+
+DROP VIEW batch_calls, batch_matches;
+DROP TABLE batch_words, batch_calls_off, batch_calls_on, batch_calls_small,
+	batch_matches_off, batch_matches_on, batch_matches_small, batch_guarded,
+	batch_mixed, batch_pairs, batch_secrets;
+DROP ROLE regress_batch_reader;
+DROP FUNCTION batch_plan(text), batch_leak(text);
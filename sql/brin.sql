@@ -0,0 +1,91 @@
+--
+-- brin_phonetic_bloom_ops: index scans must return what sequential scans
+-- return, and #= and ##= must agree with soundex() and dmetaphone()
+--
+
+-- runs of the same surname, so that block ranges differ, among random words
+CREATE TABLE brin_names AS
+	SELECT i AS id,
+		CASE WHEN i % 5 = 0 THEN substr(md5(i::text), 1, 6)
+			 ELSE (ARRAY['Robert', 'Rupert', 'Rubin', 'Smith', 'Smyth',
+						 'Schmidt', 'Schmitt', 'Catherine', 'Kathryn',
+						 'Katherine', 'Lee', 'Leigh', 'Ashcraft', 'Tymczak',
+						 'Pfister', 'Jackson', 'Jakson', 'Thompson', 'Tomson',
+						 'Gutierrez', 'Wilson', 'Willson', 'Knight', 'Night',
+						 'Philips', 'Phillips', 'Fischer', 'Fisher', 'Meyer',
+						 'Meier', 'Mayer', 'Johnson', 'Jonson', 'Brown',
+						 'Braun', 'Clark', 'Clarke', 'Wright', 'Write',
+						 'Xavier'])[1 + (i - 1) / 500 % 40]
+		END AS w
+	FROM generate_series(1, 20000) i;
+INSERT INTO brin_names VALUES (0, NULL), (0, '');
+CREATE INDEX brin_names_idx ON brin_names
+	USING brin (w brin_phonetic_bloom_ops) WITH (pages_per_range = 4);
+ANALYZE brin_names;
+
+CREATE TABLE brin_queries (q text);
+INSERT INTO brin_queries VALUES ('Robert'), ('Smith'), ('Kathrine'), ('Lee'),
+	('Tomsen'), ('Wrigt'), ('Zzyzx'), ('qqq'), (''), ('123');
+
+-- whether a nonempty Double Metaphone code of a is one of b's
+CREATE FUNCTION brin_dmetaphone_shared(a text, b text) RETURNS bool
+LANGUAGE sql AS $$
+	SELECT (dmetaphone(a) <> '' AND
+			dmetaphone(a) IN (dmetaphone(b), dmetaphone_alt(b))) OR
+		   (dmetaphone_alt(a) <> '' AND
+			dmetaphone_alt(a) IN (dmetaphone(b), dmetaphone_alt(b)))
+$$;
+
+-- the pairs matched by each operator that the functions don't match, or the
+-- other way round
+CREATE FUNCTION brin_mismatches(OUT soundex bigint, OUT dmetaphone bigint)
+LANGUAGE sql AS $$
+	SELECT
+		(SELECT count(*)
+		 FROM (((SELECT q, id FROM brin_queries, brin_names WHERE w #= q)
+				EXCEPT ALL
+				(SELECT q, id FROM brin_queries, brin_names
+				 WHERE soundex(w) = soundex(q)))
+			   UNION ALL
+			   ((SELECT q, id FROM brin_queries, brin_names
+				 WHERE soundex(w) = soundex(q))
+				EXCEPT ALL
+				(SELECT q, id FROM brin_queries, brin_names WHERE w #= q))) diff),
+		(SELECT count(*)
+		 FROM (((SELECT q, id FROM brin_queries, brin_names WHERE w ##= q)
+				EXCEPT ALL
+				(SELECT q, id FROM brin_queries, brin_names
+				 WHERE brin_dmetaphone_shared(w, q)))
+			   UNION ALL
+			   ((SELECT q, id FROM brin_queries, brin_names
+				 WHERE brin_dmetaphone_shared(w, q))
+				EXCEPT ALL
+				(SELECT q, id FROM brin_queries, brin_names WHERE w ##= q))) diff)
+$$;
+
+SET enable_seqscan = off;
+EXPLAIN (COSTS OFF) SELECT id FROM brin_names WHERE w #= 'Robert';
+EXPLAIN (COSTS OFF) SELECT id FROM brin_names WHERE w ##= 'Smith';
+SELECT q, (SELECT count(*) FROM brin_names WHERE w #= q) AS matches
+FROM brin_queries ORDER BY q COLLATE "C";
+SELECT * FROM brin_mismatches();
+
+-- rows added after the index was built, summarized or not
+INSERT INTO brin_names
+	SELECT 30000 + i, (ARRAY['Roberts', 'Smithe', 'Lea', 'Zzyzx'])[1 + i % 4]
+	FROM generate_series(1, 2000) i;
+SELECT * FROM brin_mismatches();
+SELECT brin_summarize_new_values('brin_names_idx') IS NOT NULL AS summarized;
+SELECT * FROM brin_mismatches();
+RESET enable_seqscan;
+
+-- and the operators alone
+SET enable_bitmapscan = off;
+SELECT * FROM brin_mismatches();
+RESET enable_bitmapscan;
+
+SELECT 'Robert' #= 'Rupert' AS soundex, '' ##= '' AS empty,
+	NULL::text #= 'Robert' AS null_soundex, 'Robert' ##= NULL AS null_dmetaphone;
+
+DROP FUNCTION brin_mismatches(), brin_dmetaphone_shared(text, text);
+DROP TABLE brin_names, brin_queries;
@@ -0,0 +1,167 @@
+--
+-- dameraulevenshtein: optimal string alignment distance, from the dynamic
+-- program and from the matcher compiled for unit-cost queries
+--
+
+-- an adjacent swap costs trans_c once, and a swapped pair is not edited
+-- again; with trans_c 0 the distance is Levenshtein's
+SELECT a, b, levenshtein(a, b) AS lev, dameraulevenshtein(a, b) AS osa,
+	dameraulevenshtein(a, b, 1, 1, 1, 0) AS no_trans,
+	dameraulevenshtein(a, b, 2, 3, 4, 1) AS costs,
+	dameraulevenshtein_less_equal(a, b, 1) AS le1
+FROM (VALUES ('ab', 'ba'), ('ca', 'abc'), ('kitten', 'ktiten'),
+	('recieve', 'receive'), ('abcdef', 'badcfe'), ('', 'ab'), ('ab', ''),
+	('a', 'a')) t(a, b);
+
+-- the distance from its definition, for any costs
+CREATE FUNCTION dl_ref(a text, b text, ins int, del int, sub int, trans int)
+RETURNS int
+LANGUAGE plpgsql IMMUTABLE STRICT AS $$
+DECLARE
+	s text[] := regexp_split_to_array(a, '');
+	t text[] := regexp_split_to_array(b, '');
+	m int := length(a);
+	n int := length(b);
+	d int[] := array_fill(0, ARRAY[m + 1, n + 1], ARRAY[0, 0]);
+	v int;
+BEGIN
+	FOR i IN 0..m LOOP
+		d[i][0] := i * del;
+	END LOOP;
+	FOR j IN 0..n LOOP
+		d[0][j] := j * ins;
+	END LOOP;
+	FOR i IN 1..m LOOP
+		FOR j IN 1..n LOOP
+			v := least(d[i - 1][j] + del, d[i][j - 1] + ins,
+					   d[i - 1][j - 1] + CASE WHEN s[i] = t[j] THEN 0 ELSE sub END);
+			IF i > 1 AND j > 1 AND s[i] = t[j - 1] AND s[i - 1] = t[j] THEN
+				v := least(v, d[i - 2][j - 2] + trans);
+			END IF;
+			d[i][j] := v;
+		END LOOP;
+	END LOOP;
+	RETURN d[m][n];
+END
+$$;
+
+-- queries short and long, up to and past the 64 characters the matcher
+-- takes
+CREATE TABLE dl_queries (q text);
+INSERT INTO dl_queries VALUES ('kitten'), ('recieve'), ('abcdefgh'), ('a'),
+	(''), ('abcabcab'), (repeat('ab', 20)),
+	(substr(md5('x') || md5('y') || md5('z'), 1, 64)),
+	(substr(md5('x') || md5('y') || md5('z'), 1, 65));
+
+-- random words, and each query with adjacent characters swapped, with two
+-- swaps, and with a swap next to a deletion
+CREATE TABLE dl_words AS
+	SELECT substr(md5(i::text), 1, 1 + i % 12) AS w
+	FROM generate_series(1, 150) i
+	UNION ALL
+	SELECT overlay(q placing substr(q, p + 1, 1) || substr(q, p, 1)
+				   from p for 2)
+	FROM dl_queries, generate_series(1, length(q) - 1) p
+	UNION ALL
+	SELECT overlay(q placing substr(q, p + 1, 1) || substr(q, p, 1) ||
+				   substr(q, p + 3, 1) || substr(q, p + 2, 1) from p for 4)
+	FROM dl_queries, generate_series(1, length(q) - 3, 3) p
+	UNION ALL
+	SELECT overlay(q placing substr(q, p + 1, 1) || substr(q, p, 1)
+				   from p for 3)
+	FROM dl_queries, generate_series(1, length(q) - 2, 2) p
+	UNION ALL
+	SELECT repeat(md5('z'), 4) || substr(md5('w'), 1, i)
+	FROM generate_series(0, 125, 25) i
+	UNION ALL
+	VALUES (''), ('kitten'), ('bacbacba'), ('ba');
+
+-- every pair, with distances computed from two columns, which is never
+-- compiled
+CREATE TABLE dl_pairs AS
+	SELECT q, w, dameraulevenshtein(w, q) AS d, levenshtein(w, q) AS lev,
+		dameraulevenshtein(w, q, 2, 3, 4, 1) AS d_costs,
+		dameraulevenshtein(w, q, 1, 1, 1, 0) AS d_no_trans
+	FROM dl_queries, dl_words;
+
+SELECT count(*) AS pairs,
+	count(*) FILTER (WHERE d < lev) AS swapped,
+	count(*) FILTER (WHERE d > lev) AS worse,
+	count(*) FILTER (WHERE d_no_trans <> lev) AS no_trans_mismatches,
+	count(*) FILTER (WHERE length(w) > 64) AS long_words
+FROM dl_pairs;
+
+-- the dynamic program against the definition, short words with several
+-- costs and long ones with unit costs
+SELECT count(*) AS compared,
+	count(*) FILTER (WHERE d <> dl_ref(w, q, 1, 1, 1, 1)) AS unit_mismatches,
+	count(*) FILTER (WHERE d_costs <> dl_ref(w, q, 2, 3, 4, 1)) AS costs_mismatches,
+	count(*) FILTER (WHERE dameraulevenshtein(w, q, 1, 1, 3, 1) <>
+					 dl_ref(w, q, 1, 1, 3, 1)) AS cheap_indel_mismatches,
+	count(*) FILTER (WHERE dameraulevenshtein(q, w, 1, 2, 1, 5) <>
+					 dl_ref(q, w, 1, 2, 1, 5)) AS dear_trans_mismatches
+FROM dl_pairs
+WHERE length(w) <= 12 AND length(q) <= 12;
+
+SELECT count(*) AS compared,
+	count(*) FILTER (WHERE d <> dl_ref(w, q, 1, 1, 1, 1)) AS mismatches
+FROM dl_pairs
+WHERE length(w) > 64 AND length(q) > 64;
+
+-- the bounded dynamic program: exact up to k, above k otherwise
+SELECT k,
+	count(*) FILTER (WHERE NOT ((le <= k) = (d <= k) AND
+								(le > k OR le = d))) AS unit_wrong,
+	count(*) FILTER (WHERE NOT ((le_costs <= k) = (d_costs <= k) AND
+								(le_costs > k OR le_costs = d_costs))) AS costs_wrong
+FROM (SELECT k, d, d_costs,
+		dameraulevenshtein_less_equal(w, q, k) AS le,
+		dameraulevenshtein_less_equal(w, q, 2, 3, 4, 1, k) AS le_costs
+	  FROM dl_pairs, unnest(ARRAY[0, 1, 2, 5, 300]) k) s
+GROUP BY k ORDER BY k;
+
+-- in here each query is an external parameter, so the calls compile it,
+-- from either argument, and compile it again for each new query
+CREATE FUNCTION dl_matcher_wrong(k int) RETURNS bigint
+LANGUAGE plpgsql AS $$
+DECLARE
+	query text;
+	n bigint := 0;
+BEGIN
+	FOR query IN SELECT q FROM dl_queries LOOP
+		IF k < 0 THEN
+			n := n + (SELECT count(*) FROM dl_pairs p
+					  WHERE p.q = query AND
+						(dameraulevenshtein(p.w, query) <> p.d OR
+						 dameraulevenshtein(query, p.w) <> p.d));
+		ELSE
+			n := n + (SELECT count(*)
+					  FROM (SELECT p.d,
+							  dameraulevenshtein_less_equal(p.w, query, k) AS x,
+							  dameraulevenshtein_less_equal(query, p.w, k) AS y
+							FROM dl_pairs p WHERE p.q = query) s
+					  WHERE NOT ((x <= k) = (d <= k) AND (x > k OR x = d) AND
+								 (y <= k) = (d <= k) AND (y > k OR y = d)));
+		END IF;
+	END LOOP;
+	RETURN n;
+END
+$$;
+
+SELECT k, dl_matcher_wrong(k) AS wrong
+FROM unnest(ARRAY[-1, 0, 1, 2, 3, 10]) k;
+
+-- and the same with constants
+SELECT count(*) FILTER (WHERE dameraulevenshtein(w, 'recieve') <>
+						dl_ref(w, 'recieve', 1, 1, 1, 1)) AS mismatches,
+	count(*) FILTER (WHERE dameraulevenshtein_less_equal('kitten', w, 2) <= 2) AS within_2
+FROM dl_words;
+
+\set VERBOSITY terse
+SELECT dameraulevenshtein(repeat('a', 256), 'a');
+SELECT dameraulevenshtein_less_equal('a', repeat('a', 256), 1, 1, 1, 1, 2);
+SELECT dameraulevenshtein(w, repeat('a', 256)) FROM dl_words;
+\set VERBOSITY default
+
+DROP FUNCTION dl_matcher_wrong(int), dl_ref(text, text, int, int, int, int);
+DROP TABLE dl_queries, dl_words, dl_pairs;
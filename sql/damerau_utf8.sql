@@ -0,0 +1,79 @@
+/*
+ * This test must be run in a database with UTF-8 encoding,
+ * because other encodings don't support all the characters used.
+ */
+SELECT getdatabaseencoding() <> 'UTF8'
+       AS skip_test \gset
+\if :skip_test
+\quit
+\endif
+
+set client_encoding = utf8;
+
+-- dameraulevenshtein over multibyte characters
+SELECT a, b, levenshtein(a, b) AS lev, dameraulevenshtein(a, b) AS osa,
+	dameraulevenshtein(a, b, 2, 3, 4, 1) AS costs,
+	dameraulevenshtein_less_equal(a, b, 1) AS le1
+FROM (VALUES ('größe', 'gröeß'), ('größe', 'grösse'), ('ßüöä', 'üßöä'),
+	('été', 'eté'), ('naïve', 'nave'), ('äb', 'bä')) t(a, b);
+
+-- queries of characters of each UTF-8 length, up to and past the 64
+-- characters the matcher takes
+CREATE TABLE dlu_queries (q text);
+INSERT INTO dlu_queries VALUES ('größe'), ('ßüöä'), ('naïve café'),
+	('日本語テキスト'), ('a😀b😃c'), (repeat('äöüß', 16)),
+	(repeat('äöüß', 16) || 'é');
+
+-- each query with adjacent characters swapped, with two swaps, and with a
+-- swap next to a deletion, and some others
+CREATE TABLE dlu_words AS
+	SELECT overlay(q placing substr(q, p + 1, 1) || substr(q, p, 1)
+				   from p for 2) AS w
+	FROM dlu_queries, generate_series(1, length(q) - 1) p
+	UNION ALL
+	SELECT overlay(q placing substr(q, p + 1, 1) || substr(q, p, 1) ||
+				   substr(q, p + 3, 1) || substr(q, p + 2, 1) from p for 4)
+	FROM dlu_queries, generate_series(1, length(q) - 3, 3) p
+	UNION ALL
+	SELECT overlay(q placing substr(q, p + 1, 1) || substr(q, p, 1)
+				   from p for 3)
+	FROM dlu_queries, generate_series(1, length(q) - 2, 2) p
+	UNION ALL
+	VALUES (''), ('grösse'), ('gröse'), ('naive cafe'), ('日本語'),
+		('本日語'), ('a😃b😀c'), ('abc'), (repeat('öäüß', 16));
+
+-- distances computed from two columns, which is never compiled
+CREATE TABLE dlu_pairs AS
+	SELECT q, w, dameraulevenshtein(w, q) AS d, levenshtein(w, q) AS lev
+	FROM dlu_queries, dlu_words;
+
+SELECT count(*) AS pairs, count(*) FILTER (WHERE d < lev) AS swapped
+FROM dlu_pairs;
+
+-- and from each query compiled, from either argument
+CREATE FUNCTION dlu_matcher_wrong(k int) RETURNS bigint
+LANGUAGE plpgsql AS $$
+DECLARE
+	query text;
+	n bigint := 0;
+BEGIN
+	FOR query IN SELECT q FROM dlu_queries LOOP
+		n := n + (SELECT count(*)
+				  FROM (SELECT p.d,
+						  dameraulevenshtein_less_equal(p.w, query, k) AS x,
+						  dameraulevenshtein_less_equal(query, p.w, k) AS y,
+						  dameraulevenshtein(p.w, query) AS z
+						FROM dlu_pairs p WHERE p.q = query) s
+				  WHERE NOT ((x <= k) = (d <= k) AND (x > k OR x = d) AND
+							 (y <= k) = (d <= k) AND (y > k OR y = d) AND
+							 z = d));
+	END LOOP;
+	RETURN n;
+END
+$$;
+
+SELECT k, dlu_matcher_wrong(k) AS wrong
+FROM unnest(ARRAY[0, 1, 2, 3, 10]) k;
+
+DROP FUNCTION dlu_matcher_wrong(int);
+DROP TABLE dlu_queries, dlu_words, dlu_pairs;
@@ -0,0 +1,73 @@
+--
+-- Blocked duplicate detection within work_mem
+--
+
+-- random words in small soundex blocks, and one large S532 block whose
+-- metaphone subkeys are SMTK (1500 words) and SMTS (300 words)
+CREATE TABLE dd_words AS
+	SELECT i AS id,
+		   translate(substr(md5(i::text), 1, 6 + i % 5),
+					 '0123456789', 'ghijklmnop') AS w
+	FROM generate_series(1, 1600) i
+	UNION ALL
+	SELECT i,
+		   'smit' ||
+		   translate(substr(md5(i::text), 1, 3),
+					 '0123456789abcdef', 'aeuaeuaeuaeuaeua') ||
+		   substr(CASE WHEN i <= 3100 THEN 'kq' ELSE 'sz' END, 1 + i % 2, 1) ||
+		   translate(substr(md5(i::text), 4, 2),
+					 '0123456789abcdef', 'aeuaeuaeuaeuaeua')
+	FROM generate_series(1601, 3400) i;
+
+CREATE TABLE dd_ref AS
+	SELECT x.id AS id1, y.id AS id2, levenshtein(x.w, y.w) AS distance
+	FROM dd_words x JOIN dd_words y ON soundex(x.w) = soundex(y.w)
+	WHERE x.id < y.id AND levenshtein_less_equal(x.w, y.w, 1) <= 1;
+
+-- everything fits: exactly the pairs within max_d in each block
+SET work_mem = '4MB';
+CREATE TABLE dd_held AS
+	SELECT * FROM fuzzy_dedupe('SELECT id, w FROM dd_words', 1);
+
+SELECT (SELECT count(*) FROM dd_held) AS pairs,
+	   (SELECT count(*) FROM ((TABLE dd_held EXCEPT ALL TABLE dd_ref)
+							  UNION ALL
+							  (TABLE dd_ref EXCEPT ALL TABLE dd_held)) d) AS mismatches;
+
+-- the input spills, S532 is split by subkey, and SMTK is still too large
+-- and is compared by block nested loop: only pairs across subkeys are lost
+SET work_mem = '64kB';
+CREATE TABLE dd_spilled AS
+	SELECT * FROM fuzzy_dedupe('SELECT id::bigint, w FROM dd_words', 1);
+
+SELECT (SELECT count(*) FROM dd_spilled) AS pairs,
+	   (SELECT count(*) FROM (TABLE dd_spilled EXCEPT ALL TABLE dd_ref) d) AS extra,
+	   (SELECT count(*)
+		FROM (TABLE dd_ref EXCEPT ALL TABLE dd_spilled) d
+		JOIN dd_words x ON x.id = d.id1 JOIN dd_words y ON y.id = d.id2
+		WHERE metaphone(x.w, 8) = metaphone(y.w, 8)) AS missing_same_subkey,
+	   (SELECT count(*) FROM (TABLE dd_ref EXCEPT ALL TABLE dd_spilled) d) AS missing;
+
+-- the full distance matrix of each block, from spilled input
+SELECT count(*) AS pairs,
+	   count(*) FILTER (WHERE d.distance IS DISTINCT FROM
+							  levenshtein(x.w, y.w)) AS wrong_distance,
+	   count(*) FILTER (WHERE soundex(x.w) <> soundex(y.w)
+						OR d.id1 >= d.id2) AS wrong_pair
+FROM fuzzy_block_distances('SELECT id, w FROM dd_words WHERE id <= 1600') d
+	 JOIN dd_words x ON x.id = d.id1 JOIN dd_words y ON y.id = d.id2;
+RESET work_mem;
+
+-- rows with a null id or word are skipped
+SELECT * FROM fuzzy_block_distances(
+	$$VALUES (1, 'robert'), (2, 'rupert'), (NULL, 'robert'), (3, NULL),
+			 (4, 'rubin'), (5, 'smith')$$)
+ORDER BY id1, id2;
+
+\set VERBOSITY terse
+SELECT * FROM fuzzy_dedupe('SELECT id, w FROM dd_words', -1);
+SELECT * FROM fuzzy_dedupe('SELECT w, id FROM dd_words', 1);
+SELECT * FROM fuzzy_dedupe('SELECT id, w, w FROM dd_words', 1);
+\set VERBOSITY default
+
+DROP TABLE dd_words, dd_ref, dd_held, dd_spilled;
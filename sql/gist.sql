@@ -0,0 +1,67 @@
+--
+-- gist_fuzzy_ops: index scans must return what sequential scans return
+--
+
+CREATE TABLE gist_words AS
+	SELECT substr(md5(i::text), 1, 3 + i % 10) AS w
+	FROM generate_series(1, 3000) i;
+INSERT INTO gist_words VALUES (''), ('abc'), ('abd'), ('xabc');
+CREATE INDEX gist_words_idx ON gist_words USING gist (w gist_fuzzy_ops);
+ANALYZE gist_words;
+
+CREATE TABLE gist_queries (q text);
+INSERT INTO gist_queries VALUES ('abc'), ('c4ca4238'), ('zzzz'), (''),
+	('1679091c5a880faf6fb5e6087eb1b2dc'), ('a87ff679a');
+
+-- with the given radius, the pairs matched by %~ that are not within it,
+-- or the other way round
+CREATE FUNCTION gist_within_mismatches(r int) RETURNS bigint
+LANGUAGE sql AS $$
+	SELECT set_config('fuzzystrmatch.radius', r::text, false);
+	SELECT count(*)
+	FROM (((SELECT q, w FROM gist_queries, gist_words WHERE w %~ q)
+		   EXCEPT ALL
+		   (SELECT q, w FROM gist_queries, gist_words WHERE levenshtein(w, q) <= r))
+		  UNION ALL
+		  ((SELECT q, w FROM gist_queries, gist_words WHERE levenshtein(w, q) <= r)
+		   EXCEPT ALL
+		   (SELECT q, w FROM gist_queries, gist_words WHERE w %~ q))) diff
+$$;
+
+CREATE FUNCTION gist_nearest(n int) RETURNS TABLE (q text, d int[])
+LANGUAGE sql AS $$
+	SELECT q, ARRAY(SELECT w <~> q FROM gist_words ORDER BY w <~> q LIMIT n)
+	FROM gist_queries
+$$;
+
+SET enable_indexscan = off;
+SET enable_bitmapscan = off;
+CREATE TABLE gist_seq_nearest AS SELECT * FROM gist_nearest(25);
+RESET enable_indexscan;
+RESET enable_bitmapscan;
+
+SET enable_seqscan = off;
+SET fuzzystrmatch.radius = 1;
+
+SET enable_bitmapscan = off;
+EXPLAIN (COSTS OFF) SELECT w FROM gist_words WHERE w %~ 'abc';
+SELECT w FROM gist_words WHERE w %~ 'abc' ORDER BY w;
+SELECT r, gist_within_mismatches(r) AS mismatches FROM generate_series(0, 3) r;
+RESET enable_bitmapscan;
+
+SET fuzzystrmatch.radius = 1;
+SET enable_indexscan = off;
+EXPLAIN (COSTS OFF) SELECT w FROM gist_words WHERE w %~ 'abc';
+SELECT w FROM gist_words WHERE w %~ 'abc' ORDER BY w;
+SELECT r, gist_within_mismatches(r) AS mismatches FROM generate_series(0, 3) r;
+RESET enable_indexscan;
+
+-- nearest neighbours come out of the index in distance order
+EXPLAIN (COSTS OFF) SELECT w FROM gist_words ORDER BY w <~> 'abc' LIMIT 5;
+SELECT w, w <~> 'abc' AS d FROM gist_words ORDER BY w <~> 'abc', w LIMIT 3;
+SELECT count(*) AS mismatches
+FROM gist_nearest(25) i JOIN gist_seq_nearest s USING (q)
+WHERE i.d <> s.d;
+
+RESET fuzzystrmatch.radius;
+RESET enable_seqscan;
@@ -0,0 +1,45 @@
+--
+-- fuzzystrmatch.result_memory_limit: calls that would use more fail, and
+-- calls within it return what they return without it
+--
+
+-- the setting is defined when the library is loaded
+LOAD 'fuzzystrmatch';
+
+CREATE TABLE lim_words AS
+	SELECT array_agg(substr(md5(i::text), 1, 1 + i % 12) ORDER BY i) AS a
+	FROM generate_series(1, 1000) i;
+CREATE TABLE lim_many AS
+	SELECT array_agg(substr(md5(i::text), 1, 8) ORDER BY i) AS a
+	FROM generate_series(1, 100000) i;
+
+CREATE TABLE lim_off AS
+	SELECT metaphone_many(a, 4) AS m, dmetaphone_many(a) AS d FROM lim_words;
+
+SET fuzzystrmatch.result_memory_limit = '64kB';
+SHOW fuzzystrmatch.result_memory_limit;
+
+SELECT m = metaphone_many(a, 4) AS metaphone_same,
+	d = dmetaphone_many(a) AS dmetaphone_same
+FROM lim_off, lim_words;
+SELECT dmetaphone(repeat('a', 30000)) AS d, dmetaphone_alt(repeat('a', 30000)) AS da;
+
+\set VERBOSITY terse
+SELECT cardinality(metaphone_many(a, 4)) FROM lim_many;
+SELECT cardinality(dmetaphone_many(a)) FROM lim_many;
+SELECT dmetaphone(repeat('a', 40000));
+SELECT dmetaphone_alt(repeat('a', 40000));
+\set VERBOSITY default
+
+-- the limit is per call: many calls may use more between them
+SELECT count(dmetaphone(repeat('a', 30000 + i))) FROM generate_series(1, 100) i;
+
+-- and zero means no limit
+SET fuzzystrmatch.result_memory_limit = 0;
+SELECT cardinality(metaphone_many(a, 4)) AS metaphone,
+	cardinality(dmetaphone_many(a)) AS dmetaphone
+FROM lim_many;
+SELECT dmetaphone(repeat('a', 40000)) AS d;
+RESET fuzzystrmatch.result_memory_limit;
+
+DROP TABLE lim_words, lim_many, lim_off;
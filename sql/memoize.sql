@@ -0,0 +1,36 @@
+CREATE EXTENSION fuzzystrmatch;
+
+-- few distinct words, so that most pairs come round again
+CREATE TABLE memo_words AS
+	SELECT i AS id, substr(md5((i % 40)::text), 1, 2 + i % 7) AS w
+	FROM generate_series(1, 200) i;
+
+CREATE FUNCTION memo_distances() RETURNS TABLE (a int, b int, d int[])
+LANGUAGE sql AS $$
+	SELECT x.id, y.id,
+		ARRAY[levenshtein(x.w, y.w),
+			  levenshtein(x.w, y.w, 2, 3, 4),
+			  levenshtein_less_equal(x.w, y.w, 2),
+			  levenshtein_less_equal(x.w, y.w, 3, 1, 2, 4),
+			  dameraulevenshtein(x.w, y.w),
+			  dameraulevenshtein_less_equal(x.w, y.w, 1, 2, 1, 1, 3)]
+	FROM memo_words x, memo_words y
+$$;
+
+SET fuzzystrmatch.memoize = off;
+CREATE TABLE memo_off AS SELECT * FROM memo_distances();
+
+-- a small work_mem makes the memo start over many times
+SET fuzzystrmatch.memoize = on;
+SET work_mem = '64kB';
+CREATE TABLE memo_on AS SELECT * FROM memo_distances();
+
+SELECT count(*) AS mismatches
+FROM ((TABLE memo_on EXCEPT ALL TABLE memo_off)
+	  UNION ALL
+	  (TABLE memo_off EXCEPT ALL TABLE memo_on)) diff;
+
+SELECT count(*) AS pairs FROM memo_on;
+
+RESET work_mem;
+RESET fuzzystrmatch.memoize;
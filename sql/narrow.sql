@@ -0,0 +1,52 @@
+--
+-- Levenshtein distance with 8-bit, 16-bit and int DP cells
+--
+
+-- lengths from 0 to 255, so that each cell width is used for some pairs
+CREATE TABLE narrow_pairs AS
+	SELECT i AS id,
+		   substr(repeat(md5(i::text), 8), 1, (i * 37) % 256) AS a,
+		   substr(repeat(md5((-i)::text), 8), 1, (i * 53) % 256) AS b
+	FROM generate_series(1, 30) i;
+
+-- unit costs need 8-bit cells only for short strings, larger costs need
+-- 16-bit or int cells, and a negative cost always uses int cells
+SELECT id, length(a) AS m, length(b) AS n,
+	   levenshtein(a, b) AS unit,
+	   levenshtein(a, b, 0, 1, 1) AS free_ins,
+	   levenshtein(a, b, 3, 5, 7) AS small,
+	   levenshtein(a, b, 200, 100, 250) AS medium,
+	   levenshtein(a, b, 1000, 1000, 1000) AS large,
+	   levenshtein(a, b, 2, 2, -1) AS negative
+FROM narrow_pairs
+ORDER BY id;
+
+-- the bounded variant may use narrow cells for any lengths, as long as
+-- max_d + 1 fits: check it against the unbounded distance for many bounds
+CREATE TABLE narrow_costs (ins int, del int, sub int);
+INSERT INTO narrow_costs VALUES
+	(1, 1, 1), (0, 1, 1), (3, 5, 7), (200, 100, 250), (1000, 1000, 1000);
+
+SELECT c.ins, c.del, c.sub,
+	   count(*) FILTER (WHERE e.exact <= k) AS within,
+	   count(*) FILTER (WHERE NOT ((e.d <= k) = (e.exact <= k) AND
+								   (e.d > k OR e.d = e.exact))) AS mismatches
+FROM narrow_costs c,
+	 (VALUES (0), (1), (10), (100), (254), (255), (256), (1000),
+			 (65534), (65535), (65536), (1000000)) AS b(k),
+	 LATERAL (SELECT levenshtein_less_equal(p.a, p.b, c.ins, c.del, c.sub, k),
+					 levenshtein(p.a, p.b, c.ins, c.del, c.sub)
+			  FROM narrow_pairs p) AS e(d, exact)
+GROUP BY c.ins, c.del, c.sub
+ORDER BY c.ins, c.del, c.sub;
+
+-- values at the edges of each width
+SELECT levenshtein(repeat('a', 255), '') AS del_255,
+	   levenshtein('', repeat('a', 255)) AS ins_255,
+	   levenshtein(repeat('a', 255), repeat('b', 255), 1, 1, 2) AS sub_510,
+	   levenshtein(repeat('a', 255), repeat('b', 255), 128, 129, 1000) AS max_16,
+	   levenshtein(repeat('a', 255), repeat('b', 255), 129, 129, 1000) AS over_16,
+	   levenshtein_less_equal(repeat('a', 255), repeat('b', 255), 1, 1, 1, 254) > 254 AS le_254,
+	   levenshtein_less_equal(repeat('a', 255), repeat('b', 255), 1, 1, 1, 255) AS le_255;
+
+DROP TABLE narrow_pairs, narrow_costs;
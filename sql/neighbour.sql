@@ -0,0 +1,64 @@
+--
+-- fuzzy_neighbour_match: the offsets of the preceding rows within distance k
+--
+
+SELECT v, fuzzy_neighbour_match(v, 2, 1) OVER (ORDER BY v COLLATE "C")
+FROM (VALUES ('kitten'), ('mitten'), ('sitting'), ('smitten'), (NULL),
+	('kitten')) t(v);
+
+-- groups of similar values, nulls, empty values, and values on both sides
+-- of the 64 characters up to which the bit-parallel comparison is used
+CREATE TABLE nbr_names AS
+	SELECT i AS id, i % 3 AS grp,
+		CASE WHEN i % 50 = 0 THEN NULL
+			 WHEN i % 47 = 0 THEN ''
+			 WHEN i % 23 = 0 THEN repeat(substr(md5((i / 69)::text), 1, 8),
+										 8 + i % 3)
+			 ELSE substr(md5((i / 4)::text), 1, 3 + i % 5) ||
+				substr(md5(i::text), 1, i % 3)
+		END AS v
+	FROM generate_series(1, 1200) i;
+INSERT INTO nbr_names VALUES
+	(2001, 0, repeat('ab', 40)), (2002, 0, 'x' || repeat('ab', 40)),
+	(2003, 0, repeat('ab', 40) || 'c'), (2004, 0, repeat('ab', 39) || 'b'),
+	(2005, 1, repeat('a', 64)), (2006, 1, repeat('a', 65)),
+	(2007, 1, repeat('a', 63) || 'b'), (2008, 1, repeat('a', 63)),
+	(2009, 2, 'a'), (2010, 2, 'b'), (2011, 2, '');
+
+-- the rows whose result differs from a self-join on the row numbers
+CREATE FUNCTION nbr_mismatches(w int, k int) RETURNS bigint
+LANGUAGE sql AS $$
+	WITH o AS (
+		SELECT grp, v,
+			row_number() OVER win AS rn,
+			fuzzy_neighbour_match(v, w, k) OVER win AS m
+		FROM nbr_names
+		WINDOW win AS (PARTITION BY grp ORDER BY v COLLATE "C", id))
+	SELECT count(*) FROM o
+	WHERE m IS DISTINCT FROM
+		CASE WHEN v IS NOT NULL THEN ARRAY(
+			SELECT (o.rn - p.rn)::int FROM o p
+			WHERE p.grp = o.grp AND p.rn BETWEEN o.rn - w AND o.rn - 1
+				AND levenshtein(p.v, o.v) <= k
+			ORDER BY p.rn DESC) END
+$$;
+
+SELECT w, k, nbr_mismatches(w, k) AS mismatches
+FROM (VALUES (0, 0), (1, 0), (1, 1), (3, 2), (10, 1), (10, 3), (50, 2),
+	(2000, 1)) p(w, k);
+
+SELECT sum(cardinality(m)) AS matches, count(m) AS compared
+FROM (SELECT fuzzy_neighbour_match(v, 10, 2)
+		OVER (PARTITION BY grp ORDER BY v COLLATE "C", id) AS m
+	  FROM nbr_names) s;
+
+\set VERBOSITY terse
+SELECT fuzzy_neighbour_match(v, NULL, 1) OVER (ORDER BY id) FROM nbr_names;
+SELECT fuzzy_neighbour_match(v, -1, 1) OVER (ORDER BY id) FROM nbr_names;
+SELECT fuzzy_neighbour_match(v, 100001, 1) OVER (ORDER BY id) FROM nbr_names;
+SELECT fuzzy_neighbour_match(v, 2, -1) OVER (ORDER BY id) FROM nbr_names;
+SELECT fuzzy_neighbour_match(v, 2, id) OVER (ORDER BY id) FROM nbr_names;
+\set VERBOSITY default
+
+DROP FUNCTION nbr_mismatches(int, int);
+DROP TABLE nbr_names;
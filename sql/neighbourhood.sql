@@ -0,0 +1,178 @@
+--
+-- fuzzy_neighbourhood, and levenshtein conditions answered with index probes
+-- on columns whose CHECK constraints bound their characters
+--
+
+SELECT fuzzy_neighbourhood('ax', 1, 'a');
+
+-- against the definition: every string over the alphabet up to the longest
+-- a neighbourhood can hold
+CREATE TABLE nh_strings AS
+	WITH RECURSIVE s(v) AS (
+		SELECT ''::text
+		UNION ALL
+		SELECT v || c FROM s, unnest(ARRAY['a', 'b', 'c', 'd']) c
+		WHERE length(v) < 6)
+	SELECT v FROM s;
+
+SELECT q, k,
+	(SELECT count(*) FROM fuzzy_neighbourhood(q, k, 'abcd')) AS strings,
+	ARRAY(SELECT v FROM fuzzy_neighbourhood(q, k, 'abcd') v
+		  ORDER BY v COLLATE "C") =
+	ARRAY(SELECT v FROM nh_strings WHERE levenshtein(v, q) <= k
+		  ORDER BY v COLLATE "C") AS same
+FROM (VALUES (''), ('a'), ('cc'), ('abc'), ('dcba')) t(q),
+	generate_series(0, 2) k
+ORDER BY q COLLATE "C", k;
+
+SELECT left(v, 8) AS v, length(v) AS len, a,
+	fuzzy_within_alphabet(v, a) AS within
+FROM (VALUES ('abc', 'abcd'), ('abx', 'abcd'), ('', ''), ('b a', 'ab '),
+	(repeat('a', 255), 'a'), (repeat('a', 256), 'a'), (NULL, 'a')) t(v, a);
+
+\set VERBOSITY terse
+SELECT fuzzy_neighbourhood('a', -1, 'a');
+\set VERBOSITY default
+
+-- the planner hook is installed when the library is loaded; keep batched
+-- scans out of the plans
+LOAD 'fuzzystrmatch';
+SET fuzzystrmatch.batch_size = 0;
+SET enable_seqscan = off;
+SET enable_bitmapscan = off;
+
+-- words over abcd, and one that is not, and one too long to compare
+CREATE TABLE nh_words AS
+	SELECT i AS id, translate(substr(md5(i::text), 1, 1 + i % 6),
+							  '0123456789abcdef', 'abcdabcdabcdabcd') AS w
+	FROM generate_series(1, 3000) i;
+INSERT INTO nh_words VALUES (0, NULL), (-1, ''), (-2, 'abx'),
+	(-3, repeat('a', 300));
+CREATE INDEX nh_words_w ON nh_words (w);
+ANALYZE nh_words;
+
+-- the scan of a query's plan, and the probes it makes
+CREATE FUNCTION nh_plan(query text) RETURNS SETOF text
+LANGUAGE plpgsql AS $$
+DECLARE
+	line text;
+BEGIN
+	FOR line IN EXECUTE 'EXPLAIN (COSTS OFF) ' || query LOOP
+		IF line ~ 'Scan|Cond|Filter' THEN
+			RETURN NEXT regexp_replace(regexp_replace(btrim(line),
+										   '^Filter: .*', 'Filter'),
+									   '\{[^}]*\}', '{...}');
+		END IF;
+	END LOOP;
+END
+$$;
+
+-- the scan of the words a condition matches, how many it matches, and
+-- whether the rows are those matched without probes
+CREATE FUNCTION nh_check(cond text, OUT scan text, OUT matches int,
+	OUT same bool)
+LANGUAGE plpgsql AS $$
+DECLARE
+	query text := 'SELECT array_agg(id ORDER BY id) FROM nh_words WHERE ' || cond;
+	saved text := current_setting('fuzzystrmatch.neighbourhood_max_variants');
+	ids int[];
+	plain_ids int[];
+BEGIN
+	SELECT p INTO scan FROM nh_plan(query) p WHERE p ~ 'Scan' LIMIT 1;
+	EXECUTE query INTO ids;
+	PERFORM set_config('fuzzystrmatch.neighbourhood_max_variants', '0', false);
+	EXECUTE query INTO plain_ids;
+	PERFORM set_config('fuzzystrmatch.neighbourhood_max_variants', saved, false);
+	matches := coalesce(cardinality(ids), 0);
+	same := ids IS NOT DISTINCT FROM plain_ids;
+END
+$$;
+
+-- without a constraint nothing is rewritten: the word outside the alphabet
+-- is found, and the long one makes the comparison fail
+SELECT * FROM nh_plan('SELECT id FROM nh_words
+	WHERE levenshtein_less_equal(w, ''abc'', 1) <= 1');
+SELECT id, w FROM nh_words
+WHERE length(w) < 256 AND levenshtein(w, 'abc') <= 1 AND
+	NOT fuzzy_within_alphabet(w, 'abcd');
+\set VERBOSITY terse
+SELECT count(*) FROM nh_words WHERE levenshtein_less_equal(w, 'abc', 1) <= 1;
+\set VERBOSITY default
+
+-- nor with one that is not validated
+ALTER TABLE nh_words ADD CONSTRAINT nh_words_alphabet
+	CHECK (fuzzy_within_alphabet(w, 'abcd')) NOT VALID;
+SELECT * FROM nh_plan('SELECT id FROM nh_words
+	WHERE levenshtein_less_equal(w, ''abc'', 1) <= 1');
+\set VERBOSITY terse
+ALTER TABLE nh_words VALIDATE CONSTRAINT nh_words_alphabet;
+INSERT INTO nh_words VALUES (-4, 'abcde');
+\set VERBOSITY default
+SELECT id FROM nh_words WHERE NOT fuzzy_within_alphabet(w, 'abcd')
+ORDER BY id;
+
+DELETE FROM nh_words WHERE id IN (-2, -3);
+ALTER TABLE nh_words VALIDATE CONSTRAINT nh_words_alphabet;
+
+SELECT * FROM nh_plan('SELECT id FROM nh_words
+	WHERE levenshtein_less_equal(w, ''abc'', 1) <= 1');
+SELECT * FROM nh_plan('SELECT id FROM nh_words
+	WHERE levenshtein_less_equal(w, ''abc'', 1) <= 2');
+
+-- probes for distances up to what the bounded function computes, as above
+-- but not beyond, for queries with characters outside the alphabet, and not
+-- for neighbourhoods larger than fuzzystrmatch.neighbourhood_max_variants
+SELECT cond, c.*
+FROM (VALUES ('levenshtein_less_equal(w, ''abc'', 1) <= 1'),
+	('levenshtein(w, ''abc'') < 2'),
+	('1 >= levenshtein(''dcba'', w)'),
+	('levenshtein_less_equal(''cab'', w, 2) <= 1'),
+	('levenshtein(w, ''abx'') <= 1'),
+	('levenshtein(w, '''') <= 1'),
+	('levenshtein(w, ''b'') <= 0'),
+	('levenshtein(w, ''abc'') <= 2'),
+	('levenshtein(w, ''abc'') <= 1 AND id % 2 = 0'),
+	('levenshtein(w, ''abc'') <= 1 OR id = 1')) t(cond),
+	nh_check(cond) c;
+
+SET fuzzystrmatch.neighbourhood_max_variants = 2000;
+SELECT * FROM nh_check('levenshtein(w, ''abc'') <= 2');
+
+-- a query the functions reject still fails, however many probes it allows
+SET fuzzystrmatch.neighbourhood_max_variants = 1000000;
+SELECT * FROM nh_plan(format('SELECT id FROM nh_words
+	WHERE levenshtein(w, %L) <= 1', repeat('a', 256)));
+\set VERBOSITY terse
+SELECT * FROM nh_check(format('levenshtein(w, %L) <= 1', repeat('a', 256)));
+\set VERBOSITY default
+RESET fuzzystrmatch.neighbourhood_max_variants;
+
+-- without the constraint, the plan made with it is not used again
+PREPARE nh_query AS
+	SELECT count(*) FROM nh_words WHERE levenshtein(w, 'abc') <= 1;
+SELECT * FROM nh_plan('EXECUTE nh_query');
+ALTER TABLE nh_words DROP CONSTRAINT nh_words_alphabet;
+SELECT * FROM nh_plan('EXECUTE nh_query');
+DEALLOCATE nh_query;
+
+-- a constraint child tables do not inherit only covers scans of the parent
+CREATE TABLE nh_parent (w text,
+	CHECK (fuzzy_within_alphabet(w, 'abcd')) NO INHERIT);
+CREATE TABLE nh_child () INHERITS (nh_parent);
+CREATE INDEX nh_parent_w ON nh_parent (w);
+CREATE INDEX nh_child_w ON nh_child (w);
+INSERT INTO nh_parent VALUES ('abc'), ('abd');
+INSERT INTO nh_child VALUES ('abx'), ('abcc');
+SELECT w FROM nh_parent WHERE levenshtein(w, 'abc') <= 1
+ORDER BY w COLLATE "C";
+SELECT * FROM nh_plan('SELECT w FROM ONLY nh_parent
+	WHERE levenshtein(w, ''abc'') <= 1');
+SELECT w FROM ONLY nh_parent WHERE levenshtein(w, 'abc') <= 1
+ORDER BY w COLLATE "C";
+
+RESET enable_seqscan;
+RESET enable_bitmapscan;
+RESET fuzzystrmatch.batch_size;
+
+DROP FUNCTION nh_check(text), nh_plan(text);
+DROP TABLE nh_strings, nh_words, nh_child, nh_parent;
@@ -0,0 +1,52 @@
+--
+-- Array forms of metaphone and dmetaphone
+--
+
+CREATE TABLE pm_words AS
+	SELECT array_agg(CASE WHEN i % 50 = 0 THEN NULL
+						  WHEN i % 77 = 0 THEN ''
+						  ELSE translate(substr(md5(i::text) || md5((-i)::text),
+												1, 1 + i % 40),
+										 '0123456789', 'ghijklmnop') END
+					 ORDER BY i) AS a
+	FROM generate_series(1, 2000) i;
+
+-- every element must be encoded as the scalar functions encode it; codes
+-- of up to 20 characters outgrow the space first set aside for them
+SELECT n, count(*) AS elements,
+	   count(*) FILTER (WHERE a[i] IS NULL) AS nulls,
+	   count(*) FILTER (WHERE m[i] IS DISTINCT FROM metaphone(a[i], n)) AS mismatches
+FROM pm_words, (VALUES (1), (4), (20)) v(n),
+	 LATERAL (SELECT metaphone_many(a, n) AS m) s,
+	 generate_subscripts(a, 1) i
+GROUP BY n ORDER BY n;
+
+SELECT count(*) AS elements,
+	   count(*) FILTER (WHERE d[i][1] IS DISTINCT FROM dmetaphone(a[i])
+						OR d[i][2] IS DISTINCT FROM dmetaphone_alt(a[i])) AS mismatches
+FROM pm_words, LATERAL (SELECT dmetaphone_many(a) AS d) s,
+	 generate_subscripts(a, 1) i;
+
+SELECT array_dims(metaphone_many(a, 4)) AS metaphone_dims,
+	   array_dims(dmetaphone_many(a)) AS dmetaphone_dims
+FROM pm_words;
+
+-- the shape of the input is kept, lower bounds included
+SELECT array_dims(m) AS dims,
+	   m[0][2] = metaphone('Thompson', 4) AND m[0][3] = metaphone('Smith', 4) AND
+	   m[1][2] IS NULL AND m[1][3] = metaphone('Knight', 4) AS matches
+FROM metaphone_many('[0:1][2:3]={{Thompson,Smith},{NULL,Knight}}', 4) m;
+
+SELECT array_dims(d) AS dims,
+	   d[0:0][2:2][1:2] = ARRAY[[[dmetaphone('Thompson'), dmetaphone_alt('Thompson')]]] AS first,
+	   d[1:1][2:2][1:2] = ARRAY[[[NULL, NULL]]]::text[] AS null_element
+FROM dmetaphone_many('[0:1][2:3]={{Thompson,Smith},{NULL,Knight}}') d;
+
+SELECT metaphone_many('{}', 4) AS m, dmetaphone_many('{}') AS d;
+
+\set VERBOSITY terse
+SELECT metaphone_many('{abc}', 0);
+SELECT dmetaphone_many('{{{{{{a}}}}}}');
+\set VERBOSITY default
+
+DROP TABLE pm_words;
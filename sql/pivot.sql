@@ -0,0 +1,43 @@
+--
+-- Pivot-based filtering
+--
+
+CREATE TABLE pivot_words AS
+	SELECT i AS id, substr(md5(i::text), 1, 2 + i % 9) AS w
+	FROM generate_series(1, 2000) i;
+
+-- farthest-first from the first sample string
+CREATE TABLE pivot_set AS
+	SELECT fuzzy_choose_pivots(array_agg(w ORDER BY id), 4) AS p
+	FROM pivot_words;
+SELECT p FROM pivot_set;
+
+SELECT fuzzy_choose_pivots('{abc,abc,NULL,abc}', 3);
+SELECT fuzzy_choose_pivots('{}', 3);
+SELECT fuzzy_choose_pivots('{abc,xyz}', 0);
+
+ALTER TABLE pivot_words ADD COLUMN pd smallint[];
+UPDATE pivot_words SET pd = fuzzy_pivot_distances(w, p) FROM pivot_set;
+
+SELECT count(*) AS mismatches
+FROM pivot_words, pivot_set, generate_subscripts(p, 1) i
+WHERE pd[i] <> levenshtein(w, p[i]);
+
+-- the filter must keep exactly the rows within max_d
+CREATE TABLE pivot_queries (q text);
+INSERT INTO pivot_queries VALUES ('c4ca'), ('a97da629b'), ('zzz'), (''),
+	('1679091c5a880faf6fb5e6087eb1b2dc'), ('8f14e4');
+
+SELECT k, count(*) FILTER (WHERE levenshtein(w, q) <= k) AS within,
+	count(*) FILTER (WHERE fuzzy_pivot_filter(w, pd, q,
+										  fuzzy_pivot_distances(q, p), k)
+					 <> (levenshtein(w, q) <= k)) AS mismatches
+FROM pivot_words, pivot_set, pivot_queries, generate_series(-1, 3) k
+GROUP BY k ORDER BY k;
+
+\set VERBOSITY terse
+SELECT fuzzy_choose_pivots('{abc}', -1);
+SELECT fuzzy_pivot_distances('abc', '{abd,NULL}');
+SELECT fuzzy_pivot_filter('abc', '{1,2}', 'abd', '{1}', 2);
+SELECT fuzzy_pivot_filter('abc', '{1,NULL}', 'abd', '{1,2}', 2);
+\set VERBOSITY default
@@ -0,0 +1,66 @@
+--
+-- q-gram similarity
+--
+
+-- a string of m characters has m + q - 1 grams
+SELECT q, cardinality(qgram_array('', q)) AS empty,
+	   cardinality(qgram_array('a', q)) AS one,
+	   cardinality(qgram_array('abab', q)) AS four
+FROM generate_series(1, 8) q;
+
+SELECT qgram_overlap('abab', 'abab', 2) AS same,
+	   qgram_overlap('abab', 'ab', 2) AS repeated,
+	   qgram_overlap('abc', 'xyz', 2) AS disjoint,
+	   round(qgram_jaccard('abcd', 'abce', 2)::numeric, 4) AS jaccard,
+	   qgram_dice('abcd', 'abce', 2) AS dice,
+	   qgram_jaccard('', '', 1) AS empty_jaccard,
+	   qgram_dice('', '', 1) AS empty_dice;
+
+CREATE TABLE qgram_words AS
+	SELECT i AS id, substr(md5(i::text), 1, i % 13) AS w
+	FROM generate_series(1, 60) i;
+INSERT INTO qgram_words VALUES
+	(61, repeat(md5('61'), 4)), (62, 'c4c'), (63, 'c4ca');
+ALTER TABLE qgram_words ADD COLUMN g2 int[], ADD COLUMN g3 int[];
+UPDATE qgram_words SET g2 = qgram_array(w, 2), g3 = qgram_array(w, 3);
+
+-- overlaps against a short and a long string; the long one is searched by
+-- galloping rather than by a plain merge
+SELECT id, length(w) AS len,
+	   qgram_overlap(w, 'c4ca4238', 2) AS short2,
+	   qgram_overlap(w, 'c4ca4238', 3) AS short3,
+	   qgram_overlap(w, repeat(md5('61'), 4), 2) AS long2
+FROM qgram_words
+WHERE id IN (1, 2, 3, 12, 25, 40, 61, 62, 63)
+ORDER BY id;
+
+-- the array forms must agree with the text forms, including for arrays
+-- that are not sorted
+SELECT count(*) AS pairs,
+	   count(*) FILTER (WHERE qgram_overlap(x.g2, y.g2) <> qgram_overlap(x.w, y.w, 2)
+						OR qgram_overlap(x.g3, y.g3) <> qgram_overlap(x.w, y.w, 3)
+						OR qgram_jaccard(x.g2, y.g2) <> qgram_jaccard(x.w, y.w, 2)
+						OR qgram_dice(x.g3, y.g3) <> qgram_dice(x.w, y.w, 3)
+						OR qgram_overlap(ARRAY(SELECT unnest(x.g2) ORDER BY 1 DESC), y.g2)
+						   <> qgram_overlap(x.w, y.w, 2)) AS mismatches
+FROM qgram_words x, qgram_words y;
+
+-- jaccard_at_least must agree with jaccard, whether it answers from the
+-- sizes, part way through the merge or at the end
+SELECT t, count(*) FILTER (WHERE qgram_jaccard(x.w, y.w, 2) >= t) AS reached,
+	   count(*) FILTER (WHERE qgram_jaccard_at_least(x.w, y.w, 2, t)
+						<> (qgram_jaccard(x.w, y.w, 2) >= t)
+						OR qgram_jaccard_at_least(x.g2, y.g2, t)
+						<> (qgram_jaccard(x.w, y.w, 2) >= t)) AS mismatches
+FROM qgram_words x, qgram_words y,
+	 (VALUES (0.0::float8), (0.125), (0.25), (0.5), (0.75), (1.0)) AS v(t)
+GROUP BY t ORDER BY t;
+
+\set VERBOSITY terse
+SELECT qgram_array('abc', 0);
+SELECT qgram_jaccard('abc', 'abd', 9);
+SELECT qgram_overlap('{{1,2},{3,4}}'::int[], '{1}');
+SELECT qgram_dice('{1,NULL}'::int[], '{1}');
+\set VERBOSITY default
+
+DROP TABLE qgram_words;
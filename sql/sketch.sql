@@ -0,0 +1,51 @@
+--
+-- Sketches for estimating the edit distance of long texts
+--
+
+-- sketches have the same size whatever the length of the text
+SELECT octet_length(fuzzy_sketch('', 3)) AS empty,
+	   octet_length(fuzzy_sketch('abc', 3)) AS short,
+	   octet_length(fuzzy_sketch(repeat(md5('x'), 1000), 16)) AS long;
+
+-- texts of 1920 characters, each with a copy that has k substitutions (odd
+-- i) or insertions (even i) of a character the text doesn't contain, 64
+-- characters apart; the edit distance between the two is exactly k
+CREATE TABLE sketch_docs AS
+	SELECT i, 1 + i % 12 AS k,
+		   string_agg(c, '' ORDER BY j) AS x,
+		   string_agg(CASE WHEN j > 1 + i % 12 THEN c
+						   WHEN i % 2 = 0 THEN 'Z' || c
+						   ELSE 'Z' || substr(c, 2) END, '' ORDER BY j) AS y
+	FROM generate_series(1, 40) i, generate_series(1, 30) j,
+		 LATERAL (SELECT md5((i * 100 + j)::text) ||
+						 md5((-(i * 100 + j))::text) AS c) s
+	GROUP BY i;
+
+-- sparse edits are estimated to within the sketch's error, identical texts
+-- estimate to 0, and unrelated texts far apart
+SELECT q, count(*) AS texts,
+	   count(*) FILTER (WHERE e.edited BETWEEN 0.5 * d.k AND 1.5 * d.k) AS close,
+	   avg(e.edited / d.k) BETWEEN 0.8 AND 1.2 AS unbiased,
+	   count(*) FILTER (WHERE e.same = 0) AS same_zero,
+	   count(*) FILTER (WHERE e.unrelated > 100) AS unrelated_far
+FROM sketch_docs d JOIN sketch_docs o ON o.i = d.i % 40 + 1,
+	 (VALUES (3), (5)) v(q),
+	 LATERAL (SELECT fuzzy_sketch_distance(fuzzy_sketch(d.x, q), fuzzy_sketch(d.y, q)),
+					 fuzzy_sketch_distance(fuzzy_sketch(d.x, q), fuzzy_sketch(d.x, q)),
+					 fuzzy_sketch_distance(fuzzy_sketch(d.x, q), fuzzy_sketch(o.x, q))
+			 ) e(edited, same, unrelated)
+GROUP BY q ORDER BY q;
+
+-- estimates are clamped to the bounds the lengths impose
+SELECT fuzzy_sketch_distance(fuzzy_sketch('', 3), fuzzy_sketch('abcdef', 3)) AS from_empty,
+	   fuzzy_sketch_distance(fuzzy_sketch('ab', 3), fuzzy_sketch('abcdefgh', 3)) >= 6 AS at_least_length_difference,
+	   fuzzy_sketch_distance(fuzzy_sketch('abc', 2), fuzzy_sketch('xyz', 2)) <= 3 AS at_most_longer_length;
+
+\set VERBOSITY terse
+SELECT fuzzy_sketch('abc', 0);
+SELECT fuzzy_sketch('abc', 17);
+SELECT fuzzy_sketch_distance(fuzzy_sketch('abc', 2), fuzzy_sketch('abc', 3));
+SELECT fuzzy_sketch_distance('\x00', fuzzy_sketch('abc', 3));
+\set VERBOSITY default
+
+DROP TABLE sketch_docs;
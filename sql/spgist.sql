@@ -0,0 +1,83 @@
+--
+-- spgist_fuzzy_ops: index scans must return what sequential scans return
+--
+
+-- random words, words sharing a long prefix, and many copies of one word,
+-- so that the tree has prefixes, deep levels and allTheSame tuples
+CREATE TABLE spg_words AS
+	SELECT i AS id, substr(md5(i::text), 1, 3 + i % 10) AS w
+	FROM generate_series(1, 3000) i
+	UNION ALL
+	SELECT 10000 + i, 'prefix' || substr(md5(i::text), 1, i % 6)
+	FROM generate_series(1, 500) i
+	UNION ALL
+	SELECT 20000 + i, 'abc' FROM generate_series(1, 200) i;
+INSERT INTO spg_words VALUES (0, ''), (0, 'ab'), (0, 'abd'), (0, 'xabc'),
+	(0, NULL);
+CREATE INDEX spg_words_idx ON spg_words USING spgist (w spgist_fuzzy_ops);
+ANALYZE spg_words;
+
+CREATE TABLE spg_queries (q text);
+INSERT INTO spg_queries VALUES ('abc'), ('c4ca4238'), ('zzzz'), (''),
+	('prefix'), ('prefixc4c'), ('1679091c5a880faf6fb5e6087eb1b2dc'),
+	('a87ff679a');
+
+-- with the given radius, the pairs matched by %~ that are not within it,
+-- or the other way round
+CREATE FUNCTION spg_within_mismatches(r int) RETURNS bigint
+LANGUAGE sql AS $$
+	SELECT set_config('fuzzystrmatch.radius', r::text, false);
+	SELECT count(*)
+	FROM (((SELECT q, w FROM spg_queries, spg_words WHERE w %~ q)
+		   EXCEPT ALL
+		   (SELECT q, w FROM spg_queries, spg_words WHERE levenshtein(w, q) <= r))
+		  UNION ALL
+		  ((SELECT q, w FROM spg_queries, spg_words WHERE levenshtein(w, q) <= r)
+		   EXCEPT ALL
+		   (SELECT q, w FROM spg_queries, spg_words WHERE w %~ q))) diff
+$$;
+
+SET enable_seqscan = off;
+SET fuzzystrmatch.radius = 1;
+
+SET enable_bitmapscan = off;
+EXPLAIN (COSTS OFF) SELECT id FROM spg_words WHERE w %~ 'abc';
+SELECT w, count(id) FROM spg_words WHERE w %~ 'abc' GROUP BY w ORDER BY w;
+SELECT r, spg_within_mismatches(r) AS mismatches FROM generate_series(0, 3) r;
+RESET enable_bitmapscan;
+
+SET fuzzystrmatch.radius = 1;
+SET enable_indexscan = off;
+EXPLAIN (COSTS OFF) SELECT id FROM spg_words WHERE w %~ 'abc';
+SELECT w, count(id) FROM spg_words WHERE w %~ 'abc' GROUP BY w ORDER BY w;
+SELECT r, spg_within_mismatches(r) AS mismatches FROM generate_series(0, 3) r;
+RESET enable_indexscan;
+
+-- index-only scans return the strings the leaves reconstruct
+VACUUM ANALYZE spg_words;
+SET fuzzystrmatch.radius = 1;
+SET enable_bitmapscan = off;
+EXPLAIN (COSTS OFF) SELECT w FROM spg_words WHERE w %~ 'prefix';
+SELECT w, count(*) FROM spg_words WHERE w %~ 'prefix' GROUP BY w ORDER BY w;
+RESET enable_bitmapscan;
+
+-- several scan keys must all be satisfied
+SET fuzzystrmatch.radius = 2;
+SELECT count(*) FROM spg_words WHERE w %~ 'prefix1' AND w %~ 'prefixc4';
+SET enable_indexscan = off;
+SET enable_bitmapscan = off;
+RESET enable_seqscan;
+SELECT count(*) FROM spg_words WHERE w %~ 'prefix1' AND w %~ 'prefixc4';
+RESET enable_bitmapscan;
+RESET enable_indexscan;
+SET enable_seqscan = off;
+
+\set VERBOSITY terse
+SELECT count(*) FROM spg_words WHERE w %~ repeat('a', 256);
+\set VERBOSITY default
+
+RESET fuzzystrmatch.radius;
+RESET enable_seqscan;
+
+DROP FUNCTION spg_within_mismatches(int);
+DROP TABLE spg_words, spg_queries;
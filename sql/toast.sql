@@ -0,0 +1,63 @@
+--
+-- Bounded distances between compressed or out-of-line values
+--
+
+-- the padding makes the rows big enough to be toasted at all, and then a
+-- small toast_tuple_target pushes even short strings out of line
+CREATE TABLE toast_ext (id int, a text, b text, pad text)
+	WITH (toast_tuple_target = 128);
+ALTER TABLE toast_ext ALTER a SET STORAGE EXTERNAL, ALTER b SET STORAGE EXTERNAL,
+	ALTER pad SET STORAGE PLAIN;
+INSERT INTO toast_ext
+	SELECT i, substr(repeat(md5(i::text), 8), 1, 100 + i % 150),
+		   substr(repeat(md5(i::text), 8), 1 + i % 3, 100 + (i * 7) % 150),
+		   repeat('-', 2100)
+	FROM generate_series(1, 300) i;
+
+-- or compresses them in line
+CREATE TABLE toast_cmp (id int, a text, b text, pad text)
+	WITH (toast_tuple_target = 128);
+ALTER TABLE toast_cmp ALTER a SET STORAGE MAIN, ALTER b SET STORAGE MAIN,
+	ALTER pad SET STORAGE PLAIN;
+INSERT INTO toast_cmp SELECT * FROM toast_ext;
+
+SELECT pg_relation_size(reltoastrelid) > 0 AS out_of_line
+FROM pg_class WHERE relname = 'toast_ext';
+SELECT count(*) > 0 AS compressed
+FROM toast_cmp WHERE pg_column_size(a) < octet_length(a);
+
+-- exact distances, computed on plain copies of the values
+CREATE TABLE toast_exact AS
+	SELECT id, levenshtein(a || '', b || '') AS lev,
+		   levenshtein(a || '', b || '', 2, 1, 3) AS lev_costs,
+		   dameraulevenshtein(a || '', b || '') AS dlev,
+		   dameraulevenshtein(a || '', b || '', 1, 3, 2, 1) AS dlev_costs
+	FROM toast_ext;
+
+-- a bounded result above max_d only means "more than max_d"
+CREATE FUNCTION toast_agrees(d int, exact int, max_d int) RETURNS bool
+LANGUAGE sql IMMUTABLE
+AS $$ SELECT (d <= max_d) = (exact <= max_d) AND (d > max_d OR d = exact) $$;
+
+SELECT count(*) AS mismatches
+FROM toast_ext t JOIN toast_exact e USING (id), generate_series(0, 150, 10) k
+WHERE NOT toast_agrees(levenshtein_less_equal(a, b, k), lev, k)
+	OR NOT toast_agrees(levenshtein_less_equal(a, b, 2, 1, 3, k), lev_costs, k)
+	OR NOT toast_agrees(dameraulevenshtein_less_equal(a, b, k), dlev, k)
+	OR NOT toast_agrees(dameraulevenshtein_less_equal(a, b, 1, 3, 2, 1, k),
+						dlev_costs, k);
+
+SELECT count(*) AS mismatches
+FROM toast_cmp t JOIN toast_exact e USING (id), generate_series(0, 150, 10) k
+WHERE NOT toast_agrees(levenshtein_less_equal(a, b, k), lev, k)
+	OR NOT toast_agrees(levenshtein_less_equal(a, b, 2, 1, 3, k), lev_costs, k)
+	OR NOT toast_agrees(dameraulevenshtein_less_equal(a, b, k), dlev, k)
+	OR NOT toast_agrees(dameraulevenshtein_less_equal(a, b, 1, 3, 2, 1, k),
+						dlev_costs, k);
+
+-- over-long values are still rejected, whatever max_d
+\set VERBOSITY terse
+INSERT INTO toast_ext VALUES (0, repeat('x', 300), 'x', repeat('-', 2100));
+SELECT levenshtein_less_equal(a, b, 1) FROM toast_ext WHERE id = 0;
+SELECT levenshtein_less_equal(b, a, 1000) FROM toast_ext WHERE id = 0;
+\set VERBOSITY default
@@ -0,0 +1,97 @@
+--
+-- levenshtein_token_sort and levenshtein_token_set
+--
+
+SELECT a, b,
+	levenshtein_token_sort(a, b) AS sort,
+	levenshtein_token_set(a, b) AS set
+FROM (VALUES ('Smith John', 'John Smith'),
+	('John Smith', 'John  Smith Jr'),
+	('John Smith', 'Jon Smyth'),
+	('  a b  c ', 'c b a'),
+	('a a b', 'a b b'),
+	('new york mets', 'new york mets vs atlanta braves'),
+	('', ''),
+	('', 'abc'),
+	('   ', 'x')) t(a, b);
+
+-- the same from their definitions: tokens split on whitespace, sorted
+-- bytewise and joined with single spaces
+CREATE FUNCTION tok_tokens(s text) RETURNS SETOF text
+LANGUAGE sql AS $$
+	SELECT t FROM regexp_split_to_table(s, '\s+') t WHERE t <> ''
+$$;
+
+CREATE FUNCTION tok_join(tokens text[]) RETURNS text
+LANGUAGE sql AS $$
+	SELECT array_to_string(ARRAY(SELECT t FROM unnest(tokens) t
+								 ORDER BY t COLLATE "C"), ' ')
+$$;
+
+-- for the set distance, the smallest of the distances between the shared
+-- tokens S and S followed by the tokens of either string alone
+CREATE FUNCTION tok_set(a text, b text) RETURNS int
+LANGUAGE sql AS $$
+	SELECT least(length(sa) - length(s), length(sb) - length(s),
+				 levenshtein(sa, sb))
+	FROM (SELECT s, concat_ws(' ', nullif(s, ''), nullif(a_only, '')) AS sa,
+			concat_ws(' ', nullif(s, ''), nullif(b_only, '')) AS sb
+		  FROM (SELECT
+				tok_join(ARRAY(SELECT tok_tokens(a)
+							   INTERSECT SELECT tok_tokens(b))) AS s,
+				tok_join(ARRAY(SELECT tok_tokens(a)
+							   EXCEPT SELECT tok_tokens(b))) AS a_only,
+				tok_join(ARRAY(SELECT tok_tokens(b)
+							   EXCEPT SELECT tok_tokens(a))) AS b_only) p) j
+$$;
+
+-- strings of tokens from a small vocabulary, so that they share some,
+-- separated by runs of spaces, tabs and newlines
+CREATE TABLE tok_strings AS
+	SELECT i, (SELECT string_agg(substr(md5(((i * 7 + j) % 12)::text), 1,
+										 1 + (i + j) % 4),
+								 (ARRAY[' ', '  ', E'\t', E' \n'])[1 + j % 4]
+								 ORDER BY j)
+			   FROM generate_series(1, i % 7) j) AS s
+	FROM generate_series(1, 60) i;
+UPDATE tok_strings SET s = coalesce(s, '') || ' ' WHERE i % 5 = 0;
+UPDATE tok_strings SET s = E'\t' || coalesce(s, '') WHERE i % 3 = 0;
+
+CREATE TABLE tok_results AS
+	SELECT x.s AS a, y.s AS b,
+		levenshtein_token_sort(x.s, y.s) AS sort,
+		levenshtein(tok_join(ARRAY(SELECT tok_tokens(x.s))),
+					tok_join(ARRAY(SELECT tok_tokens(y.s)))) AS sort_ref,
+		levenshtein_token_set(x.s, y.s) AS set,
+		tok_set(x.s, y.s) AS set_ref
+	FROM tok_strings x, tok_strings y;
+
+SELECT count(*) AS pairs,
+	count(*) FILTER (WHERE sort <> sort_ref) AS sort_mismatches,
+	count(*) FILTER (WHERE set <> set_ref) AS set_mismatches,
+	count(*) FILTER (WHERE set < sort) AS set_smaller,
+	count(*) FILTER (WHERE set > sort) AS set_larger
+FROM tok_results;
+
+-- bounded: exact up to k, above k otherwise
+SELECT k,
+	count(*) FILTER (WHERE NOT ((d_sort <= k) = (sort <= k) AND
+								(d_sort > k OR d_sort = sort))) AS sort_wrong,
+	count(*) FILTER (WHERE NOT ((d_set <= k) = (set <= k) AND
+								(d_set > k OR d_set = set))) AS set_wrong
+FROM (SELECT k, sort, set,
+		levenshtein_token_sort_less_equal(a, b, k) AS d_sort,
+		levenshtein_token_set_less_equal(a, b, k) AS d_set
+	  FROM tok_results, unnest(ARRAY[0, 1, 3, 10]) k) s
+GROUP BY k ORDER BY k;
+
+\set VERBOSITY terse
+SELECT levenshtein_token_sort(repeat('ab ', 86), 'ab');
+-- repeated tokens are dropped before the length is checked
+SELECT levenshtein_token_set(repeat('ab ', 86), 'ef');
+SELECT levenshtein_token_set(
+	(SELECT string_agg(i::text, ' ') FROM generate_series(100, 199) i), 'ef');
+\set VERBOSITY default
+
+DROP FUNCTION tok_set(text, text), tok_join(text[]), tok_tokens(text);
+DROP TABLE tok_strings, tok_results;
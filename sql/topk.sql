@@ -0,0 +1,54 @@
+--
+-- fuzzy_topk: the k nearest words must be those a sort by distance finds
+--
+
+CREATE TABLE topk_words AS
+	SELECT substr(md5(i::text), 1, 1 + i % 12) AS w
+	FROM generate_series(1, 3000) i;
+INSERT INTO topk_words VALUES (NULL), (''), (repeat('a', 300)),
+	('kitten'), ('sitting'), ('mitten'), ('smitten'), ('bitten');
+CREATE INDEX topk_words_length ON topk_words (length(w));
+ANALYZE topk_words;
+
+CREATE TABLE topk_queries (q text);
+INSERT INTO topk_queries VALUES (''), ('a'), ('c4ca'), ('kitten'),
+	('c4ca4238a0b9'), ('zzzzzzzz'), (repeat('a', 40));
+
+-- for each k, the queries whose distances differ from those of a sort, and
+-- the rows returned that are not in the table at the distance given
+CREATE FUNCTION topk_check(k int) RETURNS TABLE (mismatches bigint, wrong bigint)
+LANGUAGE sql AS $$
+	SELECT
+		(SELECT count(*) FROM topk_queries
+		 WHERE ARRAY(SELECT distance FROM fuzzy_topk('topk_words', 'w', q, k))
+			<> ARRAY(SELECT levenshtein(w, q) FROM topk_words
+					 WHERE length(w) <= 255 ORDER BY 1 LIMIT k)),
+		(SELECT count(*) FROM topk_queries, fuzzy_topk('topk_words', 'w', q, k) t
+		 WHERE t.distance <> levenshtein(t.word, q)
+			OR NOT EXISTS (SELECT 1 FROM topk_words WHERE w = t.word))
+$$;
+
+SELECT * FROM fuzzy_topk('topk_words', 'w', 'kitten', 4);
+SELECT k, c.* FROM unnest(ARRAY[0, 1, 5, 25, 3006, 5000]) k, topk_check(k) c;
+
+-- nulls and words too long for levenshtein are never returned
+SELECT count(*), count(word), max(length(word))
+FROM fuzzy_topk('topk_words', 'w', 'abc', 5000);
+
+-- the same without the index, every bucket a sequential scan
+DROP INDEX topk_words_length;
+SELECT k, c.* FROM unnest(ARRAY[1, 25]) k, topk_check(k) c;
+
+CREATE TABLE topk_empty (w text);
+SELECT count(*) FROM fuzzy_topk('topk_empty', 'w', 'abc', 3);
+INSERT INTO topk_empty VALUES (NULL);
+SELECT count(*) FROM fuzzy_topk('topk_empty', 'w', 'abc', 3);
+
+\set VERBOSITY terse
+SELECT * FROM fuzzy_topk('topk_words', 'w', 'abc', -1);
+SELECT * FROM fuzzy_topk('topk_words', 'w', repeat('a', 256), 1);
+SELECT * FROM fuzzy_topk('topk_words', 'nope', 'abc', 1);
+\set VERBOSITY default
+
+DROP FUNCTION topk_check(int);
+DROP TABLE topk_words, topk_queries, topk_empty;
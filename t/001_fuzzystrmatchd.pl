@@ -0,0 +1,150 @@
+# Tests for fuzzystrmatchd and fuzzystrmatch_loadgen.
+#
+# These need "make tools"; the programs are looked for in PATH, which the
+# TAP harness points at the build directory.
+
+use strict;
+use warnings;
+use File::Temp qw(tempdir);
+use IO::Socket::UNIX;
+use Time::HiRes qw(usleep);
+use Test::More;
+
+my $dir = tempdir(CLEANUP => 1);
+my $socket = "$dir/sock";
+
+# Reference edit distance: the plain dynamic program, all costs 1
+sub levenshtein
+{
+	my ($s, $t) = @_;
+	my @prev = (0 .. length($t));
+
+	for my $i (1 .. length($s))
+	{
+		my @cur = ($i);
+
+		for my $j (1 .. length($t))
+		{
+			my $sub = $prev[ $j - 1 ] +
+			  (substr($s, $i - 1, 1) eq substr($t, $j - 1, 1) ? 0 : 1);
+			my $best = $prev[$j] + 1;
+
+			$best = $cur[ $j - 1 ] + 1 if $cur[ $j - 1 ] + 1 < $best;
+			$best = $sub if $sub < $best;
+			push @cur, $best;
+		}
+		@prev = @cur;
+	}
+	return $prev[-1];
+}
+
+# Deterministic word list: a few fixed words and some generated ones
+my @words = qw(kitten sitting mitten smith smyth schmidt robert rupert);
+my $x = 12345;
+for (1 .. 300)
+{
+	my $len = 3 + $_ % 9;
+	my $w = '';
+	for (1 .. $len)
+	{
+		$x = ($x * 1103515245 + 12345) % 2147483648;
+		$w .= chr(ord('a') + ($x >> 16) % 6);
+	}
+	push @words, $w;
+}
+my %seen;
+@words = grep { !$seen{$_}++ } @words;
+
+open(my $fh, '>', "$dir/words") or die "could not write word list: $!";
+print $fh "$_\n" for @words;
+close($fh);
+
+my $pid = fork();
+die "fork failed: $!" unless defined $pid;
+if ($pid == 0)
+{
+	open(STDERR, '>', "$dir/daemon.log");
+	exec('fuzzystrmatchd', '-s', $socket, '-d', "$dir/words", '-b', '4')
+	  or die "could not run fuzzystrmatchd: $!";
+}
+
+my $conn;
+for (1 .. 100)
+{
+	$conn = IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => $socket);
+	last if $conn;
+	usleep(100_000);
+}
+ok($conn, 'daemon accepts connections');
+
+sub request
+{
+	my (@lines) = @_;
+
+	print $conn map { "$_\n" } @lines;
+	$conn->flush;
+	my @responses;
+	for (@lines)
+	{
+		my $line = <$conn>;
+		chomp $line;
+		push @responses, $line;
+	}
+	return @responses;
+}
+
+is_deeply([ request('PING') ], ['OK'], 'PING');
+is_deeply(
+	[ request("DIST\tkitten\tsitting", "DIST\t\tabc", "DIST\tsmith\tsmith") ],
+	[ "OK\t3", "OK\t3", "OK\t0" ],
+	'DIST');
+is_deeply(
+	[ request("SOUNDEX\tsmith", "DMETAPHONE\tsmith") ],
+	[ "OK\t3\tschmidt\tsmith\tsmyth", "OK\t3\tschmidt\tsmith\tsmyth" ],
+	'SOUNDEX and DMETAPHONE');
+like((request('BOGUS'))[0], qr/^ERR\t/, 'unknown request');
+like((request("LEV\tx\tkitten"))[0], qr/^ERR\t/, 'bad LEV distance');
+
+# LEV must return exactly the words within max_d, with their distances;
+# send the queries pipelined so that they are batched together
+my @queries = qw(kitten abcab fedcba aaaa bcdef abcdefab x);
+for my $max_d (0 .. 2)
+{
+	my @got = request(map { "LEV\t$max_d\t$_" } @queries);
+	my $mismatches = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my @expected;
+		for my $w (@words)
+		{
+			my $d = levenshtein($queries[$i], $w);
+			push @expected, "$w $d" if $d <= $max_d;
+		}
+
+		my (undef, $n, @fields) = split /\t/, $got[$i], -1;
+		my @pairs;
+		push @pairs, join(' ', splice(@fields, 0, 2)) while @fields;
+		$mismatches++
+		  unless $n == @expected
+		  && join(',', sort @pairs) eq join(',', sort @expected);
+	}
+	is($mismatches, 0, "LEV with max_d $max_d matches the reference");
+}
+
+my ($stats) = request('STATS');
+like($stats, qr/\tentries=${\ scalar @words}\t/, 'STATS counts the entries');
+like($stats, qr/\tmax_batch=4\t/, 'batches are limited by -b');
+
+# the load generator only reports success if every response was well formed
+my $out = `fuzzystrmatch_loadgen -s $socket -d $dir/words -c 3 -p 8 -n 2000 -r 1`;
+is($?, 0, 'loadgen exits successfully');
+like($out, qr/^\s*requests=2000$/m, 'loadgen got all responses');
+like($out, qr/^\s*errors=0$/m, 'loadgen saw no errors');
+
+close($conn);
+kill 'TERM', $pid;
+waitpid($pid, 0);
+is($?, 0, 'daemon exits cleanly on SIGTERM');
+
+done_testing();
@@ -0,0 +1,167 @@
+# Tests for compiled dictionaries: fuzzystrmatch_builddict, the daemon
+# serving a mapped image, and fuzzy_dict_load() and its searches.
+
+use strict;
+use warnings;
+use IO::Socket::UNIX;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Time::HiRes qw(usleep);
+use Test::More;
+
+my $dir = PostgreSQL::Test::Utils::tempdir_short;
+
+my @words = qw(kitten sitting mitten smith smyth schmidt robert rupert
+  catherine kathryn café naïve);
+my $x = 4242;
+for (1 .. 500)
+{
+	my $len = 2 + $_ % 11;
+	my $w = '';
+	for (1 .. $len)
+	{
+		$x = ($x * 1103515245 + 12345) % 2147483648;
+		$w .= chr(ord('a') + ($x >> 16) % 7);
+	}
+	push @words, $w;
+}
+my %seen;
+@words = grep { !$seen{$_}++ } @words;
+
+open(my $fh, '>', "$dir/words") or die "could not write word list: $!";
+print $fh "$_\n" for @words;
+close($fh);
+
+command_ok(
+	[ 'fuzzystrmatch_builddict', '-g', '7', "$dir/words", "$dir/dict.img" ],
+	'builddict compiles the word list');
+
+# A daemon serving the image must answer exactly as one that compiled the
+# word list itself.
+sub start_daemon
+{
+	my ($socket, $dict) = @_;
+	my $pid = fork();
+
+	die "fork failed: $!" unless defined $pid;
+	if ($pid == 0)
+	{
+		open(STDERR, '>', "$socket.log");
+		exec('fuzzystrmatchd', '-s', $socket, '-d', $dict)
+		  or die "could not run fuzzystrmatchd: $!";
+	}
+	for (1 .. 100)
+	{
+		my $conn =
+		  IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => $socket);
+		return ($pid, $conn) if $conn;
+		usleep(100_000);
+	}
+	die "fuzzystrmatchd did not start";
+}
+
+sub ask
+{
+	my ($conn, @lines) = @_;
+
+	print $conn map { "$_\n" } @lines;
+	$conn->flush;
+	return map { my $l = <$conn>; chomp $l; $l } @lines;
+}
+
+my @queries = qw(kitten smith katherine cafe abcab gfedcba aaaa x);
+my @requests;
+for my $q (@queries)
+{
+	push @requests, "LEV\t$_\t$q" for 0 .. 2;
+	push @requests, "SOUNDEX\t$q", "DMETAPHONE\t$q";
+}
+
+my ($pid_words, $conn_words) = start_daemon("$dir/w.sock", "$dir/words");
+my ($pid_image, $conn_image) = start_daemon("$dir/i.sock", "$dir/dict.img");
+
+is_deeply(
+	[ ask($conn_image, @requests) ],
+	[ ask($conn_words, @requests) ],
+	'daemon answers the same from the image and from the word list');
+like((ask($conn_image, 'STATS'))[0],
+	qr/\tentries=${\ scalar @words}\t/, 'image holds every word');
+
+kill 'TERM', $pid_words, $pid_image;
+waitpid($pid_words, 0);
+waitpid($pid_image, 0);
+
+# The backend maps the same image; its searches must agree with the SQL
+# functions applied to every word.
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init(extra => [ '--encoding=UTF8', '--locale=C' ]);
+$node->start;
+
+$node->safe_psql(
+	'postgres', qq{
+CREATE EXTENSION fuzzystrmatch;
+CREATE TABLE words (w text);
+COPY words FROM '$dir/words';
+CREATE TABLE queries (q text);
+INSERT INTO queries SELECT unnest('{${\ join(',', @queries)}}'::text[]);
+});
+
+is($node->safe_psql('postgres', "SELECT fuzzy_dict_load('d', '$dir/dict.img')"),
+	scalar @words, 'fuzzy_dict_load returns the number of words');
+
+is( $node->safe_psql(
+		'postgres', q{
+SELECT count(*) FROM queries, generate_series(0, 2) k,
+LATERAL ((SELECT word, distance FROM fuzzy_dict_search('d', q, k)
+		  EXCEPT ALL
+		  SELECT w, levenshtein(w, q) FROM words WHERE levenshtein(w, q) <= k)
+		 UNION ALL
+		 (SELECT w, levenshtein(w, q) FROM words WHERE levenshtein(w, q) <= k
+		  EXCEPT ALL
+		  SELECT word, distance FROM fuzzy_dict_search('d', q, k))) diff
+}),
+	'0',
+	'fuzzy_dict_search matches levenshtein()');
+
+is( $node->safe_psql(
+		'postgres', q{
+SELECT count(*) FROM queries,
+LATERAL ((SELECT fuzzy_dict_soundex('d', q)
+		  EXCEPT ALL
+		  SELECT w FROM words WHERE soundex(w) = soundex(q))
+		 UNION ALL
+		 (SELECT w FROM words WHERE soundex(w) = soundex(q)
+		  EXCEPT ALL
+		  SELECT fuzzy_dict_soundex('d', q))) diff
+}),
+	'0',
+	'fuzzy_dict_soundex matches soundex()');
+
+is( $node->safe_psql(
+		'postgres', q{
+SELECT count(*) FROM queries,
+LATERAL (SELECT dmetaphone(q) p, dmetaphone_alt(q) a) c,
+LATERAL ((SELECT fuzzy_dict_dmetaphone('d', q)
+		  EXCEPT ALL
+		  SELECT w FROM words
+		  WHERE dmetaphone(w) IN (p, a) OR dmetaphone_alt(w) IN (p, a))
+		 UNION ALL
+		 (SELECT w FROM words
+		  WHERE dmetaphone(w) IN (p, a) OR dmetaphone_alt(w) IN (p, a)
+		  EXCEPT ALL
+		  SELECT fuzzy_dict_dmetaphone('d', q))) diff
+}),
+	'0',
+	'fuzzy_dict_dmetaphone matches dmetaphone()');
+
+my ($ret, $stdout, $stderr) =
+  $node->psql('postgres', "SELECT fuzzy_dict_load('e', '$dir/words')");
+like($stderr, qr/ERROR/, 'a word list is not a compiled dictionary');
+
+($ret, $stdout, $stderr) =
+  $node->psql('postgres', "SELECT * FROM fuzzy_dict_search('nosuch', 'a', 1)");
+like($stderr, qr/ERROR/, 'unknown dictionaries are rejected');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,91 @@
+# Tests for fuzzy_search_parallel() and its background workers.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', q{
+max_worker_processes = 8
+log_min_messages = debug1
+});
+$node->start;
+
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION fuzzystrmatch;
+CREATE TABLE cand AS
+	SELECT substr(md5(i::text), 1, 3 + i % 6) AS c
+	FROM generate_series(1, 40000) i;
+});
+
+# Results must not depend on how many workers share the work
+for my $workers (0, 1, 4)
+{
+	is( $node->safe_psql(
+			'postgres', qq{
+SET fuzzystrmatch.max_workers = $workers;
+SELECT count(*) FROM generate_series(0, 2) k,
+	(VALUES ('abc'), ('1f0e3'), ('c4ca42')) q(q),
+LATERAL ((SELECT candidate, distance
+		  FROM fuzzy_search_parallel(q, (SELECT array_agg(c) FROM cand), k)
+		  EXCEPT ALL
+		  SELECT c, levenshtein(c, q) FROM cand
+		  WHERE levenshtein_less_equal(c, q, k) <= k)
+		 UNION ALL
+		 (SELECT c, levenshtein(c, q) FROM cand
+		  WHERE levenshtein_less_equal(c, q, k) <= k
+		  EXCEPT ALL
+		  SELECT candidate, distance
+		  FROM fuzzy_search_parallel(q, (SELECT array_agg(c) FROM cand), k))) diff
+}),
+		'0',
+		"results match levenshtein() with max_workers = $workers");
+}
+
+like(
+	slurp_file($node->logfile),
+	qr/background worker "fuzzystrmatch worker" \(PID \d+\) exited with exit code 0/,
+	'workers were launched and exited cleanly');
+
+is( $node->safe_psql(
+		'postgres', q{
+SELECT count(*) FROM fuzzy_search_parallel('abc', '{abd,NULL,xyz,ab}', 1)
+}),
+	'2',
+	'nulls are skipped');
+
+# An error in a worker is raised in the leader
+my ($ret, $stdout, $stderr) = $node->psql(
+	'postgres', q{
+SELECT count(*) FROM fuzzy_search_parallel('abc',
+	(SELECT array_agg(CASE WHEN i % 1000 = 999 THEN repeat('x', 300) ELSE 'abc' END)
+	 FROM generate_series(1, 40000) i), 1)
+});
+like($stderr, qr/argument exceeds the maximum length of 255 bytes/,
+	'errors in workers are reported');
+
+# Cancelling the leader stops its workers
+($ret, $stdout, $stderr) = $node->psql(
+	'postgres', q{
+SET statement_timeout = '500ms';
+SELECT count(*) FROM fuzzy_search_parallel(repeat('ab', 120),
+	(SELECT array_agg(repeat(md5(i::text), 7)) FROM generate_series(1, 200000) i),
+	240)
+});
+like($stderr, qr/canceling statement due to statement timeout/,
+	'parallel search can be cancelled');
+ok( $node->poll_query_until(
+		'postgres', q{
+SELECT count(*) = 0 FROM pg_stat_activity
+WHERE backend_type = 'fuzzystrmatch worker'
+}),
+	'no workers are left behind');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,189 @@
+# Tests for incremental maintenance of compiled dictionaries: changes
+# recorded by fuzzy_dict_track() must show up in searches straight away,
+# and fuzzy_dict_compact() must fold them into the image file.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dir = PostgreSQL::Test::Utils::tempdir_short;
+
+my @words = qw(kitten sitting mitten smith smyth schmidt robert rupert
+  catherine kathryn);
+my $x = 1717;
+for (1 .. 300)
+{
+	my $len = 2 + $_ % 9;
+	my $w = '';
+	for (1 .. $len)
+	{
+		$x = ($x * 1103515245 + 12345) % 2147483648;
+		$w .= chr(ord('a') + ($x >> 16) % 6);
+	}
+	push @words, $w;
+}
+my %seen;
+@words = grep { !$seen{$_}++ } @words;
+
+open(my $fh, '>', "$dir/words") or die "could not write word list: $!";
+print $fh "$_\n" for @words;
+close($fh);
+
+command_ok([ 'fuzzystrmatch_builddict', "$dir/words", "$dir/dict.img" ],
+	'builddict compiles the word list');
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init(extra => [ '--encoding=UTF8', '--locale=C' ]);
+$node->start;
+
+$node->safe_psql(
+	'postgres', qq{
+CREATE EXTENSION fuzzystrmatch;
+CREATE TABLE words (w text PRIMARY KEY);
+COPY words FROM '$dir/words';
+CREATE TRIGGER words_dict AFTER INSERT OR UPDATE OR DELETE ON words
+	FOR EACH ROW EXECUTE PROCEDURE fuzzy_dict_track('d', 'w');
+CREATE TABLE queries (q text);
+INSERT INTO queries VALUES ('kitten'), ('smith'), ('katherine'), ('abcab'),
+	('fedcba'), ('aaaa'), ('zebra'), ('x');
+});
+
+# Dictionaries are loaded per backend, so each check loads the image first.
+# The searches must return what the SQL functions return for every word
+# now in the table.
+sub differences
+{
+	my ($name) = @_;
+
+	return $node->safe_psql(
+		'postgres', qq{
+\\o /dev/null
+SELECT fuzzy_dict_load('$name', '$dir/dict.img');
+\\o
+SELECT
+ (SELECT count(*) FROM queries, generate_series(0, 2) k,
+  LATERAL ((SELECT word, distance FROM fuzzy_dict_search('$name', q, k)
+			EXCEPT ALL
+			SELECT w, levenshtein(w, q) FROM words WHERE levenshtein(w, q) <= k)
+		   UNION ALL
+		   (SELECT w, levenshtein(w, q) FROM words WHERE levenshtein(w, q) <= k
+			EXCEPT ALL
+			SELECT word, distance FROM fuzzy_dict_search('$name', q, k))) diff)
+ + (SELECT count(*) FROM queries,
+	LATERAL ((SELECT fuzzy_dict_soundex('$name', q)
+			  EXCEPT ALL
+			  SELECT w FROM words WHERE soundex(w) = soundex(q))
+			 UNION ALL
+			 (SELECT w FROM words WHERE soundex(w) = soundex(q)
+			  EXCEPT ALL
+			  SELECT fuzzy_dict_soundex('$name', q))) diff)
+ + (SELECT count(*) FROM queries,
+	LATERAL (SELECT dmetaphone(q) p, dmetaphone_alt(q) a) c,
+	LATERAL ((SELECT fuzzy_dict_dmetaphone('$name', q)
+			  EXCEPT ALL
+			  SELECT w FROM words
+			  WHERE dmetaphone(w) IN (p, a) OR dmetaphone_alt(w) IN (p, a))
+			 UNION ALL
+			 (SELECT w FROM words
+			  WHERE dmetaphone(w) IN (p, a) OR dmetaphone_alt(w) IN (p, a)
+			  EXCEPT ALL
+			  SELECT fuzzy_dict_dmetaphone('$name', q))) diff)
+});
+}
+
+is(differences('d'), '0', 'searches match the table before any change');
+
+# Additions, removals, renames, a removed word put back, a new word removed
+# again, and a change that is rolled back.
+$node->safe_psql(
+	'postgres', q{
+INSERT INTO words VALUES ('kitchen'), ('smithe'), ('zebras'), ('abcabc');
+DELETE FROM words WHERE w IN ('sitting', 'smyth', 'robert');
+UPDATE words SET w = 'katharine' WHERE w = 'catherine';
+UPDATE words SET w = w WHERE w = 'mitten';
+INSERT INTO words VALUES ('robert');
+INSERT INTO words VALUES ('zebrass');
+DELETE FROM words WHERE w = 'zebrass';
+DELETE FROM words WHERE w IN (SELECT w FROM words WHERE w LIKE 'ab%' LIMIT 5);
+BEGIN;
+INSERT INTO words VALUES ('rolled back');
+DELETE FROM words WHERE w = 'kitten';
+ROLLBACK;
+});
+
+isnt($node->safe_psql('postgres', "SELECT count(*) FROM fuzzy_dict_delta WHERE dict = 'd'"),
+	'0', 'changes are recorded');
+is($node->safe_psql('postgres', "SELECT count(*) FROM fuzzy_dict_delta WHERE word = 'mitten'"),
+	'0', 'updates that keep the word are not recorded');
+is(differences('d'), '0', 'searches see the recorded changes');
+
+# A backend that mapped the image before compaction must notice the new
+# file; "e" has no recorded changes of its own, so it only matches the
+# table once it searches the new image.
+my $count = $node->safe_psql('postgres', 'SELECT count(*) FROM words');
+my @before = stat("$dir/dict.img");
+is( $node->safe_psql(
+		'postgres', qq{
+\\o /dev/null
+SELECT fuzzy_dict_load('d', '$dir/dict.img');
+SELECT fuzzy_dict_load('e', '$dir/dict.img');
+SELECT count(*) FROM fuzzy_dict_search('e', 'kitten', 2);
+\\o
+SELECT fuzzy_dict_compact('d');
+SELECT count(*) FROM fuzzy_dict_search('e', 'kitchen', 0);
+}),
+	"$count\n1",
+	'compaction returns the number of words and replaces the image');
+isnt((stat("$dir/dict.img"))[1], $before[1], 'the image file was replaced');
+is($node->safe_psql('postgres', "SELECT count(*) FROM fuzzy_dict_delta WHERE dict = 'd'"),
+	'0', 'compaction consumes the recorded changes');
+is($node->safe_psql('postgres', "SELECT fuzzy_dict_load('f', '$dir/dict.img')"),
+	$count, 'the new image holds every word in the table');
+is(differences('d'), '0', 'searches match the table after compaction');
+is(differences('e'), '0', 'searches under another name match the new image');
+
+# Tracking carries on against the new image, and a second compaction
+# starts from it.
+$node->safe_psql(
+	'postgres', q{
+INSERT INTO words VALUES ('sitting');
+DELETE FROM words WHERE w = 'kitchen';
+});
+is(differences('d'), '0', 'searches see changes made after compaction');
+$count = $node->safe_psql('postgres', 'SELECT count(*) FROM words');
+is( $node->safe_psql(
+		'postgres', qq{
+\\o /dev/null
+SELECT fuzzy_dict_load('d', '$dir/dict.img');
+\\o
+SELECT fuzzy_dict_compact('d');
+SELECT fuzzy_dict_compact('d');
+}),
+	"$count\n$count",
+	'a second compaction folds in the new changes, and a third has none');
+is(differences('d'), '0', 'searches match the table after both compactions');
+
+my ($ret, $stdout, $stderr) = $node->psql(
+	'postgres', q{
+CREATE TABLE other (v text);
+CREATE TRIGGER other_dict AFTER INSERT ON other
+	FOR EACH ROW EXECUTE PROCEDURE fuzzy_dict_track('d', 'w');
+INSERT INTO other VALUES ('x');
+});
+like($stderr, qr/column "w" of relation "other" does not exist/,
+	'the trigger rejects an unknown column');
+
+($ret, $stdout, $stderr) = $node->psql(
+	'postgres', q{
+DROP TRIGGER other_dict ON other;
+CREATE TRIGGER other_before BEFORE INSERT ON other
+	FOR EACH ROW EXECUTE PROCEDURE fuzzy_dict_track('d', 'v');
+INSERT INTO other VALUES ('x');
+});
+like($stderr, qr/must be fired AFTER ROW/, 'the trigger must run after the row');
+
+$node->stop;
+
+done_testing();
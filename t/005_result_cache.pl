@@ -0,0 +1,172 @@
+# Tests for the shared result cache of dictionary searches: results must be
+# the same with and without it, must be shared between backends, and must
+# not outlive changes to the dictionary.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dir = PostgreSQL::Test::Utils::tempdir_short;
+
+my @words = qw(kitten sitting mitten smith smyth schmidt robert rupert);
+my $x = 2929;
+for (1 .. 400)
+{
+	my $len = 2 + $_ % 8;
+	my $w = '';
+	for (1 .. $len)
+	{
+		$x = ($x * 1103515245 + 12345) % 2147483648;
+		$w .= chr(ord('a') + ($x >> 16) % 6);
+	}
+	push @words, $w;
+}
+my %seen;
+@words = grep { !$seen{$_}++ } @words;
+
+open(my $fh, '>', "$dir/words") or die "could not write word list: $!";
+print $fh "$_\n" for @words;
+close($fh);
+
+command_ok([ 'fuzzystrmatch_builddict', "$dir/words", "$dir/dict.img" ],
+	'builddict compiles the word list');
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init(extra => [ '--encoding=UTF8', '--locale=C' ]);
+$node->start;
+
+$node->safe_psql(
+	'postgres', qq{
+CREATE EXTENSION fuzzystrmatch;
+CREATE TABLE words (w text PRIMARY KEY);
+COPY words FROM '$dir/words';
+CREATE TRIGGER words_dict AFTER INSERT OR UPDATE OR DELETE ON words
+	FOR EACH ROW EXECUTE PROCEDURE fuzzy_dict_track('d', 'w');
+CREATE TABLE queries (q text);
+INSERT INTO queries VALUES ('kitten'), ('smith'), ('abcab'), ('fedcba'),
+	('aaaa'), ('zebra');
+});
+
+# Each call is a new backend, which loads the image first
+sub query
+{
+	my ($sql) = @_;
+
+	return $node->safe_psql(
+		'postgres', qq{
+\\o /dev/null
+SELECT fuzzy_dict_load('d', '$dir/dict.img');
+\\o
+$sql
+});
+}
+
+# Every search result, in a stable order
+my $all_results = q{
+SELECT q, k, 'lev', word || ':' || distance
+FROM queries, generate_series(0, 2) k, fuzzy_dict_search('d', q, k)
+UNION ALL
+SELECT q, 0, 'soundex', s FROM queries, fuzzy_dict_soundex('d', q) s
+UNION ALL
+SELECT q, 0, 'dmetaphone', s FROM queries, fuzzy_dict_dmetaphone('d', q) s
+ORDER BY 1, 2, 3, 4;
+};
+
+# The searches must agree with the SQL functions applied to the table
+my $differences = q{
+SELECT count(*) FROM queries, generate_series(0, 2) k,
+LATERAL ((SELECT word, distance FROM fuzzy_dict_search('d', q, k)
+		  EXCEPT ALL
+		  SELECT w, levenshtein(w, q) FROM words WHERE levenshtein(w, q) <= k)
+		 UNION ALL
+		 (SELECT w, levenshtein(w, q) FROM words WHERE levenshtein(w, q) <= k
+		  EXCEPT ALL
+		  SELECT word, distance FROM fuzzy_dict_search('d', q, k))) diff;
+};
+
+is(query('SELECT entries, used, hit_ratio IS NULL FROM fuzzy_cache_stats()'),
+	'0|0|t', 'there is no cache unless the library is preloaded');
+my $uncached = query($all_results);
+isnt($uncached, '', 'searches return results');
+
+$node->append_conf(
+	'postgresql.conf', q{
+shared_preload_libraries = 'fuzzystrmatch'
+fuzzystrmatch.cache_entries = 64
+});
+$node->restart;
+
+is(query('SELECT entries, used, hits, misses FROM fuzzy_cache_stats()'),
+	'64|0|0|0', 'the preloaded cache starts empty');
+
+is(query($all_results), $uncached, 'cold cache returns the same results');
+my ($used, $misses) =
+  split(/\|/, query('SELECT used, misses FROM fuzzy_cache_stats()'));
+ok($used > 0 && $misses > 0, 'searches fill the cache');
+
+# another backend finds what the first one cached
+is(query($all_results), $uncached, 'warm cache returns the same results');
+my ($hits, $ratio) =
+  split(/\|/, query('SELECT hits, hit_ratio > 0 FROM fuzzy_cache_stats()'));
+ok($hits > 0 && $ratio eq 't', 'results are shared between backends');
+
+# and answers them without reading the recorded changes
+my $search = q{SELECT count(*) FROM fuzzy_dict_search('d', 'kitten', 1)};
+my $count = query($search);
+is( query(qq{
+BEGIN;
+$search;
+SELECT coalesce(sum(seq_scan + coalesce(idx_scan, 0)), 0)
+FROM pg_stat_xact_user_tables WHERE relname = 'fuzzy_dict_delta';
+COMMIT;
+}),
+	"$count\n0",
+	'cached results are found without reading the changes');
+
+# recorded changes must not be answered from the cache
+$node->safe_psql(
+	'postgres', q{
+INSERT INTO words VALUES ('kittens'), ('smitt'), ('abcabc');
+DELETE FROM words WHERE w IN ('mitten', 'smyth');
+});
+is(query($differences), '0', 'recorded changes are not hidden by the cache');
+
+# nor must a compacted image
+is(query("SELECT fuzzy_dict_compact('d') = (SELECT count(*) FROM words)"),
+	't', 'compaction folds in the changes');
+is(query($differences), '0', 'the compacted image is not hidden by the cache');
+
+# more distinct searches than slots: older results are evicted, and the
+# results stay right
+is( query(q{
+SELECT count(*) FROM
+	(SELECT DISTINCT w FROM words ORDER BY w LIMIT 200) s,
+	LATERAL (SELECT count(*) AS n FROM fuzzy_dict_search('d', s.w, 1)) c
+WHERE c.n <> (SELECT count(*) FROM words WHERE levenshtein(w, s.w) <= 1)
+}),
+	'0',
+	'searches are right while the cache evicts');
+my ($entries, $evictions);
+($entries, $used, $evictions) =
+  split(/\|/, query('SELECT entries, used, evictions FROM fuzzy_cache_stats()'));
+ok($evictions > 0 && $used <= $entries, 'a full cache evicts');
+
+query('SELECT fuzzy_cache_reset()');
+is(query('SELECT used, hits, misses, inserts, evictions FROM fuzzy_cache_stats()'),
+	'0|0|0|0|0', 'fuzzy_cache_reset empties the cache');
+is(query($differences), '0', 'searches are right after a reset');
+
+my ($ret, $stdout, $stderr) = $node->psql(
+	'postgres', q{
+CREATE ROLE cache_user;
+SET ROLE cache_user;
+SELECT fuzzy_cache_reset();
+});
+like($stderr, qr/permission denied/,
+	'only privileged roles may reset the cache');
+
+$node->stop;
+
+done_testing();
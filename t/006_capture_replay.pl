@@ -0,0 +1,356 @@
+# Tests for the capture of sampled calls and for fuzzystrmatch_replay: the
+# log must hold what was called and what it returned, in each of the forms
+# fuzzystrmatch.capture_inputs allows, for calls made per row and for calls
+# batched by the planner, and replaying it must reproduce the results.
+
+use strict;
+use warnings;
+use Encode qw(decode);
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dir = PostgreSQL::Test::Utils::tempdir_short;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init(extra => [ '--encoding=UTF8', '--locale=C' ]);
+$node->start;
+
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION fuzzystrmatch;
+CREATE TABLE words AS
+	SELECT i AS id, substr(md5(i::text), 1, 2 + i % 9) AS w
+	FROM generate_series(1, 300) i;
+INSERT INTO words VALUES (1001, 'kitten'), (1002, 'sitting'), (1003, 'ktiten'),
+	(1004, 'größe'), (1005, 'grösse'), (1006, 'Été'), (1007, 'ete'),
+	(1008, ''), (1009, 'Robert'), (1010, 'Rupert');
+ANALYZE words;
+});
+
+# Reference distance: the plain dynamic program, with transpositions of
+# adjacent characters if $trans is set, all costs 1
+sub distance
+{
+	my ($s, $t, $trans) = @_;
+	my @s = split(//, $s);
+	my @t = split(//, $t);
+	my @d = ([ 0 .. scalar @t ]);
+
+	for my $i (1 .. scalar @s)
+	{
+		$d[$i][0] = $i;
+		for my $j (1 .. scalar @t)
+		{
+			my $best = $d[ $i - 1 ][ $j - 1 ] + ($s[ $i - 1 ] eq $t[ $j - 1 ] ? 0 : 1);
+			$best = $d[ $i - 1 ][$j] + 1 if $d[ $i - 1 ][$j] + 1 < $best;
+			$best = $d[$i][ $j - 1 ] + 1 if $d[$i][ $j - 1 ] + 1 < $best;
+			if (   $trans
+				&& $i > 1
+				&& $j > 1
+				&& $s[ $i - 1 ] eq $t[ $j - 2 ]
+				&& $s[ $i - 2 ] eq $t[ $j - 1 ]
+				&& $d[ $i - 2 ][ $j - 2 ] + 1 < $best)
+			{
+				$best = $d[ $i - 2 ][ $j - 2 ] + 1;
+			}
+			$d[$i][$j] = $best;
+		}
+	}
+	return $d[ scalar @s ][ scalar @t ];
+}
+
+# The records of a log, see fuzzycapture.h
+sub read_log
+{
+	my ($file) = @_;
+	my @records;
+
+	open(my $fh, '<:raw', $file) or die "could not open $file: $!";
+	local $/;
+	my $data = <$fh>;
+	close($fh);
+
+	my $pos = 0;
+	while ($pos < length($data))
+	{
+		my %r;
+
+		(   $r{magic}, $r{name_len}, $r{inputs}, $r{flags},
+			$r{ins_c}, $r{del_c}, $r{sub_c}, $r{trans_c},
+			$r{max_d}, $r{result}, $r{a_chars}, $r{b_chars},
+			$r{a_size}, $r{b_size}, $r{elapsed_ns})
+		  = unpack('L S C C l8 L3', substr($data, $pos, 52));
+		die sprintf('bad magic 0x%08x at %d', $r{magic}, $pos)
+		  unless $r{magic} == 0x315A5A46;
+		$pos += 52;
+		$r{name} = substr($data, $pos, $r{name_len});
+		$pos += $r{name_len};
+		$r{a} = substr($data, $pos, $r{a_size});
+		$pos += $r{a_size};
+		$r{b} = substr($data, $pos, $r{b_size});
+		$pos += $r{b_size};
+		push @records, \%r;
+	}
+	return @records;
+}
+
+# Run sql with capturing set up as given, in a new backend
+sub capture
+{
+	my ($file, $inputs, $rate, $sql) = @_;
+
+	return $node->psql(
+		'postgres', qq{
+SET fuzzystrmatch.capture_file = '$file';
+SET fuzzystrmatch.capture_rate = $rate;
+SET fuzzystrmatch.capture_inputs = $inputs;
+\\o /dev/null
+$sql
+});
+}
+
+# Replay a log, returning the exit status and, per function, its counters
+sub replay
+{
+	my (@files) = @_;
+	my $out = `fuzzystrmatch_replay -n 2 -r 7 @files`;
+	my $status = $? >> 8;
+	my (%counts, $function);
+
+	for (split(/\n/, $out))
+	{
+		if (/^(\w+):$/)
+		{
+			$function = $1;
+		}
+		elsif (/^\s+(calls|errors|mismatches)=(\d+)$/ && defined $function)
+		{
+			$counts{$function}{$1} = $2;
+		}
+		elsif (/^records=(\d+) skipped=(\d+)/)
+		{
+			$counts{''} = { records => $1, skipped => $2 };
+		}
+	}
+	return ($status, \%counts);
+}
+
+my $nwords = $node->safe_psql('postgres', 'SELECT count(*) FROM words');
+
+# the source is not marked as UTF-8, so decode literals to compare them
+my $grosse = decode('UTF-8', 'größe');
+
+# every captured function, called once per row
+my $per_row = q{
+SELECT levenshtein(w, 'kitten'),
+	levenshtein(w, 'größe', 2, 3, 4),
+	levenshtein_less_equal(w, 'kitten', 3),
+	dameraulevenshtein(w, 'kitten'),
+	dameraulevenshtein_less_equal(w, 'sitting', 9),
+	soundex(w),
+	difference(w, 'Robert')
+FROM words;
+};
+
+my ($ret, $stdout, $stderr) = capture("$dir/off.log", 'raw', 0, $per_row);
+is($ret, 0, 'calls succeed with capturing off');
+ok(!-e "$dir/off.log", 'nothing is written with capture_rate = 0');
+
+# raw inputs: every call, exactly as made
+($ret, $stdout, $stderr) = capture("$dir/raw.log", 'raw', 1, $per_row);
+is($ret, 0, 'calls succeed while capturing');
+my @raw = read_log("$dir/raw.log");
+my %by_name;
+push @{ $by_name{ $_->{name} } }, $_ for @raw;
+for my $name (qw(levenshtein dameraulevenshtein soundex difference))
+{
+	is(scalar @{ $by_name{$name} || [] },
+		$name eq 'levenshtein' ? 2 * $nwords : $nwords,
+		"every call of $name is captured");
+}
+ok(scalar @{ $by_name{levenshtein_less_equal} || [] } > 0
+	  && scalar @{ $by_name{dameraulevenshtein_less_equal} || [] } > 0,
+	'bounded calls are captured');
+ok(!exists $by_name{unknown}, 'every record names its function');
+
+my $wrong = 0;
+for my $r (@raw)
+{
+	my $first = decode('UTF-8', $r->{a});
+	my $second = decode('UTF-8', $r->{b});
+
+	$wrong++ unless $r->{a_chars} == length($first)
+	  && $r->{b_chars} == length($second);
+	next unless $r->{name} =~ /levenshtein/;
+
+	my $costs = join(',', @$r{qw(ins_c del_c sub_c trans_c)});
+	my $trans = $r->{name} =~ /^damerau/;
+	my $exact = distance($first, $second, $trans);
+	if ($r->{name} eq 'levenshtein' && $second eq $grosse)
+	{
+		# the costed call; only check what it was called with
+		$wrong++ unless $costs eq '2,3,4,0';
+		next;
+	}
+	$wrong++ unless $costs eq ($trans ? '1,1,1,1' : '1,1,1,0');
+	if ($r->{flags} & 1)
+	{
+		$wrong++
+		  unless $r->{max_d} == ($trans ? 9 : 3)
+		  && ($exact <= $r->{max_d}
+			? $r->{result} == $exact
+			: $r->{result} > $r->{max_d});
+	}
+	else
+	{
+		$wrong++ unless $r->{max_d} == -1 && $r->{result} == $exact;
+	}
+}
+is($wrong, 0, 'raw records hold the inputs, costs, bounds and results');
+
+my ($status, $counts) = replay("$dir/raw.log");
+is($status, 0, 'replay of raw inputs succeeds');
+is($counts->{''}{records}, scalar @raw, 'replay reads every record');
+for my $name (sort keys %by_name)
+{
+	is_deeply(
+		$counts->{$name},
+		{ calls => scalar @{ $by_name{$name} }, errors => 0, mismatches => 0 },
+		"replay reproduces every call of $name");
+}
+
+# scrambled inputs keep lengths and distances, but not the letters
+($ret, $stdout, $stderr) = capture("$dir/scrambled.log", 'scrambled', 1, q{
+SELECT levenshtein(w, 'kitten'), dameraulevenshtein(w, 'größe') FROM words;
+});
+my @scrambled = read_log("$dir/scrambled.log");
+is(scalar @scrambled, 2 * $nwords, 'scrambled calls are captured');
+my ($changed, $bad) = (0, 0);
+for my $s (@scrambled)
+{
+	my $first = decode('UTF-8', $s->{a});
+	my $second = decode('UTF-8', $s->{b});
+
+	$changed++ if $second ne 'kitten' && $second ne $grosse;
+	$bad++
+	  unless length($second) == $s->{b_chars}
+	  && length($first) == $s->{a_chars}
+	  && distance($first, $second, $s->{name} =~ /^damerau/) == $s->{result};
+}
+is($bad, 0, 'scrambling keeps lengths and distances');
+ok($changed > 0, 'scrambling changes the inputs');
+($status, $counts) = replay("$dir/scrambled.log");
+is($status, 0, 'replay of scrambled inputs succeeds');
+is($counts->{levenshtein}{mismatches} + $counts->{dameraulevenshtein}{mismatches},
+	0, 'replay of scrambled inputs reproduces the distances');
+
+# hashed inputs are four bytes, the same for the same input
+($ret, $stdout, $stderr) = capture("$dir/hashed.log", 'hashed', 1, q{
+SELECT levenshtein('kitten', 'sitting'), levenshtein('kitten', 'mitten'),
+	soundex('kitten');
+});
+my @hashed = read_log("$dir/hashed.log");
+is(join(' ', map { "$_->{a_size}/$_->{b_size}" } @hashed),
+	'4/4 4/4 4/0', 'hashed inputs are one hash each');
+ok( $hashed[0]{a} eq $hashed[1]{a}
+	  && $hashed[1]{a} eq $hashed[2]{a}
+	  && $hashed[0]{b} ne $hashed[1]{b},
+	'equal inputs have equal hashes');
+
+# and without inputs only the lengths are kept
+($ret, $stdout, $stderr) = capture("$dir/none.log", 'none', 1, q{
+SELECT levenshtein('kitten', 'größe');
+});
+my @none = read_log("$dir/none.log");
+is( join(' ', map { "$_->{a_size}/$_->{b_size}/$_->{a_chars}/$_->{b_chars}/$_->{result}" } @none),
+	'0/0/6/5/5',
+	'without inputs, lengths and the result are kept');
+
+# calls replayed from lengths alone are timed but not checked
+($status, $counts) = replay("$dir/hashed.log", "$dir/none.log");
+is($status, 0, 'replay of hashed and missing inputs succeeds');
+is_deeply($counts->{levenshtein}, { calls => 3, errors => 0, mismatches => 0 },
+	'inputs are made up for every call');
+
+# calls evaluated a batch at a time by FuzzyBatchScan are captured under the
+# name of the function they stand for
+my $batched = q{
+SELECT id, levenshtein(w, 'c4ca4238'), soundex(w)
+FROM words
+WHERE length(w) < 256 AND levenshtein_less_equal(w, 'c4ca', 2) <= 2;
+};
+like(
+	$node->safe_psql('postgres', "LOAD 'fuzzystrmatch'; EXPLAIN (COSTS OFF) $batched"),
+	qr/Batched Calls/,
+	'the calls are batched');
+($ret, $stdout, $stderr) =
+  capture("$dir/batch.log", 'raw', 1, "LOAD 'fuzzystrmatch';\n$batched");
+is($ret, 0, 'batched calls succeed while capturing');
+my @batch = read_log("$dir/batch.log");
+my %batch_names;
+$batch_names{ $_->{name} }++ for @batch;
+is(join(' ', sort keys %batch_names),
+	'levenshtein levenshtein_less_equal soundex',
+	'batched calls are captured under their own names');
+$wrong = 0;
+for my $r (@batch)
+{
+	next if $r->{name} eq 'soundex';
+
+	my $exact = distance(decode('UTF-8', $r->{a}), decode('UTF-8', $r->{b}));
+	if ($r->{name} eq 'levenshtein_less_equal')
+	{
+		$wrong++
+		  unless ($r->{flags} & 1)
+		  && $r->{max_d} == 2
+		  && $r->{b} eq 'c4ca'
+		  && ($exact <= 2 ? $r->{result} == $exact : $r->{result} > 2);
+	}
+	else
+	{
+		$wrong++
+		  unless !($r->{flags} & 1)
+		  && $r->{b} eq 'c4ca4238'
+		  && $r->{result} == $exact;
+	}
+}
+is($wrong, 0, 'batched records hold the inputs and results');
+($status, $counts) = replay("$dir/batch.log");
+is($status, 0, 'replay of batched calls succeeds');
+is( $counts->{levenshtein}{mismatches} +
+	  $counts->{levenshtein_less_equal}{mismatches},
+	0,
+	'replay reproduces the batched calls');
+
+# a fraction of the calls, as the rate says
+($ret, $stdout, $stderr) = capture("$dir/half.log", 'none', 0.5, q{
+SELECT levenshtein(w, 'kitten') FROM words, generate_series(1, 10);
+});
+my @half = read_log("$dir/half.log");
+ok(@half > 0 && @half < 10 * $nwords,
+	'capture_rate samples some of the calls');
+
+# a file that can't be opened is warned about once, and the calls go on
+($ret, $stdout, $stderr) = capture("$dir/missing/x.log", 'raw', 1, $per_row);
+is($ret, 0, 'calls succeed when the capture file cannot be opened');
+my @warnings = ($stderr =~ /could not open capture file/g);
+is(scalar @warnings, 1, 'an unusable capture file is warned about once');
+
+# only superusers choose where calls are written
+($ret, $stdout, $stderr) = $node->psql(
+	'postgres', q{
+LOAD 'fuzzystrmatch';
+CREATE ROLE capture_user;
+SET ROLE capture_user;
+SET fuzzystrmatch.capture_file = 'calls.log';
+});
+like($stderr, qr/permission denied to set parameter/,
+	'only privileged roles may set the capture file');
+
+command_fails([ 'fuzzystrmatch_replay', "$dir/missing.log" ],
+	'replay fails on a missing log');
+
+$node->stop;
+
+done_testing();
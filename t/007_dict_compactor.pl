@@ -0,0 +1,146 @@
+# Tests for the changes to compiled dictionaries that backends keep while
+# the module is preloaded: a backend must still see every committed change,
+# and its own uncommitted ones, and the compaction worker must fold the
+# changes into the image once there are enough of them.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dir = PostgreSQL::Test::Utils::tempdir_short;
+
+my @words = qw(kitten sitting mitten smith smyth schmidt robert rupert);
+my $x = 4141;
+for (1 .. 300)
+{
+	my $len = 2 + $_ % 8;
+	my $w = '';
+	for (1 .. $len)
+	{
+		$x = ($x * 1103515245 + 12345) % 2147483648;
+		$w .= chr(ord('a') + ($x >> 16) % 6);
+	}
+	push @words, $w;
+}
+my %seen;
+@words = grep { !$seen{$_}++ } @words;
+
+open(my $fh, '>', "$dir/words") or die "could not write word list: $!";
+print $fh "$_\n" for @words;
+close($fh);
+
+command_ok([ 'fuzzystrmatch_builddict', "$dir/words", "$dir/dict.img" ],
+	'builddict compiles the word list');
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init(extra => [ '--encoding=UTF8', '--locale=C' ]);
+$node->append_conf(
+	'postgresql.conf', q{
+shared_preload_libraries = 'fuzzystrmatch'
+fuzzystrmatch.dict_compact_database = 'postgres'
+fuzzystrmatch.dict_compact_threshold = 0
+fuzzystrmatch.dict_compact_naptime = 1
+max_prepared_transactions = 2
+});
+$node->start;
+
+$node->safe_psql(
+	'postgres', qq{
+CREATE EXTENSION fuzzystrmatch;
+CREATE TABLE words (w text PRIMARY KEY);
+COPY words FROM '$dir/words';
+CREATE TRIGGER words_dict AFTER INSERT OR UPDATE OR DELETE ON words
+	FOR EACH ROW EXECUTE PROCEDURE fuzzy_dict_track('d', 'w');
+CREATE TABLE queries (q text);
+INSERT INTO queries VALUES ('kitten'), ('smith'), ('abcab'), ('fedcba'),
+	('aaaa'), ('zebra');
+});
+
+ok( $node->poll_query_until(
+		'postgres', q{
+SELECT count(*) = 1 FROM pg_stat_activity
+WHERE backend_type = 'fuzzystrmatch dictionary compactor'
+}),
+	'the compaction worker is running');
+
+# The searches must agree with the SQL functions applied to the table
+my $differences = q{
+SELECT count(*) FROM queries, generate_series(0, 2) k,
+LATERAL ((SELECT word, distance FROM fuzzy_dict_search('d', q, k)
+		  EXCEPT ALL
+		  SELECT w, levenshtein(w, q) FROM words WHERE levenshtein(w, q) <= k)
+		 UNION ALL
+		 (SELECT w, levenshtein(w, q) FROM words WHERE levenshtein(w, q) <= k
+		  EXCEPT ALL
+		  SELECT word, distance FROM fuzzy_dict_search('d', q, k))) diff;
+};
+
+# One backend keeps the dictionary, and its changes, for the whole test
+my $session = $node->background_psql('postgres');
+$session->query_safe("SELECT fuzzy_dict_load('d', '$dir/dict.img')");
+is($session->query_safe($differences), '0', 'searches match the table');
+
+$node->safe_psql(
+	'postgres', q{
+INSERT INTO words VALUES ('kitchen'), ('smithe'), ('zebras');
+DELETE FROM words WHERE w IN ('sitting', 'smyth');
+});
+is($session->query_safe($differences), '0',
+	'kept changes give way to changes committed elsewhere');
+is($session->query_safe($differences), '0',
+	'and are kept again while nothing changes');
+
+is( $session->query_safe(q{
+BEGIN;
+INSERT INTO words VALUES ('zebrass');
+DELETE FROM words WHERE w = 'kitten';
+SELECT string_agg(word, ',' ORDER BY word) FROM fuzzy_dict_search('d', 'zebras', 1);
+SELECT count(*) FROM fuzzy_dict_search('d', 'kitten', 0);
+ROLLBACK;
+}),
+	"zebras,zebrass\n0",
+	'a transaction sees its own changes');
+is($session->query_safe($differences), '0',
+	'and they are gone once it rolls back');
+
+my ($ret, $stdout, $stderr) = $node->psql(
+	'postgres', q{
+BEGIN;
+INSERT INTO words VALUES ('prepared');
+PREPARE TRANSACTION 'fuzzy';
+});
+like(
+	$stderr,
+	qr/cannot PREPARE a transaction that has changed a fuzzy dictionary/,
+	'a transaction that changed a dictionary cannot be prepared');
+is($node->safe_psql('postgres', 'SELECT count(*) FROM pg_prepared_xacts'),
+	'0', 'so none is left prepared');
+
+# Past the threshold, the worker compacts the dictionary
+my @before = stat("$dir/dict.img");
+$node->append_conf('postgresql.conf', 'fuzzystrmatch.dict_compact_threshold = 5');
+$node->reload;
+$node->safe_psql(
+	'postgres', q{
+INSERT INTO words VALUES ('abcdeg'), ('gfedcb'), ('aabbgg'), ('ggbbaa');
+DELETE FROM words WHERE w IN ('robert', 'rupert');
+});
+ok( $node->poll_query_until(
+		'postgres',
+		"SELECT count(*) = 0 FROM fuzzy_dict_delta WHERE dict = 'd'"),
+	'the worker consumes the recorded changes');
+isnt((stat("$dir/dict.img"))[1], $before[1], 'the image file was replaced');
+is( $node->safe_psql(
+		'postgres',
+		"SELECT fuzzy_dict_load('e', '$dir/dict.img') = count(*) FROM words"),
+	't',
+	'the new image holds every word in the table');
+is($session->query_safe($differences), '0',
+	'searches match the table after compaction');
+
+$session->quit;
+$node->stop;
+
+done_testing();
@@ -0,0 +1,16 @@
+-- C code calling the SQL functions gives them no FmgrInfo to keep state in,
+-- so per-call-site memoization must be skipped for such calls
+SET fuzzystrmatch.memoize = on;
+
+SELECT test_fsm_direct_distance('levenshtein', 'kitten', 'sitting') AS d;
+SELECT test_fsm_direct_distance('levenshtein_less_equal', 'kitten', 'sitting', 2) > 2
+	AS over_2;
+SELECT test_fsm_direct_distance('levenshtein_less_equal', 'kitten', 'mitten', 2) AS d;
+SELECT test_fsm_direct_distance('dameraulevenshtein', 'abcd', 'acbd') AS d;
+SELECT test_fsm_direct_distance('dameraulevenshtein_less_equal', 'abcd', 'badc', 1) > 1
+	AS over_1;
+
+-- the same calls through the executor, with the memo in use
+SELECT levenshtein('kitten', s) AS d FROM (VALUES ('sitting'), ('sitting')) v(s);
+
+RESET fuzzystrmatch.memoize;
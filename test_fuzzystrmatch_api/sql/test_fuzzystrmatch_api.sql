@@ -0,0 +1,62 @@
+CREATE EXTENSION fuzzystrmatch;
+CREATE EXTENSION test_fuzzystrmatch_api;
+
+SELECT test_fsm_api_version() >= 1 AS has_version_1;
+
+CREATE TABLE pairs AS
+	SELECT substr(md5(i::text), 1, i % 14) AS a,
+		   substr(md5((i * 7)::text), 1, (i * 3) % 14) AS b
+	FROM generate_series(1, 500) i;
+
+-- each member must agree with the SQL function it stands for
+SELECT count(*) AS mismatches
+FROM pairs, (VALUES (1, 1, 1), (2, 3, 4), (1, 0, 5)) c(ins, del, sub)
+WHERE test_fsm_levenshtein(a, b, ins, del, sub) <>
+	levenshtein(a, b, ins, del, sub);
+
+-- bounded results above max_d only mean "more than max_d"
+SELECT count(*) AS mismatches
+FROM pairs, (VALUES (1, 1, 1), (2, 3, 4), (1, 0, 5)) c(ins, del, sub),
+	generate_series(0, 4) k,
+	LATERAL (SELECT test_fsm_levenshtein_less_equal(a, b, ins, del, sub, k) AS d,
+		levenshtein(a, b, ins, del, sub) AS exact) r
+WHERE (d <= k) <> (exact <= k) OR (d <= k AND d <> exact);
+
+SELECT count(*) AS mismatches
+FROM (SELECT a, array_agg(b ORDER BY b) AS bs FROM pairs GROUP BY a) g,
+	generate_series(-1, 3) k,
+	LATERAL test_fsm_levenshtein_batch(a, bs, k) r,
+	LATERAL unnest(r.distances, bs) u(d, b)
+WHERE CASE WHEN k < 0 THEN d <> levenshtein(a, b)
+	ELSE (d <= k) <> (levenshtein(a, b) <= k) OR
+		(d <= k AND d <> levenshtein(a, b)) END;
+
+SELECT count(*) AS mismatches
+FROM (SELECT a, array_agg(b ORDER BY b) AS bs FROM pairs GROUP BY a) g,
+	generate_series(-1, 3) k,
+	LATERAL test_fsm_levenshtein_batch(a, bs, k) r
+WHERE r.nmatches <> CASE WHEN k < 0 THEN cardinality(bs)
+	ELSE (SELECT count(*) FROM unnest(bs) b WHERE levenshtein(a, b) <= k) END;
+
+SELECT * FROM test_fsm_levenshtein_batch('abc', '{}', 1);
+
+CREATE TABLE names (name text);
+INSERT INTO names VALUES ('Thompson'), ('Schmidt'), ('Knight'), ('Xavier'),
+	('Caesar'), ('Gnocchi'), ('Wright'), ('Ashcroft'), ('Tymczak'),
+	('Pfister'), ('Jose'), ('Zhao'), ('Ghislane'), ('Hugh'), ('Lloyd'),
+	('McHugh'), ('Orchestra'), ('Czerny'), ('Abernathy'), ('1234'), ('');
+
+SELECT count(*) AS mismatches
+FROM names
+WHERE test_fsm_soundex(name) <> soundex(name)
+	OR test_fsm_dmetaphone(name) <>
+		ARRAY[dmetaphone(name), dmetaphone_alt(name)]
+	OR test_fsm_metaphone(name, 4) <> metaphone(name, 4)
+	OR test_fsm_metaphone(name, 10) <> metaphone(name, 10);
+
+-- and raise the same errors
+\set VERBOSITY terse
+SELECT test_fsm_levenshtein(repeat('x', 256), 'a', 1, 1, 1);
+SELECT test_fsm_levenshtein_less_equal('a', repeat('x', 256), 1, 1, 1, 2);
+SELECT test_fsm_metaphone('abc', 0);
+SELECT test_fsm_levenshtein_batch('abc', '{abd,NULL}', 1);
@@ -0,0 +1,42 @@
+/* contrib/fuzzystrmatch/test_fuzzystrmatch_api/test_fuzzystrmatch_api--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION test_fuzzystrmatch_api" to load this file. \quit
+
+CREATE FUNCTION test_fsm_api_version () RETURNS int
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION test_fsm_levenshtein (text, text, int, int, int) RETURNS int
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION test_fsm_levenshtein_less_equal (text, text, int, int, int, int)
+RETURNS int
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION test_fsm_levenshtein_batch (query text, candidates text[],
+	max_d int, OUT nmatches int, OUT distances int[])
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION test_fsm_soundex (text) RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION test_fsm_dmetaphone (text) RETURNS text[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION test_fsm_metaphone (text, int) RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION test_fsm_direct_distance (text, text, text) RETURNS int
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION test_fsm_direct_distance (text, text, text, int) RETURNS int
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
@@ -0,0 +1,181 @@
+/*
+ * test_fuzzystrmatch_api.c
+ *
+ * Test module calling the fuzzystrmatch kernels through the C interface
+ * published in fuzzystrmatch_api.h, so that the regression test can compare
+ * each member with the corresponding SQL function.  It also calls the SQL
+ * functions' C entry points through DirectFunctionCall, which is how other
+ * C code may use them, and which gives them no FmgrInfo.
+ *
+ * contrib/fuzzystrmatch/test_fuzzystrmatch_api/test_fuzzystrmatch_api.c
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "fuzzystrmatch_api.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+
+PG_MODULE_MAGIC;
+
+static const FuzzyStrMatchAPI *
+test_api(void)
+{
+	return fuzzystrmatch_get_api(1);
+}
+
+PG_FUNCTION_INFO_V1(test_fsm_api_version);
+Datum
+test_fsm_api_version(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32(test_api()->version);
+}
+
+PG_FUNCTION_INFO_V1(test_fsm_levenshtein);
+Datum
+test_fsm_levenshtein(PG_FUNCTION_ARGS)
+{
+	text	   *a = PG_GETARG_TEXT_PP(0);
+	text	   *b = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_INT32(test_api()->levenshtein(VARDATA_ANY(a),
+											VARSIZE_ANY_EXHDR(a),
+											VARDATA_ANY(b),
+											VARSIZE_ANY_EXHDR(b),
+											PG_GETARG_INT32(2),
+											PG_GETARG_INT32(3),
+											PG_GETARG_INT32(4)));
+}
+
+PG_FUNCTION_INFO_V1(test_fsm_levenshtein_less_equal);
+Datum
+test_fsm_levenshtein_less_equal(PG_FUNCTION_ARGS)
+{
+	text	   *a = PG_GETARG_TEXT_PP(0);
+	text	   *b = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_INT32(test_api()->levenshtein_less_equal(VARDATA_ANY(a),
+													   VARSIZE_ANY_EXHDR(a),
+													   VARDATA_ANY(b),
+													   VARSIZE_ANY_EXHDR(b),
+													   PG_GETARG_INT32(2),
+													   PG_GETARG_INT32(3),
+													   PG_GETARG_INT32(4),
+													   PG_GETARG_INT32(5)));
+}
+
+PG_FUNCTION_INFO_V1(test_fsm_levenshtein_batch);
+Datum
+test_fsm_levenshtein_batch(PG_FUNCTION_ARGS)
+{
+	text	   *query = PG_GETARG_TEXT_PP(0);
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(1);
+	int			max_d = PG_GETARG_INT32(2);
+	TupleDesc	tupdesc;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			n;
+	const char **candidates;
+	int		   *lens;
+	int		   *distances;
+	Datum	   *result;
+	Datum		values[2];
+	bool		isnull[2] = {false, false};
+	int			nmatches;
+	int			i;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	deconstruct_array(array, TEXTOID, -1, false, 'i', &elems, &nulls, &n);
+	candidates = palloc(Max(n, 1) * sizeof(char *));
+	lens = palloc(Max(n, 1) * sizeof(int));
+	distances = palloc(Max(n, 1) * sizeof(int));
+	result = palloc(Max(n, 1) * sizeof(Datum));
+	for (i = 0; i < n; i++)
+	{
+		text	   *t;
+
+		if (nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("candidates must not be null")));
+		t = (text *) PG_DETOAST_DATUM_PACKED(elems[i]);
+		candidates[i] = VARDATA_ANY(t);
+		lens[i] = VARSIZE_ANY_EXHDR(t);
+	}
+
+	nmatches = test_api()->levenshtein_batch(VARDATA_ANY(query),
+											 VARSIZE_ANY_EXHDR(query),
+											 candidates, lens, n, 1, 1, 1,
+											 max_d, distances);
+
+	for (i = 0; i < n; i++)
+		result[i] = Int32GetDatum(distances[i]);
+	values[0] = Int32GetDatum(nmatches);
+	values[1] = PointerGetDatum(construct_array(result, n, INT4OID,
+												sizeof(int32), true, 'i'));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+													  values, isnull)));
+}
+
+PG_FUNCTION_INFO_V1(test_fsm_soundex);
+Datum
+test_fsm_soundex(PG_FUNCTION_ARGS)
+{
+	text	   *str = PG_GETARG_TEXT_PP(0);
+	char		code[FUZZYSTRMATCH_SOUNDEX_SIZE];
+
+	test_api()->soundex(VARDATA_ANY(str), VARSIZE_ANY_EXHDR(str), code);
+	PG_RETURN_TEXT_P(cstring_to_text(code));
+}
+
+PG_FUNCTION_INFO_V1(test_fsm_dmetaphone);
+Datum
+test_fsm_dmetaphone(PG_FUNCTION_ARGS)
+{
+	text	   *str = PG_GETARG_TEXT_PP(0);
+	char		primary[FUZZYSTRMATCH_DMETAPHONE_SIZE];
+	char		alternate[FUZZYSTRMATCH_DMETAPHONE_SIZE];
+	Datum		codes[2];
+
+	test_api()->dmetaphone(VARDATA_ANY(str), VARSIZE_ANY_EXHDR(str),
+						   primary, alternate);
+	codes[0] = CStringGetTextDatum(primary);
+	codes[1] = CStringGetTextDatum(alternate);
+	PG_RETURN_ARRAYTYPE_P(construct_array(codes, 2, TEXTOID, -1, false, 'i'));
+}
+
+PG_FUNCTION_INFO_V1(test_fsm_metaphone);
+Datum
+test_fsm_metaphone(PG_FUNCTION_ARGS)
+{
+	text	   *str = PG_GETARG_TEXT_PP(0);
+
+	PG_RETURN_TEXT_P(cstring_to_text(test_api()->metaphone(VARDATA_ANY(str),
+												   VARSIZE_ANY_EXHDR(str),
+													PG_GETARG_INT32(1))));
+}
+
+/*
+ * test_fsm_direct_distance(function, a, b [, max_d]) calls the named
+ * distance function of fuzzystrmatch with DirectFunctionCall.
+ */
+PG_FUNCTION_INFO_V1(test_fsm_direct_distance);
+Datum
+test_fsm_direct_distance(PG_FUNCTION_ARGS)
+{
+	char	   *name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	PGFunction	fn;
+
+	fn = (PGFunction) load_external_function("$libdir/fuzzystrmatch", name,
+											 true, NULL);
+	if (PG_NARGS() == 3)
+		return DirectFunctionCall2(fn, PG_GETARG_DATUM(1), PG_GETARG_DATUM(2));
+	return DirectFunctionCall3(fn, PG_GETARG_DATUM(1), PG_GETARG_DATUM(2),
+							   PG_GETARG_DATUM(3));
+}